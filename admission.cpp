@@ -0,0 +1,114 @@
+/*
+ * Remoto: HTTP admission control for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Per-client token buckets and server busy time. See admission.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "admission.h"
+
+namespace remoto
+{
+    HttpAdmission::HttpAdmission()
+        : _clientCount(0), _windowStart(0), _busyMs(0), _previousBusyMs(0),
+          _admitted(0), _limited(0), _overloaded(0)
+    {
+    }
+
+    HttpAdmission::ClientBucket &HttpAdmission::find(uint32_t ip, uint32_t now)
+    {
+        int oldest = 0;
+        for (int i = 0; i < _clientCount; ++i)
+        {
+            if (_clients[i].ip == ip)
+            {
+                return _clients[i];
+            }
+            if (now - _clients[i].lastMs > now - _clients[oldest].lastMs)
+            {
+                oldest = i;
+            }
+        }
+        int slot = _clientCount < HTTP_ADMISSION_CLIENTS ? _clientCount++ : oldest;
+        // A new client starts with its full burst
+        _clients[slot].ip = ip;
+        _clients[slot].level = HTTP_CLIENT_BURST * 1000;
+        _clients[slot].lastMs = now;
+        return _clients[slot];
+    }
+
+    void HttpAdmission::advance(uint32_t now)
+    {
+        uint32_t elapsed = now - _windowStart;
+        if (elapsed >= 2000)
+        {
+            _previousBusyMs = 0;
+            _busyMs = 0;
+            _windowStart = now;
+        }
+        else if (elapsed >= 1000)
+        {
+            _previousBusyMs = _busyMs;
+            _busyMs = 0;
+            _windowStart += 1000;
+        }
+    }
+
+    uint32_t HttpAdmission::recentBusyMs(uint32_t now) const
+    {
+        // The previous second weighs for the part still in the last 1000 ms
+        uint32_t into = now - _windowStart;
+        if (into >= 2000)
+        {
+            return 0;
+        }
+        if (into >= 1000)
+        {
+            return _busyMs * (2000 - into) / 1000;
+        }
+        return _busyMs + _previousBusyMs * (1000 - into) / 1000;
+    }
+
+    uint32_t HttpAdmission::admit(uint32_t ip)
+    {
+        uint32_t now = millis();
+        advance(now);
+        if (recentBusyMs(now) >= HTTP_MAX_BUSY_MS)
+        {
+            _overloaded++;
+            return 1;
+        }
+        ClientBucket &bucket = find(ip, now);
+        // HTTP_CLIENT_RATE requests per second are as many thousandths per ms
+        uint32_t elapsed = now - bucket.lastMs;
+        uint32_t full = HTTP_CLIENT_BURST * 1000;
+        bucket.level = elapsed < (full - bucket.level) / HTTP_CLIENT_RATE ? bucket.level + elapsed * HTTP_CLIENT_RATE : full;
+        bucket.lastMs = now;
+        if (bucket.level >= 1000)
+        {
+            bucket.level -= 1000;
+            _admitted++;
+            return 0;
+        }
+        _limited++;
+        uint32_t waitMs = (1000 - bucket.level + HTTP_CLIENT_RATE - 1) / HTTP_CLIENT_RATE;
+        return (waitMs + 999) / 1000;
+    }
+
+    void HttpAdmission::addBusy(uint32_t ms)
+    {
+        advance(millis());
+        _busyMs += ms;
+    }
+
+    void HttpAdmission::toJson(JsonObject stats) const
+    {
+        stats["admitted"] = _admitted;
+        stats["limited"] = _limited;
+        stats["overloaded"] = _overloaded;
+        stats["busyMs"] = recentBusyMs(millis());
+    }
+} // namespace remoto
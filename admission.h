@@ -0,0 +1,71 @@
+/*
+ * Remoto: HTTP admission control for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Keeps web traffic from starving the rest of the firmware. Every
+ * client address has a token bucket of HTTP_CLIENT_BURST requests,
+ * refilled at HTTP_CLIENT_RATE per second; a client past its share is
+ * answered 429 with Retry-After before its request is read. The time
+ * spent serving requests is also tracked over a sliding second, and
+ * every client is turned away while it exceeds HTTP_MAX_BUSY_MS.
+ * loop() serves waiting clients for at most HTTP_LOOP_BUDGET_MS before
+ * giving the processor back.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(ADMISSION_H)
+#define ADMISSION_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Client addresses tracked, the least recently seen one is replaced
+#define HTTP_ADMISSION_CLIENTS 8
+// Requests per second and burst of one client
+#define HTTP_CLIENT_RATE 4
+#define HTTP_CLIENT_BURST 10
+// HTTP work allowed per second, and per pass of loop()
+#define HTTP_MAX_BUSY_MS 500
+#define HTTP_LOOP_BUDGET_MS 50
+
+namespace remoto
+{
+    class HttpAdmission
+    {
+    private:
+        struct ClientBucket
+        {
+            uint32_t ip;
+            uint32_t level; // thousandths of a request
+            uint32_t lastMs;
+        };
+
+        ClientBucket _clients[HTTP_ADMISSION_CLIENTS];
+        uint8_t _clientCount;
+        // Busy time of the current and of the previous second
+        uint32_t _windowStart;
+        uint32_t _busyMs;
+        uint32_t _previousBusyMs;
+
+        uint32_t _admitted;
+        uint32_t _limited;    // client over its rate
+        uint32_t _overloaded; // server over its busy time
+
+        ClientBucket &find(uint32_t ip, uint32_t now);
+        void advance(uint32_t now);
+        uint32_t recentBusyMs(uint32_t now) const;
+
+    public:
+        HttpAdmission();
+
+        // 0 to serve the client now, otherwise the seconds it should wait
+        uint32_t admit(uint32_t ip);
+        // Account time spent serving requests
+        void addBusy(uint32_t ms);
+
+        void toJson(JsonObject stats) const;
+    };
+} // namespace remoto
+
+#endif // ADMISSION_H
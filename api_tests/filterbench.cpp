@@ -0,0 +1,323 @@
+/*
+ * Remoto: Analog input filter benchmark
+ * -------------------------------------------------------------------
+ * Runs filter chains of the firmware (filter.cpp, scalar kernels) over a
+ * synthetic 0-10 V signal, a square wave between two levels with
+ * Gaussian noise and occasional spikes to the rails, and reports per
+ * chain the CPU time per input sample, the noise left on the steady
+ * parts of the signal and how many samples a step takes to come through.
+ * Samples are fed in the blocks the channel scan would pass, one burst
+ * of as many samples as the chain decimates per call.
+ *
+ * Build: g++ -O2 -std=gnu++17 -DARDUINO=10819 -DARDUINOJSON_ENABLE_PROGMEM=0 -Ireplay/shim
+ *        -I<ArduinoJson>/src -I.. filterbench.cpp ../filter.cpp -o filterbench
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+
+#include "filter.h"
+#include "scaling.h"
+
+namespace filterbench
+{
+    using Clock = std::chrono::steady_clock;
+
+    const char *const DEFAULT_CHAINS[] = {
+        "none",
+        "average:8",
+        "median:5",
+        "lowpass:20",
+        "median:5,lowpass:8",
+        "median:5,decimate:4",
+        "median:3,average:8,decimate:8"};
+
+    struct Options
+    {
+        std::vector<std::string> chains;
+        long samples = 1000000;
+        int period = 2000;     // samples per level of the square wave
+        double low = 2.0;      // V
+        double high = 8.0;     // V
+        double noise = 0.05;   // V RMS
+        double spikes = 0.002; // fraction of samples
+        unsigned seed = 1;
+        bool csv = false;
+    };
+
+    struct Signal
+    {
+        std::vector<uint16_t> samples;
+        std::vector<uint16_t> clean; // level without noise, per sample
+    };
+
+    struct Result
+    {
+        double nsPerSample = 0;
+        double noiseMv = 0; // RMS on the second half of each level
+        double maxMv = 0;   // largest error there
+        double latency = 0; // mean input samples to reach 90% of a step
+        long outputs = 0;
+    };
+
+    static double countsToVolts(double counts)
+    {
+        return counts * remoto::FACTORY_FULL_SCALE / (1UL << ADC_BITS);
+    }
+
+    static uint16_t voltsToCounts(double volts)
+    {
+        double counts = volts / remoto::FACTORY_FULL_SCALE * (1UL << ADC_BITS) + 0.5;
+        return (uint16_t)std::min<double>(std::max(counts, 0.0), remoto::ADC_MAX);
+    }
+
+    static Signal generate(const Options &opt)
+    {
+        Signal signal;
+        std::mt19937 rng(opt.seed);
+        std::normal_distribution<double> noise(0, opt.noise);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        signal.samples.resize(opt.samples);
+        signal.clean.resize(opt.samples);
+        for (long i = 0; i < opt.samples; ++i)
+        {
+            double level = (i / opt.period) % 2 ? opt.high : opt.low;
+            double volts = level + noise(rng);
+            if (uniform(rng) < opt.spikes)
+            {
+                volts = uniform(rng) < 0.5 ? 0 : remoto::FACTORY_FULL_SCALE;
+            }
+            signal.clean[i] = voltsToCounts(level);
+            signal.samples[i] = voltsToCounts(volts);
+        }
+        return signal;
+    }
+
+    // "median:5,lowpass:20", or "none" for the raw samples
+    static bool parseChain(const std::string &spec, remoto::ChannelFilter &filter)
+    {
+        filter.clear();
+        if (spec == "none")
+        {
+            return true;
+        }
+        std::stringstream ss(spec);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            size_t colon = item.find(':');
+            if (colon == std::string::npos)
+            {
+                return false;
+            }
+            remoto::FilterKind kind = remoto::filterKindFromName(item.substr(0, colon).c_str());
+            int length = atoi(item.c_str() + colon + 1);
+            if (kind == remoto::FilterKind::NONE || length <= 0 || length > 0xFFFF ||
+                filter.addStage(kind, (uint16_t)length) != 0)
+            {
+                return false;
+            }
+        }
+        return filter.isValid();
+    }
+
+    static Result measure(const Options &opt, const Signal &signal, const remoto::ChannelFilter &settings)
+    {
+        Result result;
+        remoto::FilterChain chain;
+        chain.configure(settings);
+        int block = std::max(1, chain.decimation());
+        long blocks = (long)signal.samples.size() / block;
+
+        // Timed on its own, without the bookkeeping of the outputs
+        std::vector<uint16_t> values(blocks);
+        std::vector<bool> valid(blocks);
+        Clock::time_point start = Clock::now();
+        for (long b = 0; b < blocks; ++b)
+        {
+            uint16_t value = 0;
+            valid[b] = chain.process(&signal.samples[b * block], block, value);
+            values[b] = value;
+        }
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        result.nsPerSample = ns / (blocks * block);
+
+        // Each output stands for the last sample of its block
+        double sumSquares = 0;
+        long steady = 0;
+        long steps = 0;
+        double totalLatency = 0;
+        long stepAt = -1;
+        double from = 0;
+        double to = 0;
+        for (long b = 0; b < blocks; ++b)
+        {
+            if (!valid[b])
+            {
+                continue;
+            }
+            result.outputs++;
+            long i = b * block + block - 1;
+            long phase = i % opt.period;
+            if (i >= opt.period && phase < block)
+            {
+                // A step happened within this block
+                stepAt = i - phase;
+                from = signal.clean[stepAt - 1];
+                to = signal.clean[stepAt];
+            }
+            double value = values[b];
+            if (stepAt >= 0 && std::fabs(value - from) >= 0.9 * std::fabs(to - from))
+            {
+                totalLatency += i - stepAt + 1;
+                steps++;
+                stepAt = -1;
+            }
+            if (phase >= opt.period / 2)
+            {
+                double error = countsToVolts(value - signal.clean[i]) * 1000;
+                sumSquares += error * error;
+                result.maxMv = std::max(result.maxMv, std::fabs(error));
+                steady++;
+            }
+        }
+        result.noiseMv = steady > 0 ? std::sqrt(sumSquares / steady) : 0;
+        result.latency = steps > 0 ? totalLatency / steps : 0;
+        return result;
+    }
+
+    //-------------------------- MAIN ---------------------------
+    static void usage(const char *name)
+    {
+        printf("Usage: %s [options]\n"
+               "  -f, --filter CHAIN       chain to measure, repeatable, e.g. median:5,lowpass:20\n"
+               "                           or none (default: a set of typical chains)\n"
+               "  -n, --samples N          input samples per chain (default 1000000)\n"
+               "  -p, --period N           samples per level of the square wave (default 2000)\n"
+               "      --low V              low level (default 2)\n"
+               "      --high V             high level (default 8)\n"
+               "      --noise V            Gaussian noise RMS (default 0.05)\n"
+               "      --spikes FRACTION    samples replaced by a rail (default 0.002)\n"
+               "      --seed N             random seed (default 1)\n"
+               "      --csv                machine readable output\n",
+               name);
+    }
+
+    static int run(int argc, char **argv)
+    {
+        Options opt;
+        enum
+        {
+            OPT_LOW = 256,
+            OPT_HIGH,
+            OPT_NOISE,
+            OPT_SPIKES,
+            OPT_SEED,
+            OPT_CSV
+        };
+        static const option longOptions[] = {
+            {"filter", required_argument, nullptr, 'f'},
+            {"samples", required_argument, nullptr, 'n'},
+            {"period", required_argument, nullptr, 'p'},
+            {"low", required_argument, nullptr, OPT_LOW},
+            {"high", required_argument, nullptr, OPT_HIGH},
+            {"noise", required_argument, nullptr, OPT_NOISE},
+            {"spikes", required_argument, nullptr, OPT_SPIKES},
+            {"seed", required_argument, nullptr, OPT_SEED},
+            {"csv", no_argument, nullptr, OPT_CSV},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}};
+
+        int c;
+        while ((c = getopt_long(argc, argv, "f:n:p:h", longOptions, nullptr)) != -1)
+        {
+            switch (c)
+            {
+            case 'f':
+                opt.chains.push_back(optarg);
+                break;
+            case 'n':
+                opt.samples = std::max(1L, atol(optarg));
+                break;
+            case 'p':
+                opt.period = std::max(2 * FILTER_BLOCK_SIZE, atoi(optarg));
+                break;
+            case OPT_LOW:
+                opt.low = atof(optarg);
+                break;
+            case OPT_HIGH:
+                opt.high = atof(optarg);
+                break;
+            case OPT_NOISE:
+                opt.noise = std::max(0.0, atof(optarg));
+                break;
+            case OPT_SPIKES:
+                opt.spikes = atof(optarg);
+                break;
+            case OPT_SEED:
+                opt.seed = (unsigned)atol(optarg);
+                break;
+            case OPT_CSV:
+                opt.csv = true;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 2;
+            }
+        }
+        if (opt.chains.empty())
+        {
+            opt.chains.assign(std::begin(DEFAULT_CHAINS), std::end(DEFAULT_CHAINS));
+        }
+        std::vector<remoto::ChannelFilter> filters(opt.chains.size());
+        for (size_t i = 0; i < opt.chains.size(); ++i)
+        {
+            if (!parseChain(opt.chains[i], filters[i]))
+            {
+                fprintf(stderr, "Invalid filter: %s\n", opt.chains[i].c_str());
+                return 2;
+            }
+        }
+
+        Signal signal = generate(opt);
+        if (opt.csv)
+        {
+            printf("filter,outputs,ns_per_sample,noise_mv,max_mv,latency_samples\n");
+        }
+        else
+        {
+            printf("%ld samples, %.1f/%.1f V every %d, %.0f mV noise, %.2f%% spikes\n", opt.samples, opt.low,
+                   opt.high, opt.period, opt.noise * 1000, opt.spikes * 100);
+            printf("%-32s %9s %9s %9s %9s %9s\n", "filter", "outputs", "ns/smp", "noise mV", "max mV", "latency");
+        }
+        for (size_t i = 0; i < opt.chains.size(); ++i)
+        {
+            Result r = measure(opt, signal, filters[i]);
+            const char *fmt = opt.csv ? "%s,%ld,%.2f,%.2f,%.1f,%.1f\n" : "%-32s %9ld %9.2f %9.2f %9.1f %9.1f\n";
+            // Quoted in CSV, the chains have commas
+            std::string name = opt.csv ? "\"" + opt.chains[i] + "\"" : opt.chains[i];
+            printf(fmt, name.c_str(), r.outputs, r.nsPerSample, r.noiseMv, r.maxMv, r.latency);
+        }
+        return 0;
+    }
+} // namespace filterbench
+
+int main(int argc, char **argv)
+{
+    return filterbench::run(argc, argv);
+}
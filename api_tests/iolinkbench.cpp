@@ -0,0 +1,313 @@
+/*
+ * Remoto: I/O core link simulation and benchmark
+ * -------------------------------------------------------------------
+ * Runs the shared-memory protocol between the M4 and the M7 cores
+ * (iolink.h) on two threads of a PC. The "M4" thread publishes input
+ * images into the image ring, which overwrites the oldest, and applies
+ * the output commands it pops;
+ * the "M7" thread takes the latest image and queues commands, as the
+ * channel registry does. Every image and command carries a pattern
+ * derived from its sequence number, so torn, reordered or lost entries
+ * are detected. Throughput, command ring full and image skipped counts
+ * and the latency from publish to read are reported per ring.
+ *
+ * The exit status is 1 when an entry arrived corrupted or out of order,
+ * so the run doubles as a test of the rings.
+ *
+ * Build: g++ -O2 -std=gnu++17 -pthread -DARDUINO=10819 -DARDUINOJSON_ENABLE_PROGMEM=0 -Ireplay/shim
+ *        -I<ArduinoJson>/src -I.. iolinkbench.cpp ../filter.cpp -o iolinkbench
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
+#include "iolink.h"
+
+namespace iolinkbench
+{
+    using Clock = std::chrono::steady_clock;
+    using remoto::IoCommand;
+    using remoto::IoImage;
+    using remoto::IoShared;
+
+    // Send times of the entries in flight, by sequence. Written before the
+    // push that releases an entry, read after the pop that acquires it.
+    constexpr uint32_t STAMPS = 1 << 16;
+
+    struct Options
+    {
+        double duration = 2;
+        int scanUs = 0;    // between images, 0 = as fast as possible
+        int pollUs = 0;    // between reads of the M7
+        int commandUs = 0; // between commands, 0 = one per read
+        bool csv = false;
+    };
+
+    struct RingStats
+    {
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        uint64_t full = 0;    // push refused
+        uint64_t skipped = 0; // replaced by a newer image before the read
+        uint64_t errors = 0;  // torn or out of order
+        std::vector<uint32_t> latencyNs;
+    };
+
+    static int64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    static void fillImage(IoImage &image, uint32_t sequence)
+    {
+        image.sequence = sequence;
+        image.failedModules = sequence * 2654435761UL;
+        image.scanMicros = ~sequence;
+        for (int i = 0; i < remoto::MAX_INPUTS; ++i)
+        {
+            image.raw[i] = (uint16_t)(sequence + i);
+            image.values[i] = (uint16_t)~(sequence + i);
+        }
+    }
+
+    static bool checkImage(const IoImage &image)
+    {
+        uint32_t sequence = image.sequence;
+        if (image.failedModules != (uint32_t)(sequence * 2654435761UL) || image.scanMicros != ~sequence)
+        {
+            return false;
+        }
+        for (int i = 0; i < remoto::MAX_INPUTS; ++i)
+        {
+            if (image.raw[i] != (uint16_t)(sequence + i) || image.values[i] != (uint16_t)~(sequence + i))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Wait for a deadline, or not at all with no period
+    static void pace(Clock::time_point &next, int periodUs)
+    {
+        if (periodUs > 0)
+        {
+            next += std::chrono::microseconds(periodUs);
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    //--------------------------- M4 ----------------------------
+    static void ioCore(const Options &opt, IoShared &shared, std::atomic<bool> &running, int64_t *imageStamps,
+                       const int64_t *commandStamps, RingStats &images, RingStats &commands)
+    {
+        IoImage image;
+        uint32_t sequence = 0;
+        uint32_t expected = 0; // next command
+        Clock::time_point next = Clock::now();
+        while (running.load(std::memory_order_relaxed))
+        {
+            IoCommand command;
+            while (shared.commands.pop(command))
+            {
+                // Output and value carry the command number
+                if (command.output != (uint16_t)expected || command.value != ((expected >> 16) & 1))
+                {
+                    commands.errors++;
+                }
+                else
+                {
+                    commands.latencyNs.push_back((uint32_t)(nowNs() - commandStamps[expected % STAMPS]));
+                }
+                commands.received++;
+                expected++;
+            }
+            // The ring overwrites the oldest image, every scan goes out
+            sequence++;
+            fillImage(image, sequence);
+            imageStamps[sequence % STAMPS] = nowNs();
+            shared.images.push(image);
+            images.sent++;
+            pace(next, opt.scanUs);
+        }
+    }
+
+    //--------------------------- M7 ----------------------------
+    static void mainCore(const Options &opt, IoShared &shared, std::atomic<bool> &running,
+                         const int64_t *imageStamps, int64_t *commandStamps, RingStats &images,
+                         RingStats &commands)
+    {
+        IoImage image;
+        uint32_t last = 0;
+        uint32_t command = 0;
+        Clock::time_point next = Clock::now();
+        Clock::time_point nextCommand = next;
+        while (running.load(std::memory_order_relaxed))
+        {
+            uint32_t skipped = 0;
+            if (shared.images.popLatest(image, skipped))
+            {
+                int64_t latency = nowNs() - imageStamps[image.sequence % STAMPS];
+                if (!checkImage(image) || image.sequence <= last)
+                {
+                    images.errors++;
+                }
+                else
+                {
+                    images.latencyNs.push_back((uint32_t)latency);
+                }
+                last = image.sequence;
+                images.received++;
+                images.skipped += skipped;
+            }
+            if (opt.commandUs == 0 || Clock::now() >= nextCommand)
+            {
+                nextCommand += std::chrono::microseconds(opt.commandUs);
+                // One writer at a time, as under the registry lock
+                commandStamps[command % STAMPS] = nowNs();
+                if (shared.commands.push({(uint16_t)command, (uint8_t)((command >> 16) & 1), 0}))
+                {
+                    commands.sent++;
+                    command++;
+                }
+                else
+                {
+                    commands.full++;
+                }
+            }
+            pace(next, opt.pollUs);
+        }
+    }
+
+    //------------------------- REPORT --------------------------
+    static double percentile(const std::vector<uint32_t> &sorted, double p)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        size_t rank = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[rank] / 1000.0;
+    }
+
+    static void report(const Options &opt, const char *name, RingStats &stats, double seconds)
+    {
+        std::vector<uint32_t> &lat = stats.latencyNs;
+        std::sort(lat.begin(), lat.end());
+        double maxUs = lat.empty() ? 0 : lat.back() / 1000.0;
+        const char *fmt = opt.csv ? "%s,%llu,%llu,%.0f,%llu,%llu,%llu,%.2f,%.2f,%.2f\n"
+                                  : "%-9s %10llu %10llu %10.0f %9llu %9llu %7llu %9.2f %9.2f %9.2f\n";
+        printf(fmt, name, (unsigned long long)stats.sent, (unsigned long long)stats.received,
+               stats.received / seconds, (unsigned long long)stats.full, (unsigned long long)stats.skipped,
+               (unsigned long long)stats.errors, percentile(lat, 50), percentile(lat, 99), maxUs);
+    }
+
+    //-------------------------- MAIN ---------------------------
+    static void usage(const char *name)
+    {
+        printf("Usage: %s [options]\n"
+               "  -d, --duration SEC       run time (default 2)\n"
+               "  -s, --scan-us US         period of the images, 0 = as fast as possible (default 0)\n"
+               "  -p, --poll-us US         period of the reads, 0 = as fast as possible (default 0)\n"
+               "  -c, --command-us US      period of the commands, 0 = one per read (default 0)\n"
+               "      --csv                machine readable output\n",
+               name);
+    }
+
+    static int run(int argc, char **argv)
+    {
+        Options opt;
+        enum
+        {
+            OPT_CSV = 256
+        };
+        static const option longOptions[] = {
+            {"duration", required_argument, nullptr, 'd'},
+            {"scan-us", required_argument, nullptr, 's'},
+            {"poll-us", required_argument, nullptr, 'p'},
+            {"command-us", required_argument, nullptr, 'c'},
+            {"csv", no_argument, nullptr, OPT_CSV},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}};
+
+        int c;
+        while ((c = getopt_long(argc, argv, "d:s:p:c:h", longOptions, nullptr)) != -1)
+        {
+            switch (c)
+            {
+            case 'd':
+                opt.duration = atof(optarg);
+                break;
+            case 's':
+                opt.scanUs = std::max(0, atoi(optarg));
+                break;
+            case 'p':
+                opt.pollUs = std::max(0, atoi(optarg));
+                break;
+            case 'c':
+                opt.commandUs = std::max(0, atoi(optarg));
+                break;
+            case OPT_CSV:
+                opt.csv = true;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 2;
+            }
+        }
+
+        // The block as the M4 lays it out, then the M7 attaches
+        std::unique_ptr<IoShared> shared(new IoShared());
+        shared->images.reset();
+        shared->commands.reset();
+        std::vector<int64_t> imageStamps(STAMPS);
+        std::vector<int64_t> commandStamps(STAMPS);
+        RingStats images;
+        RingStats commands;
+        std::atomic<bool> running(true);
+
+        Clock::time_point start = Clock::now();
+        std::thread m4(ioCore, std::cref(opt), std::ref(*shared), std::ref(running), imageStamps.data(),
+                       commandStamps.data(), std::ref(images), std::ref(commands));
+        std::thread m7(mainCore, std::cref(opt), std::ref(*shared), std::ref(running), imageStamps.data(),
+                       commandStamps.data(), std::ref(images), std::ref(commands));
+        std::this_thread::sleep_for(std::chrono::duration<double>(opt.duration));
+        running = false;
+        m7.join();
+        m4.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        if (opt.csv)
+        {
+            printf("ring,sent,received,per_s,full,skipped,errors,p50_us,p99_us,max_us\n");
+        }
+        else
+        {
+            printf("%d image slots of %zu bytes, %d command slots, %.1f s\n", IOLINK_IMAGE_SLOTS, sizeof(IoImage),
+                   IOLINK_COMMAND_SLOTS, seconds);
+            printf("%-9s %10s %10s %10s %9s %9s %7s %9s %9s %9s\n", "ring", "sent", "received", "per s", "full",
+                   "skipped", "errors", "p50 us", "p99 us", "max us");
+        }
+        report(opt, "images", images, seconds);
+        report(opt, "commands", commands, seconds);
+        return images.errors > 0 || commands.errors > 0 ? 1 : 0;
+    }
+} // namespace iolinkbench
+
+int main(int argc, char **argv)
+{
+    return iolinkbench::run(argc, argv);
+}
@@ -0,0 +1,792 @@
+/*
+ * Remoto: Load generator and latency benchmark
+ * -------------------------------------------------------------------
+ * Drives the device interfaces (GET /data, GET /config, POST /config and
+ * MQTT output commands) from a number of concurrent workers, optionally
+ * at a fixed aggregate rate, and reports throughput and latency
+ * percentiles per operation. It runs against the Flask mock in this
+ * directory or against a real device, so that firmware changes can be
+ * benchmarked the same way every time.
+ *
+ * Build: g++ -O2 -std=c++17 -pthread loadgen.cpp -o loadgen
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace loadgen
+{
+    using Clock = std::chrono::steady_clock;
+
+    enum Operation
+    {
+        OP_GET_DATA = 0,
+        OP_GET_CONFIG,
+        OP_POST_CONFIG,
+        OP_MQTT_OUTPUT,
+        OP_MODBUS_READ,
+        NUM_OPERATIONS
+    };
+
+    const char *const OPERATION_NAMES[NUM_OPERATIONS] = {"data", "config", "post", "mqtt", "modbus"};
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        int port = 80;
+        std::string mqttHost;
+        int mqttPort = 1883;
+        std::string mqttUser;
+        std::string mqttPassword;
+        std::string deviceId = "OPTA_WIFI";
+        std::string mqttPayload = "0";
+        std::string postBody = "{\"benchmark\":true}";
+        // Status of POST /config timed besides 2xx, the device answers the
+        // default body with 400. 0 once a body is given.
+        int postStatus = 400;
+        int modbusPort = 502;
+        int modbusRegisters = 8;
+        int weights[NUM_OPERATIONS] = {100, 0, 0, 0, 0};
+        int concurrency = 4;
+        double rate = 0; // aggregate requests per second, 0 = as fast as possible
+        double duration = 10;
+        double warmup = 1;
+        int timeoutMs = 5000;
+        bool csv = false;
+    };
+
+    // Latencies are kept per worker and merged at the end
+    struct Results
+    {
+        std::vector<uint32_t> latencyUs[NUM_OPERATIONS];
+        uint64_t errors[NUM_OPERATIONS] = {0};
+        uint64_t bytes[NUM_OPERATIONS] = {0};
+    };
+
+    //------------------------- SOCKETS -------------------------
+    static int openSocket(const std::string &host, int port, int timeoutMs)
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *res = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+        {
+            return -1;
+        }
+
+        int fd = -1;
+        for (addrinfo *ai = res; ai != nullptr; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+            {
+                continue;
+            }
+            timeval tv;
+            tv.tv_sec = timeoutMs / 1000;
+            tv.tv_usec = (timeoutMs % 1000) * 1000;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        return fd;
+    }
+
+    static bool sendAll(int fd, const void *data, size_t length)
+    {
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        while (length > 0)
+        {
+            ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    static bool recvAll(int fd, void *data, size_t length)
+    {
+        uint8_t *p = static_cast<uint8_t *>(data);
+        while (length > 0)
+        {
+            ssize_t n = recv(fd, p, length, 0);
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    //-------------------------- HTTP ---------------------------
+    // One request per connection, like the browser UI against the device
+    // which always answers with Connection: close. Returns the response
+    // size, or -1 on a transport error or a status neither 2xx nor the
+    // expected one.
+    static long httpRequest(const Options &opt, const char *method, const char *path, const std::string &body,
+                            int expected = 0)
+    {
+        int fd = openSocket(opt.host, opt.port, opt.timeoutMs);
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        std::string request = std::string(method) + " " + path + " HTTP/1.1\r\n";
+        request += "Host: " + opt.host + "\r\n";
+        request += "Connection: close\r\n";
+        if (!body.empty())
+        {
+            request += "Content-Type: application/json\r\n";
+            request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        }
+        request += "\r\n";
+        request += body;
+
+        if (!sendAll(fd, request.data(), request.size()))
+        {
+            close(fd);
+            return -1;
+        }
+
+        std::string response;
+        char buffer[2048];
+        ssize_t n;
+        while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        {
+            response.append(buffer, n);
+        }
+        close(fd);
+        if (n < 0 || response.size() < 12 || response.compare(0, 7, "HTTP/1.") != 0)
+        {
+            return -1;
+        }
+        int status = atoi(response.c_str() + 9);
+        if (status / 100 != 2 && status != expected)
+        {
+            return -1;
+        }
+        return (long)response.size();
+    }
+
+    //-------------------------- MQTT ---------------------------
+    // Minimal MQTT 3.1.1 publisher, QoS 1 so that the PUBACK gives a
+    // round trip to time
+    class MqttPublisher
+    {
+    private:
+        const Options &_opt;
+        int _fd = -1;
+        uint16_t _packetId = 0;
+
+        static void putString(std::string &out, const std::string &s)
+        {
+            out.push_back((char)(s.size() >> 8));
+            out.push_back((char)(s.size() & 0xFF));
+            out += s;
+        }
+
+        static void putLength(std::string &out, size_t length)
+        {
+            do
+            {
+                uint8_t digit = length % 128;
+                length /= 128;
+                if (length > 0)
+                {
+                    digit |= 0x80;
+                }
+                out.push_back((char)digit);
+            } while (length > 0);
+        }
+
+        bool readPacket(uint8_t &type, std::string &payload)
+        {
+            uint8_t header;
+            if (!recvAll(_fd, &header, 1))
+            {
+                return false;
+            }
+            size_t length = 0;
+            int shift = 0;
+            uint8_t digit;
+            do
+            {
+                if (!recvAll(_fd, &digit, 1) || shift > 21)
+                {
+                    return false;
+                }
+                length |= (size_t)(digit & 0x7F) << shift;
+                shift += 7;
+            } while (digit & 0x80);
+            payload.resize(length);
+            type = header >> 4;
+            return length == 0 || recvAll(_fd, &payload[0], length);
+        }
+
+    public:
+        explicit MqttPublisher(const Options &opt) : _opt(opt) {}
+        ~MqttPublisher()
+        {
+            disconnect();
+        }
+
+        bool connect(const std::string &clientId)
+        {
+            _fd = openSocket(_opt.mqttHost, _opt.mqttPort, _opt.timeoutMs);
+            if (_fd < 0)
+            {
+                return false;
+            }
+            std::string body;
+            putString(body, "MQTT");
+            body.push_back(4); // protocol level 3.1.1
+            uint8_t flags = 0x02; // clean session
+            if (!_opt.mqttUser.empty())
+            {
+                flags |= 0xC0;
+            }
+            body.push_back((char)flags);
+            body.push_back(0);
+            body.push_back(60); // keep alive
+            putString(body, clientId);
+            if (!_opt.mqttUser.empty())
+            {
+                putString(body, _opt.mqttUser);
+                putString(body, _opt.mqttPassword);
+            }
+            std::string packet(1, (char)0x10);
+            putLength(packet, body.size());
+            packet += body;
+            if (!sendAll(_fd, packet.data(), packet.size()))
+            {
+                disconnect();
+                return false;
+            }
+            uint8_t type;
+            std::string payload;
+            if (!readPacket(type, payload) || type != 2 || payload.size() < 2 || payload[1] != 0)
+            {
+                disconnect();
+                return false;
+            }
+            return true;
+        }
+
+        void disconnect()
+        {
+            if (_fd >= 0)
+            {
+                const uint8_t packet[2] = {0xE0, 0x00};
+                sendAll(_fd, packet, sizeof(packet));
+                close(_fd);
+                _fd = -1;
+            }
+        }
+
+        bool connected() const
+        {
+            return _fd >= 0;
+        }
+
+        // Publish and wait for the broker acknowledgement, returns the bytes sent
+        long publish(const std::string &topic, const std::string &message)
+        {
+            uint16_t id = ++_packetId == 0 ? ++_packetId : _packetId;
+            std::string body;
+            putString(body, topic);
+            body.push_back((char)(id >> 8));
+            body.push_back((char)(id & 0xFF));
+            body += message;
+            std::string packet(1, (char)0x32); // PUBLISH, QoS 1
+            putLength(packet, body.size());
+            packet += body;
+            if (!sendAll(_fd, packet.data(), packet.size()))
+            {
+                disconnect();
+                return -1;
+            }
+            uint8_t type;
+            std::string payload;
+            while (readPacket(type, payload))
+            {
+                if (type == 4 && payload.size() >= 2 &&
+                    (uint8_t)payload[0] == (id >> 8) && (uint8_t)payload[1] == (id & 0xFF))
+                {
+                    return (long)packet.size();
+                }
+            }
+            disconnect();
+            return -1;
+        }
+    };
+
+    //------------------------- MODBUS --------------------------
+    // Modbus TCP master polling the input registers over a persistent
+    // connection, the way a SCADA does
+    class ModbusPoller
+    {
+    private:
+        const Options &_opt;
+        int _fd = -1;
+        uint16_t _transaction = 0;
+
+    public:
+        explicit ModbusPoller(const Options &opt) : _opt(opt) {}
+        ~ModbusPoller()
+        {
+            disconnect();
+        }
+
+        bool connect()
+        {
+            _fd = openSocket(_opt.host, _opt.modbusPort, _opt.timeoutMs);
+            return _fd >= 0;
+        }
+
+        void disconnect()
+        {
+            if (_fd >= 0)
+            {
+                close(_fd);
+                _fd = -1;
+            }
+        }
+
+        bool connected() const
+        {
+            return _fd >= 0;
+        }
+
+        // Read input registers from address 0, returns the bytes received
+        long readInputRegisters()
+        {
+            uint16_t id = ++_transaction;
+            uint16_t count = _opt.modbusRegisters;
+            const uint8_t request[12] = {(uint8_t)(id >> 8), (uint8_t)(id & 0xFF), 0, 0, 0, 6, 1,
+                                         0x04, 0, 0, (uint8_t)(count >> 8), (uint8_t)(count & 0xFF)};
+            if (!sendAll(_fd, request, sizeof(request)))
+            {
+                disconnect();
+                return -1;
+            }
+            uint8_t header[7];
+            if (!recvAll(_fd, header, sizeof(header)))
+            {
+                disconnect();
+                return -1;
+            }
+            size_t length = (header[4] << 8) | header[5];
+            std::vector<uint8_t> pdu(length > 1 ? length - 1 : 0);
+            if (length < 2 || !recvAll(_fd, pdu.data(), pdu.size()))
+            {
+                disconnect();
+                return -1;
+            }
+            // Transaction must match, exceptions count as errors
+            if (((header[0] << 8) | header[1]) != id || pdu[0] != 0x04)
+            {
+                return -1;
+            }
+            return (long)(sizeof(header) + pdu.size());
+        }
+    };
+
+    //------------------------- WORKERS -------------------------
+    static void worker(const Options &opt, int index, Clock::time_point start, Clock::time_point stop,
+                       std::atomic<bool> &running, Results &results)
+    {
+        std::mt19937 rng(1234 + index);
+        int totalWeight = 0;
+        for (int op = 0; op < NUM_OPERATIONS; ++op)
+        {
+            totalWeight += opt.weights[op];
+        }
+        std::uniform_int_distribution<int> pick(0, totalWeight - 1);
+        std::uniform_int_distribution<int> output(1, 4);
+
+        MqttPublisher mqtt(opt);
+        ModbusPoller modbus(opt);
+        std::string clientId = "remoto-loadgen-" + std::to_string(getpid()) + "-" + std::to_string(index);
+
+        // Fixed rate: each worker owns a slice of the schedule, and latency
+        // is measured from the scheduled send time so that a stalled device
+        // cannot hide its queueing delay (coordinated omission)
+        Clock::duration interval = Clock::duration::zero();
+        if (opt.rate > 0)
+        {
+            interval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(opt.concurrency / opt.rate));
+        }
+        Clock::time_point next = start + interval * index / opt.concurrency;
+        Clock::time_point measureFrom = start + std::chrono::duration_cast<Clock::duration>(
+                                                    std::chrono::duration<double>(opt.warmup));
+
+        while (running.load(std::memory_order_relaxed))
+        {
+            if (interval != Clock::duration::zero())
+            {
+                std::this_thread::sleep_until(next);
+            }
+            Clock::time_point scheduled = interval != Clock::duration::zero() ? next : Clock::now();
+            if (scheduled >= stop)
+            {
+                break;
+            }
+            next += interval;
+
+            int roll = pick(rng);
+            int op = 0;
+            while (roll >= opt.weights[op])
+            {
+                roll -= opt.weights[op];
+                op++;
+            }
+
+            long size = -1;
+            switch (op)
+            {
+            case OP_GET_DATA:
+                size = httpRequest(opt, "GET", "/data", "");
+                break;
+            case OP_GET_CONFIG:
+                size = httpRequest(opt, "GET", "/config", "");
+                break;
+            case OP_POST_CONFIG:
+                size = httpRequest(opt, "POST", "/config", opt.postBody, opt.postStatus);
+                break;
+            case OP_MQTT_OUTPUT:
+                if (!mqtt.connected() && !mqtt.connect(clientId))
+                {
+                    // Do not hammer a broker that refuses us
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    break;
+                }
+                size = mqtt.publish(opt.deviceId + "/O" + std::to_string(output(rng)), opt.mqttPayload);
+                break;
+            case OP_MODBUS_READ:
+                if (!modbus.connected() && !modbus.connect())
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    break;
+                }
+                size = modbus.readInputRegisters();
+                break;
+            }
+            Clock::time_point done = Clock::now();
+
+            if (scheduled < measureFrom)
+            {
+                continue;
+            }
+            if (size < 0)
+            {
+                results.errors[op]++;
+                continue;
+            }
+            results.bytes[op] += size;
+            results.latencyUs[op].push_back(
+                (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(done - scheduled).count());
+        }
+    }
+
+    //------------------------- REPORT --------------------------
+    static double percentile(const std::vector<uint32_t> &sorted, double p)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        size_t rank = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[rank] / 1000.0;
+    }
+
+    static void report(const Options &opt, Results &total, double seconds)
+    {
+        if (opt.csv)
+        {
+            printf("op,count,errors,rps,kbps,p50_ms,p95_ms,p99_ms,max_ms\n");
+        }
+        else
+        {
+            printf("%-8s %9s %7s %9s %9s %9s %9s %9s %9s\n",
+                   "op", "count", "errors", "req/s", "kB/s", "p50 ms", "p95 ms", "p99 ms", "max ms");
+        }
+        for (int op = 0; op < NUM_OPERATIONS; ++op)
+        {
+            std::vector<uint32_t> &lat = total.latencyUs[op];
+            if (lat.empty() && total.errors[op] == 0)
+            {
+                continue;
+            }
+            std::sort(lat.begin(), lat.end());
+            double rps = lat.size() / seconds;
+            double kbps = total.bytes[op] / 1024.0 / seconds;
+            double maxMs = lat.empty() ? 0 : lat.back() / 1000.0;
+            const char *fmt = opt.csv ? "%s,%zu,%llu,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f\n"
+                                      : "%-8s %9zu %7llu %9.1f %9.1f %9.2f %9.2f %9.2f %9.2f\n";
+            printf(fmt, OPERATION_NAMES[op], lat.size(), (unsigned long long)total.errors[op], rps, kbps,
+                   percentile(lat, 50), percentile(lat, 95), percentile(lat, 99), maxMs);
+        }
+    }
+
+    //-------------------------- MAIN ---------------------------
+    static void usage(const char *name)
+    {
+        printf("Usage: %s [options]\n"
+               "  -H, --host HOST          device or mock address (default 127.0.0.1)\n"
+               "  -p, --port PORT          HTTP port (default 80)\n"
+               "  -m, --mix OP=W,...       operation weights, ops: data config post mqtt\n"
+               "                           modbus\n"
+               "                           (default data=100)\n"
+               "  -c, --concurrency N      concurrent workers (default 4)\n"
+               "  -r, --rate RPS           aggregate request rate, 0 = unbounded (default 0)\n"
+               "  -d, --duration SEC       measured run time (default 10)\n"
+               "  -w, --warmup SEC         discarded warmup time (default 1)\n"
+               "  -t, --timeout MS         socket timeout (default 5000)\n"
+               "      --body FILE          POST /config body, timed when accepted (default is\n"
+               "                           rejected by the device, its 400 is timed)\n"
+               "      --broker HOST        MQTT broker (default: HTTP host)\n"
+               "      --broker-port PORT   MQTT port (default 1883)\n"
+               "      --user USER          MQTT user\n"
+               "      --password PASS      MQTT password\n"
+               "      --device ID          device id for output topics (default OPTA_WIFI)\n"
+               "      --payload VALUE      payload for output commands (default 0)\n"
+               "      --modbus-port PORT   Modbus TCP port (default 502)\n"
+               "      --registers N        input registers per Modbus read (default 8)\n"
+               "      --csv                machine readable output\n",
+               name);
+    }
+
+    static bool parseMix(const char *arg, Options &opt)
+    {
+        std::fill(opt.weights, opt.weights + NUM_OPERATIONS, 0);
+        std::stringstream ss(arg);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            size_t eq = item.find('=');
+            std::string name = item.substr(0, eq);
+            int weight = eq == std::string::npos ? 1 : atoi(item.c_str() + eq + 1);
+            int op = 0;
+            while (op < NUM_OPERATIONS && name != OPERATION_NAMES[op])
+            {
+                op++;
+            }
+            if (op == NUM_OPERATIONS || weight < 0)
+            {
+                return false;
+            }
+            opt.weights[op] = weight;
+        }
+        int total = 0;
+        for (int w : opt.weights)
+        {
+            total += w;
+        }
+        return total > 0;
+    }
+
+    static int run(int argc, char **argv)
+    {
+        Options opt;
+        enum
+        {
+            OPT_BODY = 256,
+            OPT_BROKER,
+            OPT_BROKER_PORT,
+            OPT_USER,
+            OPT_PASSWORD,
+            OPT_DEVICE,
+            OPT_PAYLOAD,
+            OPT_MODBUS_PORT,
+            OPT_REGISTERS,
+            OPT_CSV
+        };
+        static const option longOptions[] = {
+            {"host", required_argument, nullptr, 'H'},
+            {"port", required_argument, nullptr, 'p'},
+            {"mix", required_argument, nullptr, 'm'},
+            {"concurrency", required_argument, nullptr, 'c'},
+            {"rate", required_argument, nullptr, 'r'},
+            {"duration", required_argument, nullptr, 'd'},
+            {"warmup", required_argument, nullptr, 'w'},
+            {"timeout", required_argument, nullptr, 't'},
+            {"body", required_argument, nullptr, OPT_BODY},
+            {"broker", required_argument, nullptr, OPT_BROKER},
+            {"broker-port", required_argument, nullptr, OPT_BROKER_PORT},
+            {"user", required_argument, nullptr, OPT_USER},
+            {"password", required_argument, nullptr, OPT_PASSWORD},
+            {"device", required_argument, nullptr, OPT_DEVICE},
+            {"payload", required_argument, nullptr, OPT_PAYLOAD},
+            {"modbus-port", required_argument, nullptr, OPT_MODBUS_PORT},
+            {"registers", required_argument, nullptr, OPT_REGISTERS},
+            {"csv", no_argument, nullptr, OPT_CSV},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}};
+
+        int c;
+        while ((c = getopt_long(argc, argv, "H:p:m:c:r:d:w:t:h", longOptions, nullptr)) != -1)
+        {
+            switch (c)
+            {
+            case 'H':
+                opt.host = optarg;
+                break;
+            case 'p':
+                opt.port = atoi(optarg);
+                break;
+            case 'm':
+                if (!parseMix(optarg, opt))
+                {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'c':
+                opt.concurrency = std::max(1, atoi(optarg));
+                break;
+            case 'r':
+                opt.rate = atof(optarg);
+                break;
+            case 'd':
+                opt.duration = atof(optarg);
+                break;
+            case 'w':
+                opt.warmup = atof(optarg);
+                break;
+            case 't':
+                opt.timeoutMs = atoi(optarg);
+                break;
+            case OPT_BODY:
+            {
+                std::ifstream file(optarg);
+                if (!file)
+                {
+                    fprintf(stderr, "Cannot read %s\n", optarg);
+                    return 2;
+                }
+                std::stringstream content;
+                content << file.rdbuf();
+                opt.postBody = content.str();
+                opt.postStatus = 0;
+                break;
+            }
+            case OPT_BROKER:
+                opt.mqttHost = optarg;
+                break;
+            case OPT_BROKER_PORT:
+                opt.mqttPort = atoi(optarg);
+                break;
+            case OPT_USER:
+                opt.mqttUser = optarg;
+                break;
+            case OPT_PASSWORD:
+                opt.mqttPassword = optarg;
+                break;
+            case OPT_DEVICE:
+                opt.deviceId = optarg;
+                break;
+            case OPT_PAYLOAD:
+                opt.mqttPayload = optarg;
+                break;
+            case OPT_MODBUS_PORT:
+                opt.modbusPort = atoi(optarg);
+                break;
+            case OPT_REGISTERS:
+                opt.modbusRegisters = std::min(125, std::max(1, atoi(optarg)));
+                break;
+            case OPT_CSV:
+                opt.csv = true;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 2;
+            }
+        }
+        if (opt.mqttHost.empty())
+        {
+            opt.mqttHost = opt.host;
+        }
+
+        std::vector<Results> results(opt.concurrency);
+        std::vector<std::thread> threads;
+        std::atomic<bool> running(true);
+        Clock::time_point start = Clock::now();
+        Clock::time_point stop = start + std::chrono::duration_cast<Clock::duration>(
+                                             std::chrono::duration<double>(opt.warmup + opt.duration));
+        for (int i = 0; i < opt.concurrency; ++i)
+        {
+            threads.emplace_back(worker, std::cref(opt), i, start, stop, std::ref(running), std::ref(results[i]));
+        }
+        std::this_thread::sleep_until(stop);
+        running = false;
+        for (std::thread &t : threads)
+        {
+            t.join();
+        }
+        // Requests still in flight at the deadline are counted too
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count() - opt.warmup;
+
+        Results total;
+        for (Results &r : results)
+        {
+            for (int op = 0; op < NUM_OPERATIONS; ++op)
+            {
+                total.latencyUs[op].insert(total.latencyUs[op].end(), r.latencyUs[op].begin(), r.latencyUs[op].end());
+                total.errors[op] += r.errors[op];
+                total.bytes[op] += r.bytes[op];
+            }
+        }
+        if (!opt.csv)
+        {
+            printf("target %s:%d, %d workers, %s, %.1f s\n", opt.host.c_str(), opt.port, opt.concurrency,
+                   opt.rate > 0 ? (std::to_string((int)opt.rate) + " req/s").c_str() : "unbounded rate", seconds);
+        }
+        report(opt, total, seconds);
+        return 0;
+    }
+} // namespace loadgen
+
+int main(int argc, char **argv)
+{
+    return loadgen::run(argc, argv);
+}
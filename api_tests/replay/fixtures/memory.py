@@ -0,0 +1,95 @@
+"""
+Memory fixture for the replay runner
+
+Writes memory.trc, a one minute session on a device with a digital and an
+analog expansion (SIM_EXPANSION_LAYOUT "DA") and the configuration in
+memory.json. It drives every code path with a heap budget:
+
+- a request to each JSON route, then /data every three seconds,
+- an output command over HTTP and two over MQTT,
+- a rejected POST /config,
+- a broker drop and reconnection,
+- a digital and an analog input changing every two seconds.
+
+The trace holds what drives the firmware and the output changes it must
+make, in the format of trace.h. Responses and publishes are left out, as
+they change with every build, so the replay is run with the topics
+ignored (see memcheck.sh).
+
+Usage: python3 memory.py [memory.trc]
+"""
+
+import struct
+import sys
+
+# trace.h
+TRACE_MAGIC = b"RMTR"
+TRACE_VERSION = 1
+TRACE_LAYOUT, TRACE_INPUTS, TRACE_OUTPUTS, TRACE_HTTP_OPEN, TRACE_HTTP_DATA = 0, 1, 2, 3, 4
+TRACE_MQTT_STATE, TRACE_MQTT_MESSAGE = 6, 7
+
+START_MS = 10000  # uptime when the capture starts
+DURATION_MS = 60000
+CLIENT = 0x0A01A8C0  # 192.168.1.10
+DEVICE_ID = b"OPTA_WIFI"
+
+records = []
+
+
+def record(ms, kind, payload):
+    records.append((ms, kind, payload))
+
+
+def request(ms, text):
+    record(ms, TRACE_HTTP_OPEN, struct.pack("<I", CLIENT))
+    record(ms, TRACE_HTTP_DATA, text)
+
+
+def get(ms, path):
+    request(ms, b"GET " + path + b" HTTP/1.1\r\nHost: opta\r\n\r\n")
+
+
+def post(ms, path, body):
+    request(ms, b"POST " + path + b" HTTP/1.1\r\nContent-Length: %d\r\n\r\n" % len(body) + body)
+
+
+def message(ms, topic, payload):
+    record(ms, TRACE_MQTT_MESSAGE, bytes([len(topic)]) + topic + payload)
+
+
+def output(ms, index, value):
+    record(ms, TRACE_OUTPUTS, struct.pack("<BB", index, value))
+
+
+# State at the start: the module layout with I7 and I8 analog, every
+# input and output at 0, the broker connected
+layout = [(0, 0xC0), (1, 0), (2, 0)]
+record(0, TRACE_LAYOUT, b"".join(struct.pack("<BI", kind, mask) for kind, mask in layout))
+record(0, TRACE_INPUTS, b"".join(struct.pack("<BH", i, 0) for i in range(32)))
+record(0, TRACE_OUTPUTS, b"".join(struct.pack("<BB", i, 0) for i in range(12)))
+record(0, TRACE_MQTT_STATE, b"\x01")
+
+# I1 toggles, I8 ramps
+for n, ms in enumerate(range(500, DURATION_MS, 2000)):
+    record(ms, TRACE_INPUTS, struct.pack("<BH", 0, n % 2) + struct.pack("<BH", 7, 1000 + 400 * (n % 20)))
+
+for n, path in enumerate([b"/data", b"/config", b"/metrics", b"/tasks", b"/outputs", b"/device", b"/logs",
+                          b"/send", b"/tls"]):
+    get(1000 + 2000 * n, path)
+post(20000, b"/outputs/2", b"1")
+output(20000, 1, 1)
+post(22000, b"/config", b'{"deviceId":1}')
+message(25000, DEVICE_ID + b"/O1", b"1")
+output(25000, 0, 1)
+message(35000, DEVICE_ID + b"/O1", b"0")
+output(35000, 0, 0)
+record(40000, TRACE_MQTT_STATE, b"\x00")
+record(45000, TRACE_MQTT_STATE, b"\x01")
+for ms in range(48000, DURATION_MS, 3000):
+    get(ms, b"/data")
+
+records.sort(key=lambda r: r[0])
+body = b"".join(struct.pack("<IBH", ms, kind, len(payload)) + payload for ms, kind, payload in records)
+header = TRACE_MAGIC + struct.pack("<BBHII", TRACE_VERSION, 0, 0, START_MS, DURATION_MS)
+with open(sys.argv[1] if len(sys.argv) > 1 else "memory.trc", "wb") as trace:
+    trace.write(header + body)
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Remoto: replay memory check
+# -------------------------------------------------------------------
+# Builds the replay runner with the heap profile, writes the fixture
+# session (fixtures/memory.py) and replays it with its configuration.
+# The runner fails when the peak of a subsystem is over its budget.
+#
+# Usage: ./memcheck.sh <ArduinoJson checkout> [build directory]
+#
+# Exit status: 0 within the budgets, 3 over one, 1 when the output
+# changes differ from the fixture, 2 when the build or the fixture fails.
+#
+# Author: Alberto Perro
+# Date: 27-12-2024
+# License: CERN-OHL-P
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 <ArduinoJson checkout> [build directory]" >&2
+    exit 2
+fi
+json=$(cd "$1" && pwd)/src
+cd "$(dirname "$0")" || exit 2
+out=${2:-build}
+mkdir -p "$out" || exit 2
+
+g++ -O2 -std=gnu++17 -DARDUINO=10819 -DARDUINOJSON_ENABLE_PROGMEM=0 -DREMOTO_SIM_EXPANSION \
+    -DSIM_EXPANSION_LAYOUT=\"DA\" -DTRACE_BUFFER_SIZE=4194304 -DREMOTO_MEM_PROFILE -Ishim -I"$json" -I../.. \
+    replay.cpp shim/shim.cpp ../../*.cpp -Wl,--wrap=malloc,--wrap=free,--wrap=realloc,--wrap=calloc \
+    -o "$out/replay-mem" || exit 2
+python3 fixtures/memory.py "$out/memory.trc" || exit 2
+
+# The fixture has no responses or publishes, only the outputs are compared
+"$out/replay-mem" --config fixtures/memory.json --ignore OPTA_WIFI/ "$out/memory.trc"
@@ -0,0 +1,947 @@
+/*
+ * Remoto: Trace replay runner
+ * -------------------------------------------------------------------
+ * Runs the firmware on Linux, on the shim in this directory, and feeds
+ * it a trace captured on a device with POST /trace/start and GET /trace:
+ * the input readings, the HTTP clients and the MQTT messages arrive at
+ * their recorded times on a virtual clock, as fast as the PC allows.
+ * The replay captures its own trace with the same hooks, and its HTTP
+ * responses, publishes and output changes are compared with the
+ * recorded ones. It reports the differences and the wall clock time
+ * spent in each handler, so a set of traces from the field doubles as
+ * a regression suite for behaviour and speed.
+ *
+ * Built with REMOTO_MEM_PROFILE it also reports the heap held by each
+ * subsystem, and fails when one went over its budget.
+ *
+ * Exit status: 0 same behaviour, 1 differences, 2 errors, 3 over a
+ * --limit or a memory budget.
+ *
+ * Build: see readme.md in the parent directory
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+// Prototypes the Arduino IDE generates for the sketch
+#include <Arduino.h>
+String getData();
+String getTasks();
+String getOutputs();
+String getTraceStatus();
+String getLogs();
+String getMetrics();
+
+#include "../../remoto.ino"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+
+#if !defined(REMOTO_SIM_EXPANSION)
+#error "the expansion inputs are driven through SimulatedExpansionBus, build with -DREMOTO_SIM_EXPANSION"
+#endif
+
+namespace replay
+{
+    // The thread loops run once per tick
+    constexpr uint64_t TICK_US = 1000;
+    // Virtual uptime run through before the capture start, from boot
+    constexpr uint64_t BOOT_US = 60000000ULL;
+
+    struct Options
+    {
+        std::string tracePath;
+        std::string configPath;
+        std::string writePath;
+        std::vector<std::string> ignore;
+        uint32_t toleranceMs = 100;
+        std::map<std::string, double> limitsUs;
+        std::map<std::string, uint32_t> memLimits; // in place of the firmware budgets
+        bool csv = false;
+        bool verbose = false;
+    };
+
+    //-------------------------- TRACE ---------------------------
+    struct Record
+    {
+        uint32_t timeMs;
+        uint8_t kind;
+        std::string data;
+    };
+
+    struct Trace
+    {
+        TraceHeader header;
+        std::vector<Record> records;
+    };
+
+    static uint16_t u16(const std::string &data, size_t at)
+    {
+        uint16_t value;
+        memcpy(&value, data.data() + at, 2);
+        return value;
+    }
+
+    static uint32_t u32(const std::string &data, size_t at)
+    {
+        uint32_t value;
+        memcpy(&value, data.data() + at, 4);
+        return value;
+    }
+
+    static bool parseTrace(const std::string &bytes, Trace &trace, std::string &error)
+    {
+        if (bytes.size() < sizeof(TraceHeader))
+        {
+            error = "shorter than a trace header";
+            return false;
+        }
+        memcpy(&trace.header, bytes.data(), sizeof(TraceHeader));
+        if (memcmp(trace.header.magic, TRACE_MAGIC, sizeof(trace.header.magic)) != 0)
+        {
+            error = "not a trace";
+            return false;
+        }
+        if (trace.header.version != TRACE_VERSION)
+        {
+            error = "trace version " + std::to_string(trace.header.version) + ", expected " + std::to_string(TRACE_VERSION);
+            return false;
+        }
+        trace.records.clear();
+        size_t offset = sizeof(TraceHeader);
+        while (offset < bytes.size())
+        {
+            if (bytes.size() - offset < TRACE_RECORD_HEADER)
+            {
+                error = "truncated record header at byte " + std::to_string(offset);
+                return false;
+            }
+            Record record;
+            record.timeMs = u32(bytes, offset);
+            record.kind = bytes[offset + 4];
+            uint16_t length = u16(bytes, offset + 5);
+            offset += TRACE_RECORD_HEADER;
+            if (record.kind >= NUM_TRACE_KINDS || bytes.size() - offset < length)
+            {
+                error = "bad record at byte " + std::to_string(offset - TRACE_RECORD_HEADER);
+                return false;
+            }
+            record.data = bytes.substr(offset, length);
+            offset += length;
+            trace.records.push_back(record);
+        }
+        // Layout, inputs and outputs at 0 open every trace
+        if (trace.records.size() < 3 || trace.records[0].kind != TRACE_LAYOUT ||
+            trace.records[1].kind != TRACE_INPUTS || trace.records[2].kind != TRACE_OUTPUTS)
+        {
+            error = "no initial state";
+            return false;
+        }
+        return true;
+    }
+
+    static bool readFile(const std::string &path, std::string &content)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        std::stringstream bytes;
+        bytes << file.rdbuf();
+        content = bytes.str();
+        return true;
+    }
+
+    // The records of the initial state, the broker state after them
+    static size_t initialRecords(const Trace &trace)
+    {
+        return trace.records.size() > 3 && trace.records[3].kind == TRACE_MQTT_STATE && trace.records[3].timeMs == 0 ? 4 : 3;
+    }
+
+    // One HTTP client, from its open to its close records
+    struct Exchange
+    {
+        uint32_t openMs = 0;
+        uint32_t address = 0;
+        std::vector<std::pair<uint32_t, std::string>> chunks;
+        bool closed = false;
+        uint32_t responseBytes = 0;
+        uint32_t responseCrc = 0;
+        uint32_t handlingUs = 0;
+        uint8_t flags = 0;
+
+        std::string requestLine() const
+        {
+            std::string line;
+            for (const auto &chunk : chunks)
+            {
+                size_t end = chunk.second.find_first_of("\r\n");
+                line += chunk.second.substr(0, end);
+                if (end != std::string::npos)
+                {
+                    break;
+                }
+            }
+            return line;
+        }
+
+        // Method and path, the category of the timing report
+        std::string route() const
+        {
+            std::string line = requestLine();
+            size_t end = line.find_first_of(" ?", line.find(' ') + 1);
+            return line.substr(0, end);
+        }
+    };
+
+    static std::vector<Exchange> exchanges(const Trace &trace)
+    {
+        // One client at a time, its records follow each other
+        std::vector<Exchange> list;
+        for (const Record &record : trace.records)
+        {
+            if (record.kind == TRACE_HTTP_OPEN)
+            {
+                list.emplace_back();
+                list.back().openMs = record.timeMs;
+                list.back().address = u32(record.data, 0);
+            }
+            else if (record.kind == TRACE_HTTP_DATA && !list.empty() && !list.back().closed)
+            {
+                list.back().chunks.emplace_back(record.timeMs, record.data);
+            }
+            else if (record.kind == TRACE_HTTP_CLOSE && !list.empty() && !list.back().closed)
+            {
+                Exchange &exchange = list.back();
+                exchange.closed = true;
+                exchange.responseBytes = u32(record.data, 0);
+                exchange.responseCrc = u32(record.data, 4);
+                exchange.handlingUs = u32(record.data, 8);
+                exchange.flags = record.data[12];
+            }
+        }
+        return list;
+    }
+
+    struct Publish
+    {
+        uint32_t timeMs;
+        uint16_t length;
+        uint32_t crc;
+    };
+
+    static std::map<std::string, std::vector<Publish>> publishes(const Trace &trace)
+    {
+        std::map<std::string, std::vector<Publish>> topics;
+        for (const Record &record : trace.records)
+        {
+            if (record.kind == TRACE_PUBLISH)
+            {
+                topics[record.data.substr(6)].push_back({record.timeMs, u16(record.data, 0), u32(record.data, 2)});
+            }
+        }
+        return topics;
+    }
+
+    struct OutputChange
+    {
+        uint32_t timeMs;
+        uint8_t value;
+    };
+
+    static std::map<int, std::vector<OutputChange>> outputChanges(const Trace &trace)
+    {
+        std::map<int, std::vector<OutputChange>> outputs;
+        for (size_t r = initialRecords(trace); r < trace.records.size(); ++r)
+        {
+            const Record &record = trace.records[r];
+            for (size_t i = 0; record.kind == TRACE_OUTPUTS && i + 1 < record.data.size(); i += 2)
+            {
+                outputs[(uint8_t)record.data[i]].push_back({record.timeMs, (uint8_t)record.data[i + 1]});
+            }
+        }
+        return outputs;
+    }
+
+    //-------------------------- TIMING ---------------------------
+    struct Timing
+    {
+        std::map<std::string, std::vector<uint32_t>> samplesNs;
+
+        void add(const std::string &category, uint64_t ns)
+        {
+            samplesNs[category].push_back(ns < UINT32_MAX ? ns : UINT32_MAX);
+        }
+    };
+
+    static Timing timing;
+
+    template <typename F>
+    static void timed(const char *category, F run)
+    {
+        uint64_t start = wallNs();
+        run();
+        timing.add(category, wallNs() - start);
+    }
+
+    static double percentile(const std::vector<uint32_t> &sorted, double p)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        size_t rank = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[rank] / 1000.0;
+    }
+
+    //-------------------------- BROKER ---------------------------
+    // Stands for the broker the device was connected to: up or down as
+    // recorded, it hands the recorded messages to the firmware and takes
+    // the publishes, which the comparison reads from the replay trace
+    class Broker : public MqttTransport
+    {
+    private:
+        bool _up = true;
+        bool _connected = false;
+        MqttMessageHandler _handler = nullptr;
+        std::deque<std::pair<std::string, std::string>> _inbox;
+
+    public:
+        void begin(const char *, uint16_t, Client &) override {}
+        bool connect(const char *, const char *, const char *) override
+        {
+            _connected = _up;
+            return _connected;
+        }
+        void disconnect() override { _connected = false; }
+        bool connected() override { return _connected; }
+        bool sessionPresent() const override { return false; }
+        bool publish(const char *, const uint8_t *, size_t, bool = false, uint8_t = 0) override
+        {
+            return _connected;
+        }
+        bool subscribe(const char *, uint8_t = 0) override { return _connected; }
+        bool loop() override
+        {
+            while (_connected && !_inbox.empty() && _handler != nullptr)
+            {
+                std::pair<std::string, std::string> message = _inbox.front();
+                _inbox.pop_front();
+                timed("mqtt message", [&]()
+                      { _handler(message.first.c_str(), (const uint8_t *)message.second.data(), message.second.size()); });
+            }
+            return _connected;
+        }
+        void onMessage(MqttMessageHandler handler) override { _handler = handler; }
+        uint8_t protocolVersion() const override { return MQTT_VERSION_311; }
+
+        void setUp(bool up)
+        {
+            _up = up;
+            _connected = _connected && up;
+        }
+        // Held until the firmware is connected, as a QoS 1 message would be
+        void deliver(const std::string &topic, const std::string &payload) { _inbox.emplace_back(topic, payload); }
+
+        using MqttTransport::publish;
+    };
+
+    static Broker broker;
+
+    //-------------------------- REPLAY ---------------------------
+    static void setInput(int index, uint16_t value)
+    {
+        if (index < ONBOARD_INPUTS)
+        {
+            setPin(A0 + index, value);
+            return;
+        }
+        int first = ONBOARD_INPUTS;
+        for (int m = 1; m < channels.moduleCount(); ++m)
+        {
+            int inputs = channels.getModule(m).inputs;
+            if (index < first + inputs)
+            {
+                expansionBus.setInput(m - 1, index - first, value);
+                return;
+            }
+            first += inputs;
+        }
+    }
+
+    static void applyInputs(const Record &record)
+    {
+        for (size_t i = 0; i + 2 < record.data.size(); i += 3)
+        {
+            setInput((uint8_t)record.data[i], u16(record.data, i + 1));
+        }
+    }
+
+    // The panel of the build must be the recorded one
+    static bool checkLayout(const Record &layout, std::string &error)
+    {
+        if ((int)layout.data.size() != channels.moduleCount() * 5)
+        {
+            error = "recorded with " + std::to_string(layout.data.size() / 5 - 1) + " expansion modules, the replay build has " +
+                    std::to_string(channels.moduleCount() - 1) + " (see SIM_EXPANSION_LAYOUT)";
+            return false;
+        }
+        for (int m = 0, first = 0; m < channels.moduleCount(); ++m)
+        {
+            const ModuleInfo &info = channels.getModule(m);
+            uint32_t analogMask = 0;
+            for (int i = 0; i < info.inputs; ++i)
+            {
+                analogMask |= (uint32_t)channels.isInputAnalog(first + i) << i;
+            }
+            first += info.inputs;
+            if ((uint8_t)layout.data[m * 5] != info.kind)
+            {
+                error = "module " + std::to_string(m) + " is of another kind (see SIM_EXPANSION_LAYOUT)";
+                return false;
+            }
+            if (u32(layout.data, m * 5 + 1) != analogMask)
+            {
+                error = "module " + std::to_string(m) + " has other analog inputs, pass the device configuration with --config";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Run the thread loops for one tick, then fill the rest of it
+    static void tick()
+    {
+        uint64_t tickEnd = nowUs() + TICK_US;
+        fireTimeouts();
+        idle = true;
+        timed("timers", []()
+              { timers.run(); });
+        timed("io", loopIo);
+        timed("comms", loopComms);
+        timed("supervisor", loopSupervisor);
+        idle = false;
+        timed("loop", loop);
+        idle = true;
+        drainLogs(Serial);
+        idle = false;
+        if (nowUs() < tickEnd)
+        {
+            setNowUs(tickEnd);
+        }
+    }
+
+    static bool ignored(const Options &opt, const std::string &name)
+    {
+        for (const std::string &text : opt.ignore)
+        {
+            if (name.find(text) != std::string::npos)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns the number of differences
+    static int compareHttp(const Options &opt, const std::vector<Exchange> &recorded,
+                           const std::vector<std::shared_ptr<Connection>> &connections)
+    {
+        int compared = 0, differ = 0, skipped = 0;
+        std::vector<std::string> lines;
+        for (size_t i = 0; i < recorded.size(); ++i)
+        {
+            const Exchange &expected = recorded[i];
+            const std::shared_ptr<Connection> &actual = connections[i];
+            std::string request = expected.requestLine();
+            // The capture's own routes answer with the capture
+            if (actual == nullptr || !expected.closed || expected.route().find(" /trace") != std::string::npos ||
+                ignored(opt, request))
+            {
+                skipped++;
+                continue;
+            }
+            compared++;
+            char line[256];
+            if (!actual->stopped)
+            {
+                snprintf(line, sizeof(line), "  #%zu %.60s at %.3f s: no response", i + 1, request.c_str(),
+                         expected.openMs / 1000.0);
+                lines.push_back(line);
+                differ++;
+                continue;
+            }
+            const std::string &response = actual->response;
+            uint32_t handlingUs = actual->stoppedUs - actual->acceptedUs;
+            bool different = response.size() != expected.responseBytes ||
+                             crc32(response.data(), response.size()) != expected.responseCrc;
+            bool slower = handlingUs > expected.handlingUs + opt.toleranceMs * 1000;
+            if (different || slower)
+            {
+                std::string status = response.substr(0, response.find_first_of("\r\n"));
+                snprintf(line, sizeof(line), "  #%zu %.60s at %.3f s: %u bytes, replayed %zu (%.40s)%s, %.1f ms, recorded %.1f ms",
+                         i + 1, request.c_str(), expected.openMs / 1000.0, expected.responseBytes, response.size(),
+                         status.c_str(), different && response.size() == expected.responseBytes ? " CRC differs" : "",
+                         handlingUs / 1000.0, expected.handlingUs / 1000.0);
+                lines.push_back(line);
+                differ++;
+            }
+        }
+        printf("HTTP       %5d compared, %d differ, %d skipped\n", compared, differ, skipped);
+        for (const std::string &line : lines)
+        {
+            printf("%s\n", line.c_str());
+        }
+        return differ;
+    }
+
+    static int comparePublishes(const Options &opt, const Trace &recorded, const Trace &replayed)
+    {
+        std::map<std::string, std::vector<Publish>> expected = publishes(recorded);
+        std::map<std::string, std::vector<Publish>> actual = publishes(replayed);
+        for (const auto &topic : actual)
+        {
+            expected[topic.first];
+        }
+        int compared = 0, differ = 0;
+        std::vector<std::string> lines;
+        for (const auto &topic : expected)
+        {
+            if (ignored(opt, topic.first))
+            {
+                continue;
+            }
+            const std::vector<Publish> &want = topic.second;
+            const std::vector<Publish> &got = actual[topic.first];
+            size_t common = std::min(want.size(), got.size());
+            int payloads = 0;
+            const Publish *first = nullptr;
+            for (size_t i = 0; i < common; ++i)
+            {
+                if (want[i].length != got[i].length || want[i].crc != got[i].crc)
+                {
+                    payloads++;
+                    first = first != nullptr ? first : &want[i];
+                }
+            }
+            compared += common;
+            if (payloads > 0 || want.size() != got.size())
+            {
+                char line[256];
+                snprintf(line, sizeof(line), "  %s: %zu recorded, %zu replayed, %d payloads differ", topic.first.c_str(),
+                         want.size(), got.size(), payloads);
+                std::string text = line;
+                if (first != nullptr)
+                {
+                    snprintf(line, sizeof(line), ", the first at %.3f s", first->timeMs / 1000.0);
+                    text += line;
+                }
+                lines.push_back(text);
+                differ += payloads + (int)(std::max(want.size(), got.size()) - common);
+            }
+            else if (opt.verbose)
+            {
+                printf("  %s: %zu same\n", topic.first.c_str(), want.size());
+            }
+        }
+        printf("Publishes  %5d compared, %d differ\n", compared, differ);
+        for (const std::string &line : lines)
+        {
+            printf("%s\n", line.c_str());
+        }
+        return differ;
+    }
+
+    static int compareOutputs(const Options &opt, const Trace &recorded, const Trace &replayed)
+    {
+        std::map<int, std::vector<OutputChange>> expected = outputChanges(recorded);
+        std::map<int, std::vector<OutputChange>> actual = outputChanges(replayed);
+        int compared = 0, differ = 0;
+        for (int o = 0; o < channels.outputCount(); ++o)
+        {
+            const std::vector<OutputChange> &want = expected[o];
+            const std::vector<OutputChange> &got = actual[o];
+            size_t common = std::min(want.size(), got.size());
+            compared += common;
+            for (size_t i = 0; i < common; ++i)
+            {
+                int32_t lateMs = (int32_t)(got[i].timeMs - want[i].timeMs);
+                if (want[i].value != got[i].value || lateMs > (int32_t)opt.toleranceMs || -lateMs > (int32_t)opt.toleranceMs)
+                {
+                    printf("  O%d change %zu: %u at %.3f s, replayed %u at %.3f s\n", o + 1, i + 1, want[i].value,
+                           want[i].timeMs / 1000.0, got[i].value, got[i].timeMs / 1000.0);
+                    differ++;
+                }
+            }
+            if (want.size() != got.size())
+            {
+                printf("  O%d: %zu changes recorded, %zu replayed\n", o + 1, want.size(), got.size());
+                differ += std::max(want.size(), got.size()) - common;
+            }
+        }
+        printf("Outputs    %5d compared, %d differ\n", compared, differ);
+        return differ;
+    }
+
+    // Prints the table, returns false when a category is over its limit
+    static bool reportTiming(const Options &opt)
+    {
+        bool within = true;
+        printf(opt.csv ? "category,count,p50 us,p99 us,max us,total ms\n" : "\n%-24s %9s %9s %9s %9s %9s\n",
+               "category", "count", "p50 us", "p99 us", "max us", "total ms");
+        for (auto &category : timing.samplesNs)
+        {
+            std::vector<uint32_t> &samples = category.second;
+            std::sort(samples.begin(), samples.end());
+            double totalMs = 0;
+            for (uint32_t ns : samples)
+            {
+                totalMs += ns / 1e6;
+            }
+            double p50 = percentile(samples, 50);
+            const char *fmt = opt.csv ? "%s,%zu,%.1f,%.1f,%.1f,%.1f%s\n" : "%-24s %9zu %9.1f %9.1f %9.1f %9.1f%s\n";
+            const char *over = "";
+            for (const auto &limit : opt.limitsUs)
+            {
+                if (category.first.compare(0, limit.first.size(), limit.first) == 0 && p50 > limit.second)
+                {
+                    over = opt.csv ? "" : "  over limit";
+                    within = false;
+                }
+            }
+            printf(fmt, category.first.c_str(), samples.size(), p50, percentile(samples, 99),
+                   samples.back() / 1000.0, totalMs, over);
+        }
+        return within;
+    }
+
+    // Prints the heap of each subsystem, returns false when one is over
+    // its budget
+    static bool reportMemory(const Options &opt)
+    {
+#if defined(REMOTO_MEM_PROFILE)
+        bool within = true;
+        printf(opt.csv ? "subsystem,allocs,live,peak,budget\n" : "\n%-24s %9s %9s %9s %9s\n", "subsystem", "allocs",
+               "live", "peak", "budget");
+        for (int i = 0; i < NUM_MEM_TAGS; i++)
+        {
+            MemTagStats stats;
+            memTagStats((MemTag)i, stats);
+            auto limit = opt.memLimits.find(memTagName((MemTag)i));
+            if (limit != opt.memLimits.end())
+            {
+                stats.budget = limit->second;
+            }
+            const char *over = "";
+            if (stats.budget > 0 && stats.peak > stats.budget)
+            {
+                over = opt.csv ? "" : "  over budget";
+                within = false;
+            }
+            printf(opt.csv ? "%s,%u,%u,%u,%u%s\n" : "%-24s %9u %9u %9u %9u%s\n", memTagName((MemTag)i), stats.allocs,
+                   stats.live, stats.peak, stats.budget, over);
+        }
+        return within;
+#else
+        (void)opt;
+        return true;
+#endif
+    }
+
+    //-------------------------- MAIN ---------------------------
+    static void usage(const char *name)
+    {
+        printf("Usage: %s [options] TRACE\n"
+               "  -c, --config FILE        device configuration, as from GET /config\n"
+               "  -i, --ignore TEXT        leave requests and topics containing TEXT out of\n"
+               "                           the comparison, repeatable\n"
+               "  -t, --tolerance MS       allowed difference in timing (default 100)\n"
+               "  -l, --limit NAME=US      fail when the median time of the categories\n"
+               "                           starting with NAME is over US, repeatable\n"
+               "  -m, --mem-limit TAG=N    fail when the peak heap of the subsystem is over\n"
+               "                           N bytes rather than its budget, repeatable,\n"
+               "                           in a REMOTO_MEM_PROFILE build\n"
+               "  -w, --write FILE         save the trace of the replay\n"
+               "  -v, --verbose            print the Serial output and the matches\n"
+               "      --csv                machine readable timing table\n",
+               name);
+    }
+
+    static int run(int argc, char **argv)
+    {
+        Options opt;
+        enum
+        {
+            OPT_CSV = 256
+        };
+        static const option longOptions[] = {
+            {"config", required_argument, nullptr, 'c'},
+            {"ignore", required_argument, nullptr, 'i'},
+            {"tolerance", required_argument, nullptr, 't'},
+            {"limit", required_argument, nullptr, 'l'},
+            {"mem-limit", required_argument, nullptr, 'm'},
+            {"write", required_argument, nullptr, 'w'},
+            {"verbose", no_argument, nullptr, 'v'},
+            {"csv", no_argument, nullptr, OPT_CSV},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}};
+
+        int c;
+        while ((c = getopt_long(argc, argv, "c:i:t:l:m:w:vh", longOptions, nullptr)) != -1)
+        {
+            switch (c)
+            {
+            case 'c':
+                opt.configPath = optarg;
+                break;
+            case 'i':
+                opt.ignore.push_back(optarg);
+                break;
+            case 't':
+                opt.toleranceMs = atoi(optarg);
+                break;
+            case 'l':
+            {
+                const char *eq = strchr(optarg, '=');
+                if (eq == nullptr)
+                {
+                    fprintf(stderr, "Invalid limit: %s\n", optarg);
+                    return 2;
+                }
+                opt.limitsUs[std::string(optarg, eq - optarg)] = atof(eq + 1);
+                break;
+            }
+            case 'm':
+            {
+                const char *eq = strchr(optarg, '=');
+                if (eq == nullptr)
+                {
+                    fprintf(stderr, "Invalid memory limit: %s\n", optarg);
+                    return 2;
+                }
+                opt.memLimits[std::string(optarg, eq - optarg)] = strtoul(eq + 1, nullptr, 10);
+                break;
+            }
+            case 'w':
+                opt.writePath = optarg;
+                break;
+            case 'v':
+                opt.verbose = true;
+                break;
+            case OPT_CSV:
+                opt.csv = true;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 2;
+            }
+        }
+        if (optind != argc - 1)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+        opt.tracePath = argv[optind];
+#if !defined(REMOTO_MEM_PROFILE)
+        if (!opt.memLimits.empty())
+        {
+            fprintf(stderr, "--mem-limit needs a build with -DREMOTO_MEM_PROFILE\n");
+            return 2;
+        }
+#endif
+        echoSerial = opt.verbose;
+
+        std::string bytes, error;
+        Trace recorded;
+        if (!readFile(opt.tracePath, bytes))
+        {
+            fprintf(stderr, "Cannot read %s\n", opt.tracePath.c_str());
+            return 2;
+        }
+        if (!parseTrace(bytes, recorded, error))
+        {
+            fprintf(stderr, "%s: %s\n", opt.tracePath.c_str(), error.c_str());
+            return 2;
+        }
+
+        // The configuration setup() finds in flash, on Ethernet, MQTT 3.1.1
+        // and plain TCP, the transports of the shim
+        config seed;
+        seed.loadDefaults();
+        if (!opt.configPath.empty())
+        {
+            std::string json;
+            if (!readFile(opt.configPath, json) || seed.loadFromJson(json.data(), json.size()) != 0)
+            {
+                fprintf(stderr, "Cannot load the configuration in %s\n", opt.configPath.c_str());
+                return 2;
+            }
+        }
+        seed.setWiFiPref(false);
+        seed.setMqttVersion(MQTT_VERSION_311);
+        seed.setMqttTls(false);
+        kvClear();
+        saveConfig(seed);
+        setPin(BTN_USER, HIGH);
+        mqtt = &broker;
+
+        // Boot so that the uptime at the capture start is the recorded one
+        uint64_t startUs = recorded.header.startMs * 1000ULL;
+        setNowUs(startUs > BOOT_US ? startUs - BOOT_US : 0);
+        uint64_t wallStart = 0;
+        std::vector<std::shared_ptr<Connection>> connections;
+        bool reset = false;
+        try
+        {
+            setup();
+            while (nowUs() < startUs)
+            {
+                tick();
+            }
+
+            std::string layoutError;
+            if (!checkLayout(recorded.records[0], layoutError))
+            {
+                fprintf(stderr, "%s: %s\n", opt.tracePath.c_str(), layoutError.c_str());
+                return 2;
+            }
+            applyInputs(recorded.records[1]);
+            for (size_t i = 0; i + 1 < recorded.records[2].data.size(); i += 2)
+            {
+                channels.setOutput((uint8_t)recorded.records[2].data[i], recorded.records[2].data[i + 1]);
+            }
+            if (initialRecords(recorded) == 4 && recorded.records[3].data[0] == 0)
+            {
+                broker.setUp(false);
+                serviceMQTT();
+            }
+            channels.scan();
+            startTrace();
+            uint64_t baseUs = nowUs();
+            wallStart = wallNs();
+
+            // Clients are queued whole, their bytes fall due on the way
+            // Uploads of keys and firmware were cut short, they are left out
+            for (const Exchange &exchange : exchanges(recorded))
+            {
+                if (exchange.flags & TRACE_REDACTED)
+                {
+                    connections.push_back(nullptr);
+                    continue;
+                }
+                std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+                connection->address = exchange.address;
+                connection->openUs = baseUs + exchange.openMs * 1000ULL;
+                for (const auto &chunk : exchange.chunks)
+                {
+                    connection->chunks.push_back({baseUs + chunk.first * 1000ULL, chunk.second});
+                }
+                connection->peerClosed = (exchange.flags & TRACE_PEER_CLOSED) != 0;
+                queueConnection(connection);
+                connections.push_back(connection);
+            }
+            std::vector<const Record *> events;
+            for (size_t r = initialRecords(recorded); r < recorded.records.size(); ++r)
+            {
+                uint8_t kind = recorded.records[r].kind;
+                if (kind == TRACE_INPUTS || kind == TRACE_MQTT_STATE || kind == TRACE_MQTT_MESSAGE)
+                {
+                    events.push_back(&recorded.records[r]);
+                }
+            }
+            std::stable_sort(events.begin(), events.end(), [](const Record *a, const Record *b)
+                             { return a->timeMs < b->timeMs; });
+
+            size_t next = 0;
+            uint64_t endUs = baseUs + (recorded.header.durationMs + opt.toleranceMs) * 1000ULL;
+            while (nowUs() < endUs)
+            {
+                for (; next < events.size() && baseUs + events[next]->timeMs * 1000ULL <= nowUs(); ++next)
+                {
+                    const Record &event = *events[next];
+                    if (event.kind == TRACE_INPUTS)
+                    {
+                        applyInputs(event);
+                    }
+                    else if (event.kind == TRACE_MQTT_STATE)
+                    {
+                        broker.setUp(event.data[0] != 0);
+                    }
+                    else
+                    {
+                        size_t topicLength = (uint8_t)event.data[0];
+                        broker.deliver(event.data.substr(1, topicLength), event.data.substr(1 + topicLength));
+                    }
+                }
+                tick();
+            }
+        }
+        catch (const Reset &)
+        {
+            reset = true;
+        }
+        trace.stop();
+        double wallS = wallStart > 0 ? (wallNs() - wallStart) / 1e9 : 0;
+
+        std::vector<Exchange> recordedExchanges = exchanges(recorded);
+        for (size_t i = 0; i < connections.size(); ++i)
+        {
+            if (connections[i] != nullptr && connections[i]->accepted && connections[i]->stopped)
+            {
+                timing.add("http " + recordedExchanges[i].route(), connections[i]->wallStopNs - connections[i]->wallStartNs);
+            }
+        }
+
+        // The replay's own capture, against the recorded one
+        TraceHeader header;
+        size_t length = trace.snapshot(header);
+        std::string own((const char *)&header, sizeof(header));
+        own.resize(sizeof(header) + length);
+        trace.read(0, (uint8_t *)&own[sizeof(header)], length);
+        Trace replayed;
+        if (!parseTrace(own, replayed, error))
+        {
+            fprintf(stderr, "replay trace: %s\n", error.c_str());
+            return 2;
+        }
+        if (!opt.writePath.empty())
+        {
+            std::ofstream file(opt.writePath, std::ios::binary);
+            file.write(own.data(), own.size());
+        }
+
+        printf("%s: %zu records, %.1f s from uptime %.1f s%s\n", opt.tracePath.c_str(), recorded.records.size(),
+               recorded.header.durationMs / 1000.0, recorded.header.startMs / 1000.0,
+               recorded.header.full ? ", capture buffer full" : "");
+        printf("Replayed in %.2f s, %.1f times the recorded pace\n", wallS, recorded.header.durationMs / 1000.0 / wallS);
+        int differences = 0;
+        if (reset)
+        {
+            printf("The firmware reset at %.3f s of the replay\n", (double)replayed.header.durationMs / 1000.0);
+            differences++;
+        }
+        differences += compareHttp(opt, recordedExchanges, connections);
+        differences += comparePublishes(opt, recorded, replayed);
+        differences += compareOutputs(opt, recorded, replayed);
+        bool within = reportTiming(opt);
+        within = reportMemory(opt) && within;
+        if (differences > 0)
+        {
+            return 1;
+        }
+        return within ? 0 : 3;
+    }
+} // namespace replay
+
+int main(int argc, char **argv)
+{
+    return replay::run(argc, argv);
+}
@@ -0,0 +1,315 @@
+/*
+ * Remoto: Arduino core shim for the replay runner
+ * -------------------------------------------------------------------
+ * The part of the Arduino mbed core the firmware uses, on Linux:
+ * String, Print, Stream, Client, UDP, IPAddress, the pins and the
+ * clock. Time is virtual and only moves when the replay runner, a
+ * delay() or a yield() moves it, see shim.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_ARDUINO_H)
+#define SHIM_ARDUINO_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <string>
+
+#define PROGMEM
+#define strlen_P strlen
+#define REDIRECT_STDOUT_TO(stream)
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define DEC 10
+#define HEX 16
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+// Pin numbers of the OPTA, only used as indexes here
+enum
+{
+    A0 = 0, A1, A2, A3, A4, A5, A6, A7,
+    D0 = 16, D1, D2, D3,
+    LED_D0 = 24, LED_D1, LED_D2, LED_D3,
+    LED_USER = 32, LEDR, LEDG, LEDB,
+    BTN_USER = 40,
+    NUM_SHIM_PINS = 48
+};
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void digitalWrite(int pin, int value);
+int analogRead(int pin);
+void analogReadResolution(int bits);
+
+// Ends the replay, see shim.h
+[[noreturn]] void NVIC_SystemReset();
+
+class String
+{
+private:
+    std::string _text;
+
+public:
+    String() {}
+    String(const char *text) : _text(text != nullptr ? text : "") {}
+    String(const char *text, size_t length) : _text(text, length) {}
+    String(char c) : _text(1, c) {}
+    explicit String(int value) : _text(std::to_string(value)) {}
+    explicit String(unsigned int value) : _text(std::to_string(value)) {}
+    explicit String(long value) : _text(std::to_string(value)) {}
+    explicit String(unsigned long value) : _text(std::to_string(value)) {}
+
+    const char *c_str() const { return _text.c_str(); }
+    unsigned int length() const { return _text.length(); }
+    void reserve(unsigned int size) { _text.reserve(size); }
+    char charAt(unsigned int index) const { return index < _text.length() ? _text[index] : 0; }
+    char operator[](unsigned int index) const { return charAt(index); }
+
+    bool concat(const char *text)
+    {
+        _text += text != nullptr ? text : "";
+        return true;
+    }
+    bool concat(const String &text) { return concat(text.c_str()); }
+    bool concat(char c)
+    {
+        _text += c;
+        return true;
+    }
+    String &operator+=(const char *text)
+    {
+        concat(text);
+        return *this;
+    }
+    String &operator+=(const String &text)
+    {
+        concat(text);
+        return *this;
+    }
+    String &operator+=(char c)
+    {
+        concat(c);
+        return *this;
+    }
+
+    bool equals(const char *text) const { return _text == (text != nullptr ? text : ""); }
+    bool operator==(const char *text) const { return equals(text); }
+    bool operator==(const String &text) const { return _text == text._text; }
+    bool operator!=(const char *text) const { return !equals(text); }
+    bool startsWith(const char *prefix) const { return _text.compare(0, strlen(prefix), prefix) == 0; }
+    bool startsWith(const String &prefix) const { return startsWith(prefix.c_str()); }
+    bool endsWith(const char *suffix) const
+    {
+        size_t n = strlen(suffix);
+        return _text.length() >= n && _text.compare(_text.length() - n, n, suffix) == 0;
+    }
+    int indexOf(char c, unsigned int from = 0) const
+    {
+        size_t at = _text.find(c, from);
+        return at == std::string::npos ? -1 : (int)at;
+    }
+    int indexOf(const char *text, unsigned int from = 0) const
+    {
+        size_t at = _text.find(text, from);
+        return at == std::string::npos ? -1 : (int)at;
+    }
+    String substring(unsigned int from) const { return from < _text.length() ? String(_text.c_str() + from) : String(); }
+    String substring(unsigned int from, unsigned int to) const
+    {
+        return from < to && from < _text.length() ? String(_text.c_str() + from, (to < _text.length() ? to : _text.length()) - from) : String();
+    }
+    long toInt() const { return atol(_text.c_str()); }
+    void trim()
+    {
+        size_t first = _text.find_first_not_of(" \t\r\n");
+        size_t last = _text.find_last_not_of(" \t\r\n");
+        _text = first == std::string::npos ? std::string() : _text.substr(first, last - first + 1);
+    }
+    void toLowerCase()
+    {
+        for (char &c : _text)
+        {
+            c = tolower((unsigned char)c);
+        }
+    }
+};
+
+// Result of a String concatenation, a type of its own in the core
+class StringSumHelper : public String
+{
+public:
+    StringSumHelper(const String &text) : String(text) {}
+    StringSumHelper(const char *text) : String(text) {}
+};
+
+inline StringSumHelper operator+(const String &a, const String &b)
+{
+    StringSumHelper sum(a);
+    sum.concat(b);
+    return sum;
+}
+inline StringSumHelper operator+(const String &a, const char *b)
+{
+    StringSumHelper sum(a);
+    sum.concat(b);
+    return sum;
+}
+inline StringSumHelper operator+(const char *a, const String &b)
+{
+    StringSumHelper sum(a);
+    sum.concat(b);
+    return sum;
+}
+
+class Print
+{
+private:
+    size_t printNumber(unsigned long long value, int base, bool negative);
+
+public:
+    virtual ~Print() = default;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+
+    size_t write(const char *text) { return text != nullptr ? write((const uint8_t *)text, strlen(text)) : 0; }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+    size_t print(const char *text) { return write(text); }
+    size_t print(const String &text) { return write(text.c_str(), text.length()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int value, int base = DEC) { return print((long)value, base); }
+    size_t print(unsigned int value, int base = DEC) { return print((unsigned long)value, base); }
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC) { return printNumber(value, base, false); }
+    size_t print(long long value, int base = DEC);
+    size_t print(unsigned long long value, int base = DEC) { return printNumber(value, base, false); }
+    size_t print(double value, int digits = 2);
+
+    size_t println() { return write("\r\n"); }
+    template <typename T>
+    size_t println(const T &value)
+    {
+        size_t n = print(value);
+        return n + println();
+    }
+    template <typename T>
+    size_t println(const T &value, int format)
+    {
+        size_t n = print(value, format);
+        return n + println();
+    }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print
+{
+protected:
+    unsigned long _timeout = 1000;
+    int timedRead();
+
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+    String readStringUntil(char terminator);
+};
+
+class IPAddress
+{
+private:
+    uint8_t _address[4];
+
+public:
+    IPAddress() : _address{} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address{a, b, c, d} {}
+    IPAddress(uint32_t address) { memcpy(_address, &address, 4); }
+
+    operator uint32_t() const
+    {
+        uint32_t address;
+        memcpy(&address, _address, 4);
+        return address;
+    }
+    uint8_t operator[](int index) const { return _address[index]; }
+    uint8_t &operator[](int index) { return _address[index]; }
+    bool operator==(const IPAddress &other) const { return memcmp(_address, other._address, 4) == 0; }
+    String toString() const;
+};
+
+class Client : public Stream
+{
+public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+};
+
+class UDP : public Stream
+{
+public:
+    virtual uint8_t begin(uint16_t port) = 0;
+    virtual void stop() = 0;
+    virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+    virtual int beginPacket(const char *host, uint16_t port) = 0;
+    virtual int endPacket() = 0;
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+    virtual int parsePacket() = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(unsigned char *buffer, size_t length) = 0;
+    virtual int peek() = 0;
+    virtual IPAddress remoteIP() = 0;
+    virtual uint16_t remotePort() = 0;
+};
+
+// Serial port, printed to stdout when the runner asks for it
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long) {}
+    operator bool() { return true; }
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif // SHIM_ARDUINO_H
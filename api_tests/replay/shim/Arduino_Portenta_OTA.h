@@ -0,0 +1,42 @@
+/*
+ * Remoto: Portenta OTA shim for the replay runner
+ * -------------------------------------------------------------------
+ * There is no update partition, every update fails at begin().
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_ARDUINO_PORTENTA_OTA_H)
+#define SHIM_ARDUINO_PORTENTA_OTA_H
+#include <stdint.h>
+
+enum StorageTypePortenta
+{
+    QSPI_FLASH_FATFS,
+    QSPI_FLASH_FATFS_MBR
+};
+
+class Arduino_Portenta_OTA
+{
+public:
+    enum class Error : int
+    {
+        None = 0,
+        NoCapableBootloader = -1,
+        NoOtaStorage = -2,
+        OtaStorageInit = -3
+    };
+};
+
+class Arduino_Portenta_OTA_QSPI : public Arduino_Portenta_OTA
+{
+public:
+    Arduino_Portenta_OTA_QSPI(StorageTypePortenta, uint32_t) {}
+    Error begin() { return Error::NoOtaStorage; }
+    Error update() { return Error::NoOtaStorage; }
+    void reset() {}
+};
+
+#endif // SHIM_ARDUINO_PORTENTA_OTA_H
@@ -0,0 +1,62 @@
+/*
+ * Remoto: Ethernet shim for the replay runner
+ * -------------------------------------------------------------------
+ * The link is always up and the port 80 server accepts the clients
+ * queued by the runner, see shim.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_ETHERNET_H)
+#define SHIM_ETHERNET_H
+#include "shim.h"
+
+enum EthernetLinkStatus
+{
+    Unknown,
+    LinkON,
+    LinkOFF
+};
+
+enum EthernetHardwareStatus
+{
+    EthernetNoHardware,
+    EthernetW5100,
+    EthernetW5200,
+    EthernetW5500,
+    EthernetPortenta
+};
+
+class EthernetClient : public ShimClient
+{
+public:
+    using ShimClient::ShimClient;
+};
+
+class EthernetServer : public ShimServer
+{
+public:
+    explicit EthernetServer(uint16_t port) : ShimServer(port) {}
+    EthernetClient available() { return EthernetClient(accept()); }
+};
+
+class EthernetUDP : public ShimUDP
+{
+};
+
+class EthernetClass
+{
+public:
+    int begin() { return 1; }
+    int begin(IPAddress) { return 1; }
+    EthernetLinkStatus linkStatus() { return LinkON; }
+    EthernetHardwareStatus hardwareStatus() { return EthernetPortenta; }
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+    int hostByName(const char *, IPAddress &) { return 0; }
+};
+
+extern EthernetClass Ethernet;
+
+#endif // SHIM_ETHERNET_H
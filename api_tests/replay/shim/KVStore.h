@@ -0,0 +1 @@
+// Remoto replay shim, see kvstore_global_api.h
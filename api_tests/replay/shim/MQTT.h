@@ -0,0 +1,38 @@
+/*
+ * Remoto: MQTTClient shim for the replay runner
+ * -------------------------------------------------------------------
+ * Never connects. The runner replaces the firmware transport with its
+ * own broker, this only lets the 3.1.1 transport build.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_MQTT_H)
+#define SHIM_MQTT_H
+#include "Arduino.h"
+
+class MQTTClient;
+typedef void (*MQTTClientCallbackAdvanced)(MQTTClient *client, char topic[], char bytes[], int length);
+
+class MQTTClient
+{
+public:
+    explicit MQTTClient(int = 128) {}
+    MQTTClient(int, int) {}
+    void begin(const char *, int, Client &) {}
+    void onMessageAdvanced(MQTTClientCallbackAdvanced) {}
+    void setKeepAlive(int) {}
+    void setCleanSession(bool) {}
+    void setTimeout(int) {}
+    bool connect(const char *, const char * = nullptr, const char * = nullptr, bool = false) { return false; }
+    bool disconnect() { return true; }
+    bool connected() { return false; }
+    bool sessionPresent() { return false; }
+    bool publish(const char *, const char *, int, bool, int) { return false; }
+    bool subscribe(const char *, int) { return false; }
+    bool loop() { return false; }
+};
+
+#endif // SHIM_MQTT_H
@@ -0,0 +1,2 @@
+// Remoto replay shim, see Ethernet.h
+#include "Ethernet.h"
@@ -0,0 +1 @@
+// Remoto replay shim, nothing is used from SPI
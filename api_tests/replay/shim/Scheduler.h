@@ -0,0 +1,25 @@
+/*
+ * Remoto: Scheduler shim for the replay runner
+ * -------------------------------------------------------------------
+ * Loops are not started, the runner calls them once per tick.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_SCHEDULER_H)
+#define SHIM_SCHEDULER_H
+#include "Arduino.h"
+
+typedef void (*SchedulerTask)();
+
+class SchedulerClass
+{
+public:
+    void startLoop(SchedulerTask, uint32_t = 1024) {}
+};
+
+extern SchedulerClass Scheduler;
+
+#endif // SHIM_SCHEDULER_H
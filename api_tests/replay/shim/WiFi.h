@@ -0,0 +1,49 @@
+/*
+ * Remoto: WiFi shim for the replay runner
+ * -------------------------------------------------------------------
+ * The radio never connects, the replay runs on the Ethernet shim.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_WIFI_H)
+#define SHIM_WIFI_H
+#include "shim.h"
+
+#define WL_IDLE_STATUS 0
+#define WL_CONNECT_FAILED 4
+#define WL_CONNECTED 3
+
+class WiFiClient : public ShimClient
+{
+public:
+    using ShimClient::ShimClient;
+};
+
+class WiFiServer : public ShimServer
+{
+public:
+    explicit WiFiServer(uint16_t port) : ShimServer(port) {}
+    WiFiClient available() { return WiFiClient(); }
+};
+
+class WiFiUDP : public ShimUDP
+{
+};
+
+class WiFiClass
+{
+public:
+    int begin(const char *, const char *) { return WL_CONNECT_FAILED; }
+    int status() { return WL_IDLE_STATUS; }
+    void config(IPAddress) {}
+    IPAddress localIP() { return IPAddress(); }
+    void disconnect() {}
+    int hostByName(const char *, IPAddress &) { return 0; }
+};
+
+extern WiFiClass WiFi;
+
+#endif // SHIM_WIFI_H
@@ -0,0 +1,31 @@
+/*
+ * Remoto: KVStore shim for the replay runner
+ * -------------------------------------------------------------------
+ * Keys live in memory for the run, the runner seeds the configuration.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_KVSTORE_GLOBAL_API_H)
+#define SHIM_KVSTORE_GLOBAL_API_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define MBED_ERROR_ITEM_NOT_FOUND -1
+#define MBED_ERROR_INVALID_SIZE -2
+
+typedef struct
+{
+    size_t size;
+    uint32_t flags;
+} kv_info_t;
+
+int kv_set(const char *key, const void *buffer, size_t size, uint32_t createFlags);
+int kv_get(const char *key, void *buffer, size_t bufferSize, size_t *actualSize);
+int kv_get_info(const char *key, kv_info_t *info);
+int kv_remove(const char *key);
+int kv_reset(const char *kvstore_path);
+
+#endif // SHIM_KVSTORE_GLOBAL_API_H
@@ -0,0 +1,133 @@
+/*
+ * Remoto: mbed OS shim for the replay runner
+ * -------------------------------------------------------------------
+ * Threads are never started, the runner calls their loops in turn, so
+ * locks do nothing and event flags never wait. Timeouts fire when the
+ * runner calls replay::fireTimeouts() past their deadline.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_MBED_H)
+#define SHIM_MBED_H
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+
+#define MBED_SUCCESS 0
+
+typedef enum
+{
+    RESET_REASON_POWER_ON,
+    RESET_REASON_WATCHDOG,
+    RESET_REASON_SOFTWARE
+} reset_reason_t;
+
+typedef enum
+{
+    osPriorityLow = 8,
+    osPriorityNormal = 24,
+    osPriorityRealtime = 48
+} osPriority_t;
+
+struct ticker_data_t;
+const ticker_data_t *get_us_ticker_data();
+uint64_t ticker_read_us(const ticker_data_t *ticker);
+
+namespace mbed
+{
+    struct ResetReason
+    {
+        static reset_reason_t get() { return RESET_REASON_POWER_ON; }
+    };
+
+    class Watchdog
+    {
+    public:
+        static Watchdog &get_instance()
+        {
+            static Watchdog watchdog;
+            return watchdog;
+        }
+        bool start(uint32_t) { return true; }
+        bool kick() { return true; }
+    };
+
+    template <typename F>
+    class Callback;
+
+    template <>
+    class Callback<void()> : public std::function<void()>
+    {
+    public:
+        Callback() {}
+        Callback(void (*function)()) : std::function<void()>(function) {}
+        template <typename T, typename M>
+        Callback(T *object, M method) : std::function<void()>([object, method]() { (object->*method)(); })
+        {
+        }
+    };
+
+    template <typename T, typename M>
+    Callback<void()> callback(T *object, M method)
+    {
+        return Callback<void()>(object, method);
+    }
+
+    class Timeout
+    {
+    private:
+        Callback<void()> _callback;
+        uint64_t _dueUs;
+        bool _armed;
+
+    public:
+        Timeout();
+        ~Timeout();
+        void attach(Callback<void()> callback, std::chrono::microseconds delay);
+        void detach() { _armed = false; }
+        // From replay::fireTimeouts()
+        bool fire(uint64_t nowUs);
+    };
+} // namespace mbed
+
+namespace rtos
+{
+    class Mutex
+    {
+    public:
+        void lock() {}
+        bool trylock() { return true; }
+        void unlock() {}
+    };
+
+    class EventFlags
+    {
+    private:
+        uint32_t _flags = 0;
+
+    public:
+        uint32_t set(uint32_t flags) { return _flags |= flags; }
+        uint32_t wait_any(uint32_t flags, uint32_t = 0xFFFFFFFF, bool clear = true)
+        {
+            uint32_t raised = _flags & flags;
+            if (clear)
+            {
+                _flags &= ~flags;
+            }
+            return raised;
+        }
+    };
+
+    class Thread
+    {
+    public:
+        Thread(osPriority_t = osPriorityNormal, uint32_t = 4096,
+               unsigned char * = nullptr, const char * = nullptr) {}
+        int start(void (*)()) { return 0; }
+    };
+} // namespace rtos
+
+#endif // SHIM_MBED_H
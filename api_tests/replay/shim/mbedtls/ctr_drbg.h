@@ -0,0 +1,2 @@
+// Remoto replay shim, see ../mbedtls_shim.h
+#include "../mbedtls_shim.h"
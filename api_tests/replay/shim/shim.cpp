@@ -0,0 +1,586 @@
+/*
+ * Remoto: Arduino and mbed shim for the replay runner
+ * -------------------------------------------------------------------
+ * Virtual clock, pins, Serial, network clients, timeouts and the
+ * in-memory KV store. See shim.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "shim.h"
+#include "mbed.h"
+#include "Scheduler.h"
+#include "Ethernet.h"
+#include "WiFi.h"
+#include "kvstore_global_api.h"
+#include "mbedtls_shim.h"
+#include "memprofile.h"
+#include <malloc.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <new>
+#include <vector>
+
+HardwareSerial Serial;
+EthernetClass Ethernet;
+WiFiClass WiFi;
+SchedulerClass Scheduler;
+
+namespace replay
+{
+    bool idle = false;
+    bool echoSerial = false;
+
+    static uint64_t clockUs = 0;
+    static int pins[NUM_SHIM_PINS];
+    static std::deque<std::shared_ptr<Connection>> pending;
+
+    // Timeouts are members of firmware globals, built before this file's
+    static std::vector<mbed::Timeout *> &timeouts()
+    {
+        static std::vector<mbed::Timeout *> list;
+        return list;
+    }
+    static std::map<std::string, std::vector<uint8_t>> store;
+
+    uint64_t nowUs()
+    {
+        return clockUs;
+    }
+
+    void setNowUs(uint64_t us)
+    {
+        clockUs = us;
+    }
+
+    uint64_t wallNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void setPin(int pin, int value)
+    {
+        if (pin >= 0 && pin < NUM_SHIM_PINS)
+        {
+            pins[pin] = value;
+        }
+    }
+
+    int getPin(int pin)
+    {
+        return pin >= 0 && pin < NUM_SHIM_PINS ? pins[pin] : 0;
+    }
+
+    void queueConnection(std::shared_ptr<Connection> connection)
+    {
+        pending.push_back(connection);
+    }
+
+    void fireTimeouts()
+    {
+        // A callback may attach again, so look again after each one
+        bool fired = true;
+        while (fired)
+        {
+            fired = false;
+            for (mbed::Timeout *timeout : timeouts())
+            {
+                if (timeout->fire(clockUs))
+                {
+                    fired = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    void kvClear()
+    {
+        store.clear();
+    }
+} // namespace replay
+
+// Clock and pins
+
+unsigned long millis()
+{
+    return replay::nowUs() / 1000;
+}
+
+unsigned long micros()
+{
+    return (uint32_t)replay::nowUs();
+}
+
+void delay(unsigned long ms)
+{
+    if (!replay::idle)
+    {
+        replay::setNowUs(replay::nowUs() + ms * 1000ULL);
+    }
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    if (!replay::idle)
+    {
+        replay::setNowUs(replay::nowUs() + us);
+    }
+}
+
+void yield()
+{
+    if (!replay::idle)
+    {
+        replay::setNowUs(replay::nowUs() + replay::YIELD_US);
+    }
+}
+
+void pinMode(int, int)
+{
+}
+
+int digitalRead(int pin)
+{
+    return replay::getPin(pin) != 0;
+}
+
+void digitalWrite(int pin, int value)
+{
+    replay::setPin(pin, value);
+}
+
+int analogRead(int pin)
+{
+    return replay::getPin(pin);
+}
+
+void analogReadResolution(int)
+{
+}
+
+void NVIC_SystemReset()
+{
+    throw replay::Reset();
+}
+
+const ticker_data_t *get_us_ticker_data()
+{
+    return nullptr;
+}
+
+uint64_t ticker_read_us(const ticker_data_t *)
+{
+    return replay::nowUs();
+}
+
+// Print and Stream
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (n < size && write(buffer[n]))
+    {
+        n++;
+    }
+    return n;
+}
+
+size_t Print::printNumber(unsigned long long value, int base, bool negative)
+{
+    char text[72];
+    char *end = text + sizeof(text) - 1;
+    char *p = end;
+    *p = '\0';
+    base = base < 2 ? DEC : base;
+    do
+    {
+        int digit = value % base;
+        *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value > 0);
+    if (negative)
+    {
+        *--p = '-';
+    }
+    return write(p, end - p);
+}
+
+size_t Print::print(long value, int base)
+{
+    return print((long long)value, base);
+}
+
+size_t Print::print(long long value, int base)
+{
+    if (value < 0 && base == DEC)
+    {
+        return printNumber(-(unsigned long long)value, base, true);
+    }
+    return printNumber(value, base, false);
+}
+
+size_t Print::print(double value, int digits)
+{
+    char text[48];
+    int n = snprintf(text, sizeof(text), "%.*f", digits, value);
+    return write(text, n > 0 ? n : 0);
+}
+
+size_t Print::printf(const char *format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    return n > 0 ? write(text, std::min((size_t)n, sizeof(text) - 1)) : 0;
+}
+
+int Stream::timedRead()
+{
+    // The wait moves the virtual clock, or it would never time out
+    unsigned long start = millis();
+    do
+    {
+        int c = read();
+        if (c >= 0)
+        {
+            return c;
+        }
+        yield();
+    } while (millis() - start < _timeout && !replay::idle);
+    return -1;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t n = 0;
+    while (n < length)
+    {
+        int c = timedRead();
+        if (c < 0)
+        {
+            break;
+        }
+        buffer[n++] = c;
+    }
+    return n;
+}
+
+String Stream::readStringUntil(char terminator)
+{
+    String text;
+    int c = timedRead();
+    while (c >= 0 && c != terminator)
+    {
+        text += (char)c;
+        c = timedRead();
+    }
+    return text;
+}
+
+String IPAddress::toString() const
+{
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", _address[0], _address[1], _address[2], _address[3]);
+    return String(text);
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    if (replay::echoSerial)
+    {
+        fputc(c, stdout);
+    }
+    return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    if (replay::echoSerial)
+    {
+        fwrite(buffer, 1, size, stdout);
+    }
+    return size;
+}
+
+// Network
+
+static size_t dueBytes(const replay::Connection &connection)
+{
+    size_t n = 0;
+    for (const replay::Chunk &chunk : connection.chunks)
+    {
+        if (chunk.dueUs > replay::nowUs())
+        {
+            break;
+        }
+        n += chunk.bytes.size();
+    }
+    return n;
+}
+
+size_t ShimClient::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t ShimClient::write(const uint8_t *buffer, size_t size)
+{
+    if (!_connection || _connection->stopped)
+    {
+        return 0;
+    }
+    // The capture of the response is not the firmware's memory
+    remoto::MemScope scope(remoto::MEM_OTHER);
+    _connection->response.append((const char *)buffer, size);
+    return size;
+}
+
+int ShimClient::available()
+{
+    return _connection && !_connection->stopped ? dueBytes(*_connection) : 0;
+}
+
+int ShimClient::read()
+{
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int ShimClient::read(uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (_connection && !_connection->stopped && n < size && !_connection->chunks.empty() &&
+           _connection->chunks.front().dueUs <= replay::nowUs())
+    {
+        std::string &bytes = _connection->chunks.front().bytes;
+        size_t take = std::min(size - n, bytes.size());
+        memcpy(buffer + n, bytes.data(), take);
+        bytes.erase(0, take);
+        n += take;
+        if (bytes.empty())
+        {
+            _connection->chunks.pop_front();
+        }
+    }
+    return n > 0 ? (int)n : -1;
+}
+
+int ShimClient::peek()
+{
+    return available() > 0 ? (uint8_t)_connection->chunks.front().bytes[0] : -1;
+}
+
+void ShimClient::stop()
+{
+    if (_connection && !_connection->stopped)
+    {
+        _connection->stopped = true;
+        _connection->stoppedUs = replay::nowUs();
+        _connection->wallStopNs = replay::wallNs();
+    }
+}
+
+uint8_t ShimClient::connected()
+{
+    return _connection && !_connection->stopped && (!_connection->chunks.empty() || !_connection->peerClosed);
+}
+
+std::shared_ptr<replay::Connection> ShimServer::accept()
+{
+    if (!_listening || _port != 80 || replay::pending.empty() || replay::pending.front()->openUs > replay::nowUs())
+    {
+        return nullptr;
+    }
+    std::shared_ptr<replay::Connection> connection = replay::pending.front();
+    replay::pending.pop_front();
+    connection->accepted = true;
+    connection->acceptedUs = replay::nowUs();
+    connection->wallStartNs = replay::wallNs();
+    return connection;
+}
+
+// Timeouts
+
+namespace mbed
+{
+    Timeout::Timeout()
+        : _dueUs(0), _armed(false)
+    {
+        replay::timeouts().push_back(this);
+    }
+
+    Timeout::~Timeout()
+    {
+        std::vector<Timeout *> &list = replay::timeouts();
+        list.erase(std::remove(list.begin(), list.end(), this), list.end());
+    }
+
+    void Timeout::attach(Callback<void()> callback, std::chrono::microseconds delay)
+    {
+        _callback = callback;
+        _dueUs = replay::nowUs() + delay.count();
+        _armed = true;
+    }
+
+    bool Timeout::fire(uint64_t nowUs)
+    {
+        if (!_armed || _dueUs > nowUs)
+        {
+            return false;
+        }
+        _armed = false;
+        _callback();
+        return true;
+    }
+} // namespace mbed
+
+// KV store
+
+int kv_set(const char *key, const void *buffer, size_t size, uint32_t)
+{
+    const uint8_t *bytes = (const uint8_t *)buffer;
+    // Flash on the device, not heap
+    remoto::MemScope scope(remoto::MEM_OTHER);
+    replay::store[key].assign(bytes, bytes + size);
+    return MBED_SUCCESS;
+}
+
+int kv_get(const char *key, void *buffer, size_t bufferSize, size_t *actualSize)
+{
+    auto item = replay::store.find(key);
+    if (item == replay::store.end())
+    {
+        return MBED_ERROR_ITEM_NOT_FOUND;
+    }
+    size_t n = std::min(bufferSize, item->second.size());
+    memcpy(buffer, item->second.data(), n);
+    if (actualSize != nullptr)
+    {
+        *actualSize = n;
+    }
+    return MBED_SUCCESS;
+}
+
+int kv_get_info(const char *key, kv_info_t *info)
+{
+    auto item = replay::store.find(key);
+    if (item == replay::store.end())
+    {
+        return MBED_ERROR_ITEM_NOT_FOUND;
+    }
+    info->size = item->second.size();
+    info->flags = 0;
+    return MBED_SUCCESS;
+}
+
+int kv_remove(const char *key)
+{
+    return replay::store.erase(key) > 0 ? MBED_SUCCESS : MBED_ERROR_ITEM_NOT_FOUND;
+}
+
+int kv_reset(const char *)
+{
+    replay::store.clear();
+    return MBED_SUCCESS;
+}
+
+// mbedTLS, every operation fails
+
+static constexpr int TLS_FAIL = -0x7080;
+
+void mbedtls_sha256_init(mbedtls_sha256_context *) {}
+void mbedtls_sha256_free(mbedtls_sha256_context *) {}
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *, int) { return TLS_FAIL; }
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *, const unsigned char *, size_t) { return TLS_FAIL; }
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *, unsigned char output[32])
+{
+    memset(output, 0, 32);
+    return TLS_FAIL;
+}
+void mbedtls_platform_zeroize(void *buf, size_t len) { memset(buf, 0, len); }
+void mbedtls_x509_crt_init(mbedtls_x509_crt *) {}
+void mbedtls_x509_crt_free(mbedtls_x509_crt *) {}
+int mbedtls_x509_crt_parse(mbedtls_x509_crt *, const unsigned char *, size_t) { return TLS_FAIL; }
+void mbedtls_pk_init(mbedtls_pk_context *) {}
+void mbedtls_pk_free(mbedtls_pk_context *) {}
+int mbedtls_pk_parse_key(mbedtls_pk_context *, const unsigned char *, size_t, const unsigned char *, size_t) { return TLS_FAIL; }
+void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context *) {}
+void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context *) {}
+int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context *, int (*)(void *, unsigned char *, size_t), void *,
+                          const unsigned char *, size_t) { return TLS_FAIL; }
+int mbedtls_ctr_drbg_random(void *, unsigned char *, size_t) { return TLS_FAIL; }
+void mbedtls_entropy_init(mbedtls_entropy_context *) {}
+void mbedtls_entropy_free(mbedtls_entropy_context *) {}
+int mbedtls_entropy_func(void *, unsigned char *, size_t) { return TLS_FAIL; }
+void mbedtls_ssl_init(mbedtls_ssl_context *) {}
+void mbedtls_ssl_free(mbedtls_ssl_context *) {}
+void mbedtls_ssl_config_init(mbedtls_ssl_config *) {}
+void mbedtls_ssl_config_free(mbedtls_ssl_config *) {}
+void mbedtls_ssl_session_init(mbedtls_ssl_session *session) { memset(session, 0, sizeof(*session)); }
+void mbedtls_ssl_session_free(mbedtls_ssl_session *) {}
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config *, int, int, int) { return TLS_FAIL; }
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config *, int (*)(void *, unsigned char *, size_t), void *) {}
+void mbedtls_ssl_conf_session_tickets(mbedtls_ssl_config *, int) {}
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *, mbedtls_x509_crt *, void *) {}
+int mbedtls_ssl_conf_own_cert(mbedtls_ssl_config *, mbedtls_x509_crt *, mbedtls_pk_context *) { return TLS_FAIL; }
+int mbedtls_ssl_conf_psk(mbedtls_ssl_config *, const unsigned char *, size_t, const unsigned char *,
+                         size_t) { return TLS_FAIL; }
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *, int) {}
+int mbedtls_ssl_setup(mbedtls_ssl_context *, const mbedtls_ssl_config *) { return TLS_FAIL; }
+void mbedtls_ssl_set_bio(mbedtls_ssl_context *, void *, mbedtls_ssl_send_t *, mbedtls_ssl_recv_t *,
+                         mbedtls_ssl_recv_timeout_t *) {}
+int mbedtls_ssl_session_reset(mbedtls_ssl_context *) { return TLS_FAIL; }
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context *, const char *) { return TLS_FAIL; }
+int mbedtls_ssl_set_session(mbedtls_ssl_context *, const mbedtls_ssl_session *) { return TLS_FAIL; }
+int mbedtls_ssl_get_session(const mbedtls_ssl_context *, mbedtls_ssl_session *) { return TLS_FAIL; }
+int mbedtls_ssl_handshake(mbedtls_ssl_context *) { return TLS_FAIL; }
+int mbedtls_ssl_read(mbedtls_ssl_context *, unsigned char *, size_t) { return TLS_FAIL; }
+int mbedtls_ssl_write(mbedtls_ssl_context *, const unsigned char *, size_t) { return TLS_FAIL; }
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *) { return 0; }
+int mbedtls_ssl_close_notify(mbedtls_ssl_context *) { return TLS_FAIL; }
+const char *mbedtls_ssl_get_ciphersuite(const mbedtls_ssl_context *) { return ""; }
+
+#if defined(REMOTO_MEM_PROFILE)
+// Allocations, linked with -Wl,--wrap=malloc,--wrap=free,--wrap=realloc,--wrap=calloc
+extern "C"
+{
+    void *__real_malloc(size_t size);
+    void __real_free(void *block);
+    void *__real_realloc(void *block, size_t size);
+}
+
+static const remoto::MemAllocator rawAllocator = {__real_malloc, __real_free, __real_realloc, memalign};
+
+extern "C"
+{
+    void *__wrap_malloc(size_t size) { return remoto::memMalloc(rawAllocator, size); }
+    void __wrap_free(void *block) { remoto::memFree(rawAllocator, block); }
+    void *__wrap_realloc(void *block, size_t size) { return remoto::memRealloc(rawAllocator, block, size); }
+    void *__wrap_calloc(size_t count, size_t size) { return remoto::memCalloc(rawAllocator, count, size); }
+}
+
+// The C++ library allocates on its own, not through the wrapped symbols
+void *operator new(size_t size)
+{
+    void *block = malloc(size);
+    if (block == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+// Not inlined, or GCC takes the free of a new'd block for a mismatch
+__attribute__((noinline)) void operator delete(void *block) noexcept { free(block); }
+void operator delete[](void *block) noexcept { operator delete(block); }
+void operator delete(void *block, size_t) noexcept { operator delete(block); }
+void operator delete[](void *block, size_t) noexcept { operator delete(block); }
+#endif
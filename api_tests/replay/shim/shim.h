@@ -0,0 +1,138 @@
+/*
+ * Remoto: Replay runner hooks into the shim
+ * -------------------------------------------------------------------
+ * The virtual clock, the pin levels, the HTTP connections handed to the
+ * port 80 servers and the pending mbed::Timeout callbacks, driven by
+ * the replay runner. Network clients and servers are shared by the
+ * Ethernet and WiFi shims; outgoing connections always fail, so MQTT
+ * goes through the runner's broker and NTP never answers.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHIM_H)
+#define SHIM_H
+#include "Arduino.h"
+#include <deque>
+#include <memory>
+#include <string>
+
+namespace replay
+{
+    // Microseconds since the start of the run
+    uint64_t nowUs();
+    void setNowUs(uint64_t us);
+    // Wall clock, for the timing report
+    uint64_t wallNs();
+
+    // While set, delay() and yield() return at once: the runner calls the
+    // thread loops once per tick, their sleep is the tick itself. Unset,
+    // for the main loop, they move the clock like the waits they stand for.
+    extern bool idle;
+    constexpr uint64_t YIELD_US = 1000;
+
+    // Copy Serial to stdout
+    extern bool echoSerial;
+
+    void setPin(int pin, int value);
+    int getPin(int pin);
+
+    struct Chunk
+    {
+        uint64_t dueUs;
+        std::string bytes;
+    };
+
+    // One HTTP client, fed to the firmware as its chunks fall due
+    struct Connection
+    {
+        uint32_t address = 0;
+        uint64_t openUs = 0;
+        std::deque<Chunk> chunks; // bytes not read yet
+        bool peerClosed = false;  // hangs up once the chunks are read
+        bool accepted = false;
+        bool stopped = false;
+        std::string response;
+        uint64_t acceptedUs = 0;
+        uint64_t stoppedUs = 0;
+        uint64_t wallStartNs = 0;
+        uint64_t wallStopNs = 0;
+    };
+
+    // Clients of the port 80 servers, accepted in order once open
+    void queueConnection(std::shared_ptr<Connection> connection);
+
+    // Call the mbed::Timeout callbacks due by now
+    void fireTimeouts();
+
+    // Thrown by NVIC_SystemReset(), ends the replay
+    struct Reset
+    {
+    };
+
+    void kvClear();
+} // namespace replay
+
+class ShimClient : public Client
+{
+protected:
+    std::shared_ptr<replay::Connection> _connection;
+
+public:
+    ShimClient() {}
+    explicit ShimClient(std::shared_ptr<replay::Connection> connection) : _connection(connection) {}
+
+    int connect(IPAddress, uint16_t) override { return 0; }
+    int connect(const char *, uint16_t) override { return 0; }
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buffer, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return _connection != nullptr; }
+    IPAddress remoteIP() const { return _connection ? IPAddress(_connection->address) : IPAddress(); }
+    using Print::write;
+};
+
+class ShimServer
+{
+private:
+    uint16_t _port;
+    bool _listening;
+
+protected:
+    std::shared_ptr<replay::Connection> accept();
+
+public:
+    explicit ShimServer(uint16_t port) : _port(port), _listening(false) {}
+    void begin() { _listening = true; }
+};
+
+// NTP requests go nowhere, no answer ever comes back
+class ShimUDP : public UDP
+{
+public:
+    uint8_t begin(uint16_t) override { return 1; }
+    void stop() override {}
+    int beginPacket(IPAddress, uint16_t) override { return 1; }
+    int beginPacket(const char *, uint16_t) override { return 1; }
+    int endPacket() override { return 1; }
+    size_t write(uint8_t) override { return 1; }
+    size_t write(const uint8_t *, size_t size) override { return size; }
+    int parsePacket() override { return 0; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int read(unsigned char *, size_t) override { return 0; }
+    int peek() override { return -1; }
+    IPAddress remoteIP() override { return IPAddress(); }
+    uint16_t remotePort() override { return 0; }
+    using Print::write;
+};
+
+#endif // SHIM_H
@@ -10,9 +10,15 @@ Features:
 - Device configuration API with support for GET and POST methods.
 - Static web page serving for device information and configuration.
 - Simulated MQTT publish endpoint.
+- Simulated firmware update endpoint.
+- Scheduler statistics API.
+- Output commands API, plain values and timed commands.
 """
 
 
+import hashlib
+import json
+
 from flask import Flask, jsonify, request
 
 # Mock telemetry data for the IoT device
@@ -21,6 +27,12 @@ data = {
     "mqttConnected": "true",  # Indicates MQTT connection status
     "lastPublish": 125,  # Time in seconds since the last telemetry publish
     "NTP": 1736370059,
+    "time": 1736370059125,
+    "budget": {  # Publish budget, the limits left are listed for the budgets set
+        "sentBytes": 182000, "sentMessages": 6500, "hourBytesLeft": 3100, "dayBytesLeft": 60400,
+        "deniedControl": 0, "deniedPeriodic": 0, "telemetryPeriodS": 300
+    },
+    "http": {"admitted": 5210, "limited": 12, "overloaded": 0, "busyMs": 35},  # Web server admission
     "inputs": {  # Inputs with their current values and types
         "I1": {"value": True, "type": True},
         "I2": {"value": True, "type": True},
@@ -28,8 +40,8 @@ data = {
         "I4": {"value": True, "type": True},
         "I5": {"value": True, "type": True},
         "I6": {"value": True, "type": True},
-        "I7": {"value": 0.05, "type": False},  # Analog input example
-        "I8": {"value": 6.5, "type": False},   # Analog input example
+        "I7": {"value": 0.05, "type": False, "unit": "V"},  # Analog input example
+        "I8": {"value": 6.5, "type": False, "unit": "bar"},  # Analog input with scaling
     },
     "outputs": {  # Outputs with their current states
         "O1": True,
@@ -48,12 +60,16 @@ config = {
     "ssid": "MYSSID", # Example SSID
     "wifiPass": "SSID Password", # Example SSID Password
     "timeServer": "TimeServer",
+    "logLevel": "info",  # Records below this level are not logged
     "mqtt": {  # MQTT broker configuration
         "server": "public.cloud.shiftr.io",
         "port": 1883,
         "user": "public",
         "password": "public",
-        "updateInterval": 300  # Telemetry update interval in seconds
+        "updateInterval": 300,  # Telemetry update interval in seconds
+        "version": 4,  # MQTT protocol level, 4 for 3.1.1 or 5 for 5.0
+        "tls": False,  # MQTT over TLS
+        "budget": {"hourBytes": 10000, "hourMessages": 0, "dayBytes": 200000, "dayMessages": 0}  # 0 is unlimited
     },
     "inputs": {  # Pin configurations for the inputs
         "I1": 1,
@@ -64,9 +80,49 @@ config = {
         "I6": 1,
         "I7": 0,
         "I8": 0
+    },
+    "scaling": {  # Optional per-channel calibration of the analog inputs
+        "I7": {"gain": 1.0, "offset": 0.0, "unit": "V"},
+        "I8": {"gain": 1.25, "offset": -2.5, "unit": "bar", "min": 0, "max": 10}
     }
 }
 
+# Mock timing statistics of the scheduled tasks
+tasks = {
+    "comms": [
+        {"name": "mqtt", "periodMs": 50, "priority": 0, "runs": 7200, "misses": 0, "skipped": 0,
+         "execAvgUs": 210, "execMaxUs": 5100, "jitterAvgUs": 400, "jitterMaxUs": 2900},
+        {"name": "telemetry", "periodMs": 300000, "priority": 1, "runs": 2, "misses": 0, "skipped": 0,
+         "execAvgUs": 41000, "execMaxUs": 43500, "jitterAvgUs": 800, "jitterMaxUs": 1200},
+        {"name": "heartbeat", "periodMs": 5000, "priority": 2, "runs": 72, "misses": 0, "skipped": 0,
+         "execAvgUs": 15, "execMaxUs": 40, "jitterAvgUs": 350, "jitterMaxUs": 4100}
+    ],
+    "io": [
+        {"name": "scan", "periodMs": 20, "priority": 0, "runs": 18000, "misses": 0, "skipped": 0,
+         "execAvgUs": 900, "execMaxUs": 2400, "jitterAvgUs": 120, "jitterMaxUs": 1000},
+        {"name": "modbus", "periodMs": 1, "priority": 1, "runs": 350000, "misses": 0, "skipped": 12,
+         "execAvgUs": 30, "execMaxUs": 1800, "jitterAvgUs": 300, "jitterMaxUs": 2600}
+    ]
+}
+
+# Mock TLS status, only the presence of each credential is reported
+tls = {
+    "enabled": False, "ca": False, "cert": False, "key": False, "psk": False,
+    "ready": False, "connected": False,
+    "handshakes": {"full": 0, "resumed": 0, "failed": 0, "lastMs": 0, "lastResumed": False,
+                   "fullAvgMs": 0, "fullMaxMs": 0, "resumedAvgMs": 0, "resumedMaxMs": 0, "lastError": 0}
+}
+
+# Mock log ring, oldest record first
+logs = {
+    "level": "info", "dropped": 0,
+    "records": [
+        {"t": 10450, "l": "info", "m": "Connected to MQTT broker!"},
+        {"t": 10462, "l": "info", "m": "Subscribed to OPTA_WIFI/O1"},
+        {"t": 12003, "l": "warn", "m": "Supervisor: task comms missed its 2000 ms deadline"}
+    ]
+}
+
 # Flask app initialization with a static folder for serving web pages
 api = Flask(__name__, static_folder="web/")
 
@@ -85,6 +141,33 @@ def get_device():
 def get_realtime():
     return jsonify(data)
 
+# Endpoint for the scheduler statistics
+@api.route('/tasks', methods=['GET'])
+def get_tasks():
+    return jsonify(tasks)
+
+# Endpoint for the log records held in RAM
+@api.route('/logs', methods=['GET'])
+def get_logs():
+    logs["level"] = config.get("logLevel", "info")
+    return jsonify(logs)
+
+# Endpoint for the TLS credentials and handshake statistics
+@api.route('/tls', methods=['GET'])
+def get_tls():
+    return jsonify(tls)
+
+# Simulated credential upload, an empty body removes the credential
+@api.route('/tls/<name>', methods=['POST'])
+def post_tls(name):
+    if name not in ("ca", "cert", "key", "psk"):
+        return jsonify({"status": "error", "message": "Unknown credential"}), 404
+    body = request.get_data()
+    if len(body) > 4096:
+        return jsonify({"status": "error", "message": "Incomplete credential"}), 413
+    tls[name] = len(body) > 0
+    return jsonify({"status": "success", "message": "Credential stored, applied at the next boot"})
+
 # Endpoint for retrieving or updating device configuration
 @api.route('/config', methods=['GET', 'POST'])
 def config_endpoint():
@@ -96,11 +179,87 @@ def config_endpoint():
         config = request.json
         return jsonify({"message": "Configuration updated successfully!"})
 
+# Last timed command of each output, the mock runs them instantly
+timers = {}
+
+# Steps, passes and final value of a timed command, None if invalid
+def timed_steps(command):
+    mode = command.get("mode")
+    value = command.get("value", 1)
+    if mode == "pulse" and value in (0, 1) and 0 < command.get("ms", 0) <= 86400000:
+        return [[value, command["ms"]]], 1, 1 - value
+    if mode == "delay" and value in (0, 1) and 0 < command.get("ms", 0) <= 86400000:
+        return [[None, command["ms"]]], 1, value
+    if mode == "pwm" and 0 < command.get("onMs", 0) < command.get("periodMs", 0) <= 86400000:
+        on = command["onMs"]
+        return [[1, on], [0, command["periodMs"] - on]], command.get("count", 0), 0
+    if mode == "sequence":
+        steps = command.get("steps", [])
+        if 0 < len(steps) <= 16 and all(len(s) == 2 and s[0] in (0, 1) and 0 < s[1] <= 86400000 for s in steps):
+            return steps, command.get("repeat", 1), command.get("final", 0)
+    return None
+
+# Output states and their last timed command
+@api.route('/outputs', methods=['GET'])
+def get_outputs():
+    return jsonify({name: dict({"state": int(state)}, **({"timer": timers[name]} if name in timers else {}))
+                    for name, state in data["outputs"].items()})
+
+# Simulated output command, a plain 0/1 or a timed command in JSON
+@api.route('/outputs/<int:n>', methods=['POST'])
+def post_output(n):
+    name = "O%d" % n
+    if name not in data["outputs"]:
+        return jsonify({"status": "error", "message": "Unknown output"}), 404
+    body = request.get_data(as_text=True).strip()
+    try:
+        command = json.loads(body) if body.startswith("{") else {"mode": "set", "value": int(body or "x") != 0}
+    except ValueError:
+        return jsonify({"status": "error", "message": "Invalid command"}), 400
+    mode = command.get("mode")
+    if mode == "set" and command.get("value") in (0, 1):
+        data["outputs"][name] = bool(command["value"])
+    elif mode == "cancel":
+        if timers.get(name, {}).get("status") == "running":
+            timers[name]["status"] = "cancelled"
+    else:
+        program = timed_steps(command)
+        if program is None:
+            return jsonify({"status": "error", "message": "Invalid command"}), 400
+        steps, repeat, final = program
+        if repeat == 0:
+            # Runs until replaced, reported as running after its first pass
+            timers[name] = {"mode": mode, "status": "running", "edges": len(steps), "cycles": 1,
+                            "requestedMs": sum(s[1] for s in steps[:-1]), "actualMs": sum(s[1] for s in steps[:-1]), "maxLateUs": 0}
+            data["outputs"][name] = bool(steps[-1][0])
+        else:
+            duration = sum(s[1] for s in steps) * repeat
+            timers[name] = {"mode": mode, "status": "done", "edges": len(steps) * repeat + 1, "cycles": repeat,
+                            "requestedMs": duration, "actualMs": duration, "maxLateUs": 0}
+            data["outputs"][name] = bool(final)
+    return jsonify({"status": "success", "message": "Command started"})
+
 # Simulated endpoint for MQTT publishing
 @api.route('/send', methods=['GET'])
 def get_send():
     return jsonify({"message": "MQTT published successfully!"})
 
+# Simulated firmware update, streams and verifies the image like the device
+@api.route('/firmware', methods=['POST'])
+def post_firmware():
+    expected = request.headers.get('X-Firmware-SHA256', '').lower()
+    if request.content_length is None:
+        return jsonify({"status": "error", "message": "Content-Length required"}), 411
+    digest = hashlib.sha256()
+    while True:
+        chunk = request.stream.read(4096)
+        if not chunk:
+            break
+        digest.update(chunk)
+    if digest.hexdigest() != expected:
+        return jsonify({"status": "error", "message": "Firmware verification failed"}), 422
+    return jsonify({"status": "success", "message": "Firmware verified, rebooting"})
+
 # Start the Flask server
 if __name__ == '__main__':
     api.run()
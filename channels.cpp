@@ -0,0 +1,295 @@
+/*
+ * Remoto: Channel registry for Arduino OPTA and its expansion modules
+ * -------------------------------------------------------------------
+ * Onboard IO and expansion bus drivers. See channels.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "channels.h"
+#include "scaling.h"
+#include "logger.h"
+#if !defined(REMOTO_SIM_EXPANSION)
+#include "OptaBlue.h"
+#endif
+
+namespace remoto
+{
+    static const int ONBOARD_INPUT_PINS[ONBOARD_INPUTS] = {A0, A1, A2, A3, A4, A5, A6, A7};
+    static const int ONBOARD_OUTPUT_PINS[ONBOARD_OUTPUTS] = {D0, D1, D2, D3};
+    static const int ONBOARD_OUTPUT_LEDS[ONBOARD_OUTPUTS] = {LED_D0, LED_D1, LED_D2, LED_D3};
+
+    // Expansion voltages on the scale of the onboard ADC, so that one
+    // scaling description fits every analog channel
+    static uint16_t voltsToCounts(float volts)
+    {
+        float counts = volts / (float)FACTORY_FULL_SCALE * (float)(1UL << ADC_BITS);
+        if (counts <= 0.0f)
+        {
+            return 0;
+        }
+        return counts >= ADC_MAX ? ADC_MAX : (uint16_t)(counts + 0.5f);
+    }
+
+    void beginOnboard(uint32_t analogMask)
+    {
+        analogReadResolution(ADC_BITS);
+        for (int i = 0; i < ONBOARD_INPUTS; ++i)
+        {
+            if (!(analogMask & (1UL << i)))
+            {
+                pinMode(ONBOARD_INPUT_PINS[i], INPUT);
+            }
+        }
+        for (int i = 0; i < ONBOARD_OUTPUTS; ++i)
+        {
+            pinMode(ONBOARD_OUTPUT_PINS[i], OUTPUT);
+            pinMode(ONBOARD_OUTPUT_LEDS[i], OUTPUT);
+            digitalWrite(ONBOARD_OUTPUT_PINS[i], LOW);
+            digitalWrite(ONBOARD_OUTPUT_LEDS[i], LOW);
+        }
+    }
+
+    void readOnboardInputs(uint32_t analogMask, uint16_t *values)
+    {
+        for (int i = 0; i < ONBOARD_INPUTS; ++i)
+        {
+            if (analogMask & (1UL << i))
+            {
+                values[i] = analogRead(ONBOARD_INPUT_PINS[i]);
+            }
+            else
+            {
+                values[i] = digitalRead(ONBOARD_INPUT_PINS[i]);
+            }
+        }
+    }
+
+    uint16_t readOnboardAnalog(int index)
+    {
+        return analogRead(ONBOARD_INPUT_PINS[index]);
+    }
+
+    void writeOnboardOutputs(const uint8_t *values)
+    {
+        for (int i = 0; i < ONBOARD_OUTPUTS; ++i)
+        {
+            digitalWrite(ONBOARD_OUTPUT_PINS[i], values[i]);
+            digitalWrite(ONBOARD_OUTPUT_LEDS[i], values[i]);
+        }
+    }
+
+#if defined(REMOTO_SIM_EXPANSION)
+    SimulatedExpansionBus::SimulatedExpansionBus()
+        : _numModules(0), _outputs{}
+    {
+        for (int m = 0; m < MAX_EXPANSIONS; ++m)
+        {
+            for (int i = 0; i < DIGITAL_EXPANSION_INPUTS; ++i)
+            {
+                _forced[m][i] = -1;
+            }
+        }
+    }
+
+    int SimulatedExpansionBus::discover(ModuleInfo *modules, int capacity)
+    {
+        const char *layout = SIM_EXPANSION_LAYOUT;
+        _numModules = 0;
+        for (; *layout != '\0' && _numModules < MAX_EXPANSIONS && _numModules < capacity; ++layout)
+        {
+            if (*layout == 'D')
+            {
+                _modules[_numModules] = {MODULE_DIGITAL, DIGITAL_EXPANSION_INPUTS, DIGITAL_EXPANSION_OUTPUTS};
+            }
+            else if (*layout == 'A')
+            {
+                _modules[_numModules] = {MODULE_ANALOG, ANALOG_EXPANSION_INPUTS, 0};
+            }
+            else
+            {
+                continue;
+            }
+            modules[_numModules] = _modules[_numModules];
+            _numModules++;
+        }
+        return _numModules;
+    }
+
+    int SimulatedExpansionBus::configure(int module, uint32_t)
+    {
+        return module < _numModules ? 0 : -1;
+    }
+
+    int SimulatedExpansionBus::readInputs(int module, uint32_t analogMask, uint16_t *values)
+    {
+        if (module >= _numModules)
+        {
+            return -1;
+        }
+        uint32_t now = millis();
+        const ModuleInfo &info = _modules[module];
+        for (int i = 0; i < info.inputs; ++i)
+        {
+            bool analog = analogMask & (1UL << i);
+            if (_forced[module][i] >= 0)
+            {
+                values[i] = _forced[module][i];
+                continue;
+            }
+            uint32_t value;
+            if (info.kind == MODULE_DIGITAL && i < info.outputs)
+            {
+                value = _outputs[module][i] ? ADC_MAX : 0;
+            }
+            else
+            {
+                // Triangle over 0-10 V, one cycle per minute, phase by channel
+                uint32_t phase = (now / 60 + i * 125) % 1000;
+                uint32_t volts = phase < 500 ? phase * 20 : (1000 - phase) * 20; // mV
+                value = voltsToCounts(volts / 1000.0f);
+            }
+            values[i] = analog ? value : value > ADC_MAX / 2;
+        }
+        return 0;
+    }
+
+    int SimulatedExpansionBus::writeOutputs(int module, const uint8_t *values)
+    {
+        if (module >= _numModules)
+        {
+            return -1;
+        }
+        memcpy(_outputs[module], values, _modules[module].outputs);
+        return 0;
+    }
+
+    void SimulatedExpansionBus::setInput(int module, int channel, int32_t value)
+    {
+        if (module >= 0 && module < MAX_EXPANSIONS && channel >= 0 && channel < DIGITAL_EXPANSION_INPUTS)
+        {
+            _forced[module][channel] = value;
+        }
+    }
+#else
+    int OptaExpansionBus::discover(ModuleInfo *modules, int capacity)
+    {
+        Opta::OptaController.begin();
+        Opta::OptaController.update();
+        int count = 0;
+        for (int i = 0; i < Opta::OptaController.getExpansionNum() && count < capacity && count < MAX_EXPANSIONS; ++i)
+        {
+            uint8_t type = Opta::OptaController.getExpansionType(i);
+            if (type == EXPANSION_OPTA_DIGITAL_MEC || type == EXPANSION_OPTA_DIGITAL_STS)
+            {
+                modules[count] = {MODULE_DIGITAL, DIGITAL_EXPANSION_INPUTS, DIGITAL_EXPANSION_OUTPUTS};
+            }
+            else if (type == EXPANSION_OPTA_ANALOG)
+            {
+                modules[count] = {MODULE_ANALOG, ANALOG_EXPANSION_INPUTS, 0};
+            }
+            else
+            {
+                logWarn("Skipping unsupported expansion %d", i);
+                continue;
+            }
+            _device[count] = i;
+            _kind[count] = modules[count].kind;
+            count++;
+        }
+        return count;
+    }
+
+    int OptaExpansionBus::configure(int module, uint32_t analogMask)
+    {
+        if (_kind[module] != MODULE_ANALOG)
+        {
+            // Digital module inputs are read either way without setup
+            return 0;
+        }
+        for (int ch = 0; ch < ANALOG_EXPANSION_INPUTS; ++ch)
+        {
+            if (analogMask & (1UL << ch))
+            {
+                Opta::AnalogExpansion::beginChannelAsAdc(Opta::OptaController, _device[module], ch,
+                                                         OA_VOLTAGE_ADC, true, false, false, 0);
+            }
+            else
+            {
+                Opta::AnalogExpansion::beginChannelAsDigitalInput(Opta::OptaController, _device[module], ch);
+            }
+        }
+        return 0;
+    }
+
+    int OptaExpansionBus::readInputs(int module, uint32_t analogMask, uint16_t *values)
+    {
+        uint8_t device = _device[module];
+        if (_kind[module] == MODULE_DIGITAL)
+        {
+            Opta::DigitalExpansion exp = Opta::OptaController.getExpansion(device);
+            if (!exp)
+            {
+                return -1;
+            }
+            // One bus transaction per kind of reading, then per-pin access
+            // to the local copy
+            if (analogMask != 0)
+            {
+                exp.updateAnalogInputs();
+            }
+            if (analogMask != (1UL << DIGITAL_EXPANSION_INPUTS) - 1)
+            {
+                exp.updateDigitalInputs();
+            }
+            for (int i = 0; i < DIGITAL_EXPANSION_INPUTS; ++i)
+            {
+                values[i] = (analogMask & (1UL << i)) ? voltsToCounts(exp.pinVoltage(i, false))
+                                                      : (exp.digitalRead(i, false) == HIGH);
+            }
+            return 0;
+        }
+        Opta::AnalogExpansion exp = Opta::OptaController.getExpansion(device);
+        if (!exp)
+        {
+            return -1;
+        }
+        if (analogMask != 0)
+        {
+            exp.updateAnalogInputs();
+        }
+        if (analogMask != (1UL << ANALOG_EXPANSION_INPUTS) - 1)
+        {
+            exp.updateDigitalInputs();
+        }
+        for (int i = 0; i < ANALOG_EXPANSION_INPUTS; ++i)
+        {
+            values[i] = (analogMask & (1UL << i)) ? voltsToCounts(exp.pinVoltage(i, false))
+                                                  : (exp.digitalRead(i, false) == HIGH);
+        }
+        return 0;
+    }
+
+    int OptaExpansionBus::writeOutputs(int module, const uint8_t *values)
+    {
+        if (_kind[module] != MODULE_DIGITAL)
+        {
+            return 0;
+        }
+        Opta::DigitalExpansion exp = Opta::OptaController.getExpansion(_device[module]);
+        if (!exp)
+        {
+            return -1;
+        }
+        for (int i = 0; i < DIGITAL_EXPANSION_OUTPUTS; ++i)
+        {
+            exp.digitalWrite(i, values[i] ? HIGH : LOW);
+        }
+        // All relays of the module in one transaction
+        exp.updateDigitalOutputs();
+        return 0;
+    }
+#endif
+} // namespace remoto
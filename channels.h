@@ -0,0 +1,438 @@
+/*
+ * Remoto: Channel registry for Arduino OPTA and its expansion modules
+ * -------------------------------------------------------------------
+ * The inputs and outputs of the OPTA and of the expansion modules found
+ * on its bus at boot are numbered in one flat list, onboard channels
+ * first and then module by module in bus order. The registry is sized
+ * at compile time for the largest supported panel, and keeps a snapshot
+ * of every input that is refreshed with one batched read per module.
+ *
+ * Define REMOTO_SIM_EXPANSION to replace the expansion bus with a
+ * simulated one, so the firmware can be exercised without modules.
+ * The registry can also mirror one run by another core, which scans the
+ * inputs and drives the outputs for it (RemoteIo, see iolink.h).
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(CHANNELS_H)
+#define CHANNELS_H
+#include <Arduino.h>
+#include "mbed.h"
+#include "logger.h"
+
+// Period of the input snapshot refresh
+#define IO_SCAN_INTERVAL_MS 20
+// Most readings of an onboard analog input in one scan, for its filter
+#define INPUT_BURST_MAX 16
+
+// #define REMOTO_SIM_EXPANSION
+// Modules on the simulated bus, D for digital and A for analog
+#if !defined(SIM_EXPANSION_LAYOUT)
+#define SIM_EXPANSION_LAYOUT "DA"
+#endif
+
+namespace remoto
+{
+    constexpr int ONBOARD_INPUTS = 8;
+    constexpr int ONBOARD_OUTPUTS = 4;
+    // Expansion modules addressed by the OPTA controller
+    constexpr int MAX_EXPANSIONS = 5;
+    constexpr int DIGITAL_EXPANSION_INPUTS = 16;
+    constexpr int DIGITAL_EXPANSION_OUTPUTS = 8;
+    constexpr int ANALOG_EXPANSION_INPUTS = 8;
+
+    // Capacity of a fully populated panel
+    constexpr int MAX_MODULES = 1 + MAX_EXPANSIONS;
+    constexpr int MAX_INPUTS = ONBOARD_INPUTS + MAX_EXPANSIONS * DIGITAL_EXPANSION_INPUTS;
+    constexpr int MAX_OUTPUTS = ONBOARD_OUTPUTS + MAX_EXPANSIONS * DIGITAL_EXPANSION_OUTPUTS;
+
+    enum ModuleKind : uint8_t
+    {
+        MODULE_ONBOARD = 0,
+        MODULE_DIGITAL = 1,
+        MODULE_ANALOG = 2
+    };
+
+    struct ModuleInfo
+    {
+        ModuleKind kind;
+        uint8_t inputs;
+        uint8_t outputs;
+    };
+
+    // Access to the expansion modules. Inputs are read a whole module at
+    // a time: channels flagged in analogMask return ADC counts on the
+    // scale of the onboard inputs, the others 0 or 1.
+    class ExpansionBus
+    {
+    public:
+        virtual ~ExpansionBus() = default;
+
+        // Find the modules, returns how many were stored
+        virtual int discover(ModuleInfo *modules, int capacity) = 0;
+        virtual int configure(int module, uint32_t analogMask) = 0;
+        virtual int readInputs(int module, uint32_t analogMask, uint16_t *values) = 0;
+        virtual int writeOutputs(int module, const uint8_t *values) = 0;
+    };
+
+#if defined(REMOTO_SIM_EXPANSION)
+    // Modules that exist only in memory. The first outputs of a digital
+    // module are looped back to its first inputs, the other inputs follow
+    // a slow pattern and analog channels ramp up and down.
+    class SimulatedExpansionBus : public ExpansionBus
+    {
+    private:
+        ModuleInfo _modules[MAX_EXPANSIONS];
+        int _numModules;
+        uint8_t _outputs[MAX_EXPANSIONS][DIGITAL_EXPANSION_OUTPUTS];
+        int32_t _forced[MAX_EXPANSIONS][DIGITAL_EXPANSION_INPUTS];
+
+    public:
+        SimulatedExpansionBus();
+
+        int discover(ModuleInfo *modules, int capacity) override;
+        int configure(int module, uint32_t analogMask) override;
+        int readInputs(int module, uint32_t analogMask, uint16_t *values) override;
+        int writeOutputs(int module, const uint8_t *values) override;
+
+        // Pin an input to a reading, counts or 0/1 depending on its mode.
+        // -1 returns it to the pattern.
+        void setInput(int module, int channel, int32_t value);
+    };
+#else
+    // Digital and analog expansions through Arduino_Opta_Blueprint
+    class OptaExpansionBus : public ExpansionBus
+    {
+    private:
+        uint8_t _device[MAX_EXPANSIONS]; // controller index of each module
+        ModuleKind _kind[MAX_EXPANSIONS];
+
+    public:
+        int discover(ModuleInfo *modules, int capacity) override;
+        int configure(int module, uint32_t analogMask) override;
+        int readInputs(int module, uint32_t analogMask, uint16_t *values) override;
+        int writeOutputs(int module, const uint8_t *values) override;
+    };
+#endif
+
+    // Filtering of the analog inputs between the reading and the snapshot
+    class InputFilter
+    {
+    public:
+        virtual ~InputFilter() = default;
+
+        // Readings wanted per scan, 0 for an input without a filter.
+        // Only onboard inputs are read more than once.
+        virtual int samplesPerScan(int index) const = 0;
+        // The readings of one scan to the snapshot value, false keeps the
+        // previous value
+        virtual bool filter(int index, const uint16_t *samples, int count, uint16_t &value) = 0;
+    };
+
+    // Channels scanned and driven by another core. The registry forwards
+    // its settings and output writes, and takes its snapshot from the
+    // scans the other core publishes.
+    class RemoteIo
+    {
+    public:
+        virtual ~RemoteIo() = default;
+
+        // Modules of the panel, onboard first, returns how many were stored
+        virtual int discover(ModuleInfo *modules, int capacity) = 0;
+        virtual int configure(const uint32_t *analogMasks, int modules) = 0;
+        // Latest scan, raw and filtered. 0 with a new one, 1 with none
+        // since the last call, -1 when the other core stopped publishing.
+        virtual int readImage(uint16_t *raw, uint16_t *values, int count, uint32_t &failedModules,
+                              uint32_t &scanMicros) = 0;
+        // Called with the registry locked, by one thread at a time
+        virtual int writeOutput(int index, uint8_t value) = 0;
+    };
+
+    // Onboard inputs A0-A7 and relays D0-D3 with their LEDs
+    void beginOnboard(uint32_t analogMask);
+    void readOnboardInputs(uint32_t analogMask, uint16_t *values);
+    // One more reading of an analog onboard input
+    uint16_t readOnboardAnalog(int index);
+    void writeOnboardOutputs(const uint8_t *values);
+
+    template <int MaxModules, int MaxInputs, int MaxOutputs>
+    class ChannelRegistry
+    {
+        static_assert(MaxModules <= 32, "module masks are 32 bit");
+
+    private:
+        struct Module
+        {
+            ModuleInfo info;
+            uint8_t firstInput;
+            uint8_t firstOutput;
+            uint32_t analogMask;
+        };
+
+        ExpansionBus *_bus;
+        RemoteIo *_remote; // set when another core runs the channels
+        InputFilter *_filter;
+        Module _modules[MaxModules];
+        int _numModules;
+        int _numInputs;
+        int _numOutputs;
+        uint16_t _raw[MaxInputs];     // last scan, 0/1 or ADC counts
+        uint16_t _values[MaxInputs];  // same, after the filters
+        uint8_t _outputs[MaxOutputs]; // commanded state
+        uint32_t _failedModules;      // modules that failed the last scan
+        uint32_t _scanMicros;
+        rtos::Mutex _mutex;
+
+        // Index of the module owning an output
+        int outputModule(int index) const
+        {
+            int m = 0;
+            while (m + 1 < _numModules && _modules[m + 1].firstOutput <= index)
+            {
+                m++;
+            }
+            return m;
+        }
+
+        // Number the modules found, onboard first. Modules that do not fit
+        // the capacity are left out.
+        int addModules(const ModuleInfo *found, int count)
+        {
+            _numModules = 0;
+            _numInputs = 0;
+            _numOutputs = 0;
+            for (int m = 0; m < count; ++m)
+            {
+                if (_numInputs + found[m].inputs > MaxInputs || _numOutputs + found[m].outputs > MaxOutputs)
+                {
+                    logWarn("Channel capacity exceeded, ignoring module %d", m);
+                    break;
+                }
+                _modules[m] = {found[m], (uint8_t)_numInputs, (uint8_t)_numOutputs, 0};
+                _numInputs += found[m].inputs;
+                _numOutputs += found[m].outputs;
+                _numModules++;
+            }
+            return _numModules;
+        }
+
+        // Snapshot value of an input from the readings of this scan
+        uint16_t filterInput(int m, int channel)
+        {
+            int index = _modules[m].firstInput + channel;
+            if (_filter == nullptr || !((_modules[m].analogMask >> channel) & 1))
+            {
+                return _raw[index];
+            }
+            int wanted = _filter->samplesPerScan(index);
+            if (wanted <= 0)
+            {
+                return _raw[index];
+            }
+            uint16_t samples[INPUT_BURST_MAX];
+            samples[0] = _raw[index];
+            int count = 1;
+            // The rest of the burst right after the scan read
+            while (m == 0 && count < wanted && count < INPUT_BURST_MAX)
+            {
+                samples[count++] = readOnboardAnalog(channel);
+            }
+            uint16_t value = _values[index];
+            _filter->filter(index, samples, count, value);
+            return value;
+        }
+
+    public:
+        ChannelRegistry()
+            : _bus(nullptr), _remote(nullptr), _filter(nullptr), _numModules(0), _numInputs(0), _numOutputs(0),
+              _raw{}, _values{}, _outputs{}, _failedModules(0), _scanMicros(0)
+        {
+        }
+
+        // Register the onboard channels and the modules found on the bus
+        int begin(ExpansionBus &bus)
+        {
+            _bus = &bus;
+            _remote = nullptr;
+            ModuleInfo found[MaxModules];
+            found[0] = {MODULE_ONBOARD, ONBOARD_INPUTS, ONBOARD_OUTPUTS};
+            return addModules(found, 1 + bus.discover(found + 1, MaxModules - 1));
+        }
+
+        // Mirror the channels of another core, with the modules it found
+        int begin(RemoteIo &remote)
+        {
+            _bus = nullptr;
+            _remote = &remote;
+            ModuleInfo found[MaxModules];
+            return addModules(found, remote.discover(found, MaxModules));
+        }
+
+        // Select analog (counts) or digital (0/1) reading of an input
+        int setInputAnalog(int index, bool analog)
+        {
+            for (int m = _numModules - 1; m >= 0; --m)
+            {
+                if (index >= _modules[m].firstInput && index < _numInputs)
+                {
+                    uint32_t bit = 1UL << (index - _modules[m].firstInput);
+                    _modules[m].analogMask = analog ? (_modules[m].analogMask | bit) : (_modules[m].analogMask & ~bit);
+                    return 0;
+                }
+            }
+            return -1;
+        }
+
+        bool isInputAnalog(int index) const
+        {
+            for (int m = _numModules - 1; m >= 0; --m)
+            {
+                if (index >= _modules[m].firstInput && index < _numInputs)
+                {
+                    return (_modules[m].analogMask >> (index - _modules[m].firstInput)) & 1;
+                }
+            }
+            return false;
+        }
+
+        // Filters of the analog inputs, nullptr for none. A remote
+        // registry is filtered by the other core.
+        void setFilter(InputFilter *filter)
+        {
+            _mutex.lock();
+            _filter = filter;
+            _mutex.unlock();
+        }
+
+        // Apply the input modes and drive all outputs low
+        void configure()
+        {
+            _mutex.lock();
+            if (_remote != nullptr)
+            {
+                uint32_t masks[MaxModules];
+                for (int m = 0; m < _numModules; ++m)
+                {
+                    masks[m] = _modules[m].analogMask;
+                }
+                if (_remote->configure(masks, _numModules) != 0)
+                {
+                    logWarn("Remote channels not configured");
+                }
+                _mutex.unlock();
+                return;
+            }
+            beginOnboard(_modules[0].analogMask);
+            for (int m = 1; m < _numModules; ++m)
+            {
+                _bus->configure(m - 1, _modules[m].analogMask);
+                _bus->writeOutputs(m - 1, _outputs + _modules[m].firstOutput);
+            }
+            _mutex.unlock();
+        }
+
+        // Refresh the input snapshot, one transaction per module. A module
+        // that does not answer keeps its previous values. Filtered inputs
+        // change in the snapshot only once their filter has run. A remote
+        // registry takes the latest scan of the other core instead.
+        void scan()
+        {
+            _mutex.lock();
+            if (_remote != nullptr)
+            {
+                // Every module is lost with the other core
+                if (_remote->readImage(_raw, _values, _numInputs, _failedModules, _scanMicros) < 0)
+                {
+                    _failedModules = (1UL << _numModules) - 1;
+                }
+                _mutex.unlock();
+                return;
+            }
+            uint32_t start = micros();
+            readOnboardInputs(_modules[0].analogMask, _raw);
+            uint32_t failed = 0;
+            for (int m = 1; m < _numModules; ++m)
+            {
+                if (_bus->readInputs(m - 1, _modules[m].analogMask, _raw + _modules[m].firstInput) != 0)
+                {
+                    failed |= 1UL << m;
+                }
+            }
+            for (int m = 0; m < _numModules; ++m)
+            {
+                for (int c = 0; !(failed & (1UL << m)) && c < _modules[m].info.inputs; ++c)
+                {
+                    _values[_modules[m].firstInput + c] = filterInput(m, c);
+                }
+            }
+            _failedModules = failed;
+            _scanMicros = micros() - start;
+            _mutex.unlock();
+        }
+
+        // Last scanned value of an input, filtered
+        uint16_t readInput(int index) const
+        {
+            return (index >= 0 && index < _numInputs) ? _values[index] : 0;
+        }
+
+        // Same, as read before the filters
+        uint16_t readRawInput(int index) const
+        {
+            return (index >= 0 && index < _numInputs) ? _raw[index] : 0;
+        }
+
+        // Set an output, the owning module is written in one transaction
+        int setOutput(int index, uint8_t value)
+        {
+            if (index < 0 || index >= _numOutputs)
+            {
+                return -1;
+            }
+            _mutex.lock();
+            uint8_t previous = _outputs[index];
+            _outputs[index] = value != 0;
+            int m = outputModule(index);
+            int result = 0;
+            if (_remote != nullptr)
+            {
+                result = _remote->writeOutput(index, _outputs[index]);
+            }
+            else if (m == 0)
+            {
+                writeOnboardOutputs(_outputs);
+            }
+            else
+            {
+                result = _bus->writeOutputs(m - 1, _outputs + _modules[m].firstOutput);
+            }
+            // Not written, the state stays the one last set
+            if (result != 0)
+            {
+                _outputs[index] = previous;
+            }
+            _mutex.unlock();
+            return result;
+        }
+
+        uint8_t getOutput(int index) const
+        {
+            return (index >= 0 && index < _numOutputs) ? _outputs[index] : 0;
+        }
+
+        int inputCount() const { return _numInputs; }
+        int outputCount() const { return _numOutputs; }
+        int moduleCount() const { return _numModules; }
+        const ModuleInfo &getModule(int module) const { return _modules[module].info; }
+        // Modules that did not answer the last scan, bit per module
+        uint32_t getFailedModules() const { return _failedModules; }
+        uint32_t getScanMicros() const { return _scanMicros; }
+    };
+
+    using Channels = ChannelRegistry<MAX_MODULES, MAX_INPUTS, MAX_OUTPUTS>;
+} // namespace remoto
+
+#endif // CHANNELS_H
@@ -19,38 +19,63 @@
  */
 
 #include "config.h"
+#include "configstore.h"
+#include "memprofile.h"
 #include <ArduinoJson.h> // Include ArduinoJson library
 #include <Arduino.h>
 
 namespace remoto
 {
+    // Copy a string setting into its storage, -1 if it does not fit
+    static int copySetting(char *field, size_t size, const char *value)
+    {
+        if (value == nullptr)
+        {
+            value = "";
+        }
+        size_t length = strlen(value);
+        if (length >= size)
+        {
+            return -1;
+        }
+        memcpy(field, value, length + 1);
+        return 0;
+    }
+
+    // Same, truncating: the value is known to fit or comes from flash
+    static void copyField(char *field, size_t size, const char *value)
+    {
+        strncpy(field, value != nullptr ? value : "", size - 1);
+        field[size - 1] = '\0';
+    }
+
     config::config()
     {
         loadDefaults();
     }
 
     // Getter for deviceId
-    String config::getDeviceId() const
+    const char *config::getDeviceId() const
     {
         return _deviceId;
     }
 
     // Setter for deviceId
-    void config::setDeviceId(const String &id)
+    int config::setDeviceId(const char *id)
     {
-        _deviceId = id;
+        return copySetting(_deviceId, sizeof(_deviceId), id);
     }
 
     // Getter for IP address
-    String config::getDeviceIpAddress() const
+    const char *config::getDeviceIpAddress() const
     {
         return _ipaddr;
     }
 
     // Setter for IP address
-    void config::setDeviceIpAddress(const String &ip)
+    int config::setDeviceIpAddress(const char *ip)
     {
-        _ipaddr = ip;
+        return copySetting(_ipaddr, sizeof(_ipaddr), ip);
     }
 
     // Getter for dhcp
@@ -77,16 +102,33 @@ namespace remoto
         _preferWifi = val;
     }
 
+    // Getter for the log level
+    LogLevel config::getLogLevel() const
+    {
+        return _logLevel;
+    }
+
+    // Setter for the log level
+    int config::setLogLevel(LogLevel level)
+    {
+        if (level >= NUM_LOG_LEVELS)
+        {
+            return -1;
+        }
+        _logLevel = level;
+        return 0;
+    }
+
     // Getter for MQTT server
-    String config::getMqttServer() const
+    const char *config::getMqttServer() const
     {
         return _mqtt.server;
     }
 
     // Setter for MQTT server
-    void config::setMqttServer(const String &server)
+    int config::setMqttServer(const char *server)
     {
-        _mqtt.server = server;
+        return copySetting(_mqtt.server, sizeof(_mqtt.server), server);
     }
 
     // Getter for MQTT Port
@@ -102,27 +144,27 @@ namespace remoto
     }
 
     // Getter for MQTT user
-    String config::getMqttUser() const
+    const char *config::getMqttUser() const
     {
         return _mqtt.user;
     }
 
     // Setter for MQTT user
-    void config::setMqttUser(const String &user)
+    int config::setMqttUser(const char *user)
     {
-        _mqtt.user = user;
+        return copySetting(_mqtt.user, sizeof(_mqtt.user), user);
     }
 
     // Getter for MQTT password
-    String config::getMqttPassword() const
+    const char *config::getMqttPassword() const
     {
         return _mqtt.password;
     }
 
     // Setter for MQTT password
-    void config::setMqttPassword(const String &password)
+    int config::setMqttPassword(const char *password)
     {
-        _mqtt.password = password;
+        return copySetting(_mqtt.password, sizeof(_mqtt.password), password);
     }
 
     // Getter for MQTT update interval
@@ -136,49 +178,84 @@ namespace remoto
     {
         _mqtt.updateInterval = interval;
     }
+
+    int config::getMqttVersion() const
+    {
+        return _mqtt.version;
+    }
+
+    int config::setMqttVersion(int version)
+    {
+        if (version != 4 && version != 5)
+        {
+            return -1;
+        }
+        _mqtt.version = version;
+        return 0;
+    }
+
+    bool config::getMqttTls() const
+    {
+        return _mqtt.tls;
+    }
+
+    void config::setMqttTls(bool tls)
+    {
+        _mqtt.tls = tls;
+    }
+
+    const PublishBudget &config::getPublishBudget() const
+    {
+        return _mqtt.budget;
+    }
+
+    void config::setPublishBudget(const PublishBudget &budget)
+    {
+        _mqtt.budget = budget;
+    }
     
     // Getter for timeserver address
-    String config::getTimeServer() const
+    const char *config::getTimeServer() const
     {
         return _timeServer;
     }
 
     // Setter for timeserver address
-    void config::setTimeServer(const String &timeserver)
+    int config::setTimeServer(const char *timeserver)
     {
-        _timeServer = timeserver;
+        return copySetting(_timeServer, sizeof(_timeServer), timeserver);
     }
         
     // Getter for ssid name
-    String config::getSSID() const
+    const char *config::getSSID() const
     {
         return _ssid;
     }
 
     // Setter for ssid name
-    void config::setSSID(const String &ssid)
+    int config::setSSID(const char *ssid)
     {
-        _ssid = ssid;
+        return copySetting(_ssid, sizeof(_ssid), ssid);
     }
 
     // Getter for ssid password
-    String config::getWiFiPassword() const
+    const char *config::getWiFiPassword() const
     {
         return _wifiPass;
     }
 
     // Setter for ssid password
-    void config::setWiFiPassword(const String &password)
+    int config::setWiFiPassword(const char *password)
     {
-        _wifiPass = password;
+        return copySetting(_wifiPass, sizeof(_wifiPass), password);
     }
 
     // Getter for input type (DIGITAL or ANALOG)
     int config::getInputType(int index) const
     {
-        if (index >= 0 && index < NUM_INPUTS)
+        if (index >= 0 && index < MAX_INPUTS)
         {
-            return _inputs[index][1]; // 0 for ANALOG, 1 for DIGITAL
+            return _inputTypes[index]; // 0 for ANALOG, 1 for DIGITAL
         }
         return -1; // Invalid index
     }
@@ -186,75 +263,83 @@ namespace remoto
     // Setter for input type (DIGITAL or ANALOG)
     int config::setInputType(int index, int type)
     {
-        if (index >= 0 && index < NUM_INPUTS && (type == DIGITAL || type == ANALOG))
+        if (index >= 0 && index < MAX_INPUTS && (type == DIGITAL || type == ANALOG))
         {
-            _inputs[index][1] = type; // 0 for ANALOG, 1 for DIGITAL
+            _inputTypes[index] = type; // 0 for ANALOG, 1 for DIGITAL
             return 0;
         }
         return -1; // Invalid index
     }
-    int config::getInputPin(int index) const
+    int32_t config::scaleInput(int index, uint16_t raw) const
     {
-        if (index >= 0 && index < NUM_INPUTS)
+        if (index >= 0 && index < MAX_INPUTS)
         {
-            return _inputs[index][0];
+            return _scaling[index].convert(raw);
         }
-        return -1; // Invalid index
+        return 0; // Invalid index
     }
 
-    int config::getOutputPin(int index) const
+    const char *config::getInputUnit(int index) const
     {
-        if (index >= 0 && index < NUM_OUTPUTS)
+        if (index >= 0 && index < MAX_INPUTS)
         {
-            return _outputs[index];
+            return _scaling[index].getUnit();
         }
-        return -1; // Invalid index
+        return ""; // Invalid index
     }
 
-    int config::getOutputLed(int index) const
+    const ChannelFilter &config::getInputFilter(int index) const
     {
-        if (index >= 0 && index < NUM_OUTPUTS)
+        static const ChannelFilter none;
+        if (index >= 0 && index < MAX_INPUTS)
         {
-            return _outputsLed[index];
+            return _filters[index];
         }
-        return -1; // Invalid index
+        return none; // Invalid index
     }
 
-    // Initialize input pin modes
-    void config::initializePins()
+    // Function to load configuration from a JSON string
+    // Function to load configuration from a JSON buffer
+    int config::loadFromJson(const char *buffer, size_t length)
     {
-        analogReadResolution(ADC_BITS);
+        MemScope scope(MEM_CONFIG);
+        DynamicJsonDocument doc(CONFIG_JSON_SIZE);
+        DeserializationError error = deserializeJson(doc, buffer, length);
 
-        for (int i = 0; i < NUM_INPUTS; ++i)
-        {
-            if (_inputs[i][1] == DIGITAL)
-            {
-                pinMode(_inputs[i][0], INPUT); // Set pin to digital input
-            }
-        }
-        for (int i = 0; i < NUM_OUTPUTS; ++i)
+        // Check for deserialization errors
+        if (error)
         {
-            pinMode(_outputs[i], OUTPUT);
-            pinMode(_outputsLed[i], OUTPUT);
-            digitalWrite(_outputs[i], LOW);
-            digitalWrite(_outputsLed[i], LOW);
+            logWarn("Failed to parse JSON");
+            return -1;
         }
+        return loadFromDocument(doc);
     }
 
-    // Function to load configuration from a JSON string
-    // Function to load configuration from a JSON buffer
-    int config::loadFromJson(const char *buffer, size_t length)
+    // Function to load configuration from a mutable JSON buffer
+    int config::loadFromJsonInPlace(char *buffer, size_t length)
     {
-        DynamicJsonDocument doc(1024);
+        MemScope scope(MEM_CONFIG);
+        // Zero-copy: strings stay in the buffer, the document only holds the tree
+        DynamicJsonDocument doc(CONFIG_JSON_NODES_SIZE);
         DeserializationError error = deserializeJson(doc, buffer, length);
 
-        // Check for deserialization errors
         if (error)
         {
-            Serial.println("Failed to parse JSON");
+            logWarn("Failed to parse JSON");
             return -1;
         }
+        return loadFromDocument(doc);
+    }
+
+    // True if the string value fits a setting of the given length
+    static bool fits(JsonVariantConst value, size_t length)
+    {
+        const char *str = value.as<const char *>();
+        return str == nullptr || strlen(str) <= length;
+    }
 
+    int config::loadFromDocument(const JsonDocument &doc)
+    {
         // Check if all necessary keys are present
         if (!doc.containsKey("deviceId") ||
             !doc.containsKey("deviceIpAddress") ||
@@ -270,29 +355,144 @@ namespace remoto
             !doc["mqtt"].containsKey("updateInterval") ||
             !doc.containsKey("inputs"))
         {
-            Serial.println("Missing required keys in JSON");
+            logWarn("Missing required keys in JSON");
+            return -1;
+        }
+
+        // Settings must fit their slot of the stored record
+        if (!fits(doc["deviceId"], CONFIG_DEVICE_ID_LEN) ||
+            !fits(doc["deviceIpAddress"], CONFIG_IP_ADDR_LEN) ||
+            !fits(doc["ssid"], CONFIG_SSID_LEN) ||
+            !fits(doc["wifiPass"], CONFIG_WIFI_PASS_LEN) ||
+            !fits(doc["timeServer"], CONFIG_HOST_LEN) ||
+            !fits(doc["mqtt"]["server"], CONFIG_HOST_LEN) ||
+            !fits(doc["mqtt"]["user"], CONFIG_MQTT_USER_LEN) ||
+            !fits(doc["mqtt"]["password"], CONFIG_MQTT_PASS_LEN))
+        {
+            logWarn("Value too long in JSON");
+            return -1;
+        }
+        // Optional, older configurations keep MQTT 3.1.1
+        JsonVariantConst version = doc["mqtt"]["version"];
+        if (!version.isNull() && version.as<int>() != 4 && version.as<int>() != 5)
+        {
+            logWarn("Invalid MQTT version");
+            return -1;
+        }
+        if (!doc["mqtt"]["tls"].isNull() && !doc["mqtt"]["tls"].is<bool>())
+        {
+            logWarn("Invalid MQTT TLS flag");
+            return -1;
+        }
+        // Optional too, and any subset of the four limits
+        JsonObjectConst budget = doc["mqtt"]["budget"];
+        for (JsonPairConst limit : budget)
+        {
+            if (!limit.value().is<uint32_t>())
+            {
+                logWarn("Invalid MQTT budget");
+                return -1;
+            }
+        }
+        // Optional, older configurations log at the default level
+        JsonVariantConst logLevel = doc["logLevel"];
+        if (!logLevel.isNull() && logLevelFromName(logLevel.as<const char *>()) == NUM_LOG_LEVELS)
+        {
+            logWarn("Invalid log level");
+            return -1;
+        }
+
+        // Inputs, scaling and filters may list any subset of the channels,
+        // the others keep their type, calibration and filter
+        ChannelScaling scaling;
+        ChannelFilter filter;
+        int chains = 0;
+        for (int i = 0; i < MAX_INPUTS; ++i)
+        {
+            char pinName[8];
+            snprintf(pinName, sizeof(pinName), "I%d", i + 1);
+            JsonVariantConst type = doc["inputs"][pinName];
+            if (!type.isNull() && type.as<int>() != DIGITAL && type.as<int>() != ANALOG)
+            {
+                logWarn("Invalid type for %s", pinName);
+                return -1;
+            }
+            JsonVariantConst description = doc["scaling"][pinName];
+            if (!description.isNull() && scaling.fromJson(description.as<JsonObjectConst>()) != 0)
+            {
+                logWarn("Invalid scaling for %s", pinName);
+                return -1;
+            }
+            JsonVariantConst chain = doc["filters"][pinName];
+            if (!chain.isNull() && filter.fromJson(chain.as<JsonArrayConst>()) != 0)
+            {
+                logWarn("Invalid filter for %s", pinName);
+                return -1;
+            }
+            // Chains of the analog inputs, as they will be after the update
+            int8_t kind = type.isNull() ? _inputTypes[i] : type.as<int>();
+            const ChannelFilter &result = chain.isNull() ? _filters[i] : filter;
+            if (kind == ANALOG && result.stageCount() > 0)
+            {
+                chains++;
+            }
+        }
+        if (chains > FILTER_MAX_CHANNELS)
+        {
+            logWarn("Too many filter chains, %d at most", FILTER_MAX_CHANNELS);
             return -1;
         }
 
         // Set values from JSON if all keys are valid
-        _deviceId = doc["deviceId"].as<String>();
-        _ipaddr = doc["deviceIpAddress"].as<String>();
+        copyField(_deviceId, sizeof(_deviceId), doc["deviceId"].as<const char *>());
+        copyField(_ipaddr, sizeof(_ipaddr), doc["deviceIpAddress"].as<const char *>());
         _dhcp = doc["dhcp"].as<bool>();
         _preferWifi = doc["preferWifi"].as<bool>();
-        _ssid = doc["ssid"].as<String>();
-        _ssid = doc["wifiPass"].as<String>();
-        _ssid = doc["timeServer"].as<String>();
-        _mqtt.server = doc["mqtt"]["server"].as<String>();
+        copyField(_ssid, sizeof(_ssid), doc["ssid"].as<const char *>());
+        copyField(_wifiPass, sizeof(_wifiPass), doc["wifiPass"].as<const char *>());
+        copyField(_timeServer, sizeof(_timeServer), doc["timeServer"].as<const char *>());
+        copyField(_mqtt.server, sizeof(_mqtt.server), doc["mqtt"]["server"].as<const char *>());
         _mqtt.port = doc["mqtt"]["port"].as<int>();
-        _mqtt.user = doc["mqtt"]["user"].as<String>();
-        _mqtt.password = doc["mqtt"]["password"].as<String>();
+        copyField(_mqtt.user, sizeof(_mqtt.user), doc["mqtt"]["user"].as<const char *>());
+        copyField(_mqtt.password, sizeof(_mqtt.password), doc["mqtt"]["password"].as<const char *>());
         _mqtt.updateInterval = doc["mqtt"]["updateInterval"].as<int>();
+        if (!version.isNull())
+        {
+            _mqtt.version = version.as<int>();
+        }
+        if (!doc["mqtt"]["tls"].isNull())
+        {
+            _mqtt.tls = doc["mqtt"]["tls"].as<bool>();
+        }
+        _mqtt.budget.hourBytes = budget["hourBytes"] | _mqtt.budget.hourBytes;
+        _mqtt.budget.hourMessages = budget["hourMessages"] | _mqtt.budget.hourMessages;
+        _mqtt.budget.dayBytes = budget["dayBytes"] | _mqtt.budget.dayBytes;
+        _mqtt.budget.dayMessages = budget["dayMessages"] | _mqtt.budget.dayMessages;
+        if (!logLevel.isNull())
+        {
+            _logLevel = logLevelFromName(logLevel.as<const char *>());
+        }
 
-        // Load input pins and types
-        for (int i = 0; i < NUM_INPUTS; ++i)
+        // Load input types and calibration, already validated
+        for (int i = 0; i < MAX_INPUTS; ++i)
         {
-            String pinName = "I" + String(i + 1);
-            _inputs[i][1] = doc["inputs"][pinName].as<int>();
+            char pinName[8];
+            snprintf(pinName, sizeof(pinName), "I%d", i + 1);
+            JsonVariantConst type = doc["inputs"][pinName];
+            if (!type.isNull())
+            {
+                _inputTypes[i] = type.as<int>();
+            }
+            JsonVariantConst description = doc["scaling"][pinName];
+            if (!description.isNull())
+            {
+                _scaling[i].fromJson(description.as<JsonObjectConst>());
+            }
+            JsonVariantConst chain = doc["filters"][pinName];
+            if (!chain.isNull())
+            {
+                _filters[i].fromJson(chain.as<JsonArrayConst>());
+            }
         }
 
         return 0; // Successfully loaded configuration
@@ -301,7 +501,8 @@ namespace remoto
     // Function to convert configuration to a JSON string
     String config::toJson() const
     {
-        DynamicJsonDocument doc(2048);
+        MemScope scope(MEM_JSON);
+        DynamicJsonDocument doc(CONFIG_JSON_SIZE);
 
         doc["deviceId"] = _deviceId;
         doc["deviceIpAddress"] = _ipaddr;
@@ -310,16 +511,35 @@ namespace remoto
         doc["ssid"] = _ssid;
         doc["wifiPass"] = _wifiPass;
         doc["timeServer"] = _timeServer;
+        doc["logLevel"] = logLevelName(_logLevel);
         doc["mqtt"]["server"] = _mqtt.server;
         doc["mqtt"]["port"] = _mqtt.port;
         doc["mqtt"]["user"] = _mqtt.user;
         doc["mqtt"]["password"] = _mqtt.password;
         doc["mqtt"]["updateInterval"] = _mqtt.updateInterval;
-
-        for (int i = 0; i < NUM_INPUTS; ++i)
+        doc["mqtt"]["version"] = _mqtt.version;
+        doc["mqtt"]["tls"] = _mqtt.tls;
+        JsonObject budget = doc["mqtt"].createNestedObject("budget");
+        budget["hourBytes"] = _mqtt.budget.hourBytes;
+        budget["hourMessages"] = _mqtt.budget.hourMessages;
+        budget["dayBytes"] = _mqtt.budget.dayBytes;
+        budget["dayMessages"] = _mqtt.budget.dayMessages;
+
+        // Calibration and filters are listed for the analog inputs only,
+        // the others keep theirs across a round trip
+        for (int i = 0; i < MAX_INPUTS; ++i)
         {
-            String pinName = "I" + String(i + 1);
-            doc["inputs"][pinName] = _inputs[i][1];
+            char pinName[8];
+            snprintf(pinName, sizeof(pinName), "I%d", i + 1);
+            doc["inputs"][pinName] = _inputTypes[i];
+            if (_inputTypes[i] == ANALOG)
+            {
+                _scaling[i].toJson(doc["scaling"].createNestedObject(pinName));
+                if (_filters[i].stageCount() > 0)
+                {
+                    _filters[i].toJson(doc["filters"].createNestedArray(pinName));
+                }
+            }
         }
 
         String jsonString;
@@ -327,36 +547,146 @@ namespace remoto
         return jsonString;
     }
 
+    // Inputs on the factory curve and unfiltered are left out of the record
+    static bool isCustomized(const ChannelScaling &scaling, const ChannelFilter &filter)
+    {
+        ScalingSettings settings;
+        ScalingSettings factory;
+        scaling.toSettings(settings);
+        ChannelScaling().toSettings(factory);
+        return filter.stageCount() > 0 || memcmp(&settings, &factory, sizeof(settings)) != 0;
+    }
+
+    int config::recordChannels() const
+    {
+        int count = 0;
+        for (int i = 0; i < MAX_INPUTS; ++i)
+        {
+            if (isCustomized(_scaling[i], _filters[i]))
+            {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    void config::toRecord(ConfigRecord &record, ChannelRecord *channels) const
+    {
+        // Zero the padding too, the CRC covers every byte
+        memset((void *)&record, 0, sizeof(record));
+        copyField(record.deviceId, sizeof(record.deviceId), _deviceId);
+        copyField(record.ipaddr, sizeof(record.ipaddr), _ipaddr);
+        copyField(record.ssid, sizeof(record.ssid), _ssid);
+        copyField(record.wifiPass, sizeof(record.wifiPass), _wifiPass);
+        copyField(record.timeServer, sizeof(record.timeServer), _timeServer);
+        copyField(record.mqttServer, sizeof(record.mqttServer), _mqtt.server);
+        copyField(record.mqttUser, sizeof(record.mqttUser), _mqtt.user);
+        copyField(record.mqttPassword, sizeof(record.mqttPassword), _mqtt.password);
+        record.mqttPort = _mqtt.port;
+        record.updateInterval = _mqtt.updateInterval;
+        record.mqttVersion = _mqtt.version;
+        record.mqttTls = _mqtt.tls;
+        record.budget = _mqtt.budget;
+        record.logLevel = _logLevel;
+        record.dhcp = _dhcp;
+        record.preferWifi = _preferWifi;
+        for (int i = 0; i < MAX_INPUTS; ++i)
+        {
+            record.inputTypes[i] = _inputTypes[i];
+            if (isCustomized(_scaling[i], _filters[i]))
+            {
+                ChannelRecord &channel = channels[record.numChannels++];
+                memset((void *)&channel, 0, sizeof(channel));
+                channel.input = i;
+                _scaling[i].toSettings(channel.scaling);
+                channel.filter = _filters[i];
+            }
+        }
+    }
+
+    int config::fromRecord(const ConfigRecord &record, const ChannelRecord *channels)
+    {
+        if (record.numChannels > MAX_INPUTS)
+        {
+            return -1;
+        }
+        for (int i = 0; i < MAX_INPUTS; ++i)
+        {
+            if (record.inputTypes[i] != DIGITAL && record.inputTypes[i] != ANALOG)
+            {
+                return -1;
+            }
+        }
+        // Checked before anything is applied, the settings are compiled
+        // as if they came from the REST config
+        ChannelScaling check;
+        for (int c = 0; c < record.numChannels; ++c)
+        {
+            if (channels[c].input >= MAX_INPUTS || check.fromSettings(channels[c].scaling) != 0 ||
+                !channels[c].filter.isValid())
+            {
+                return -1;
+            }
+        }
+        copyField(_deviceId, sizeof(_deviceId), record.deviceId);
+        copyField(_ipaddr, sizeof(_ipaddr), record.ipaddr);
+        copyField(_ssid, sizeof(_ssid), record.ssid);
+        copyField(_wifiPass, sizeof(_wifiPass), record.wifiPass);
+        copyField(_timeServer, sizeof(_timeServer), record.timeServer);
+        copyField(_mqtt.server, sizeof(_mqtt.server), record.mqttServer);
+        copyField(_mqtt.user, sizeof(_mqtt.user), record.mqttUser);
+        copyField(_mqtt.password, sizeof(_mqtt.password), record.mqttPassword);
+        _mqtt.port = record.mqttPort;
+        _mqtt.updateInterval = record.updateInterval;
+        // Zero in records written before the setting existed
+        _mqtt.version = record.mqttVersion == 5 ? 5 : 4;
+        _mqtt.tls = record.mqttTls != 0;
+        _mqtt.budget = record.budget;
+        _logLevel = record.logLevel < NUM_LOG_LEVELS ? (LogLevel)record.logLevel : DEFAULT_LOG_LEVEL;
+        _dhcp = record.dhcp != 0;
+        _preferWifi = record.preferWifi != 0;
+        for (int i = 0; i < MAX_INPUTS; ++i)
+        {
+            _inputTypes[i] = record.inputTypes[i];
+            _scaling[i].loadDefaults();
+            _filters[i].clear();
+        }
+        for (int c = 0; c < record.numChannels; ++c)
+        {
+            _scaling[channels[c].input].fromSettings(channels[c].scaling);
+            _filters[channels[c].input] = channels[c].filter;
+        }
+        return 0;
+    }
+
     void config::loadDefaults()
     {
-        _deviceId = DEFAULT_DEVICE_ID;
-        _mqtt.server = DEFAULT_MQTT_BROKER;
+        copyField(_deviceId, sizeof(_deviceId), DEFAULT_DEVICE_ID);
+        copyField(_mqtt.server, sizeof(_mqtt.server), DEFAULT_MQTT_BROKER);
         _mqtt.port = DEFAULT_MQTT_PORT;
-        _mqtt.user = DEFAULT_MQTT_USER;
-        _mqtt.password = DEFAULT_MQTT_PASSWORD;
+        copyField(_mqtt.user, sizeof(_mqtt.user), DEFAULT_MQTT_USER);
+        copyField(_mqtt.password, sizeof(_mqtt.password), DEFAULT_MQTT_PASSWORD);
         _mqtt.updateInterval = DEFAULT_TELEMETRY_INTERVAL;
+        _mqtt.version = DEFAULT_MQTT_VERSION;
+        _mqtt.tls = DEFAULT_MQTT_TLS;
+        _mqtt.budget.hourBytes = DEFAULT_BUDGET_HOUR_BYTES;
+        _mqtt.budget.hourMessages = DEFAULT_BUDGET_HOUR_MESSAGES;
+        _mqtt.budget.dayBytes = DEFAULT_BUDGET_DAY_BYTES;
+        _mqtt.budget.dayMessages = DEFAULT_BUDGET_DAY_MESSAGES;
         _dhcp = DEFAULT_USE_DHCP;
         _preferWifi = DEFAULT_PREFER_WIFI;
-        _ipaddr = DEFAULT_IP_ADDR;
-        _ssid = DEFAULT_SSID;
-        _wifiPass = DEFAULT_SSID_PASS;
-        _timeServer = DEFAULT_TIME_SERVER;
-        // Default input pin configurations
-        _inputs[0][0] = A0;
-        _inputs[0][1] = DIGITAL;
-        _inputs[1][0] = A1;
-        _inputs[1][1] = DIGITAL;
-        _inputs[2][0] = A2;
-        _inputs[2][1] = DIGITAL;
-        _inputs[3][0] = A3;
-        _inputs[3][1] = DIGITAL;
-        _inputs[4][0] = A4;
-        _inputs[4][1] = DIGITAL;
-        _inputs[5][0] = A5;
-        _inputs[5][1] = DIGITAL;
-        _inputs[6][0] = A6;
-        _inputs[6][1] = ANALOG;
-        _inputs[7][0] = A7;
-        _inputs[7][1] = ANALOG;
+        copyField(_ipaddr, sizeof(_ipaddr), DEFAULT_IP_ADDR);
+        copyField(_ssid, sizeof(_ssid), DEFAULT_SSID);
+        copyField(_wifiPass, sizeof(_wifiPass), DEFAULT_SSID_PASS);
+        copyField(_timeServer, sizeof(_timeServer), DEFAULT_TIME_SERVER);
+        _logLevel = DEFAULT_LOG_LEVEL;
+        // Onboard I7 and I8 are analog, everything else digital
+        for (int i = 0; i < MAX_INPUTS; ++i)
+        {
+            _inputTypes[i] = (i == 6 || i == 7) ? ANALOG : DIGITAL;
+            // Factory curve on every analog input
+            _scaling[i].loadDefaults();
+            _filters[i].clear();
+        }
     }
 } // namespace remoto
@@ -21,18 +21,41 @@
 #if !defined(CONFIGS_H)
 #define CONFIGS_H
 #include "Arduino.h"
+#include "scaling.h"
+#include "channels.h"
+#include "filter.h"
+#include "governor.h"
+#include "logger.h"
 //-------------------- DEFAULTS ---------------------
 #define DEFAULT_DEVICE_ID "OPTA_WIFI"
 #define DEFAULT_MQTT_BROKER "public.cloud.shiftr.io"
 #define DEFAULT_MQTT_PORT 1883
 #define DEFAULT_MQTT_USER "public"
 #define DEFAULT_MQTT_PASSWORD "public"
+// Protocol level, 4 for MQTT 3.1.1 or 5 for MQTT 5.0
+#define DEFAULT_MQTT_VERSION 4
+// TLS to the broker, needs a CA certificate or PSK uploaded to /tls
+#define DEFAULT_MQTT_TLS false
+// Publish budgets per hour and per day, 0 is unlimited
+#define DEFAULT_BUDGET_HOUR_BYTES 0
+#define DEFAULT_BUDGET_HOUR_MESSAGES 0
+#define DEFAULT_BUDGET_DAY_BYTES 0
+#define DEFAULT_BUDGET_DAY_MESSAGES 0
+// Connection attempts before giving the loop back
+#define MQTT_CONNECT_ATTEMPTS 5
+// Period of the broker keepalive and command dispatch
+#define MQTT_SERVICE_MS 50
+// Stack of the MQTT thread without TLS. publishStalls() alone holds a
+// 512 byte JSON document and its payload, the connect adds DNS.
+#define COMMS_STACK_SIZE 4096
+// Heartbeat LED, one blink per period
+#define HEARTBEAT_PERIOD_MS 5000
+#define HEARTBEAT_BLINK_MS 100
 
 #define DEFAULT_TELEMETRY_INTERVAL 5 * 60U
 
 #define DEFAULT_USE_DHCP true
 #define DEFAULT_IP_ADDR "192.168.1.231"
-#define ADC_BITS 16
 
 //Wifi Secrets
 #define DEFAULT_SSID "SSID"
@@ -42,36 +65,62 @@
 //NTP
 #define DEFAULT_TIME_SERVER "pool.ntp.org"
 
+// Records below this level are not logged
+#define DEFAULT_LOG_LEVEL remoto::LOG_INFO
+
+// Serialized configuration size, grows with the channel capacity
+#define CONFIG_JSON_SIZE (2048 + remoto::MAX_INPUTS * 128)
+// JSON tree of the configuration, without the strings
+#define CONFIG_JSON_NODES_SIZE (1024 + remoto::MAX_INPUTS * 96)
+
+// Longest accepted values of the string settings
+#define CONFIG_DEVICE_ID_LEN 32
+#define CONFIG_IP_ADDR_LEN 15
+#define CONFIG_SSID_LEN 32
+#define CONFIG_WIFI_PASS_LEN 64
+#define CONFIG_HOST_LEN 63
+#define CONFIG_MQTT_USER_LEN 63
+#define CONFIG_MQTT_PASS_LEN 63
+
 namespace remoto
 {
 
-    constexpr int NUM_INPUTS = 8;
-    constexpr int NUM_OUTPUTS = 4;
     constexpr int DIGITAL = 1;
     constexpr int ANALOG = 0;
+
+    struct ConfigRecord;
+    struct ChannelRecord;
+
     class config
     {
     private:
-        String _deviceId;
+        // String settings are stored inline, nothing is allocated after load
+        char _deviceId[CONFIG_DEVICE_ID_LEN + 1];
         bool _dhcp;
         bool _preferWifi;
-        String _ipaddr;
-        String _ssid;
-        String _wifiPass;
-        String _timeServer;
+        char _ipaddr[CONFIG_IP_ADDR_LEN + 1];
+        char _ssid[CONFIG_SSID_LEN + 1];
+        char _wifiPass[CONFIG_WIFI_PASS_LEN + 1];
+        char _timeServer[CONFIG_HOST_LEN + 1];
+        LogLevel _logLevel;
 
         struct MqttConfig
         {
-            String server;
-            String user;
-            String password;
+            char server[CONFIG_HOST_LEN + 1];
+            char user[CONFIG_MQTT_USER_LEN + 1];
+            char password[CONFIG_MQTT_PASS_LEN + 1];
             unsigned int port;
             int updateInterval;
+            uint8_t version;
+            bool tls;
+            PublishBudget budget;
         } _mqtt;
 
-        int _inputs[NUM_INPUTS][2]; // Array for input pins and types (DIGITAL or ANALOG)
-        const int _outputs[NUM_OUTPUTS] = {D0, D1, D2, D3};
-        const int _outputsLed[NUM_OUTPUTS] = {LED_D0, LED_D1, LED_D2, LED_D3};
+        int8_t _inputTypes[MAX_INPUTS];      // DIGITAL or ANALOG, see channels.h for the numbering
+        ChannelScaling _scaling[MAX_INPUTS]; // Calibration of the analog inputs
+        ChannelFilter _filters[MAX_INPUTS];  // Filter chains of the analog inputs
+
+        int loadFromDocument(const JsonDocument &doc);
 
     public:
         config();
@@ -79,70 +128,99 @@ namespace remoto
 
         // load default values
         void loadDefaults();
+
+        // The string getters point into the configuration, the setters
+        // return -1 for values longer than their CONFIG_*_LEN
+
         // Getter and Setter for deviceId
-        String getDeviceId() const;
-        void setDeviceId(const String &id);
+        const char *getDeviceId() const;
+        int setDeviceId(const char *id);
 
         // Getter and Setter for device Ip address
-        String getDeviceIpAddress() const;
-        void setDeviceIpAddress(const String &ip);
+        const char *getDeviceIpAddress() const;
+        int setDeviceIpAddress(const char *ip);
 
         // Getter and Setter for DHCP
         bool getDHCP() const;
         void setDHCP(const bool val);
 
         // Getter and Setter for MQTT server
-        String getMqttServer() const;
-        void setMqttServer(const String &server);
+        const char *getMqttServer() const;
+        int setMqttServer(const char *server);
 
         // Getter and Setter for MQTT port
         int getMqttPort() const;
         void setMqttPort(const int port);
 
         // Getter and Setter for MQTT user
-        String getMqttUser() const;
-        void setMqttUser(const String &user);
+        const char *getMqttUser() const;
+        int setMqttUser(const char *user);
 
         // Getter and Setter for MQTT password
-        String getMqttPassword() const;
-        void setMqttPassword(const String &password);
+        const char *getMqttPassword() const;
+        int setMqttPassword(const char *password);
 
         // Getter and Setter for MQTT update interval
         int getMqttUpdateInterval() const;
         void setMqttUpdateInterval(int interval);
+
+        // Getter and Setter for the MQTT protocol level
+        int getMqttVersion() const;
+        int setMqttVersion(int version);
+
+        // Getter and Setter for MQTT over TLS
+        bool getMqttTls() const;
+        void setMqttTls(bool tls);
+
+        // Getter and Setter for the MQTT publish budget
+        const PublishBudget &getPublishBudget() const;
+        void setPublishBudget(const PublishBudget &budget);
         
         // Getter and Setter for WiFi SSID
-        String getSSID() const;
-        void setSSID(const String &ssid);
+        const char *getSSID() const;
+        int setSSID(const char *ssid);
 
         // Getter and Setter for WiFi password
-        String getWiFiPassword() const;
-        void setWiFiPassword(const String &password);
+        const char *getWiFiPassword() const;
+        int setWiFiPassword(const char *password);
 
         // Getter and Setter for TimeServer Address
-        String getTimeServer() const;
-        void setTimeServer(const String &timeserver);
+        const char *getTimeServer() const;
+        int setTimeServer(const char *timeserver);
 
         // Getter and Setter for WifiPref
         bool getWiFiPref() const;
         void setWiFiPref(const bool val);
 
+        // Getter and Setter for the log level
+        LogLevel getLogLevel() const;
+        int setLogLevel(LogLevel level);
+
         // Getter and setter for input type (DIGITAL or ANALOG)
         int getInputType(int index) const;
         int setInputType(int index, int type);
 
-        int getInputPin(int index) const;
-        int getOutputPin(int index) const;
-        int getOutputLed(int index) const;
 
-        // Initialize pin modes
-        void initializePins();
+        // Convert a raw analog reading to milli engineering units
+        int32_t scaleInput(int index, uint16_t raw) const;
+        // Engineering unit of an analog input
+        const char *getInputUnit(int index) const;
+        // Filter chain of an analog input, empty for none
+        const ChannelFilter &getInputFilter(int index) const;
 
         // Function to load configuration from a JSON string
         int loadFromJson(const char *buffer, size_t length);
+        // Same, parsing in place: the buffer is modified
+        int loadFromJsonInPlace(char *buffer, size_t length);
 
         // Function to convert configuration to a JSON string
         String toJson() const;
+
+        // Binary form kept in flash, see configstore.h. The record is
+        // followed by recordChannels() channel entries.
+        int recordChannels() const;
+        void toRecord(ConfigRecord &record, ChannelRecord *channels) const;
+        int fromRecord(const ConfigRecord &record, const ChannelRecord *channels);
     };
 } // namespace remoto
 
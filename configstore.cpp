@@ -0,0 +1,401 @@
+/*
+ * Remoto: Binary configuration storage for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Record layout, integrity check and migration. See configstore.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "configstore.h"
+#include "memprofile.h"
+#include "mbed.h"
+#include "kvstore_global_api.h"
+#include <stddef.h>
+#include <type_traits>
+
+namespace remoto
+{
+    static_assert(std::is_trivially_copyable<ConfigRecord>::value &&
+                      std::is_trivially_copyable<ChannelRecord>::value,
+                  "the config record is stored with memcpy");
+    // The stored layouts, any change here needs a new schema version
+    static_assert(sizeof(ScalingSettings) == 104, "ScalingSettings layout changed");
+    static_assert(sizeof(ChannelFilter) == 16, "ChannelFilter layout changed");
+    static_assert(sizeof(ChannelRecord) == 124, "ChannelRecord layout changed");
+    static_assert(sizeof(ConfigRecord) == 524, "ConfigRecord layout changed");
+
+    // Up to version 5 ChannelScaling was stored as it sits in memory, its
+    // description followed by the compiled form
+    struct ScalingV5
+    {
+        uint8_t mode;
+        float coeffs[4];
+        uint8_t numCoeffs;
+        float lutX[8];
+        float lutY[8];
+        uint8_t lutPoints;
+        uint8_t clamp;
+        float min;
+        float max;
+        char unit[9];
+        int32_t compiled[26];
+    };
+
+    // Schema version 1, the eight onboard inputs only
+    constexpr int V1_INPUTS = 8;
+    struct ConfigRecordV1
+    {
+        char deviceId[CONFIG_DEVICE_ID_LEN + 1];
+        char ipaddr[CONFIG_IP_ADDR_LEN + 1];
+        char ssid[CONFIG_SSID_LEN + 1];
+        char wifiPass[CONFIG_WIFI_PASS_LEN + 1];
+        char timeServer[CONFIG_HOST_LEN + 1];
+        char mqttServer[CONFIG_HOST_LEN + 1];
+        char mqttUser[CONFIG_MQTT_USER_LEN + 1];
+        char mqttPassword[CONFIG_MQTT_PASS_LEN + 1];
+        uint32_t mqttPort;
+        int32_t updateInterval;
+        uint8_t dhcp;
+        uint8_t preferWifi;
+        uint8_t reserved[2];
+        int32_t inputTypes[V1_INPUTS];
+        ScalingV5 scaling[V1_INPUTS];
+    };
+
+    // Schema version 5, one entry per channel of the registry capacity
+    constexpr int V5_INPUTS = 88;
+    struct ConfigRecordV5
+    {
+        char deviceId[CONFIG_DEVICE_ID_LEN + 1];
+        char ipaddr[CONFIG_IP_ADDR_LEN + 1];
+        char ssid[CONFIG_SSID_LEN + 1];
+        char wifiPass[CONFIG_WIFI_PASS_LEN + 1];
+        char timeServer[CONFIG_HOST_LEN + 1];
+        char mqttServer[CONFIG_HOST_LEN + 1];
+        char mqttUser[CONFIG_MQTT_USER_LEN + 1];
+        char mqttPassword[CONFIG_MQTT_PASS_LEN + 1];
+        uint32_t mqttPort;
+        int32_t updateInterval;
+        uint8_t dhcp;
+        uint8_t preferWifi;
+        uint8_t mqttVersion;
+        uint8_t mqttTls;
+        int8_t inputTypes[V5_INPUTS];
+        ScalingV5 scaling[V5_INPUTS];
+        PublishBudget budget; // added in version 3
+        uint8_t logLevel;     // added in version 4
+        uint8_t reserved[3];
+        ChannelFilter filters[V5_INPUTS]; // added in version 5
+    };
+
+    static_assert(sizeof(ScalingV5) == 216, "ScalingV5 must match the stored layout");
+    static_assert(sizeof(ConfigRecordV1) == 2176, "ConfigRecordV1 must match the stored layout");
+    static_assert(sizeof(ConfigRecordV5) == 20940, "ConfigRecordV5 must match the stored layout");
+    static_assert(V5_INPUTS <= MAX_INPUTS, "version 5 records do not fit the registry");
+    static_assert(offsetof(ConfigRecordV5, inputTypes) == offsetof(ConfigRecord, inputTypes),
+                  "the settings before the inputs are copied as they are");
+
+    // Schemas 2 to 4 are prefixes of version 5, without the budget, the
+    // log level and the filters
+    constexpr size_t V2_SIZE = offsetof(ConfigRecordV5, budget);
+    constexpr size_t V3_SIZE = offsetof(ConfigRecordV5, logLevel);
+    constexpr size_t V4_SIZE = offsetof(ConfigRecordV5, filters);
+
+    // Largest record in flash, a version 5 one
+    constexpr size_t CONFIG_STORED_MAX = sizeof(ConfigRecordHeader) + sizeof(ConfigRecordV5);
+    static_assert(sizeof(ConfigRecord) + MAX_INPUTS * sizeof(ChannelRecord) <= sizeof(ConfigRecordV5),
+                  "a version 6 record can be larger than a version 5 one");
+
+    // Half-byte table, 64 bytes of flash instead of 1 KB
+    static const uint32_t CRC_TABLE[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+    uint32_t crc32(const void *data, size_t length, uint32_t crc)
+    {
+        const uint8_t *bytes = (const uint8_t *)data;
+        crc = ~crc;
+        for (size_t i = 0; i < length; ++i)
+        {
+            crc = CRC_TABLE[(crc ^ bytes[i]) & 0x0F] ^ (crc >> 4);
+            crc = CRC_TABLE[(crc ^ (bytes[i] >> 4)) & 0x0F] ^ (crc >> 4);
+        }
+        return ~crc;
+    }
+
+    // Bring an older payload up to a version 5 record. Each step fills
+    // in what the next schema added.
+    static int upgradeToV5(ConfigRecordV5 &record, uint16_t version, const uint8_t *payload, size_t payloadSize)
+    {
+        if (version >= 2)
+        {
+            if (payloadSize > sizeof(ConfigRecordV5))
+            {
+                return -1;
+            }
+            memcpy((void *)&record, payload, payloadSize);
+        }
+        switch (version)
+        {
+        case 1:
+        {
+            if (payloadSize != sizeof(ConfigRecordV1))
+            {
+                return -1;
+            }
+            const ConfigRecordV1 &v1 = *(const ConfigRecordV1 *)payload;
+            memset((void *)&record, 0, sizeof(record));
+            memcpy(record.deviceId, v1.deviceId, sizeof(record.deviceId));
+            memcpy(record.ipaddr, v1.ipaddr, sizeof(record.ipaddr));
+            memcpy(record.ssid, v1.ssid, sizeof(record.ssid));
+            memcpy(record.wifiPass, v1.wifiPass, sizeof(record.wifiPass));
+            memcpy(record.timeServer, v1.timeServer, sizeof(record.timeServer));
+            memcpy(record.mqttServer, v1.mqttServer, sizeof(record.mqttServer));
+            memcpy(record.mqttUser, v1.mqttUser, sizeof(record.mqttUser));
+            memcpy(record.mqttPassword, v1.mqttPassword, sizeof(record.mqttPassword));
+            record.mqttPort = v1.mqttPort;
+            record.updateInterval = v1.updateInterval;
+            record.dhcp = v1.dhcp;
+            record.preferWifi = v1.preferWifi;
+            // Expansion channels start as digital with the factory curve
+            for (int i = 0; i < V5_INPUTS; ++i)
+            {
+                record.inputTypes[i] = i < V1_INPUTS ? v1.inputTypes[i] : DIGITAL;
+                if (i < V1_INPUTS)
+                {
+                    record.scaling[i] = v1.scaling[i];
+                }
+                else
+                {
+                    record.scaling[i].numCoeffs = 2;
+                    record.scaling[i].coeffs[1] = 1.0f;
+                    strcpy(record.scaling[i].unit, "V");
+                }
+            }
+            payloadSize = V2_SIZE;
+        }
+            // fall through
+        case 2:
+            if (payloadSize != V2_SIZE)
+            {
+                return -1;
+            }
+            // No budget, publishing stays unlimited
+            memset((void *)&record.budget, 0, sizeof(record.budget));
+            payloadSize = V3_SIZE;
+            // fall through
+        case 3:
+            if (payloadSize != V3_SIZE)
+            {
+                return -1;
+            }
+            record.logLevel = DEFAULT_LOG_LEVEL;
+            memset(record.reserved, 0, sizeof(record.reserved));
+            payloadSize = V4_SIZE;
+            // fall through
+        case 4:
+            if (payloadSize != V4_SIZE)
+            {
+                return -1;
+            }
+            // Inputs stay unfiltered
+            for (int i = 0; i < V5_INPUTS; ++i)
+            {
+                record.filters[i].clear();
+            }
+            payloadSize = sizeof(ConfigRecordV5);
+            // fall through
+        case 5:
+            return payloadSize == sizeof(ConfigRecordV5) ? 0 : -1;
+        default:
+            logError("Unknown config record version %u", (unsigned)version);
+            return -1;
+        }
+    }
+
+    // Version 5 to the current schema: the scaling descriptions lose
+    // their compiled form, which fromRecord() computes again
+    static int loadRecordV5(config &conf, const ConfigRecordV5 &old)
+    {
+        size_t size = sizeof(ConfigRecord) + V5_INPUTS * sizeof(ChannelRecord);
+        ConfigRecord *record = (ConfigRecord *)malloc(size);
+        if (record == nullptr)
+        {
+            return -1;
+        }
+        memset((void *)record, 0, size);
+        memcpy(record, &old, offsetof(ConfigRecordV5, inputTypes));
+        memcpy(record->inputTypes, old.inputTypes, sizeof(old.inputTypes));
+        for (int i = V5_INPUTS; i < MAX_INPUTS; ++i)
+        {
+            record->inputTypes[i] = DIGITAL;
+        }
+        record->budget = old.budget;
+        record->logLevel = old.logLevel;
+        // Every input gets an entry, the next save leaves the defaults out
+        ChannelRecord *channels = (ChannelRecord *)(record + 1);
+        for (int i = 0; i < V5_INPUTS; ++i)
+        {
+            const ScalingV5 &from = old.scaling[i];
+            ScalingSettings &to = channels[i].scaling;
+            channels[i].input = i;
+            to.mode = from.mode;
+            to.numCoeffs = from.numCoeffs;
+            to.lutPoints = from.lutPoints;
+            to.clamp = from.clamp;
+            // Counts out of range are rejected by fromRecord()
+            if (from.numCoeffs <= MAX_POLY_COEFFS)
+            {
+                memcpy(to.coeffs, from.coeffs, from.numCoeffs * sizeof(float));
+            }
+            if (from.lutPoints <= MAX_LUT_POINTS)
+            {
+                memcpy(to.lutX, from.lutX, from.lutPoints * sizeof(float));
+                memcpy(to.lutY, from.lutY, from.lutPoints * sizeof(float));
+            }
+            to.min = from.min;
+            to.max = from.max;
+            memcpy(to.unit, from.unit, sizeof(to.unit));
+            channels[i].filter = old.filters[i];
+        }
+        record->numChannels = V5_INPUTS;
+        int ret = conf.fromRecord(*record, channels);
+        free(record);
+        return ret;
+    }
+
+    static int migrateRecord(config &conf, uint16_t version, const uint8_t *payload, size_t payloadSize)
+    {
+        ConfigRecordV5 *old = (ConfigRecordV5 *)malloc(sizeof(ConfigRecordV5));
+        if (old == nullptr)
+        {
+            return -1;
+        }
+        int ret = upgradeToV5(*old, version, payload, payloadSize);
+        if (ret == 0)
+        {
+            ret = loadRecordV5(conf, *old);
+        }
+        free(old);
+        return ret;
+    }
+
+    // First releases kept the configuration as JSON text
+    static int loadLegacyConfig(config &conf)
+    {
+        kv_info_t info;
+        if (kv_get_info(CONFIG_LEGACY_KEY, &info) != MBED_SUCCESS || info.size == 0 || info.size > CONFIG_JSON_SIZE)
+        {
+            return CONFIG_MISSING;
+        }
+        char *buffer = (char *)malloc(info.size);
+        if (buffer == nullptr)
+        {
+            return CONFIG_CORRUPT;
+        }
+        size_t actual = 0;
+        int ret = -1;
+        if (kv_get(CONFIG_LEGACY_KEY, buffer, info.size, &actual) == MBED_SUCCESS)
+        {
+            ret = conf.loadFromJsonInPlace(buffer, actual);
+        }
+        free(buffer);
+        if (ret != 0 || saveConfig(conf) != 0)
+        {
+            return CONFIG_CORRUPT;
+        }
+        kv_remove(CONFIG_LEGACY_KEY);
+        logInfo("Config migrated from JSON");
+        return CONFIG_MIGRATED;
+    }
+
+    // Check and apply the record read into buffer
+    static int loadRecord(config &conf, const uint8_t *buffer, size_t size)
+    {
+        const ConfigRecordHeader &header = *(const ConfigRecordHeader *)buffer;
+        const uint8_t *payload = buffer + sizeof(ConfigRecordHeader);
+        size_t payloadSize = size - sizeof(ConfigRecordHeader);
+        if (header.magic != CONFIG_RECORD_MAGIC || header.headerSize != sizeof(ConfigRecordHeader) ||
+            header.payloadSize != payloadSize || header.crc != crc32(payload, payloadSize))
+        {
+            logError("Config record failed its integrity check");
+            return CONFIG_CORRUPT;
+        }
+        if (header.version != CONFIG_RECORD_VERSION)
+        {
+            return migrateRecord(conf, header.version, payload, payloadSize) == 0 ? CONFIG_MIGRATED : CONFIG_CORRUPT;
+        }
+        const ConfigRecord &record = *(const ConfigRecord *)payload;
+        if (payloadSize < sizeof(ConfigRecord) ||
+            payloadSize != sizeof(ConfigRecord) + record.numChannels * sizeof(ChannelRecord) ||
+            conf.fromRecord(record, (const ChannelRecord *)(&record + 1)) != 0)
+        {
+            return CONFIG_CORRUPT;
+        }
+        return CONFIG_LOADED;
+    }
+
+    int loadConfig(config &conf)
+    {
+        MemScope scope(MEM_CONFIG);
+        kv_info_t info;
+        if (kv_get_info(CONFIG_RECORD_KEY, &info) != MBED_SUCCESS)
+        {
+            return loadLegacyConfig(conf);
+        }
+        if (info.size < sizeof(ConfigRecordHeader) || info.size > CONFIG_STORED_MAX)
+        {
+            return CONFIG_CORRUPT;
+        }
+        // Only held while loading, nothing stays allocated
+        uint8_t *buffer = (uint8_t *)malloc(info.size);
+        if (buffer == nullptr)
+        {
+            return CONFIG_CORRUPT;
+        }
+        size_t actual = 0;
+        int result = CONFIG_CORRUPT;
+        if (kv_get(CONFIG_RECORD_KEY, buffer, info.size, &actual) == MBED_SUCCESS && actual == info.size)
+        {
+            result = loadRecord(conf, buffer, actual);
+        }
+        free(buffer);
+        if (result == CONFIG_MIGRATED)
+        {
+            saveConfig(conf);
+        }
+        return result;
+    }
+
+    int saveConfig(const config &conf)
+    {
+        MemScope scope(MEM_CONFIG);
+        size_t payloadSize = sizeof(ConfigRecord) + conf.recordChannels() * sizeof(ChannelRecord);
+        size_t size = sizeof(ConfigRecordHeader) + payloadSize;
+        uint8_t *buffer = (uint8_t *)malloc(size);
+        if (buffer == nullptr)
+        {
+            logError("Failed to store config");
+            return -1;
+        }
+        ConfigRecordHeader *header = (ConfigRecordHeader *)buffer;
+        ConfigRecord *record = (ConfigRecord *)(header + 1);
+        conf.toRecord(*record, (ChannelRecord *)(record + 1));
+        header->magic = CONFIG_RECORD_MAGIC;
+        header->version = CONFIG_RECORD_VERSION;
+        header->headerSize = sizeof(ConfigRecordHeader);
+        header->payloadSize = payloadSize;
+        header->crc = crc32(record, payloadSize);
+        int ret = kv_set(CONFIG_RECORD_KEY, buffer, size, 0) == MBED_SUCCESS ? 0 : -1;
+        free(buffer);
+        if (ret != 0)
+        {
+            logError("Failed to store config");
+        }
+        return ret;
+    }
+} // namespace remoto
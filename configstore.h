@@ -0,0 +1,95 @@
+/*
+ * Remoto: Binary configuration storage for Arduino OPTA
+ * -------------------------------------------------------------------
+ * The configuration is kept in flash as a fixed-layout binary record
+ * behind a small header carrying a magic number, the schema version,
+ * the payload size and a CRC-32. Only the inputs with their own
+ * calibration or filters get an entry, with the settings as entered;
+ * booting is a read, a CRC check and a compile of those entries. JSON
+ * is only used at the REST boundary. Records written by an older
+ * firmware are migrated to the current schema, including the JSON text
+ * stored by the first releases.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(CONFIGSTORE_H)
+#define CONFIGSTORE_H
+#include <Arduino.h>
+#include "config.h"
+
+// KVStore keys of the binary record and of the legacy JSON text
+#define CONFIG_RECORD_KEY "cfgrec"
+#define CONFIG_LEGACY_KEY "config"
+
+namespace remoto
+{
+    constexpr uint32_t CONFIG_RECORD_MAGIC = 0x43544D52; // "RMTC"
+    constexpr uint16_t CONFIG_RECORD_VERSION = 6;
+
+    struct ConfigRecordHeader
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t headerSize;
+        uint32_t payloadSize;
+        uint32_t crc; // CRC-32 of the payload
+    };
+
+    // An input whose calibration or filter chain differs from the
+    // defaults. Inputs on the factory curve and unfiltered take no room.
+    struct ChannelRecord
+    {
+        uint8_t input;
+        uint8_t reserved[3];
+        ScalingSettings scaling;
+        ChannelFilter filter;
+    };
+
+    // Schema version 6. The payload is this record followed by
+    // numChannels ChannelRecord entries. Any change to the layout,
+    // pinned by the size checks in configstore.cpp, needs a new version
+    // and a migration step.
+    struct ConfigRecord
+    {
+        char deviceId[CONFIG_DEVICE_ID_LEN + 1];
+        char ipaddr[CONFIG_IP_ADDR_LEN + 1];
+        char ssid[CONFIG_SSID_LEN + 1];
+        char wifiPass[CONFIG_WIFI_PASS_LEN + 1];
+        char timeServer[CONFIG_HOST_LEN + 1];
+        char mqttServer[CONFIG_HOST_LEN + 1];
+        char mqttUser[CONFIG_MQTT_USER_LEN + 1];
+        char mqttPassword[CONFIG_MQTT_PASS_LEN + 1];
+        uint32_t mqttPort;
+        int32_t updateInterval;
+        uint8_t dhcp;
+        uint8_t preferWifi;
+        uint8_t mqttVersion;
+        uint8_t mqttTls;
+        int8_t inputTypes[MAX_INPUTS];
+        PublishBudget budget;
+        uint8_t logLevel;
+        uint8_t reserved;
+        uint16_t numChannels;
+    };
+
+    enum ConfigLoadResult
+    {
+        CONFIG_LOADED = 0,
+        CONFIG_MIGRATED = 1,
+        CONFIG_MISSING = -1,
+        CONFIG_CORRUPT = -2
+    };
+
+    // Load the configuration from flash, migrating older records
+    int loadConfig(config &conf);
+    // Store the configuration as a binary record
+    int saveConfig(const config &conf);
+
+    // CRC-32 (IEEE 802.3), chainable through crc
+    uint32_t crc32(const void *data, size_t length, uint32_t crc = 0);
+} // namespace remoto
+
+#endif // CONFIGSTORE_H
@@ -0,0 +1,466 @@
+/*
+ * Remoto: Analog input filters for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Filter settings, block kernels and the chains of the inputs. See
+ * filter.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "filter.h"
+#include "scaling.h"
+#include <math.h>
+
+namespace remoto
+{
+    // Raw counts in Q31, with headroom for the 16 bit full scale
+    constexpr int SAMPLE_SHIFT = 15;
+
+    struct KindInfo
+    {
+        const char *name;
+        const char *key; // of the length in JSON
+        uint16_t min;
+        uint16_t max;
+    };
+
+    static const KindInfo KINDS[] = {
+        {"none", nullptr, 0, 0},
+        {"average", "taps", 2, FILTER_MAX_TAPS},
+        {"median", "taps", 3, FILTER_MAX_MEDIAN},
+        {"lowpass", "tau", 1, FILTER_MAX_TAU},
+        {"decimate", "factor", 2, FILTER_BLOCK_SIZE}};
+    constexpr int NUM_KINDS = sizeof(KINDS) / sizeof(KINDS[0]);
+
+    FilterKind filterKindFromName(const char *name)
+    {
+        for (int i = 1; name != nullptr && i < NUM_KINDS; ++i)
+        {
+            if (strcmp(name, KINDS[i].name) == 0)
+            {
+                return (FilterKind)i;
+            }
+        }
+        return FilterKind::NONE;
+    }
+
+    const char *filterKindName(FilterKind kind)
+    {
+        return (int)kind < NUM_KINDS ? KINDS[(int)kind].name : "?";
+    }
+
+    //------------------------ SETTINGS ------------------------
+    ChannelFilter::ChannelFilter()
+    {
+        clear();
+    }
+
+    void ChannelFilter::clear()
+    {
+        memset(_stages, 0, sizeof(_stages));
+    }
+
+    int ChannelFilter::addStage(FilterKind kind, uint16_t length)
+    {
+        int count = stageCount();
+        if (count >= FILTER_MAX_STAGES || kind == FilterKind::NONE || (int)kind >= NUM_KINDS)
+        {
+            return -1;
+        }
+        const KindInfo &info = KINDS[(int)kind];
+        if (length < info.min || length > info.max || (kind == FilterKind::MEDIAN && length % 2 == 0))
+        {
+            return -1;
+        }
+        // The whole decimation of the chain fits one block
+        if (kind == FilterKind::DECIMATE && decimation() * length > FILTER_BLOCK_SIZE)
+        {
+            return -1;
+        }
+        _stages[count] = {kind, 0, length};
+        return 0;
+    }
+
+    int ChannelFilter::stageCount() const
+    {
+        int count = 0;
+        while (count < FILTER_MAX_STAGES && _stages[count].kind != FilterKind::NONE)
+        {
+            count++;
+        }
+        return count;
+    }
+
+    const FilterStage &ChannelFilter::getStage(int index) const
+    {
+        return _stages[index];
+    }
+
+    int ChannelFilter::decimation() const
+    {
+        int factor = 1;
+        for (int i = 0; i < stageCount(); ++i)
+        {
+            if (_stages[i].kind == FilterKind::DECIMATE)
+            {
+                factor *= _stages[i].length;
+            }
+        }
+        return factor;
+    }
+
+    bool ChannelFilter::isValid() const
+    {
+        ChannelFilter check;
+        int count = stageCount();
+        for (int i = 0; i < count; ++i)
+        {
+            if (check.addStage(_stages[i].kind, _stages[i].length) != 0)
+            {
+                return false;
+            }
+        }
+        // Nothing but empty stages after the last one
+        for (int i = count; i < FILTER_MAX_STAGES; ++i)
+        {
+            if (_stages[i].kind != FilterKind::NONE)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int ChannelFilter::fromJson(JsonArrayConst stages)
+    {
+        ChannelFilter next;
+        if (stages.isNull() || stages.size() > FILTER_MAX_STAGES)
+        {
+            return -1;
+        }
+        for (JsonObjectConst stage : stages)
+        {
+            FilterKind kind = filterKindFromName(stage["type"].as<const char *>());
+            if (kind == FilterKind::NONE)
+            {
+                return -1;
+            }
+            JsonVariantConst length = stage[KINDS[(int)kind].key];
+            if (!length.is<uint16_t>() || next.addStage(kind, length.as<uint16_t>()) != 0)
+            {
+                return -1;
+            }
+        }
+        *this = next;
+        return 0;
+    }
+
+    void ChannelFilter::toJson(JsonArray stages) const
+    {
+        for (int i = 0; i < stageCount(); ++i)
+        {
+            JsonObject stage = stages.createNestedObject();
+            stage["type"] = KINDS[(int)_stages[i].kind].name;
+            stage[KINDS[(int)_stages[i].kind].key] = _stages[i].length;
+        }
+    }
+
+    //------------------------ KERNELS ------------------------
+    FilterChain::FilterChain() : _numStages(0), _decimation(1), _primed(false)
+    {
+        memset((void *)_stages, 0, sizeof(_stages));
+    }
+
+    int FilterChain::configure(const ChannelFilter &settings)
+    {
+        if (!settings.isValid())
+        {
+            return -1;
+        }
+        memset((void *)_stages, 0, sizeof(_stages));
+        _numStages = settings.stageCount();
+        _decimation = settings.decimation();
+        _primed = false;
+        for (int i = 0; i < _numStages; ++i)
+        {
+            Stage &stage = _stages[i];
+            stage.kind = settings.getStage(i).kind;
+            stage.length = settings.getStage(i).length;
+            if (stage.kind == FilterKind::AVERAGE)
+            {
+#if defined(REMOTO_CMSIS_DSP)
+                // Equal taps of 1/N, rounded so that they never sum above one
+                for (int t = 0; t < stage.length; ++t)
+                {
+                    stage.average.coeffs[t] = (q31_t)(0x7FFFFFFFL / stage.length);
+                }
+                arm_fir_init_q31(&stage.average.fir, stage.length, stage.average.coeffs, stage.average.state,
+                                 FILTER_BLOCK_SIZE);
+#endif
+            }
+            else if (stage.kind == FilterKind::LOWPASS)
+            {
+                // y += a * (x - y), with a = 1 - e^(-1/tau)
+                double a = 1.0 - exp(-1.0 / stage.length);
+#if defined(REMOTO_CMSIS_DSP)
+                LowpassState &lowpass = stage.lowpass;
+                lowpass.coeffs[0] = (q31_t)(a * 2147483647.0);
+                lowpass.coeffs[1] = 0;
+                lowpass.coeffs[2] = 0;
+                lowpass.coeffs[3] = (q31_t)((1.0 - a) * 2147483647.0);
+                lowpass.coeffs[4] = 0;
+                arm_biquad_cascade_df1_init_q31(&lowpass.biquad, 1, lowpass.coeffs, lowpass.state, 0);
+#else
+                stage.lowpass.alpha = (int32_t)(a * 2147483647.0);
+#endif
+            }
+        }
+        return 0;
+    }
+
+    // Start from a steady input, so that the first outputs do not ramp
+    void FilterChain::prime(int32_t sample)
+    {
+        for (int i = 0; i < _numStages; ++i)
+        {
+            Stage &stage = _stages[i];
+            switch (stage.kind)
+            {
+            case FilterKind::AVERAGE:
+#if defined(REMOTO_CMSIS_DSP)
+                // The state starts with the N - 1 previous samples
+                for (int t = 0; t < stage.length - 1; ++t)
+                {
+                    stage.average.state[t] = sample;
+                }
+#else
+                for (int t = 0; t < stage.length; ++t)
+                {
+                    stage.average.history[t] = sample;
+                }
+                stage.average.sum = (int64_t)sample * stage.length;
+                stage.average.next = 0;
+#endif
+                break;
+            case FilterKind::MEDIAN:
+                for (int t = 0; t < stage.length; ++t)
+                {
+                    stage.median.window[t] = sample;
+                }
+                stage.median.next = 0;
+                stage.median.count = stage.length;
+                break;
+            case FilterKind::LOWPASS:
+#if defined(REMOTO_CMSIS_DSP)
+                // x[n-1], x[n-2], y[n-1], y[n-2]
+                for (int t = 0; t < 4; ++t)
+                {
+                    stage.lowpass.state[t] = sample;
+                }
+#else
+                stage.lowpass.y = sample;
+#endif
+                break;
+            case FilterKind::DECIMATE:
+                stage.decimate.phase = 0;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    int FilterChain::runAverage(Stage &stage, const int32_t *in, int32_t *out, int count)
+    {
+#if defined(REMOTO_CMSIS_DSP)
+        arm_fir_q31(&stage.average.fir, (q31_t *)in, out, count);
+#else
+        // Running sum, one add and one subtract per sample
+        AverageState &average = stage.average;
+        for (int i = 0; i < count; ++i)
+        {
+            average.sum += in[i] - average.history[average.next];
+            average.history[average.next] = in[i];
+            if (++average.next >= stage.length)
+            {
+                average.next = 0;
+            }
+            out[i] = (int32_t)((average.sum + stage.length / 2) / stage.length);
+        }
+#endif
+        return count;
+    }
+
+    int FilterChain::runMedian(Stage &stage, const int32_t *in, int32_t *out, int count)
+    {
+        MedianState &median = stage.median;
+        for (int i = 0; i < count; ++i)
+        {
+            median.window[median.next] = in[i];
+            if (++median.next >= stage.length)
+            {
+                median.next = 0;
+            }
+            // Insertion sort, at most FILTER_MAX_MEDIAN values
+            int32_t sorted[FILTER_MAX_MEDIAN];
+            for (int j = 0; j < median.count; ++j)
+            {
+                int32_t value = median.window[j];
+                int k = j;
+                while (k > 0 && sorted[k - 1] > value)
+                {
+                    sorted[k] = sorted[k - 1];
+                    k--;
+                }
+                sorted[k] = value;
+            }
+            out[i] = sorted[median.count / 2];
+        }
+        return count;
+    }
+
+    int FilterChain::runLowpass(Stage &stage, const int32_t *in, int32_t *out, int count)
+    {
+#if defined(REMOTO_CMSIS_DSP)
+        arm_biquad_cascade_df1_q31(&stage.lowpass.biquad, (q31_t *)in, out, count);
+#else
+        LowpassState &lowpass = stage.lowpass;
+        for (int i = 0; i < count; ++i)
+        {
+            lowpass.y += (int32_t)(((int64_t)(in[i] - lowpass.y) * lowpass.alpha) >> 31);
+            out[i] = lowpass.y;
+        }
+#endif
+        return count;
+    }
+
+    int FilterChain::runDecimate(Stage &stage, const int32_t *in, int32_t *out, int count)
+    {
+        int kept = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            if (++stage.decimate.phase >= stage.length)
+            {
+                stage.decimate.phase = 0;
+                out[kept++] = in[i];
+            }
+        }
+        return kept;
+    }
+
+    bool FilterChain::process(const uint16_t *samples, int count, uint16_t &value)
+    {
+        int32_t first[FILTER_BLOCK_SIZE];
+        int32_t second[FILTER_BLOCK_SIZE];
+        count = count < FILTER_BLOCK_SIZE ? count : FILTER_BLOCK_SIZE;
+        if (count <= 0)
+        {
+            return false;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            first[i] = (int32_t)samples[i] << SAMPLE_SHIFT;
+        }
+        if (!_primed)
+        {
+            prime(first[0]);
+            _primed = true;
+        }
+        // Each stage reads one buffer and writes the other
+        int32_t *in = first;
+        int32_t *out = second;
+        for (int i = 0; i < _numStages && count > 0; ++i)
+        {
+            Stage &stage = _stages[i];
+            switch (stage.kind)
+            {
+            case FilterKind::AVERAGE:
+                count = runAverage(stage, in, out, count);
+                break;
+            case FilterKind::MEDIAN:
+                count = runMedian(stage, in, out, count);
+                break;
+            case FilterKind::LOWPASS:
+                count = runLowpass(stage, in, out, count);
+                break;
+            case FilterKind::DECIMATE:
+                count = runDecimate(stage, in, out, count);
+                break;
+            default:
+                memcpy(out, in, count * sizeof(int32_t));
+                break;
+            }
+            int32_t *swap = in;
+            in = out;
+            out = swap;
+        }
+        if (count == 0)
+        {
+            return false;
+        }
+        // Round back to counts
+        int64_t counts = ((int64_t)in[count - 1] + (1 << (SAMPLE_SHIFT - 1))) >> SAMPLE_SHIFT;
+        value = counts <= 0 ? 0 : (counts >= (int64_t)ADC_MAX ? ADC_MAX : (uint16_t)counts);
+        return true;
+    }
+
+    //------------------------ INPUTS ------------------------
+    FilterBank::FilterBank() : _used(0)
+    {
+        memset(_slots, -1, sizeof(_slots));
+    }
+
+    int FilterBank::setChain(int index, const ChannelFilter &settings)
+    {
+        if (index < 0 || index >= MAX_INPUTS || !settings.isValid())
+        {
+            return -1;
+        }
+        if (settings.stageCount() == 0)
+        {
+            _slots[index] = -1;
+            return 0;
+        }
+        int slot = _slots[index];
+        if (slot < 0)
+        {
+            if (_used >= FILTER_MAX_CHANNELS)
+            {
+                return -1;
+            }
+            slot = _used++;
+        }
+        if (_chains[slot].configure(settings) != 0)
+        {
+            return -1;
+        }
+        _slots[index] = slot;
+        return 0;
+    }
+
+    void FilterBank::clear()
+    {
+        memset(_slots, -1, sizeof(_slots));
+        _used = 0;
+    }
+
+    int FilterBank::samplesPerScan(int index) const
+    {
+        if (index < 0 || index >= MAX_INPUTS || _slots[index] < 0)
+        {
+            return 0;
+        }
+        return _chains[_slots[index]].decimation();
+    }
+
+    bool FilterBank::filter(int index, const uint16_t *samples, int count, uint16_t &value)
+    {
+        if (index < 0 || index >= MAX_INPUTS || _slots[index] < 0)
+        {
+            return false;
+        }
+        return _chains[_slots[index]].process(samples, count, value);
+    }
+} // namespace remoto
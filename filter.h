@@ -0,0 +1,191 @@
+/*
+ * Remoto: Analog input filters for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Each analog input can run its readings through a chain of up to
+ * FILTER_MAX_STAGES stages before they reach the input snapshot:
+ *
+ *   average   moving average of the last N samples
+ *   median    median of the last N samples (N odd), drops spikes
+ *   lowpass   first-order IIR with a time constant of N samples
+ *   decimate  keeps one sample out of N
+ *
+ * The chain runs on the block of samples of each scan. Onboard inputs
+ * are read in a burst of as many samples as the decimation stages drop,
+ * so "median 5, decimate 4" filters four readings into each scan value.
+ * Expansion inputs deliver one reading per scan, where decimation only
+ * slows the updates down. A sample before any decimation is one reading
+ * of the burst; after it, or without it, one scan.
+ *
+ * Samples are carried in Q31, counts << 15. Built with REMOTO_CMSIS_DSP
+ * and the Arduino_CMSIS-DSP library the average and lowpass stages run
+ * on the q31 FIR and biquad kernels of CMSIS-DSP, otherwise on the
+ * scalar code, which is what api_tests/filterbench.cpp measures on a PC.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(FILTER_H)
+#define FILTER_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "channels.h"
+#if defined(REMOTO_CMSIS_DSP)
+#include <arm_math.h>
+#endif
+
+#define FILTER_MAX_STAGES 4
+#define FILTER_MAX_TAPS 16
+#define FILTER_MAX_MEDIAN 9
+#define FILTER_MAX_TAU 10000
+// Largest block of one scan, the longest burst of an onboard input
+#define FILTER_BLOCK_SIZE INPUT_BURST_MAX
+// Inputs with a chain, their state is allocated statically
+#define FILTER_MAX_CHANNELS 16
+
+namespace remoto
+{
+    enum class FilterKind : uint8_t
+    {
+        NONE = 0,
+        AVERAGE,
+        MEDIAN,
+        LOWPASS,
+        DECIMATE
+    };
+
+    struct FilterStage
+    {
+        FilterKind kind;
+        uint8_t reserved;
+        uint16_t length; // taps, time constant or factor
+    };
+
+    // Settings of one chain, part of the stored configuration
+    class ChannelFilter
+    {
+    private:
+        FilterStage _stages[FILTER_MAX_STAGES]; // NONE after the last one
+
+    public:
+        ChannelFilter();
+
+        void clear();
+        // -1 when the chain is full or the length is out of range
+        int addStage(FilterKind kind, uint16_t length);
+        int stageCount() const;
+        const FilterStage &getStage(int index) const;
+        // Samples dropped per sample kept, at most FILTER_BLOCK_SIZE
+        int decimation() const;
+        // Also checks the settings read from flash
+        bool isValid() const;
+
+        // [{"type": "median", "taps": 5}, {"type": "lowpass", "tau": 20},
+        //  {"type": "average", "taps": 8}, {"type": "decimate", "factor": 4}]
+        int fromJson(JsonArrayConst stages);
+        void toJson(JsonArray stages) const;
+    };
+
+    // Running state of a chain
+    class FilterChain
+    {
+    private:
+        struct AverageState
+        {
+#if defined(REMOTO_CMSIS_DSP)
+            arm_fir_instance_q31 fir;
+            q31_t coeffs[FILTER_MAX_TAPS];
+            q31_t state[FILTER_MAX_TAPS + FILTER_BLOCK_SIZE - 1];
+#else
+            int32_t history[FILTER_MAX_TAPS];
+            int64_t sum;
+            uint8_t next;
+#endif
+        };
+
+        struct MedianState
+        {
+            int32_t window[FILTER_MAX_MEDIAN];
+            uint8_t next;
+            uint8_t count;
+        };
+
+        struct LowpassState
+        {
+#if defined(REMOTO_CMSIS_DSP)
+            arm_biquad_casd_df1_inst_q31 biquad;
+            q31_t coeffs[5];
+            q31_t state[4];
+#else
+            int32_t alpha;
+            int32_t y;
+#endif
+        };
+
+        struct DecimateState
+        {
+            uint16_t phase;
+        };
+
+        struct Stage
+        {
+            FilterKind kind;
+            uint16_t length;
+            union
+            {
+                AverageState average;
+                MedianState median;
+                LowpassState lowpass;
+                DecimateState decimate;
+            };
+        };
+
+        Stage _stages[FILTER_MAX_STAGES];
+        int _numStages;
+        int _decimation;
+        bool _primed; // states hold the first sample
+
+        void prime(int32_t sample);
+        int runAverage(Stage &stage, const int32_t *in, int32_t *out, int count);
+        int runMedian(Stage &stage, const int32_t *in, int32_t *out, int count);
+        int runLowpass(Stage &stage, const int32_t *in, int32_t *out, int count);
+        int runDecimate(Stage &stage, const int32_t *in, int32_t *out, int count);
+
+    public:
+        FilterChain();
+
+        int configure(const ChannelFilter &settings);
+        int decimation() const { return _decimation; }
+        bool empty() const { return _numStages == 0; }
+
+        // Filter a block of raw counts, false when no sample came out
+        bool process(const uint16_t *samples, int count, uint16_t &value);
+    };
+
+    // Chains of the inputs, called by the channel registry on each scan
+    class FilterBank : public InputFilter
+    {
+    private:
+        FilterChain _chains[FILTER_MAX_CHANNELS];
+        int8_t _slots[MAX_INPUTS]; // chain of each input, -1 for none
+        int _used;
+
+    public:
+        FilterBank();
+
+        // An empty chain removes the filter. Returns -1 when the settings
+        // are invalid or every chain is taken.
+        int setChain(int index, const ChannelFilter &settings);
+        void clear();
+
+        int samplesPerScan(int index) const override;
+        bool filter(int index, const uint16_t *samples, int count, uint16_t &value) override;
+    };
+
+    // "average", "median", "lowpass" or "decimate", NONE if unknown
+    FilterKind filterKindFromName(const char *name);
+    const char *filterKindName(FilterKind kind);
+} // namespace remoto
+
+#endif // FILTER_H
@@ -0,0 +1,243 @@
+/*
+ * Remoto: Publish bandwidth governor for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Token buckets and publish admission. See governor.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "governor.h"
+#include "kvstore_global_api.h"
+
+namespace remoto
+{
+    constexpr uint32_t BUDGET_MAGIC = 0x42554447; // "BUDG"
+
+    // Day buckets kept in flash across resets
+    struct PersistedBudget
+    {
+        uint32_t magic;
+        uint32_t capacity[2]; // budgets the levels were charged against
+        uint32_t available[2];
+    };
+
+    TokenBucket::TokenBucket()
+        : _level(0), _size(0), _capacity(0), _windowMs(1)
+    {
+    }
+
+    void TokenBucket::configure(uint32_t capacity, uint32_t windowMs)
+    {
+        _capacity = capacity;
+        _windowMs = windowMs;
+        _size = (uint64_t)capacity * windowMs;
+        _level = _size;
+    }
+
+    void TokenBucket::refill(uint32_t elapsedMs)
+    {
+        uint64_t gained = (uint64_t)elapsedMs * _capacity;
+        _level = _size - _level > gained ? _level + gained : _size;
+    }
+
+    bool TokenBucket::allows(uint32_t tokens, uint8_t reservePercent) const
+    {
+        if (unlimited())
+        {
+            return true;
+        }
+        uint64_t reserve = _size / 100 * reservePercent;
+        return _level >= (uint64_t)tokens * _windowMs + reserve;
+    }
+
+    void TokenBucket::take(uint32_t tokens)
+    {
+        uint64_t cost = (uint64_t)tokens * _windowMs;
+        _level = _level > cost ? _level - cost : 0;
+    }
+
+    uint32_t TokenBucket::available() const
+    {
+        return _level / _windowMs;
+    }
+
+    void TokenBucket::setAvailable(uint32_t tokens)
+    {
+        uint64_t level = (uint64_t)tokens * _windowMs;
+        _level = level < _size ? level : _size;
+    }
+
+    uint32_t TokenBucket::refillMs(uint32_t tokens) const
+    {
+        if (unlimited())
+        {
+            return 0;
+        }
+        uint64_t ms = ((uint64_t)tokens * _windowMs + _capacity - 1) / _capacity;
+        return ms > UINT32_MAX ? UINT32_MAX : ms;
+    }
+
+    PublishGovernor::PublishGovernor()
+        : _lastRefill(0), _sentBytes(0), _sentMessages(0)
+    {
+        for (int i = 0; i < NUM_PUBLISH_PRIORITIES; ++i)
+        {
+            _denied[i] = 0;
+        }
+        _saved[0] = 0;
+        _saved[1] = 0;
+    }
+
+    void PublishGovernor::begin(const PublishBudget &budget)
+    {
+        _mutex.lock();
+        _buckets[HOUR_BYTES].configure(budget.hourBytes, GOVERNOR_HOUR_MS);
+        _buckets[HOUR_MESSAGES].configure(budget.hourMessages, GOVERNOR_HOUR_MS);
+        _buckets[DAY_BYTES].configure(budget.dayBytes, GOVERNOR_DAY_MS);
+        _buckets[DAY_MESSAGES].configure(budget.dayMessages, GOVERNOR_DAY_MS);
+        restore();
+        persist(true);
+        _lastRefill = millis();
+        _mutex.unlock();
+    }
+
+    void PublishGovernor::restore()
+    {
+        PersistedBudget stored;
+        size_t actual = 0;
+        if (kv_get("budget", &stored, sizeof(stored), &actual) != MBED_SUCCESS || actual != sizeof(stored) ||
+            stored.magic != BUDGET_MAGIC)
+        {
+            return;
+        }
+        // A changed budget starts full
+        for (int d = 0; d < 2; ++d)
+        {
+            TokenBucket &bucket = _buckets[DAY_BYTES + d];
+            if (!bucket.unlimited() && stored.capacity[d] == bucket.capacity())
+            {
+                bucket.setAvailable(stored.available[d]);
+            }
+        }
+    }
+
+    void PublishGovernor::persist(bool force)
+    {
+        if (_buckets[DAY_BYTES].unlimited() && _buckets[DAY_MESSAGES].unlimited())
+        {
+            return;
+        }
+        PersistedBudget stored;
+        stored.magic = BUDGET_MAGIC;
+        bool due = force;
+        for (int d = 0; d < 2; ++d)
+        {
+            const TokenBucket &bucket = _buckets[DAY_BYTES + d];
+            uint32_t step = bucket.capacity() / GOVERNOR_SAVE_STEPS;
+            step = step > 0 ? step : 1;
+            uint32_t available = bucket.available();
+            stored.capacity[d] = bucket.capacity();
+            stored.available[d] = available > step ? available - step : 0;
+            if (!bucket.unlimited() && (available <= _saved[d] || available - _saved[d] >= 2 * step))
+            {
+                due = true;
+            }
+        }
+        if (due && kv_set("budget", &stored, sizeof(stored), 0) == MBED_SUCCESS)
+        {
+            _saved[0] = stored.available[0];
+            _saved[1] = stored.available[1];
+        }
+    }
+
+    void PublishGovernor::refill()
+    {
+        uint32_t now = millis();
+        uint32_t elapsed = now - _lastRefill;
+        _lastRefill = now;
+        for (int i = 0; i < NUM_BUCKETS; ++i)
+        {
+            _buckets[i].refill(elapsed);
+        }
+    }
+
+    bool PublishGovernor::admit(PublishPriority priority, uint32_t messages, uint32_t bytes)
+    {
+        uint8_t reserve = priority == PUBLISH_CONTROL ? 0 : GOVERNOR_RESERVE_PERCENT;
+        _mutex.lock();
+        refill();
+        bool allowed = _buckets[HOUR_BYTES].allows(bytes, reserve) &&
+                       _buckets[HOUR_MESSAGES].allows(messages, reserve) &&
+                       _buckets[DAY_BYTES].allows(bytes, reserve) &&
+                       _buckets[DAY_MESSAGES].allows(messages, reserve);
+        if (allowed)
+        {
+            _buckets[HOUR_BYTES].take(bytes);
+            _buckets[HOUR_MESSAGES].take(messages);
+            _buckets[DAY_BYTES].take(bytes);
+            _buckets[DAY_MESSAGES].take(messages);
+            _sentBytes += bytes;
+            _sentMessages += messages;
+            persist(false);
+        }
+        else
+        {
+            _denied[priority] += messages;
+        }
+        _mutex.unlock();
+        return allowed;
+    }
+
+    uint32_t PublishGovernor::sustainableMs(uint32_t messages, uint32_t bytes) const
+    {
+        uint32_t periods[NUM_BUCKETS];
+        _mutex.lock();
+        periods[HOUR_BYTES] = _buckets[HOUR_BYTES].refillMs(bytes);
+        periods[HOUR_MESSAGES] = _buckets[HOUR_MESSAGES].refillMs(messages);
+        periods[DAY_BYTES] = _buckets[DAY_BYTES].refillMs(bytes);
+        periods[DAY_MESSAGES] = _buckets[DAY_MESSAGES].refillMs(messages);
+        _mutex.unlock();
+        uint32_t longest = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i)
+        {
+            longest = periods[i] > longest ? periods[i] : longest;
+        }
+        // Control messages keep their reserve in the steady state too
+        uint64_t stretched = (uint64_t)longest * 100 / (100 - GOVERNOR_RESERVE_PERCENT);
+        return stretched > UINT32_MAX ? UINT32_MAX : stretched;
+    }
+
+    uint32_t PublishGovernor::packetSize(const char *topic, size_t length, uint8_t qos)
+    {
+        // Topic length, topic, packet identifier and payload
+        uint32_t remaining = 2 + strlen(topic) + (qos > 0 ? 2 : 0) + length;
+        uint32_t header = 2;
+        for (uint32_t limit = 128; remaining >= limit && header < 5; limit <<= 7)
+        {
+            header++;
+        }
+        return header + remaining;
+    }
+
+    void PublishGovernor::toJson(JsonObject usage)
+    {
+        static const char *const NAMES[NUM_BUCKETS] = {"hourBytesLeft", "hourMessagesLeft", "dayBytesLeft", "dayMessagesLeft"};
+        _mutex.lock();
+        refill();
+        usage["sentBytes"] = _sentBytes;
+        usage["sentMessages"] = _sentMessages;
+        // Unlimited budgets are left out
+        for (int i = 0; i < NUM_BUCKETS; ++i)
+        {
+            if (!_buckets[i].unlimited())
+            {
+                usage[NAMES[i]] = _buckets[i].available();
+            }
+        }
+        usage["deniedControl"] = _denied[PUBLISH_CONTROL];
+        usage["deniedPeriodic"] = _denied[PUBLISH_PERIODIC];
+        _mutex.unlock();
+    }
+} // namespace remoto
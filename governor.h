@@ -0,0 +1,132 @@
+/*
+ * Remoto: Publish bandwidth governor for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Every MQTT publish is charged to token buckets holding the byte and
+ * message budgets of an hour and of a day. A bucket starts full and
+ * refills continuously at its budget over the window, so bursts up to
+ * the budget are allowed but the long run average never exceeds it.
+ *
+ * The day buckets survive resets: their levels are kept in KVStore,
+ * written one GOVERNOR_SAVE_STEPS-th of the budget ahead of what was
+ * spent, so a device that resets before its next write has already
+ * paid for what it sent. Each boot charges one step, the time spent
+ * off is not refilled.
+ *
+ * Control messages (output acknowledgements, stall reports) may use
+ * the whole budget. Periodic telemetry has to leave
+ * GOVERNOR_RESERVE_PERCENT of every bucket to them, and the telemetry
+ * period is stretched to the interval the budget can sustain.
+ *
+ * Bytes are MQTT packet sizes, the TCP and TLS overhead is not counted.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(GOVERNOR_H)
+#define GOVERNOR_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "mbed.h"
+
+// Share of each bucket periodic messages cannot take
+#define GOVERNOR_RESERVE_PERCENT 20
+#define GOVERNOR_HOUR_MS 3600000UL
+#define GOVERNOR_DAY_MS 86400000UL
+// Day budget charged ahead per write of the levels to flash
+#define GOVERNOR_SAVE_STEPS 32
+
+namespace remoto
+{
+    enum PublishPriority : uint8_t
+    {
+        PUBLISH_CONTROL = 0,
+        PUBLISH_PERIODIC,
+        NUM_PUBLISH_PRIORITIES
+    };
+
+    // Budgets of the rolling hour and day, 0 is unlimited
+    struct PublishBudget
+    {
+        uint32_t hourBytes;
+        uint32_t hourMessages;
+        uint32_t dayBytes;
+        uint32_t dayMessages;
+    };
+
+    class TokenBucket
+    {
+    private:
+        // Tokens are kept multiplied by the window, so a refill of
+        // capacity per millisecond is exact in integers
+        uint64_t _level;
+        uint64_t _size;
+        uint32_t _capacity; // 0 when unlimited
+        uint32_t _windowMs;
+
+    public:
+        TokenBucket();
+
+        // Set the budget of a window, the bucket starts full
+        void configure(uint32_t capacity, uint32_t windowMs);
+        void refill(uint32_t elapsedMs);
+        // Whether tokens can be taken leaving reservePercent of the bucket
+        bool allows(uint32_t tokens, uint8_t reservePercent) const;
+        void take(uint32_t tokens);
+
+        bool unlimited() const { return _capacity == 0; }
+        uint32_t capacity() const { return _capacity; }
+        uint32_t available() const;
+        // Level restored after a reset, at most the budget
+        void setAvailable(uint32_t tokens);
+        // Time to earn tokens back at the budget rate
+        uint32_t refillMs(uint32_t tokens) const;
+    };
+
+    class PublishGovernor
+    {
+    private:
+        enum Bucket : uint8_t
+        {
+            HOUR_BYTES = 0,
+            HOUR_MESSAGES,
+            DAY_BYTES,
+            DAY_MESSAGES,
+            NUM_BUCKETS
+        };
+
+        TokenBucket _buckets[NUM_BUCKETS];
+        uint32_t _lastRefill;
+        uint32_t _sentBytes;
+        uint32_t _sentMessages;
+        uint32_t _denied[NUM_PUBLISH_PRIORITIES];
+        // Day levels in flash, one step below the real ones when written
+        uint32_t _saved[2];
+        mutable rtos::Mutex _mutex;
+
+        void refill();
+        void restore();
+        // Write the day levels once a step was spent or earned back
+        void persist(bool force);
+
+    public:
+        PublishGovernor();
+
+        // Set the budgets, restoring the day levels of the last boot
+        void begin(const PublishBudget &budget);
+
+        // Charge a batch of messages if the budget allows it at this
+        // priority. A batch is admitted or denied as a whole.
+        bool admit(PublishPriority priority, uint32_t messages, uint32_t bytes);
+        // Shortest period a batch of this size can be repeated at forever
+        uint32_t sustainableMs(uint32_t messages, uint32_t bytes) const;
+
+        // Size on the wire of a PUBLISH packet
+        static uint32_t packetSize(const char *topic, size_t length, uint8_t qos = 0);
+
+        void toJson(JsonObject usage);
+    };
+} // namespace remoto
+
+#endif // GOVERNOR_H
@@ -0,0 +1,262 @@
+/*
+ * Remoto: HTTP request helpers for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Header parsing and response writing. See http.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "http.h"
+#include <ctype.h>
+
+namespace remoto
+{
+    int readLine(Client &client, char *buffer, size_t length, uint32_t timeoutMs)
+    {
+        size_t used = 0;
+        uint32_t lastData = millis();
+        while (true)
+        {
+            if (!client.available())
+            {
+                if (!client.connected() || millis() - lastData > timeoutMs)
+                {
+                    return -1;
+                }
+                yield();
+                continue;
+            }
+            int c = client.read();
+            lastData = millis();
+            if (c == '\n')
+            {
+                if (used > 0 && buffer[used - 1] == '\r')
+                {
+                    used--;
+                }
+                buffer[used] = '\0';
+                return used;
+            }
+            if (used + 1 >= length)
+            {
+                return -1;
+            }
+            buffer[used++] = c;
+        }
+    }
+
+    size_t readExact(Client &client, uint8_t *buffer, size_t length, uint32_t timeoutMs)
+    {
+        size_t used = 0;
+        uint32_t lastData = millis();
+        while (used < length)
+        {
+            int available = client.available();
+            if (available <= 0)
+            {
+                if (!client.connected() || millis() - lastData > timeoutMs)
+                {
+                    break;
+                }
+                yield();
+                continue;
+            }
+            size_t wanted = length - used;
+            if ((size_t)available < wanted)
+            {
+                wanted = available;
+            }
+            int n = client.read(buffer + used, wanted);
+            if (n > 0)
+            {
+                used += n;
+                lastData = millis();
+            }
+        }
+        return used;
+    }
+
+    // Case insensitive match of a header name, returns the value or nullptr
+    static const char *headerValue(const char *line, const char *name)
+    {
+        size_t length = strlen(name);
+        if (strncasecmp(line, name, length) != 0 || line[length] != ':')
+        {
+            return nullptr;
+        }
+        const char *value = line + length + 1;
+        while (*value == ' ' || *value == '\t')
+        {
+            value++;
+        }
+        return value;
+    }
+
+    int readRequestHeaders(Client &client, HttpRequestHeaders &headers, uint32_t timeoutMs)
+    {
+        headers.contentLength = -1;
+        headers.chunked = false;
+        headers.sha256[0] = '\0';
+
+        char line[HTTP_LINE_MAX];
+        // The request line was consumed up to its '\r' by the caller,
+        // what is left of it reads as an empty line
+        int length = readLine(client, line, sizeof(line), timeoutMs);
+        if (length == 0)
+        {
+            length = readLine(client, line, sizeof(line), timeoutMs);
+        }
+        for (; length > 0; length = readLine(client, line, sizeof(line), timeoutMs))
+        {
+            const char *value;
+            if ((value = headerValue(line, "Content-Length")) != nullptr)
+            {
+                headers.contentLength = strtol(value, nullptr, 10);
+            }
+            else if ((value = headerValue(line, "Transfer-Encoding")) != nullptr)
+            {
+                headers.chunked = strncasecmp(value, "chunked", 7) == 0;
+            }
+            else if ((value = headerValue(line, "X-Firmware-SHA256")) != nullptr)
+            {
+                strncpy(headers.sha256, value, sizeof(headers.sha256) - 1);
+                headers.sha256[sizeof(headers.sha256) - 1] = '\0';
+            }
+        }
+        // A blank line ends the headers, anything else is an error
+        return length == 0 ? 0 : -1;
+    }
+
+    // Chunked transfer coding, RFC 9112 section 7.1
+    static int readChunkedBody(Client &client, char *buffer, size_t capacity, uint32_t timeoutMs)
+    {
+        char line[HTTP_LINE_MAX];
+        size_t used = 0;
+        while (true)
+        {
+            if (readLine(client, line, sizeof(line), timeoutMs) < 0)
+            {
+                return -408;
+            }
+            // Chunk extensions after ';' are ignored
+            char *end;
+            unsigned long size = strtoul(line, &end, 16);
+            if (end == line)
+            {
+                return -400;
+            }
+            if (size == 0)
+            {
+                break;
+            }
+            if (size >= capacity - used)
+            {
+                return -413;
+            }
+            if (readExact(client, (uint8_t *)buffer + used, size, timeoutMs) != size)
+            {
+                return -408;
+            }
+            used += size;
+            // CRLF closing the chunk data
+            if (readLine(client, line, sizeof(line), timeoutMs) != 0)
+            {
+                return -400;
+            }
+        }
+        // Skip the trailer section up to the final blank line
+        int length;
+        while ((length = readLine(client, line, sizeof(line), timeoutMs)) > 0)
+        {
+        }
+        if (length < 0)
+        {
+            return -408;
+        }
+        buffer[used] = '\0';
+        return used;
+    }
+
+    int readRequestBody(Client &client, const HttpRequestHeaders &headers, char *buffer, size_t capacity, uint32_t timeoutMs)
+    {
+        if (headers.chunked)
+        {
+            return readChunkedBody(client, buffer, capacity, timeoutMs);
+        }
+        if (headers.contentLength < 0)
+        {
+            return -411;
+        }
+        // Keep room for the terminator
+        if ((size_t)headers.contentLength >= capacity)
+        {
+            return -413;
+        }
+        size_t length = headers.contentLength;
+        if (readExact(client, (uint8_t *)buffer, length, timeoutMs) != length)
+        {
+            return -408;
+        }
+        buffer[length] = '\0';
+        return length;
+    }
+
+    static const char *statusText(int status)
+    {
+        switch (status)
+        {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 408:
+            return "Request Timeout";
+        case 404:
+            return "Not Found";
+        case 411:
+            return "Length Required";
+        case 413:
+            return "Payload Too Large";
+        case 422:
+            return "Unprocessable Entity";
+        case 429:
+            return "Too Many Requests";
+        case 500:
+            return "Internal Server Error";
+        case 503:
+            return "Service Unavailable";
+        case 507:
+            return "Insufficient Storage";
+        default:
+            return "";
+        }
+    }
+
+    void sendHttpResponse(Client &client, int status, const char *contentType, const char *body)
+    {
+        client.print("HTTP/1.1 ");
+        client.print(status);
+        client.print(" ");
+        client.println(statusText(status));
+        client.print("Content-Type: ");
+        client.println(contentType);
+        client.println("Connection: close");
+        client.println();
+        client.println(body);
+        client.stop();
+    }
+
+    void sendRetryLater(Client &client, uint32_t retryAfterS)
+    {
+        client.println("HTTP/1.1 429 Too Many Requests");
+        client.print("Retry-After: ");
+        client.println(retryAfterS);
+        client.println("Content-Type: application/json");
+        client.println("Connection: close");
+        client.println();
+        client.println("{\"status\":\"error\",\"message\":\"Too many requests\"}");
+        client.stop();
+    }
+} // namespace remoto
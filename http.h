@@ -0,0 +1,52 @@
+/*
+ * Remoto: HTTP request helpers for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Small helpers shared by the WiFi and Ethernet web servers to read
+ * request headers and bodies with fixed buffers and timeouts, and to
+ * write responses. They work on any arduino::Client.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(HTTP_H)
+#define HTTP_H
+#include <Arduino.h>
+
+#define HTTP_LINE_MAX 256
+#define HTTP_TIMEOUT_MS 5000
+
+namespace remoto
+{
+    struct HttpRequestHeaders
+    {
+        long contentLength; // -1 when not given
+        bool chunked;       // Transfer-Encoding: chunked
+        char sha256[65];    // X-Firmware-SHA256, hex
+    };
+
+    // Read one CRLF terminated line, without the terminator. Returns the
+    // line length or -1 on timeout or overlong line.
+    int readLine(Client &client, char *buffer, size_t length, uint32_t timeoutMs);
+
+    // Read exactly length bytes unless the peer goes quiet for timeoutMs.
+    // Returns the number of bytes read.
+    size_t readExact(Client &client, uint8_t *buffer, size_t length, uint32_t timeoutMs);
+
+    // Consume the headers that follow the request line
+    int readRequestHeaders(Client &client, HttpRequestHeaders &headers, uint32_t timeoutMs);
+
+    // Read the body announced by the headers, Content-Length or chunked,
+    // into a fixed buffer and NUL terminate it. Returns the body length,
+    // or the HTTP status to answer with, negated, when the body is
+    // missing (411), too large (413), malformed (400) or late (408).
+    int readRequestBody(Client &client, const HttpRequestHeaders &headers, char *buffer, size_t capacity, uint32_t timeoutMs);
+
+    // Write a complete response and close the connection
+    void sendHttpResponse(Client &client, int status, const char *contentType, const char *body);
+    // 429 with the number of seconds to wait before the next request
+    void sendRetryLater(Client &client, uint32_t retryAfterS);
+} // namespace remoto
+
+#endif // HTTP_H
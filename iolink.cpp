@@ -0,0 +1,303 @@
+/*
+ * Remoto: I/O core link for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Both ends of the link between the cores and their RPC start-up. See
+ * iolink.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "iolink.h"
+#if defined(CORE_CM4) || defined(CORE_CM7)
+#include <RPC.h>
+#endif
+
+namespace remoto
+{
+    //------------------------- M4 SIDE -------------------------
+    IoCoreServer::IoCoreServer(Channels &channels, FilterBank &filters, ExpansionBus &bus, IoShared &shared)
+        : _channels(channels), _filters(filters), _bus(bus), _shared(shared), _image{}, _nextScanMs(0),
+          _running(false)
+    {
+        _shared.numModules = 0;
+        _shared.images.reset();
+        _shared.commands.reset();
+        _shared.version = IOLINK_VERSION;
+        _shared.magic = IOLINK_MAGIC;
+    }
+
+#if defined(CORE_CM4)
+    static IoCoreServer *server = nullptr;
+
+    static int ioBegin()
+    {
+        return server->begin();
+    }
+
+    static int ioConfigure()
+    {
+        return server->configure();
+    }
+
+    int IoCoreServer::boot()
+    {
+        server = this;
+        if (RPC.begin() == 0)
+        {
+            return -1;
+        }
+        RPC.bind("ioBegin", ioBegin);
+        RPC.bind("ioConfigure", ioConfigure);
+        // The M7 bound ioReady before booting this core
+        RPC.call("ioReady", (uint32_t)(uintptr_t)&_shared);
+        return 0;
+    }
+#else
+    int IoCoreServer::boot()
+    {
+        return -1;
+    }
+#endif
+
+    int IoCoreServer::begin()
+    {
+        _running = false;
+        int count = _channels.begin(_bus);
+        for (int m = 0; m < count; ++m)
+        {
+            _shared.modules[m] = _channels.getModule(m);
+        }
+        _shared.numModules = count;
+        return count;
+    }
+
+    int IoCoreServer::configure()
+    {
+        _running = false;
+        int result = 0;
+        int first = 0;
+        for (int m = 0; m < _shared.numModules; ++m)
+        {
+            for (int c = 0; c < _shared.modules[m].inputs; ++c)
+            {
+                _channels.setInputAnalog(first + c, (_shared.analogMasks[m] >> c) & 1);
+            }
+            first += _shared.modules[m].inputs;
+        }
+        // Only the analog inputs are filtered
+        _filters.clear();
+        for (int i = 0; i < _channels.inputCount(); ++i)
+        {
+            const ChannelFilter &chain = _shared.filters[i];
+            if (_channels.isInputAnalog(i) && chain.stageCount() > 0 && _filters.setChain(i, chain) != 0)
+            {
+                result = -1;
+            }
+        }
+        _channels.setFilter(&_filters);
+        _channels.configure();
+        _nextScanMs = millis();
+        _running = true;
+        return result;
+    }
+
+    void IoCoreServer::poll()
+    {
+        if (!_running)
+        {
+            return;
+        }
+        applyCommands();
+        // Scans keep their period when one runs late
+        if ((int32_t)(millis() - _nextScanMs) >= 0)
+        {
+            _nextScanMs += IO_SCAN_INTERVAL_MS;
+            scan();
+        }
+    }
+
+    int IoCoreServer::applyCommands()
+    {
+        int applied = 0;
+        IoCommand command;
+        while (_shared.commands.pop(command))
+        {
+            _channels.setOutput(command.output, command.value);
+            applied++;
+        }
+        return applied;
+    }
+
+    void IoCoreServer::scan()
+    {
+        _channels.scan();
+        _image.sequence++;
+        _image.failedModules = _channels.getFailedModules();
+        _image.scanMicros = _channels.getScanMicros();
+        for (int i = 0; i < _channels.inputCount(); ++i)
+        {
+            _image.raw[i] = _channels.readRawInput(i);
+            _image.values[i] = _channels.readInput(i);
+        }
+        // An M7 that fell behind finds the newest images
+        _shared.images.push(_image);
+    }
+
+    //------------------------- M7 SIDE -------------------------
+    IoCoreLink::IoCoreLink()
+        : _shared(nullptr), _image{}, _lastImageMs(0), _images(0), _skipped(0), _rejected(0)
+    {
+    }
+
+#if defined(CORE_CM7)
+    static volatile uint32_t sharedAddress = 0;
+
+    // Called by the M4 once it is up, on the RPC thread
+    static void ioReady(uint32_t address)
+    {
+        sharedAddress = address;
+    }
+
+    int IoCoreLink::boot()
+    {
+        RPC.bind("ioReady", ioReady);
+        if (RPC.begin() == 0)
+        {
+            return -1;
+        }
+        uint32_t start = millis();
+        while (sharedAddress == 0 && millis() - start < IOLINK_BOOT_MS)
+        {
+            delay(10);
+        }
+        uint32_t address = sharedAddress;
+        // The M4 sees its SRAM at 0x10000000, the M7 at 0x30000000
+        if ((address & 0xFFF00000UL) == 0x10000000UL)
+        {
+            address += 0x20000000UL;
+        }
+        if (address == 0 || (address & (IOLINK_SHARED_SIZE - 1)) != 0)
+        {
+            return -1;
+        }
+        // Uncached on this core, the M4 has no data cache
+        core_util_critical_section_enter();
+        uint32_t control = MPU->CTRL;
+        ARM_MPU_Disable();
+        ARM_MPU_SetRegion(ARM_MPU_RBAR(IOLINK_MPU_REGION, address),
+                          ARM_MPU_RASR(1, ARM_MPU_AP_FULL, 1, 1, 0, 0, 0, ARM_MPU_REGION_SIZE_4KB));
+        ARM_MPU_Enable(control | MPU_CTRL_PRIVDEFENA_Msk);
+        SCB_InvalidateDCache_by_Addr((uint32_t *)address, IOLINK_SHARED_SIZE);
+        core_util_critical_section_exit();
+
+        IoShared *shared = (IoShared *)address;
+        if (shared->magic != IOLINK_MAGIC || shared->version != IOLINK_VERSION)
+        {
+            return -1;
+        }
+        if (RPC.call("ioBegin").as<int>() <= 0)
+        {
+            return -1;
+        }
+        attach(*shared);
+        return 0;
+    }
+#else
+    int IoCoreLink::boot()
+    {
+        return -1;
+    }
+#endif
+
+    void IoCoreLink::attach(IoShared &shared)
+    {
+        _shared = &shared;
+        _lastImageMs = millis();
+        for (int i = 0; i < MAX_INPUTS; ++i)
+        {
+            _shared->filters[i].clear();
+        }
+    }
+
+    int IoCoreLink::setChain(int index, const ChannelFilter &settings)
+    {
+        if (_shared == nullptr || index < 0 || index >= MAX_INPUTS || !settings.isValid())
+        {
+            return -1;
+        }
+        _shared->filters[index] = settings;
+        return 0;
+    }
+
+    int IoCoreLink::discover(ModuleInfo *modules, int capacity)
+    {
+        if (_shared == nullptr)
+        {
+            return 0;
+        }
+        int count = _shared->numModules < capacity ? _shared->numModules : capacity;
+        for (int m = 0; m < count; ++m)
+        {
+            modules[m] = _shared->modules[m];
+        }
+        return count;
+    }
+
+    int IoCoreLink::configure(const uint32_t *analogMasks, int modules)
+    {
+        if (_shared == nullptr || modules > MAX_MODULES)
+        {
+            return -1;
+        }
+        memcpy(_shared->analogMasks, analogMasks, modules * sizeof(uint32_t));
+        _lastImageMs = millis();
+#if defined(CORE_CM7)
+        return RPC.call("ioConfigure").as<int>();
+#else
+        return 0;
+#endif
+    }
+
+    int IoCoreLink::readImage(uint16_t *raw, uint16_t *values, int count, uint32_t &failedModules,
+                              uint32_t &scanMicros)
+    {
+        if (_shared == nullptr)
+        {
+            return -1;
+        }
+        uint32_t skipped = 0;
+        if (!_shared->images.popLatest(_image, skipped))
+        {
+            return millis() - _lastImageMs > IOLINK_STALE_MS ? -1 : 1;
+        }
+        _lastImageMs = millis();
+        _images++;
+        _skipped += skipped;
+        count = count < MAX_INPUTS ? count : MAX_INPUTS;
+        memcpy(raw, _image.raw, count * sizeof(uint16_t));
+        memcpy(values, _image.values, count * sizeof(uint16_t));
+        failedModules = _image.failedModules;
+        scanMicros = _image.scanMicros;
+        return 0;
+    }
+
+    int IoCoreLink::writeOutput(int index, uint8_t value)
+    {
+        if (_shared == nullptr || !_shared->commands.push({(uint16_t)index, value, 0}))
+        {
+            _rejected++;
+            return -1;
+        }
+        return 0;
+    }
+
+    void IoCoreLink::toJson(JsonObject status) const
+    {
+        status["images"] = _images;
+        status["skipped"] = _skipped;
+        status["rejected"] = _rejected;
+        status["pending"] = _shared != nullptr ? _shared->commands.pending() : 0;
+    }
+} // namespace remoto
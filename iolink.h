@@ -0,0 +1,310 @@
+/*
+ * Remoto: I/O core link for Arduino OPTA
+ * -------------------------------------------------------------------
+ * With REMOTO_IO_CORE the input scan, the input filters and the output
+ * writes run on the Cortex-M4 core of the STM32H747, so their timing
+ * does not depend on the network stacks, the JSON work and the blocking
+ * connects of the M7. The same sketch is built for both cores: the M4
+ * build only runs an IoCoreServer, the M7 build mirrors it through an
+ * IoCoreLink in its channel registry.
+ *
+ * The cores share one block in the SRAM of the M4, mapped uncached on
+ * the M7. RPC only starts the link:
+ *
+ *   M7: RPC.begin() boots the M4
+ *   M4: ioReady(address of the block)           M4 -> M7
+ *   M7: ioBegin()     M4 finds the modules, their layout goes in the block
+ *   M7: ioConfigure() M4 applies the input modes and filter chains the M7
+ *                     wrote in the block, and starts scanning
+ *
+ * From then on data only moves through two lock-free single producer,
+ * single consumer rings in the block: every IO_SCAN_INTERVAL_MS the M4
+ * publishes an image of the inputs, raw and filtered, overwriting the
+ * oldest one, and the M7 takes the latest one on its own scan; output
+ * writes go the other way, one command each, and the M4 applies them
+ * within a millisecond. Each ring counter is written by one side only,
+ * with release and acquire order, as the cores share no exclusive
+ * access on this memory.
+ *
+ * An M7 that gets no answer from the M4 at boot scans on its own. One
+ * that stops receiving images reports every module as failed.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(IOLINK_H)
+#define IOLINK_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+#include <type_traits>
+#include "channels.h"
+#include "filter.h"
+
+// #define REMOTO_IO_CORE
+
+#define IOLINK_MAGIC 0x4B4C4F49UL // "IOLK"
+#define IOLINK_VERSION 2
+// Images kept for the M7, which only reads the latest
+#define IOLINK_IMAGE_SLOTS 4
+// Output writes queued to the M4
+#define IOLINK_COMMAND_SLOTS 32
+// Shared block, a power of two for its MPU region
+#define IOLINK_SHARED_SIZE 4096
+// The highest priority region, above the ones of the mbed core
+#define IOLINK_MPU_REGION 15
+// Wait for the M4 after booting it
+#define IOLINK_BOOT_MS 3000
+// No image for this long and the M7 counts the M4 as lost
+#define IOLINK_STALE_MS 200
+// Counters of the rings on cache lines of their own
+#define IOLINK_LINE 32
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the ring counters must be lock-free");
+
+namespace remoto
+{
+    // Single producer, single consumer ring of N slots. The counters run
+    // free, the next slot is written % N.
+    template <typename T, int N>
+    class SpscRing
+    {
+        static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+    private:
+        alignas(IOLINK_LINE) std::atomic<uint32_t> _written; // by the producer only
+        alignas(IOLINK_LINE) std::atomic<uint32_t> _read;    // by the consumer only
+        alignas(IOLINK_LINE) T _slots[N];
+
+    public:
+        // Before either side uses it
+        void reset()
+        {
+            _written.store(0, std::memory_order_relaxed);
+            _read.store(0, std::memory_order_relaxed);
+        }
+
+        // Producer side, false when the ring is full
+        bool push(const T &item)
+        {
+            uint32_t written = _written.load(std::memory_order_relaxed);
+            if (written - _read.load(std::memory_order_acquire) >= (uint32_t)N)
+            {
+                return false;
+            }
+            _slots[written % N] = item;
+            _written.store(written + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side, false when the ring is empty
+        bool pop(T &item)
+        {
+            uint32_t read = _read.load(std::memory_order_relaxed);
+            if (_written.load(std::memory_order_acquire) == read)
+            {
+                return false;
+            }
+            item = _slots[read % N];
+            _read.store(read + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side, the newest item. The older ones are dropped and
+        // counted in skipped.
+        bool popLatest(T &item, uint32_t &skipped)
+        {
+            uint32_t read = _read.load(std::memory_order_relaxed);
+            uint32_t written = _written.load(std::memory_order_acquire);
+            if (written == read)
+            {
+                return false;
+            }
+            // The producer does not reuse a slot before _read passes it
+            item = _slots[(written - 1) % N];
+            skipped = written - read - 1;
+            _read.store(written, std::memory_order_release);
+            return true;
+        }
+
+        // Either side, exact on the consumer side
+        uint32_t pending() const
+        {
+            return _written.load(std::memory_order_acquire) - _read.load(std::memory_order_acquire);
+        }
+    };
+
+    // Single producer, single consumer ring of N slots that never
+    // refuses an item: the producer overwrites the oldest, the consumer
+    // takes the newest. Slots are copied a word at a time, and the
+    // consumer copies again when the producer started on the slot while
+    // it was reading it.
+    template <typename T, int N>
+    class OverwriteRing
+    {
+        static_assert((N & (N - 1)) == 0 && N >= 2, "ring size must be a power of two");
+        static_assert(sizeof(T) % 4 == 0 && std::is_trivially_copyable<T>::value, "items are copied in words");
+        static constexpr int WORDS = sizeof(T) / 4;
+
+    private:
+        alignas(IOLINK_LINE) std::atomic<uint32_t> _started; // by the producer only
+        std::atomic<uint32_t> _written;                      // by the producer only
+        alignas(IOLINK_LINE) uint32_t _read;                 // by the consumer only
+        alignas(IOLINK_LINE) std::atomic<uint32_t> _slots[N][WORDS];
+
+    public:
+        // Before either side uses it
+        void reset()
+        {
+            _started.store(0, std::memory_order_relaxed);
+            _written.store(0, std::memory_order_relaxed);
+            _read = 0;
+        }
+
+        // Producer side
+        void push(const T &item)
+        {
+            uint32_t written = _written.load(std::memory_order_relaxed);
+            _started.store(written + 1, std::memory_order_relaxed);
+            // The slot is claimed before any of its words change
+            std::atomic_thread_fence(std::memory_order_release);
+            std::atomic<uint32_t> *slot = _slots[written % N];
+            for (int w = 0; w < WORDS; ++w)
+            {
+                uint32_t word;
+                memcpy(&word, (const uint8_t *)&item + w * 4, 4);
+                slot[w].store(word, std::memory_order_relaxed);
+            }
+            _written.store(written + 1, std::memory_order_release);
+        }
+
+        // Consumer side, the newest item. The ones before it since the
+        // last call, read or overwritten, are counted in skipped.
+        bool popLatest(T &item, uint32_t &skipped)
+        {
+            for (;;)
+            {
+                uint32_t written = _written.load(std::memory_order_acquire);
+                if (written == _read)
+                {
+                    return false;
+                }
+                const std::atomic<uint32_t> *slot = _slots[(written - 1) % N];
+                for (int w = 0; w < WORDS; ++w)
+                {
+                    uint32_t word = slot[w].load(std::memory_order_relaxed);
+                    memcpy((uint8_t *)&item + w * 4, &word, 4);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                // The slot is only reused by the item N after it
+                if (_started.load(std::memory_order_relaxed) - written < (uint32_t)N)
+                {
+                    skipped = written - _read - 1;
+                    _read = written;
+                    return true;
+                }
+            }
+        }
+    };
+
+    // One scan of the M4
+    struct IoImage
+    {
+        uint32_t sequence; // scans since the M4 started scanning
+        uint32_t failedModules;
+        uint32_t scanMicros;
+        uint16_t raw[MAX_INPUTS];
+        uint16_t values[MAX_INPUTS]; // after the filters
+    };
+
+    struct IoCommand
+    {
+        uint16_t output;
+        uint8_t value;
+        uint8_t reserved;
+    };
+
+    // Layout of the shared block, the same on both cores
+    struct IoShared
+    {
+        uint32_t magic; // IOLINK_MAGIC once the M4 set the block up
+        uint32_t version;
+        // Written by the M4 on ioBegin
+        int32_t numModules;
+        ModuleInfo modules[MAX_MODULES];
+        // Written by the M7 before ioConfigure
+        uint32_t analogMasks[MAX_MODULES];
+        ChannelFilter filters[MAX_INPUTS];
+        OverwriteRing<IoImage, IOLINK_IMAGE_SLOTS> images;  // M4 to M7
+        SpscRing<IoCommand, IOLINK_COMMAND_SLOTS> commands; // M7 to M4
+    };
+
+    static_assert(sizeof(IoShared) <= IOLINK_SHARED_SIZE, "IoShared does not fit its MPU region");
+
+    // The M4 side, runs the channels and their filters
+    class IoCoreServer
+    {
+    private:
+        Channels &_channels;
+        FilterBank &_filters;
+        ExpansionBus &_bus;
+        IoShared &_shared;
+        IoImage _image;
+        uint32_t _nextScanMs;
+        volatile bool _running; // set by ioConfigure on the RPC thread
+
+    public:
+        IoCoreServer(Channels &channels, FilterBank &filters, ExpansionBus &bus, IoShared &shared);
+
+        // Bind the RPC calls and tell the M7 where the block is. M4 only.
+        int boot();
+        // Find the modules and write their layout, returns how many
+        int begin();
+        // Apply the input modes and filter chains of the block, then scan
+        int configure();
+
+        // Apply the queued output writes, and scan when a scan is due
+        void poll();
+        int applyCommands();
+        void scan();
+        bool running() const { return _running; }
+    };
+
+    // The M7 side, the channel registry runs through it
+    class IoCoreLink : public RemoteIo
+    {
+    private:
+        IoShared *_shared;
+        IoImage _image;
+        uint32_t _lastImageMs;
+        uint32_t _images;   // images read
+        uint32_t _skipped;  // images replaced or overwritten before they were read
+        uint32_t _rejected; // output writes not queued, the ring was full
+
+    public:
+        IoCoreLink();
+
+        // Boot the M4 and wait for its block, -1 when it does not answer.
+        // M7 only.
+        int boot();
+        // Use a block without RPC, for the simulation on a PC
+        void attach(IoShared &shared);
+        bool attached() const { return _shared != nullptr; }
+
+        // Chain of an analog input, applied by configure()
+        int setChain(int index, const ChannelFilter &settings);
+
+        int discover(ModuleInfo *modules, int capacity) override;
+        int configure(const uint32_t *analogMasks, int modules) override;
+        int readImage(uint16_t *raw, uint16_t *values, int count, uint32_t &failedModules,
+                      uint32_t &scanMicros) override;
+        int writeOutput(int index, uint8_t value) override;
+
+        // {"images": 1200, "skipped": 0, "rejected": 0, "pending": 0}
+        void toJson(JsonObject status) const;
+    };
+} // namespace remoto
+
+#endif // IOLINK_H
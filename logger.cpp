@@ -0,0 +1,150 @@
+/*
+ * Remoto: Deferred logger for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Record ring and serial drain. See logger.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "logger.h"
+#include "mbed.h"
+#include <stdarg.h>
+
+namespace remoto
+{
+    static const char *const LEVEL_NAMES[NUM_LOG_LEVELS] = {"error", "warn", "info", "debug"};
+    static const char LEVEL_TAGS[NUM_LOG_LEVELS] = {'E', 'W', 'I', 'D'};
+
+    static LogRecord ring[LOG_RECORDS];
+    static uint32_t written = 0; // records ever written, the next goes to written % LOG_RECORDS
+    static uint32_t printed = 0; // records drained to the output
+    static uint32_t dropped = 0;
+    static uint32_t reported = 0; // drops already announced by drainLogs
+    static volatile uint8_t threshold = LOG_INFO;
+    static rtos::Mutex mutex;
+
+    LogLevel logLevelFromName(const char *name)
+    {
+        for (int i = 0; name != nullptr && i < NUM_LOG_LEVELS; ++i)
+        {
+            if (strcmp(name, LEVEL_NAMES[i]) == 0)
+            {
+                return (LogLevel)i;
+            }
+        }
+        return NUM_LOG_LEVELS;
+    }
+
+    const char *logLevelName(LogLevel level)
+    {
+        return level < NUM_LOG_LEVELS ? LEVEL_NAMES[level] : "";
+    }
+
+    void setLoggerLevel(LogLevel level)
+    {
+        if (level < NUM_LOG_LEVELS)
+        {
+            threshold = level;
+        }
+    }
+
+    LogLevel getLoggerLevel()
+    {
+        return (LogLevel)threshold;
+    }
+
+    static void append(LogLevel level, const char *format, va_list args)
+    {
+        mutex.lock();
+        LogRecord &record = ring[written % LOG_RECORDS];
+        record.timeMs = millis();
+        record.level = level;
+        vsnprintf(record.text, sizeof(record.text), format, args);
+        written++;
+        // The drain fell a full ring behind, the oldest record is lost
+        if (written - printed > LOG_RECORDS)
+        {
+            printed++;
+            dropped++;
+        }
+        mutex.unlock();
+    }
+
+// One entry point per level, filtered before any formatting
+#define LOG_FUNCTION(name, level)              \
+    void name(const char *format, ...)         \
+    {                                          \
+        if (level > threshold)                 \
+        {                                      \
+            return;                            \
+        }                                      \
+        va_list args;                          \
+        va_start(args, format);                \
+        append(level, format, args);           \
+        va_end(args);                          \
+    }
+
+    LOG_FUNCTION(logError, LOG_ERROR)
+    LOG_FUNCTION(logWarn, LOG_WARN)
+    LOG_FUNCTION(logInfo, LOG_INFO)
+    LOG_FUNCTION(logDebug, LOG_DEBUG)
+
+    size_t drainLogs(Print &out)
+    {
+        char line[LOG_TEXT_MAX + 24];
+        size_t count = 0;
+        while (true)
+        {
+            mutex.lock();
+            if (printed == written)
+            {
+                mutex.unlock();
+                break;
+            }
+            uint32_t lost = dropped - reported;
+            reported = dropped;
+            const LogRecord &record = ring[printed % LOG_RECORDS];
+            snprintf(line, sizeof(line), "[%6lu.%03lu] %c %s", (unsigned long)(record.timeMs / 1000),
+                     (unsigned long)(record.timeMs % 1000), LEVEL_TAGS[record.level], record.text);
+            printed++;
+            mutex.unlock();
+            // Printed outside the lock, writers never wait for the port
+            if (lost > 0)
+            {
+                out.print(lost);
+                out.println(" log records dropped");
+            }
+            out.println(line);
+            count++;
+        }
+        return count;
+    }
+
+    void logsToJson(JsonObject logs)
+    {
+        // Copied under the lock and serialized from the copy
+        static LogRecord snapshot[LOG_RECORDS];
+        mutex.lock();
+        uint32_t count = written < LOG_RECORDS ? written : LOG_RECORDS;
+        uint32_t first = written - count;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            snapshot[i] = ring[(first + i) % LOG_RECORDS];
+        }
+        uint32_t lost = dropped;
+        mutex.unlock();
+
+        logs["level"] = logLevelName(getLoggerLevel());
+        logs["dropped"] = lost;
+        JsonArray records = logs.createNestedArray("records");
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            JsonObject record = records.createNestedObject();
+            record["t"] = snapshot[i].timeMs;
+            record["l"] = LEVEL_NAMES[snapshot[i].level];
+            record["m"] = (const char *)snapshot[i].text;
+        }
+    }
+} // namespace remoto
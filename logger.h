@@ -0,0 +1,68 @@
+/*
+ * Remoto: Deferred logger for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Log calls format a short record into a RAM ring and return, which
+ * takes microseconds; they never wait for the serial port. A
+ * low-priority thread drains the ring to Serial with drainLogs(), so a
+ * full UART or a missing USB host delays nothing else. Records below
+ * the configured level are discarded before formatting.
+ *
+ * The ring keeps the last LOG_RECORDS records for GET /logs. Records
+ * overwritten before they reached Serial are counted as dropped.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(LOGGER_H)
+#define LOGGER_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define LOG_RECORDS 64
+// Longer messages are truncated
+#define LOG_TEXT_MAX 72
+// Drain thread, period and stack
+#define LOG_DRAIN_MS 20
+#define LOG_STACK_SIZE 2048
+
+namespace remoto
+{
+    enum LogLevel : uint8_t
+    {
+        LOG_ERROR = 0,
+        LOG_WARN,
+        LOG_INFO,
+        LOG_DEBUG,
+        NUM_LOG_LEVELS
+    };
+
+    struct LogRecord
+    {
+        uint32_t timeMs; // uptime
+        uint8_t level;
+        char text[LOG_TEXT_MAX];
+    };
+
+    // "error", "warn", "info" or "debug", NUM_LOG_LEVELS if unknown
+    LogLevel logLevelFromName(const char *name);
+    const char *logLevelName(LogLevel level);
+
+    void setLoggerLevel(LogLevel level);
+    LogLevel getLoggerLevel();
+
+    // printf style, safe from any thread but not from interrupts
+    void logError(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    void logWarn(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    void logInfo(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    void logDebug(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+    // Write the records not printed yet, may block on the output
+    size_t drainLogs(Print &out);
+
+    // Level, dropped count and the records held, oldest first
+    void logsToJson(JsonObject logs);
+} // namespace remoto
+
+#endif // LOGGER_H
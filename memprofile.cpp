@@ -0,0 +1,625 @@
+/*
+ * Remoto: Heap and stack profiler for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Heap totals, allocation tags and stack painting. See memprofile.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "memprofile.h"
+#include "logger.h"
+#include <malloc.h>
+#include <string.h>
+#if defined(ARDUINO_ARCH_MBED)
+#include <mbed.h>
+#include "rtx_os.h"
+#endif
+
+// Stacks are painted up to this far below the frame of the caller
+#define MEM_STACK_MARGIN 64
+#define MEM_STACK_PAINT 0xCCCCCCCCUL
+
+#if defined(ARDUINO_ARCH_MBED)
+// The free list of newlib nano, weak so that another allocator still links
+struct MallocChunk
+{
+    long size; // header included
+    MallocChunk *next;
+};
+extern "C" MallocChunk *__malloc_free_list __attribute__((weak));
+extern "C" void __malloc_lock(struct _reent *reent);
+extern "C" void __malloc_unlock(struct _reent *reent);
+#endif
+
+namespace remoto
+{
+    static const char *const TAG_NAMES[NUM_MEM_TAGS] = {"other", "http", "mqtt", "config", "json"};
+    static const uint32_t TAG_BUDGETS[NUM_MEM_TAGS] = {
+        MEM_BUDGET_OTHER * MEM_BUDGET_SCALE, MEM_BUDGET_HTTP * MEM_BUDGET_SCALE, MEM_BUDGET_MQTT * MEM_BUDGET_SCALE,
+        MEM_BUDGET_CONFIG * MEM_BUDGET_SCALE, MEM_BUDGET_JSON * MEM_BUDGET_SCALE};
+
+    struct HeapTotals
+    {
+        uint32_t arena;   // taken from the system
+        uint32_t used;    // in allocated blocks
+        uint32_t free;    // in free blocks of the arena
+        uint32_t largest; // largest free block, 0 when unknown
+    };
+
+    const char *memTagName(MemTag tag)
+    {
+        return tag < NUM_MEM_TAGS ? TAG_NAMES[tag] : "?";
+    }
+
+    uint32_t memTagBudget(MemTag tag)
+    {
+        return tag < NUM_MEM_TAGS ? TAG_BUDGETS[tag] : 0;
+    }
+
+    static void heapTotals(HeapTotals &heap)
+    {
+#if defined(__GLIBC__)
+        struct mallinfo2 info = mallinfo2();
+#else
+        struct mallinfo info = mallinfo();
+#endif
+        heap.arena = info.arena;
+        heap.used = info.uordblks;
+        heap.free = info.fordblks;
+        heap.largest = 0;
+#if defined(ARDUINO_ARCH_MBED)
+        if (&__malloc_free_list != nullptr)
+        {
+            __malloc_lock(_REENT);
+            for (MallocChunk *chunk = __malloc_free_list; chunk != nullptr; chunk = chunk->next)
+            {
+                if ((uint32_t)chunk->size > heap.largest)
+                {
+                    heap.largest = chunk->size;
+                }
+            }
+            __malloc_unlock(_REENT);
+        }
+#endif
+    }
+
+    // Share of the free bytes outside of the largest free block
+    static uint32_t fragmentation(const HeapTotals &heap)
+    {
+        if (heap.free == 0 || heap.largest >= heap.free)
+        {
+            return 0;
+        }
+        return 100 - (uint32_t)((uint64_t)heap.largest * 100 / heap.free);
+    }
+
+#if defined(REMOTO_MEM_PROFILE)
+    // Just before each block, anywhere within its offset
+    struct MemBlock
+    {
+        uint32_t check; // BLOCK_MAGIC ^ block address
+        uint32_t size;
+        uint16_t offset; // from the raw allocation
+        uint8_t tag;
+        uint8_t reserved;
+    };
+
+    // Keeps the blocks as aligned as malloc() would
+    static constexpr size_t HEADER_SIZE =
+        (sizeof(MemBlock) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+    static constexpr uint32_t BLOCK_MAGIC = 0x4D454D50;
+    static constexpr size_t MAX_BLOCK = UINT32_MAX - 0x10000;
+
+    struct ThreadScope
+    {
+        bool used;
+        void *thread;
+        MemTag tag;
+    };
+
+    struct StackWatch
+    {
+        void *thread;
+        const char *name;
+        const uint32_t *base;
+        uint32_t size;
+    };
+
+    // Plain data, zero before any constructor allocates
+    static MemTagStats tagStats[NUM_MEM_TAGS];
+    static uint32_t liveBytes;
+    static uint32_t peakBytes;
+    static uint32_t allocCount;
+    static uint32_t failedCount;
+    static ThreadScope scopes[MEM_MAX_THREADS];
+    static StackWatch stacks[MEM_MAX_THREADS];
+    static int stackCount;
+    static uint8_t overBudget; // tags already logged
+
+    static inline void lock()
+    {
+#if defined(ARDUINO_ARCH_MBED)
+        core_util_critical_section_enter();
+#endif
+    }
+
+    static inline void unlock()
+    {
+#if defined(ARDUINO_ARCH_MBED)
+        core_util_critical_section_exit();
+#endif
+    }
+
+    // The replay runs every thread in turn on its own
+    static inline void *currentThread()
+    {
+#if defined(ARDUINO_ARCH_MBED)
+        return osThreadGetId();
+#else
+        return nullptr;
+#endif
+    }
+
+    static MemTag currentTag()
+    {
+        void *thread = currentThread();
+        MemTag tag = MEM_OTHER;
+        lock();
+        for (int i = 0; i < MEM_MAX_THREADS; ++i)
+        {
+            if (scopes[i].used && scopes[i].thread == thread)
+            {
+                tag = scopes[i].tag;
+                break;
+            }
+        }
+        unlock();
+        return tag;
+    }
+
+    MemScope::MemScope(MemTag tag) : _previous(MEM_OTHER)
+    {
+        void *thread = currentThread();
+        lock();
+        ThreadScope *slot = nullptr;
+        for (int i = 0; i < MEM_MAX_THREADS; ++i)
+        {
+            if (scopes[i].used && scopes[i].thread == thread)
+            {
+                slot = &scopes[i];
+                break;
+            }
+            if (!scopes[i].used && slot == nullptr)
+            {
+                slot = &scopes[i];
+            }
+        }
+        // With every slot taken the thread stays untagged
+        if (slot != nullptr)
+        {
+            _previous = slot->used ? slot->tag : MEM_OTHER;
+            slot->used = true;
+            slot->thread = thread;
+            slot->tag = tag;
+        }
+        unlock();
+    }
+
+    MemScope::~MemScope()
+    {
+        void *thread = currentThread();
+        lock();
+        for (int i = 0; i < MEM_MAX_THREADS; ++i)
+        {
+            if (scopes[i].used && scopes[i].thread == thread)
+            {
+                scopes[i].tag = _previous;
+                break;
+            }
+        }
+        unlock();
+    }
+
+    static void countAlloc(uint8_t tag, uint32_t size)
+    {
+        lock();
+        MemTagStats &stats = tagStats[tag];
+        stats.live += size;
+        stats.allocs++;
+        if (stats.live > stats.peak)
+        {
+            stats.peak = stats.live;
+        }
+        liveBytes += size;
+        allocCount++;
+        if (liveBytes > peakBytes)
+        {
+            peakBytes = liveBytes;
+        }
+        unlock();
+    }
+
+    static void countFree(uint8_t tag, uint32_t size)
+    {
+        lock();
+        tagStats[tag].live -= size;
+        liveBytes -= size;
+        unlock();
+    }
+
+    static void countFailure()
+    {
+        lock();
+        failedCount++;
+        unlock();
+    }
+
+    static MemBlock *header(const void *block)
+    {
+        MemBlock *found = (MemBlock *)((uint8_t *)block - sizeof(MemBlock));
+        return found->check == (BLOCK_MAGIC ^ (uint32_t)(uintptr_t)block) ? found : nullptr;
+    }
+
+    static void *attach(void *raw, size_t size, size_t offset, MemTag tag)
+    {
+        uint8_t *block = (uint8_t *)raw + offset;
+        MemBlock *found = (MemBlock *)(block - sizeof(MemBlock));
+        found->size = size;
+        found->offset = offset;
+        found->tag = tag;
+        found->reserved = 0;
+        found->check = BLOCK_MAGIC ^ (uint32_t)(uintptr_t)block;
+        countAlloc(tag, size);
+        return block;
+    }
+
+    void *memMalloc(const MemAllocator &raw, size_t size)
+    {
+        void *allocated = size <= MAX_BLOCK ? raw.allocate(size + HEADER_SIZE) : nullptr;
+        if (allocated == nullptr)
+        {
+            countFailure();
+            return nullptr;
+        }
+        return attach(allocated, size, HEADER_SIZE, currentTag());
+    }
+
+    void *memCalloc(const MemAllocator &raw, size_t count, size_t size)
+    {
+        if (size != 0 && count > MAX_BLOCK / size)
+        {
+            countFailure();
+            return nullptr;
+        }
+        void *block = memMalloc(raw, count * size);
+        if (block != nullptr)
+        {
+            memset(block, 0, count * size);
+        }
+        return block;
+    }
+
+    void *memAlign(const MemAllocator &raw, size_t alignment, size_t size)
+    {
+        if (alignment <= alignof(max_align_t))
+        {
+            return memMalloc(raw, size);
+        }
+        // The header takes a whole alignment unit in front of the block
+        size_t offset = alignment < HEADER_SIZE ? HEADER_SIZE : alignment;
+        void *allocated = size <= MAX_BLOCK && offset <= UINT16_MAX ? raw.align(alignment, size + offset) : nullptr;
+        if (allocated == nullptr)
+        {
+            countFailure();
+            return nullptr;
+        }
+        return attach(allocated, size, offset, currentTag());
+    }
+
+    void *memRealloc(const MemAllocator &raw, void *block, size_t size)
+    {
+        if (block == nullptr)
+        {
+            return memMalloc(raw, size);
+        }
+        MemBlock *found = header(block);
+        if (found == nullptr)
+        {
+            return raw.resize(block, size);
+        }
+        if (size == 0)
+        {
+            memFree(raw, block);
+            return nullptr;
+        }
+        MemBlock old = *found;
+        if (old.offset != HEADER_SIZE)
+        {
+            // Aligned blocks move to a plain one
+            void *moved = memMalloc(raw, size);
+            if (moved != nullptr)
+            {
+                memcpy(moved, block, old.size < size ? old.size : size);
+                memFree(raw, block);
+            }
+            return moved;
+        }
+        // Left counted as it was when it cannot grow
+        void *resized = size <= MAX_BLOCK ? raw.resize((uint8_t *)block - HEADER_SIZE, size + HEADER_SIZE) : nullptr;
+        if (resized == nullptr)
+        {
+            countFailure();
+            return nullptr;
+        }
+        countFree(old.tag, old.size);
+        return attach(resized, size, HEADER_SIZE, currentTag());
+    }
+
+    void memFree(const MemAllocator &raw, void *block)
+    {
+        if (block == nullptr)
+        {
+            return;
+        }
+        MemBlock *found = header(block);
+        if (found == nullptr)
+        {
+            raw.release(block);
+            return;
+        }
+        countFree(found->tag, found->size);
+        void *allocated = (uint8_t *)block - found->offset;
+        found->check = 0;
+        raw.release(allocated);
+    }
+
+    void memWatchStack(const char *name)
+    {
+#if defined(ARDUINO_ARCH_MBED)
+        void *thread = osThreadGetId();
+        for (int i = 0; i < stackCount; ++i)
+        {
+            if (stacks[i].thread == thread)
+            {
+                return;
+            }
+        }
+        if (stackCount >= MEM_MAX_THREADS)
+        {
+            return;
+        }
+        // Below the frame of the caller the stack is unused, the first word
+        // holds the overflow magic of RTX
+        osRtxThread_t *rtx = (osRtxThread_t *)thread;
+        uint32_t *base = (uint32_t *)rtx->stack_mem;
+        uint32_t *top = (uint32_t *)(__get_PSP() - MEM_STACK_MARGIN);
+        for (uint32_t *word = base + 1; word < top; ++word)
+        {
+            *word = MEM_STACK_PAINT;
+        }
+        lock();
+        if (stackCount < MEM_MAX_THREADS)
+        {
+            stacks[stackCount] = {thread, name, base, rtx->stack_size};
+            stackCount++;
+        }
+        unlock();
+#else
+        // Stacks are only watched on the device
+        (void)name;
+#endif
+    }
+
+    bool memTagStats(MemTag tag, MemTagStats &stats)
+    {
+        if (tag >= NUM_MEM_TAGS)
+        {
+            return false;
+        }
+        lock();
+        stats = tagStats[tag];
+        unlock();
+        stats.budget = memTagBudget(tag);
+        return true;
+    }
+
+    int memStackStats(MemStackStats *stats, int count)
+    {
+        int n = 0;
+        for (; n < count && n < stackCount; ++n)
+        {
+            // Deepest use is where the paint stops
+            const uint32_t *word = stacks[n].base + 1;
+            const uint32_t *end = stacks[n].base + stacks[n].size / 4;
+            while (word < end && *word == MEM_STACK_PAINT)
+            {
+                ++word;
+            }
+            stats[n].name = stacks[n].name;
+            stats[n].size = stacks[n].size;
+            stats[n].used = (end - word) * 4;
+        }
+        return n;
+    }
+#else
+    void memWatchStack(const char *)
+    {
+    }
+
+    bool memTagStats(MemTag, MemTagStats &)
+    {
+        return false;
+    }
+
+    int memStackStats(MemStackStats *, int)
+    {
+        return 0;
+    }
+#endif
+
+    void memToJson(JsonObject metrics)
+    {
+        HeapTotals heap;
+        heapTotals(heap);
+#if defined(REMOTO_MEM_PROFILE)
+        metrics["profile"] = true;
+#else
+        metrics["profile"] = false;
+#endif
+        JsonObject heapObject = metrics.createNestedObject("heap");
+        heapObject["arena"] = heap.arena;
+        heapObject["used"] = heap.used;
+        heapObject["free"] = heap.free;
+        if (heap.largest > 0)
+        {
+            heapObject["largestFree"] = heap.largest;
+            heapObject["fragmentation"] = fragmentation(heap);
+        }
+#if defined(REMOTO_MEM_PROFILE)
+        lock();
+        uint32_t live = liveBytes;
+        uint32_t peak = peakBytes;
+        uint32_t allocs = allocCount;
+        uint32_t failed = failedCount;
+        unlock();
+        heapObject["live"] = live;
+        heapObject["peak"] = peak;
+        heapObject["allocs"] = allocs;
+        heapObject["failed"] = failed;
+        JsonObject tags = metrics.createNestedObject("tags");
+        for (int i = 0; i < NUM_MEM_TAGS; ++i)
+        {
+            MemTagStats stats;
+            memTagStats((MemTag)i, stats);
+            JsonObject tag = tags.createNestedObject(memTagName((MemTag)i));
+            tag["live"] = stats.live;
+            tag["peak"] = stats.peak;
+            tag["allocs"] = stats.allocs;
+            tag["budget"] = stats.budget;
+        }
+        MemStackStats watched[MEM_MAX_THREADS];
+        int count = memStackStats(watched, MEM_MAX_THREADS);
+        JsonObject stackObject = metrics.createNestedObject("stacks");
+        for (int i = 0; i < count; ++i)
+        {
+            JsonObject stack = stackObject.createNestedObject(watched[i].name);
+            stack["size"] = watched[i].size;
+            stack["used"] = watched[i].used;
+        }
+#endif
+    }
+
+    void memReport()
+    {
+        HeapTotals heap;
+        heapTotals(heap);
+        if (heap.largest > 0)
+        {
+            logInfo("Heap %lu used, %lu free, %lu%% fragmented", (unsigned long)heap.used, (unsigned long)heap.free,
+                    (unsigned long)fragmentation(heap));
+        }
+        else
+        {
+            logInfo("Heap %lu used, %lu free", (unsigned long)heap.used, (unsigned long)heap.free);
+        }
+#if defined(REMOTO_MEM_PROFILE)
+        for (int i = 0; i < NUM_MEM_TAGS; ++i)
+        {
+            MemTagStats stats;
+            memTagStats((MemTag)i, stats);
+            if (stats.allocs == 0)
+            {
+                continue;
+            }
+            logInfo("Heap %s: %lu live, %lu peak", memTagName((MemTag)i), (unsigned long)stats.live,
+                    (unsigned long)stats.peak);
+            if (stats.budget > 0 && stats.peak > stats.budget && !(overBudget & (1 << i)))
+            {
+                overBudget |= 1 << i;
+                logWarn("Heap %s peak %lu over its budget of %lu", memTagName((MemTag)i), (unsigned long)stats.peak,
+                        (unsigned long)stats.budget);
+            }
+        }
+        MemStackStats watched[MEM_MAX_THREADS];
+        int count = memStackStats(watched, MEM_MAX_THREADS);
+        for (int i = 0; i < count; ++i)
+        {
+            // Within an eighth of the end
+            if (watched[i].used > watched[i].size - watched[i].size / 8)
+            {
+                logWarn("Stack %s: %lu of %lu bytes", watched[i].name, (unsigned long)watched[i].used,
+                        (unsigned long)watched[i].size);
+            }
+            else
+            {
+                logInfo("Stack %s: %lu of %lu bytes", watched[i].name, (unsigned long)watched[i].used,
+                        (unsigned long)watched[i].size);
+            }
+        }
+#endif
+    }
+} // namespace remoto
+
+#if defined(REMOTO_MEM_PROFILE) && defined(ARDUINO_ARCH_MBED)
+// In place of the wrappers of mbed_alloc_wrappers.cpp, the core links
+// with --wrap for each of these. calloc() goes through _malloc_r.
+extern "C"
+{
+    void *__real__malloc_r(struct _reent *reent, size_t size);
+    void __real__free_r(struct _reent *reent, void *block);
+    void *__real__realloc_r(struct _reent *reent, void *block, size_t size);
+    void *__real__memalign_r(struct _reent *reent, size_t alignment, size_t size);
+}
+
+static void *rawMalloc(size_t size)
+{
+    return __real__malloc_r(_REENT, size);
+}
+
+static void rawFree(void *block)
+{
+    __real__free_r(_REENT, block);
+}
+
+static void *rawRealloc(void *block, size_t size)
+{
+    return __real__realloc_r(_REENT, block, size);
+}
+
+static void *rawMemalign(size_t alignment, size_t size)
+{
+    return __real__memalign_r(_REENT, alignment, size);
+}
+
+static const remoto::MemAllocator rawAllocator = {rawMalloc, rawFree, rawRealloc, rawMemalign};
+
+extern "C"
+{
+    void *__wrap__malloc_r(struct _reent *reent, size_t size)
+    {
+        return remoto::memMalloc(rawAllocator, size);
+    }
+
+    void __wrap__free_r(struct _reent *reent, void *block)
+    {
+        remoto::memFree(rawAllocator, block);
+    }
+
+    void *__wrap__realloc_r(struct _reent *reent, void *block, size_t size)
+    {
+        return remoto::memRealloc(rawAllocator, block, size);
+    }
+
+    void *__wrap__calloc_r(struct _reent *reent, size_t count, size_t size)
+    {
+        return remoto::memCalloc(rawAllocator, count, size);
+    }
+
+    void *__wrap__memalign_r(struct _reent *reent, size_t alignment, size_t size)
+    {
+        return remoto::memAlign(rawAllocator, alignment, size);
+    }
+}
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Remoto: Heap and stack profiler for Arduino OPTA
+ * -------------------------------------------------------------------
+ * GET /metrics reports the heap as the allocator sees it: arena, bytes
+ * in use, free bytes and how fragmented they are.
+ *
+ * Built with REMOTO_MEM_PROFILE every allocation carries a small header
+ * with its size and the subsystem it was made for, taken from the
+ * innermost MemScope of the allocating thread:
+ *
+ *   MemScope scope(MEM_JSON);
+ *   DynamicJsonDocument doc(capacity); // counted as JSON
+ *
+ * Live and peak bytes are then kept per subsystem, the threads paint
+ * their stacks to report a high-water mark, and a summary is logged
+ * every MEM_REPORT_MS. A subsystem whose peak goes over its MEM_BUDGET_
+ * is logged once as a warning; the replay runner fails on it.
+ *
+ * On the device the profile replaces the allocation wrappers of the mbed
+ * core (--wrap=_malloc_r and friends), so mbed_stats_heap_get() reports
+ * nothing in that build. Without REMOTO_MEM_PROFILE scopes compile to
+ * nothing and allocations are untouched.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(MEMPROFILE_H)
+#define MEMPROFILE_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <stddef.h>
+
+// Threads with their own scopes and stacks
+#define MEM_MAX_THREADS 8
+#define MEM_REPORT_MS 60000
+// Peak live bytes allowed per subsystem on the device, the MQTT one
+// includes a TLS handshake
+#define MEM_BUDGET_OTHER 0 // not checked
+#define MEM_BUDGET_HTTP 4096
+#define MEM_BUDGET_MQTT 49152
+#define MEM_BUDGET_CONFIG 16384
+#define MEM_BUDGET_JSON 24576
+// Pointers, and the JSON slots holding them, double on a 64-bit host
+// such as the one of the replay runner
+#if defined(__LP64__)
+#define MEM_BUDGET_SCALE 2
+#else
+#define MEM_BUDGET_SCALE 1
+#endif
+
+namespace remoto
+{
+    enum MemTag : uint8_t
+    {
+        MEM_OTHER = 0,
+        MEM_HTTP,
+        MEM_MQTT,
+        MEM_CONFIG,
+        MEM_JSON,
+        NUM_MEM_TAGS
+    };
+
+    struct MemTagStats
+    {
+        uint32_t live;   // bytes held now
+        uint32_t peak;   // most bytes held at once
+        uint32_t allocs; // allocations since boot
+        uint32_t budget; // 0 when not checked
+    };
+
+    struct MemStackStats
+    {
+        const char *name;
+        uint32_t size;
+        uint32_t used; // deepest use seen
+    };
+
+    // Allocations of this thread go to the tag until the scope ends
+    class MemScope
+    {
+#if defined(REMOTO_MEM_PROFILE)
+    private:
+        MemTag _previous;
+
+    public:
+        explicit MemScope(MemTag tag);
+        ~MemScope();
+#else
+    public:
+        explicit MemScope(MemTag) {}
+#endif
+        MemScope(const MemScope &) = delete;
+        MemScope &operator=(const MemScope &) = delete;
+    };
+
+    // "other", "http", "mqtt", "config" or "json"
+    const char *memTagName(MemTag tag);
+    uint32_t memTagBudget(MemTag tag);
+
+    // Called by a thread from its loop, its stack is painted the first time
+    // and measured from then on. Only on mbed, of the profile build.
+    void memWatchStack(const char *name);
+
+    // False without REMOTO_MEM_PROFILE
+    bool memTagStats(MemTag tag, MemTagStats &stats);
+    // Number of stacks written, at most count
+    int memStackStats(MemStackStats *stats, int count);
+
+    // Heap totals, the profile counts and the stacks
+    void memToJson(JsonObject metrics);
+    // Log a summary and the subsystems gone over their budget
+    void memReport();
+
+    // The allocation wrappers of the profile build, on top of the raw
+    // allocator they replace. Each block carries a header in front, blocks
+    // not allocated through them are recognised and passed through.
+    struct MemAllocator
+    {
+        void *(*allocate)(size_t size);
+        void (*release)(void *raw);
+        void *(*resize)(void *raw, size_t size);
+        void *(*align)(size_t alignment, size_t size);
+    };
+
+    void *memMalloc(const MemAllocator &raw, size_t size);
+    void *memCalloc(const MemAllocator &raw, size_t count, size_t size);
+    void *memAlign(const MemAllocator &raw, size_t alignment, size_t size);
+    void *memRealloc(const MemAllocator &raw, void *block, size_t size);
+    void memFree(const MemAllocator &raw, void *block);
+} // namespace remoto
+
+#endif // MEMPROFILE_H
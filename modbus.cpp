@@ -0,0 +1,217 @@
+/*
+ * Remoto: Modbus TCP server for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Request decoding and register map. See modbus.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "modbus.h"
+
+namespace remoto
+{
+    constexpr uint8_t FC_READ_COILS = 0x01;
+    constexpr uint8_t FC_READ_DISCRETE_INPUTS = 0x02;
+    constexpr uint8_t FC_READ_HOLDING_REGISTERS = 0x03;
+    constexpr uint8_t FC_READ_INPUT_REGISTERS = 0x04;
+    constexpr uint8_t FC_WRITE_SINGLE_COIL = 0x05;
+    constexpr uint8_t FC_WRITE_MULTIPLE_COILS = 0x0F;
+
+    constexpr uint8_t EX_ILLEGAL_FUNCTION = 0x01;
+    constexpr uint8_t EX_ILLEGAL_ADDRESS = 0x02;
+    constexpr uint8_t EX_ILLEGAL_VALUE = 0x03;
+    constexpr uint8_t EX_DEVICE_FAILURE = 0x04;
+
+    // Quantity limits of the Modbus application protocol, V1.1b3
+    constexpr uint16_t MAX_READ_BITS = 2000;
+    constexpr uint16_t MAX_READ_REGISTERS = 125;
+    constexpr uint16_t MAX_WRITE_COILS = 1968;
+
+    constexpr size_t MBAP_SIZE = 7;
+
+    static uint16_t getWord(const uint8_t *data)
+    {
+        return (data[0] << 8) | data[1];
+    }
+
+    static void putWord(uint8_t *data, uint16_t value)
+    {
+        data[0] = value >> 8;
+        data[1] = value & 0xFF;
+    }
+
+    ModbusServer::ModbusServer(const config &conf, Channels &channels, CoilWriter writer)
+        : _conf(conf), _channels(channels), _writer(writer), _requests(0), _exceptions(0)
+    {
+    }
+
+    // Read coils or discrete inputs
+    int ModbusServer::readBits(uint8_t function, const uint8_t *pdu, uint8_t *response)
+    {
+        uint16_t start = getWord(pdu + 1);
+        uint16_t count = getWord(pdu + 3);
+        if (count == 0 || count > MAX_READ_BITS)
+        {
+            return -EX_ILLEGAL_VALUE;
+        }
+        bool coils = function == FC_READ_COILS;
+        int available = coils ? _channels.outputCount() : _channels.inputCount();
+        if (start + count > available)
+        {
+            return -EX_ILLEGAL_ADDRESS;
+        }
+        uint8_t bytes = (count + 7) / 8;
+        response[0] = function;
+        response[1] = bytes;
+        memset(response + 2, 0, bytes);
+        for (uint16_t i = 0; i < count; ++i)
+        {
+            int index = start + i;
+            bool value = coils ? _channels.getOutput(index)
+                               : (_conf.getInputType(index) == DIGITAL && _channels.readInput(index) != 0);
+            if (value)
+            {
+                response[2 + i / 8] |= 1 << (i % 8);
+            }
+        }
+        return 2 + bytes;
+    }
+
+    bool ModbusServer::readRegister(uint16_t address, uint16_t &value) const
+    {
+        int inputs = _channels.inputCount();
+        if (address < inputs)
+        {
+            value = _channels.readInput(address);
+            return true;
+        }
+        if (address >= MODBUS_SCALED_BASE && address < MODBUS_SCALED_BASE + 2 * inputs)
+        {
+            int index = (address - MODBUS_SCALED_BASE) / 2;
+            uint16_t raw = _channels.readInput(index);
+            // Digital inputs read 0 or 1000, one unit per closed contact
+            int32_t scaled = _conf.getInputType(index) == ANALOG ? _conf.scaleInput(index, raw) : raw * MILLI;
+            value = (address - MODBUS_SCALED_BASE) % 2 == 0 ? (uint32_t)scaled >> 16 : (uint32_t)scaled & 0xFFFF;
+            return true;
+        }
+        return false;
+    }
+
+    int ModbusServer::readRegisters(const uint8_t *pdu, uint8_t *response)
+    {
+        uint16_t start = getWord(pdu + 1);
+        uint16_t count = getWord(pdu + 3);
+        if (count == 0 || count > MAX_READ_REGISTERS)
+        {
+            return -EX_ILLEGAL_VALUE;
+        }
+        response[0] = pdu[0];
+        response[1] = count * 2;
+        for (uint16_t i = 0; i < count; ++i)
+        {
+            uint16_t value;
+            if (!readRegister(start + i, value))
+            {
+                return -EX_ILLEGAL_ADDRESS;
+            }
+            putWord(response + 2 + 2 * i, value);
+        }
+        return 2 + count * 2;
+    }
+
+    int ModbusServer::writeCoil(const uint8_t *pdu, uint8_t *response)
+    {
+        uint16_t address = getWord(pdu + 1);
+        uint16_t value = getWord(pdu + 3);
+        if (value != 0xFF00 && value != 0x0000)
+        {
+            return -EX_ILLEGAL_VALUE;
+        }
+        if (address >= _channels.outputCount())
+        {
+            return -EX_ILLEGAL_ADDRESS;
+        }
+        if (_writer(address, value == 0xFF00) != 0)
+        {
+            return -EX_DEVICE_FAILURE;
+        }
+        // The answer echoes the request
+        memcpy(response, pdu, 5);
+        return 5;
+    }
+
+    int ModbusServer::writeCoils(const uint8_t *pdu, size_t length, uint8_t *response)
+    {
+        uint16_t start = getWord(pdu + 1);
+        uint16_t count = getWord(pdu + 3);
+        uint8_t bytes = pdu[5];
+        if (count == 0 || count > MAX_WRITE_COILS || bytes != (count + 7) / 8 || length != 6 + (size_t)bytes)
+        {
+            return -EX_ILLEGAL_VALUE;
+        }
+        if (start + count > _channels.outputCount())
+        {
+            return -EX_ILLEGAL_ADDRESS;
+        }
+        for (uint16_t i = 0; i < count; ++i)
+        {
+            bool value = pdu[6 + i / 8] & (1 << (i % 8));
+            if (_writer(start + i, value) != 0)
+            {
+                return -EX_DEVICE_FAILURE;
+            }
+        }
+        memcpy(response, pdu, 5);
+        return 5;
+    }
+
+    size_t ModbusServer::handle(const uint8_t *request, size_t length, uint8_t *response)
+    {
+        // MBAP: transaction, protocol (0 for Modbus), length, unit
+        if (length < MBAP_SIZE + 1 || getWord(request + 2) != 0)
+        {
+            return 0;
+        }
+        _requests++;
+        const uint8_t *pdu = request + MBAP_SIZE;
+        size_t pduLength = length - MBAP_SIZE;
+        uint8_t *out = response + MBAP_SIZE;
+        uint8_t function = pdu[0];
+
+        int result;
+        switch (function)
+        {
+        case FC_READ_COILS:
+        case FC_READ_DISCRETE_INPUTS:
+            result = pduLength == 5 ? readBits(function, pdu, out) : -EX_ILLEGAL_VALUE;
+            break;
+        case FC_READ_HOLDING_REGISTERS:
+        case FC_READ_INPUT_REGISTERS:
+            result = pduLength == 5 ? readRegisters(pdu, out) : -EX_ILLEGAL_VALUE;
+            break;
+        case FC_WRITE_SINGLE_COIL:
+            result = pduLength == 5 ? writeCoil(pdu, out) : -EX_ILLEGAL_VALUE;
+            break;
+        case FC_WRITE_MULTIPLE_COILS:
+            result = pduLength >= 7 ? writeCoils(pdu, pduLength, out) : -EX_ILLEGAL_VALUE;
+            break;
+        default:
+            result = -EX_ILLEGAL_FUNCTION;
+            break;
+        }
+        if (result < 0)
+        {
+            _exceptions++;
+            out[0] = function | 0x80;
+            out[1] = -result;
+            result = 2;
+        }
+
+        // Same transaction, protocol and unit, length of unit and PDU
+        memcpy(response, request, MBAP_SIZE);
+        putWord(response + 4, result + 1);
+        return MBAP_SIZE + result;
+    }
+} // namespace remoto
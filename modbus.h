@@ -0,0 +1,217 @@
+/*
+ * Remoto: Modbus TCP server for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Exposes the IO image to SCADA masters on port 502. Every request is
+ * answered from the input snapshot of the channel registry, so polling
+ * never reaches the ADC or the expansion bus; only coil writes do. They
+ * go through the writer the sketch passes, which runs them as plain
+ * commands of the output timers, like the writes of the other APIs.
+ *
+ *  Discrete inputs   n-1          state of digital input In
+ *  Coils             n-1          output On, read and write
+ *  Input registers   n-1          raw reading of In, 0/1 or ADC counts
+ *                    1000+2(n-1)  scaled value of In in thousandths of
+ *                                 its unit, signed 32 bit, high word first
+ *
+ * Holding registers read the same map as input registers.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(MODBUS_H)
+#define MODBUS_H
+#include <Arduino.h>
+#include "config.h"
+#include "channels.h"
+
+#define MODBUS_PORT 502
+// Masters served at the same time
+#define MODBUS_MAX_CLIENTS 4
+// Connections quiet for longer are closed
+#define MODBUS_IDLE_TIMEOUT_MS 60000
+// Largest ADU, MBAP header and PDU
+#define MODBUS_ADU_MAX 260
+#define MODBUS_SCALED_BASE 1000
+// Period of the connection polling
+#define MODBUS_POLL_MS 1
+
+namespace remoto
+{
+    // Write an output for a master, -1 when it could not be written
+    typedef int (*CoilWriter)(int output, bool value);
+
+    // Protocol handling, independent of the transport
+    class ModbusServer
+    {
+    private:
+        const config &_conf;
+        Channels &_channels;
+        CoilWriter _writer;
+        uint32_t _requests;
+        uint32_t _exceptions;
+
+        int readBits(uint8_t function, const uint8_t *pdu, uint8_t *response);
+        int readRegisters(const uint8_t *pdu, uint8_t *response);
+        int writeCoil(const uint8_t *pdu, uint8_t *response);
+        int writeCoils(const uint8_t *pdu, size_t length, uint8_t *response);
+        bool readRegister(uint16_t address, uint16_t &value) const;
+
+    public:
+        ModbusServer(const config &conf, Channels &channels, CoilWriter writer);
+
+        // Answer one complete ADU. Returns the length of the response
+        // written to the buffer, or 0 to drop the connection.
+        size_t handle(const uint8_t *request, size_t length, uint8_t *response);
+
+        uint32_t getRequestCount() const { return _requests; }
+        uint32_t getExceptionCount() const { return _exceptions; }
+    };
+
+    // Connections of one network interface. Partial frames are kept per
+    // connection, so a slow master never holds up the others.
+    template <class ServerT, class ClientT>
+    class ModbusListener
+    {
+    private:
+        struct Session
+        {
+            ClientT client;
+            uint8_t buffer[MODBUS_ADU_MAX];
+            size_t used;
+            uint32_t lastActivity;
+            bool open;
+        };
+
+        ServerT _server;
+        Session _sessions[MODBUS_MAX_CLIENTS];
+
+        void close(Session &session)
+        {
+            session.client.stop();
+            session.open = false;
+            session.used = 0;
+        }
+
+        // A free slot, or the one of the master that has been quiet longest
+        Session &slot()
+        {
+            Session *oldest = &_sessions[0];
+            for (Session &session : _sessions)
+            {
+                if (!session.open)
+                {
+                    return session;
+                }
+                if ((int32_t)(session.lastActivity - oldest->lastActivity) < 0)
+                {
+                    oldest = &session;
+                }
+            }
+            close(*oldest);
+            return *oldest;
+        }
+
+        void serve(Session &session, ModbusServer &modbus)
+        {
+            int available = session.client.available();
+            if (available > 0)
+            {
+                size_t wanted = sizeof(session.buffer) - session.used;
+                if ((size_t)available < wanted)
+                {
+                    wanted = available;
+                }
+                int n = session.client.read(session.buffer + session.used, wanted);
+                if (n > 0)
+                {
+                    session.used += n;
+                    session.lastActivity = millis();
+                }
+            }
+            // Several requests may be pipelined in one segment
+            while (session.used >= 7)
+            {
+                size_t frame = 6 + ((session.buffer[4] << 8) | session.buffer[5]);
+                if (frame < 8 || frame > MODBUS_ADU_MAX)
+                {
+                    close(session);
+                    return;
+                }
+                if (session.used < frame)
+                {
+                    break;
+                }
+                uint8_t response[MODBUS_ADU_MAX];
+                size_t length = modbus.handle(session.buffer, frame, response);
+                if (length == 0)
+                {
+                    close(session);
+                    return;
+                }
+                session.client.write(response, length);
+                session.used -= frame;
+                memmove(session.buffer, session.buffer + frame, session.used);
+            }
+        }
+
+    public:
+        ModbusListener()
+            : _server(MODBUS_PORT)
+        {
+            for (Session &session : _sessions)
+            {
+                session.used = 0;
+                session.lastActivity = 0;
+                session.open = false;
+            }
+        }
+
+        void begin()
+        {
+            _server.begin();
+        }
+
+        // Accept new masters and answer the complete requests, never waits
+        void poll(ModbusServer &modbus)
+        {
+            // On the mbed core available() hands out each new connection once
+            ClientT incoming = _server.available();
+            if (incoming)
+            {
+                Session &session = slot();
+                session.client = incoming;
+                session.used = 0;
+                session.lastActivity = millis();
+                session.open = true;
+            }
+            uint32_t now = millis();
+            for (Session &session : _sessions)
+            {
+                if (!session.open)
+                {
+                    continue;
+                }
+                if (!session.client.connected() || now - session.lastActivity > MODBUS_IDLE_TIMEOUT_MS)
+                {
+                    close(session);
+                    continue;
+                }
+                serve(session, modbus);
+            }
+        }
+
+        int getClientCount() const
+        {
+            int count = 0;
+            for (const Session &session : _sessions)
+            {
+                count += session.open;
+            }
+            return count;
+        }
+    };
+} // namespace remoto
+
+#endif // MODBUS_H
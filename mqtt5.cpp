@@ -0,0 +1,704 @@
+/*
+ * Remoto: MQTT 5 client for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Packet encoding, session handling and topic aliases. See mqtt5.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "mqtt5.h"
+#include "http.h"
+#include "logger.h"
+
+namespace remoto
+{
+    constexpr uint8_t CONNECT = 1;
+    constexpr uint8_t CONNACK = 2;
+    constexpr uint8_t PUBLISH = 3;
+    constexpr uint8_t PUBACK = 4;
+    constexpr uint8_t SUBSCRIBE = 8;
+    constexpr uint8_t SUBACK = 9;
+    constexpr uint8_t PINGREQ = 12;
+    constexpr uint8_t PINGRESP = 13;
+    constexpr uint8_t DISCONNECT = 14;
+
+    // Property identifiers used by the client
+    constexpr uint8_t PROP_SESSION_EXPIRY = 0x11;
+    constexpr uint8_t PROP_SERVER_KEEP_ALIVE = 0x13;
+    constexpr uint8_t PROP_RECEIVE_MAXIMUM = 0x21;
+    constexpr uint8_t PROP_TOPIC_ALIAS_MAXIMUM = 0x22;
+    constexpr uint8_t PROP_TOPIC_ALIAS = 0x23;
+    constexpr uint8_t PROP_MAXIMUM_QOS = 0x24;
+    constexpr uint8_t PROP_MAXIMUM_PACKET_SIZE = 0x27;
+
+    // Fixed header and the longest remaining length encoding
+    constexpr size_t HEADER_ROOM = 5;
+
+    struct PacketWriter
+    {
+        uint8_t *data;
+        size_t capacity;
+        size_t length;
+        bool overflow;
+
+        PacketWriter(uint8_t *buffer, size_t size)
+            : data(buffer), capacity(size), length(0), overflow(false)
+        {
+        }
+
+        void byte(uint8_t value)
+        {
+            if (length < capacity)
+            {
+                data[length++] = value;
+            }
+            else
+            {
+                overflow = true;
+            }
+        }
+        void u16(uint16_t value)
+        {
+            byte(value >> 8);
+            byte(value & 0xFF);
+        }
+        void u32(uint32_t value)
+        {
+            u16(value >> 16);
+            u16(value & 0xFFFF);
+        }
+        void varint(uint32_t value)
+        {
+            do
+            {
+                uint8_t digit = value & 0x7F;
+                value >>= 7;
+                byte(value != 0 ? digit | 0x80 : digit);
+            } while (value != 0);
+        }
+        void bytes(const void *source, size_t size)
+        {
+            if (length + size <= capacity)
+            {
+                memcpy(data + length, source, size);
+                length += size;
+            }
+            else
+            {
+                overflow = true;
+            }
+        }
+        // Strings and binary data carry a two byte length
+        void string(const char *value, size_t size)
+        {
+            u16(size);
+            bytes(value, size);
+        }
+    };
+
+    struct PacketReader
+    {
+        const uint8_t *data;
+        size_t length;
+        size_t pos;
+        bool error;
+
+        PacketReader(const uint8_t *buffer, size_t size)
+            : data(buffer), length(size), pos(0), error(false)
+        {
+        }
+
+        const uint8_t *skip(size_t size)
+        {
+            if (pos + size > length)
+            {
+                error = true;
+                return nullptr;
+            }
+            const uint8_t *start = data + pos;
+            pos += size;
+            return start;
+        }
+        uint8_t byte()
+        {
+            const uint8_t *p = skip(1);
+            return p != nullptr ? p[0] : 0;
+        }
+        uint16_t u16()
+        {
+            const uint8_t *p = skip(2);
+            return p != nullptr ? (p[0] << 8) | p[1] : 0;
+        }
+        uint32_t u32()
+        {
+            uint32_t high = u16();
+            return (high << 16) | u16();
+        }
+        uint32_t varint()
+        {
+            uint32_t value = 0;
+            for (int shift = 0; shift < 28; shift += 7)
+            {
+                uint8_t digit = byte();
+                value |= (uint32_t)(digit & 0x7F) << shift;
+                if (!(digit & 0x80))
+                {
+                    return value;
+                }
+            }
+            error = true;
+            return 0;
+        }
+    };
+
+    // Read one property, numeric values are returned and the others
+    // skipped. Returns -1 on an unknown identifier.
+    static int readProperty(PacketReader &reader, uint8_t &id, uint32_t &value)
+    {
+        id = reader.byte();
+        value = 0;
+        switch (id)
+        {
+        case 0x01: case 0x17: case 0x19: case 0x24:
+        case 0x25: case 0x28: case 0x29: case 0x2A:
+            value = reader.byte();
+            break;
+        case 0x13: case 0x21: case 0x22: case 0x23:
+            value = reader.u16();
+            break;
+        case 0x02: case 0x11: case 0x18: case 0x27:
+            value = reader.u32();
+            break;
+        case 0x0B:
+            value = reader.varint();
+            break;
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15:
+        case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            reader.skip(reader.u16());
+            break;
+        case 0x26: // user property, a pair of strings
+            reader.skip(reader.u16());
+            reader.skip(reader.u16());
+            break;
+        default:
+            return -1;
+        }
+        return reader.error ? -1 : 0;
+    }
+
+    // FNV-1a, to look up the alias of a topic
+    static uint32_t topicHash(const char *topic, size_t length)
+    {
+        uint32_t hash = 2166136261UL;
+        for (size_t i = 0; i < length; ++i)
+        {
+            hash = (hash ^ (uint8_t)topic[i]) * 16777619UL;
+        }
+        return hash;
+    }
+
+    Mqtt5Client::Mqtt5Client()
+        : _net(nullptr), _host(nullptr), _port(0), _handler(nullptr), _rxLength(0),
+          _connected(false), _sessionPresent(false), _cleanStart(true), _reason(0), _packetId(0),
+          _keepAliveS(MQTT5_KEEPALIVE_S), _receiveMaximum(0), _sendQuota(0), _aliasMaximum(0),
+          _maxPacketSize(0), _maxQos(1), _lastSend(0), _pingSent(0), _pingPending(false),
+          _aliasCount(0), _arenaUsed(0)
+    {
+    }
+
+    void Mqtt5Client::begin(const char *host, uint16_t port, Client &net)
+    {
+        _host = host;
+        _port = port;
+        _net = &net;
+    }
+
+    void Mqtt5Client::onMessage(MqttMessageHandler handler)
+    {
+        _handler = handler;
+    }
+
+    uint16_t Mqtt5Client::nextPacketId()
+    {
+        if (++_packetId == 0)
+        {
+            _packetId = 1;
+        }
+        return _packetId;
+    }
+
+    void Mqtt5Client::close()
+    {
+        _connected = false;
+        _net->stop();
+    }
+
+    bool Mqtt5Client::send(uint8_t header, size_t bodyLength)
+    {
+        uint8_t length[4];
+        int digits = 0;
+        uint32_t value = bodyLength;
+        do
+        {
+            length[digits] = value & 0x7F;
+            value >>= 7;
+            if (value != 0)
+            {
+                length[digits] |= 0x80;
+            }
+            digits++;
+        } while (value != 0);
+
+        // The body was written after HEADER_ROOM, the header goes just before
+        uint8_t *start = _tx + HEADER_ROOM - 1 - digits;
+        start[0] = header;
+        memcpy(start + 1, length, digits);
+        size_t total = 1 + digits + bodyLength;
+        if (_maxPacketSize != 0 && total > _maxPacketSize)
+        {
+            return false;
+        }
+        if (_net->write(start, total) != total)
+        {
+            close();
+            return false;
+        }
+        _lastSend = millis();
+        return true;
+    }
+
+    // Returns 1 with a packet in _rx, 0 if none is waiting, -1 on error
+    int Mqtt5Client::readPacket(uint32_t timeoutMs, uint8_t &header)
+    {
+        if (_net->available() <= 0)
+        {
+            if (timeoutMs == 0)
+            {
+                return 0;
+            }
+        }
+        if (readExact(*_net, &header, 1, timeoutMs) != 1)
+        {
+            return timeoutMs == 0 ? 0 : -1;
+        }
+        uint32_t length = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            uint8_t digit;
+            if (shift > 21 || readExact(*_net, &digit, 1, MQTT5_TIMEOUT_MS) != 1)
+            {
+                return -1;
+            }
+            length |= (uint32_t)(digit & 0x7F) << shift;
+            if (!(digit & 0x80))
+            {
+                break;
+            }
+        }
+        // Larger than the Maximum Packet Size we announced
+        if (length > sizeof(_rx) || readExact(*_net, _rx, length, MQTT5_TIMEOUT_MS) != length)
+        {
+            return -1;
+        }
+        _rxLength = length;
+        return 1;
+    }
+
+    int Mqtt5Client::handlePublish(uint8_t flags)
+    {
+        PacketReader reader(_rx, _rxLength);
+        uint8_t qos = (flags >> 1) & 0x03;
+        uint16_t topicLength = reader.u16();
+        reader.skip(topicLength);
+        uint16_t packetId = qos > 0 ? reader.u16() : 0;
+        uint32_t propertiesLength = reader.varint();
+        reader.skip(propertiesLength);
+        // No inbound aliases were granted, so the topic is never empty
+        if (reader.error || topicLength == 0 || qos > 1)
+        {
+            return -1;
+        }
+        const uint8_t *payload = _rx + reader.pos;
+        size_t payloadLength = _rxLength - reader.pos;
+
+        // Slide the topic over its length to terminate it in place
+        memmove(_rx, _rx + 2, topicLength);
+        _rx[topicLength] = '\0';
+        if (_handler != nullptr)
+        {
+            _handler((const char *)_rx, payload, payloadLength);
+        }
+        if (qos == 1)
+        {
+            PacketWriter writer(_tx + HEADER_ROOM, sizeof(_tx) - HEADER_ROOM);
+            writer.u16(packetId);
+            return send(PUBACK << 4, writer.length) ? 0 : -1;
+        }
+        return 0;
+    }
+
+    int Mqtt5Client::handlePacket(uint8_t header)
+    {
+        uint8_t type = header >> 4;
+        switch (type)
+        {
+        case PUBLISH:
+            return handlePublish(header & 0x0F);
+        case PUBACK:
+            if (_sendQuota < _receiveMaximum)
+            {
+                _sendQuota++;
+            }
+            return 0;
+        case PINGRESP:
+            _pingPending = false;
+            return 0;
+        case DISCONNECT:
+            _reason = _rxLength > 0 ? _rx[0] : 0;
+            logWarn("MQTT broker disconnected, reason %d", _reason);
+            return -1;
+        case SUBACK:
+            // Late answer to a subscription that timed out
+            return 0;
+        default:
+            return -1;
+        }
+    }
+
+    int Mqtt5Client::waitFor(uint8_t type, uint16_t packetId)
+    {
+        uint32_t start = millis();
+        while (millis() - start < MQTT5_TIMEOUT_MS)
+        {
+            uint8_t header;
+            int result = readPacket(MQTT5_TIMEOUT_MS, header);
+            if (result < 0)
+            {
+                return -1;
+            }
+            if (result == 0)
+            {
+                continue;
+            }
+            if ((header >> 4) == type && (packetId == 0 || (_rxLength >= 2 && ((_rx[0] << 8) | _rx[1]) == packetId)))
+            {
+                return 0;
+            }
+            if (handlePacket(header) != 0)
+            {
+                return -1;
+            }
+        }
+        return -1;
+    }
+
+    int Mqtt5Client::parseConnack()
+    {
+        PacketReader reader(_rx, _rxLength);
+        uint8_t flags = reader.byte();
+        _reason = reader.byte();
+        if (reader.error || _reason != 0)
+        {
+            return -1;
+        }
+        _sessionPresent = flags & 0x01;
+        // Defaults of the specification when a property is absent
+        _receiveMaximum = 65535;
+        _aliasMaximum = 0;
+        _maxPacketSize = 0;
+        _maxQos = 1;
+        _keepAliveS = MQTT5_KEEPALIVE_S;
+
+        uint32_t propertiesLength = reader.varint();
+        size_t end = reader.pos + propertiesLength;
+        while (!reader.error && reader.pos < end)
+        {
+            uint8_t id;
+            uint32_t value;
+            if (readProperty(reader, id, value) != 0)
+            {
+                return -1;
+            }
+            switch (id)
+            {
+            case PROP_RECEIVE_MAXIMUM:
+                _receiveMaximum = value;
+                break;
+            case PROP_TOPIC_ALIAS_MAXIMUM:
+                _aliasMaximum = value < MQTT5_MAX_ALIASES ? value : MQTT5_MAX_ALIASES;
+                break;
+            case PROP_MAXIMUM_PACKET_SIZE:
+                _maxPacketSize = value;
+                break;
+            case PROP_MAXIMUM_QOS:
+                _maxQos = value;
+                break;
+            case PROP_SERVER_KEEP_ALIVE:
+                _keepAliveS = value;
+                break;
+            }
+        }
+        return reader.error || _receiveMaximum == 0 ? -1 : 0;
+    }
+
+    bool Mqtt5Client::connect(const char *clientId, const char *user, const char *password)
+    {
+        if (_net == nullptr)
+        {
+            return false;
+        }
+        if (_net->connected())
+        {
+            _net->stop();
+        }
+        _connected = false;
+        _maxPacketSize = 0;
+        if (!_net->connect(_host, _port))
+        {
+            return false;
+        }
+
+        PacketWriter writer(_tx + HEADER_ROOM, sizeof(_tx) - HEADER_ROOM);
+        writer.string("MQTT", 4);
+        writer.byte(MQTT_VERSION_5);
+        uint8_t flags = _cleanStart ? 0x02 : 0x00;
+        if (user != nullptr && user[0] != '\0')
+        {
+            flags |= 0x80;
+            if (password != nullptr)
+            {
+                flags |= 0x40;
+            }
+        }
+        writer.byte(flags);
+        writer.u16(MQTT5_KEEPALIVE_S);
+        // Properties: 5 + 3 + 5 bytes
+        writer.varint(13);
+        writer.byte(PROP_SESSION_EXPIRY);
+        writer.u32(MQTT5_SESSION_EXPIRY_S);
+        writer.byte(PROP_RECEIVE_MAXIMUM);
+        writer.u16(MQTT5_RECEIVE_MAXIMUM);
+        writer.byte(PROP_MAXIMUM_PACKET_SIZE);
+        writer.u32(MQTT5_BUFFER_SIZE);
+        writer.string(clientId, strlen(clientId));
+        if (flags & 0x80)
+        {
+            writer.string(user, strlen(user));
+        }
+        if (flags & 0x40)
+        {
+            writer.string(password, strlen(password));
+        }
+        if (writer.overflow || !send(CONNECT << 4, writer.length))
+        {
+            close();
+            return false;
+        }
+
+        uint8_t header;
+        if (readPacket(MQTT5_TIMEOUT_MS, header) != 1 || (header >> 4) != CONNACK || parseConnack() != 0)
+        {
+            close();
+            return false;
+        }
+        // Aliases live as long as the network connection
+        _aliasCount = 0;
+        _arenaUsed = 0;
+        _sendQuota = _receiveMaximum;
+        _pingPending = false;
+        _cleanStart = false;
+        _connected = true;
+        return true;
+    }
+
+    void Mqtt5Client::disconnect()
+    {
+        if (_connected)
+        {
+            // Normal disconnection, the session is kept for its expiry
+            PacketWriter writer(_tx + HEADER_ROOM, sizeof(_tx) - HEADER_ROOM);
+            writer.byte(0x00);
+            send(DISCONNECT << 4, writer.length);
+        }
+        close();
+    }
+
+    bool Mqtt5Client::connected()
+    {
+        if (_connected && !_net->connected())
+        {
+            _connected = false;
+        }
+        return _connected;
+    }
+
+    // Alias of a topic, 0 when none is left. A new alias must go out
+    // with the full topic once.
+    uint16_t Mqtt5Client::findAlias(const char *topic, size_t length, bool &isNew)
+    {
+        isNew = false;
+        uint32_t hash = topicHash(topic, length);
+        for (uint16_t i = 0; i < _aliasCount; ++i)
+        {
+            const char *stored = _arena + _aliasOffset[i];
+            if (_aliasHash[i] == hash && strncmp(stored, topic, length) == 0 && stored[length] == '\0')
+            {
+                return i + 1;
+            }
+        }
+        if (_aliasCount >= _aliasMaximum || _arenaUsed + length + 1 > sizeof(_arena))
+        {
+            return 0;
+        }
+        memcpy(_arena + _arenaUsed, topic, length);
+        _arena[_arenaUsed + length] = '\0';
+        _aliasHash[_aliasCount] = hash;
+        _aliasOffset[_aliasCount] = _arenaUsed;
+        _arenaUsed += length + 1;
+        isNew = true;
+        return ++_aliasCount;
+    }
+
+    // Undo findAlias() for a publish that did not go out, the broker
+    // has not seen the topic for that alias
+    void Mqtt5Client::dropNewestAlias()
+    {
+        _aliasCount--;
+        _arenaUsed = _aliasOffset[_aliasCount];
+    }
+
+    bool Mqtt5Client::publish(const char *topic, const uint8_t *payload, size_t length, bool retained, uint8_t qos)
+    {
+        if (!connected())
+        {
+            return false;
+        }
+        qos = qos > _maxQos ? _maxQos : qos;
+        qos = qos > 1 ? 1 : qos;
+        // Flow control, wait for the broker to acknowledge earlier ones
+        if (qos == 1 && _sendQuota == 0 && waitFor(PUBACK, 0) == 0)
+        {
+            handlePacket(PUBACK << 4);
+        }
+        if (qos == 1 && _sendQuota == 0)
+        {
+            return false;
+        }
+
+        size_t topicLength = strlen(topic);
+        bool isNew;
+        uint16_t alias = findAlias(topic, topicLength, isNew);
+        PacketWriter writer(_tx + HEADER_ROOM, sizeof(_tx) - HEADER_ROOM);
+        if (alias != 0 && !isNew)
+        {
+            writer.u16(0);
+        }
+        else
+        {
+            writer.string(topic, topicLength);
+        }
+        uint16_t packetId = 0;
+        if (qos == 1)
+        {
+            packetId = nextPacketId();
+            writer.u16(packetId);
+        }
+        if (alias != 0)
+        {
+            writer.varint(3);
+            writer.byte(PROP_TOPIC_ALIAS);
+            writer.u16(alias);
+        }
+        else
+        {
+            writer.varint(0);
+        }
+        writer.bytes(payload, length);
+        uint8_t header = (PUBLISH << 4) | (qos << 1) | (retained ? 0x01 : 0x00);
+        if (writer.overflow || !send(header, writer.length))
+        {
+            if (isNew)
+            {
+                dropNewestAlias();
+            }
+            return false;
+        }
+        if (qos == 1)
+        {
+            _sendQuota--;
+        }
+        return true;
+    }
+
+    bool Mqtt5Client::subscribe(const char *topic, uint8_t qos)
+    {
+        if (!connected())
+        {
+            return false;
+        }
+        uint16_t packetId = nextPacketId();
+        PacketWriter writer(_tx + HEADER_ROOM, sizeof(_tx) - HEADER_ROOM);
+        writer.u16(packetId);
+        writer.varint(0);
+        writer.string(topic, strlen(topic));
+        // Maximum QoS, retained messages sent on subscribe
+        writer.byte(qos > 1 ? 1 : qos);
+        if (writer.overflow || !send((SUBSCRIBE << 4) | 0x02, writer.length))
+        {
+            return false;
+        }
+        if (waitFor(SUBACK, packetId) != 0)
+        {
+            close();
+            return false;
+        }
+        // Packet id, properties, then one reason code per filter
+        PacketReader reader(_rx + 2, _rxLength - 2);
+        reader.skip(reader.varint());
+        uint8_t reason = reader.byte();
+        return !reader.error && reason < 0x80;
+    }
+
+    bool Mqtt5Client::loop()
+    {
+        if (!connected())
+        {
+            return false;
+        }
+        // Bounded, so a flood of messages does not hold up the caller
+        for (int i = 0; i < MQTT5_RECEIVE_MAXIMUM * 2; ++i)
+        {
+            uint8_t header;
+            int result = readPacket(0, header);
+            if (result == 0)
+            {
+                break;
+            }
+            if (result < 0 || handlePacket(header) != 0)
+            {
+                close();
+                return false;
+            }
+        }
+
+        uint32_t now = millis();
+        if (_pingPending && now - _pingSent > _keepAliveS * 1000UL)
+        {
+            logWarn("MQTT broker stopped answering");
+            close();
+            return false;
+        }
+        if (_keepAliveS != 0 && !_pingPending && now - _lastSend >= _keepAliveS * 1000UL)
+        {
+            if (!send(PINGREQ << 4, 0))
+            {
+                return false;
+            }
+            _pingSent = now;
+            _pingPending = true;
+        }
+        return true;
+    }
+} // namespace remoto
@@ -0,0 +1,114 @@
+/*
+ * Remoto: MQTT 5 client for Arduino OPTA
+ * -------------------------------------------------------------------
+ * The subset of MQTT 5.0 the firmware needs, on any Arduino Client:
+ *
+ *  - Topic aliases. The first publish on a topic carries the topic and
+ *    an alias number, the following ones the two byte alias only, up to
+ *    the Topic Alias Maximum granted by the broker.
+ *  - Session expiry. The broker keeps the session, subscriptions and
+ *    queued QoS 1 messages, for MQTT5_SESSION_EXPIRY_S after a
+ *    disconnection; on reconnect sessionPresent() tells whether the
+ *    subscriptions must be renewed.
+ *  - Receive Maximum. Unacknowledged QoS 1 publishes never exceed the
+ *    broker limit, and the broker is told to send at most
+ *    MQTT5_RECEIVE_MAXIMUM at a time.
+ *
+ * QoS 2 and will messages are not supported, and unacknowledged QoS 1
+ * publishes are not resent after a reconnection.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(MQTT5_H)
+#define MQTT5_H
+#include <Arduino.h>
+#include "mqtttransport.h"
+
+#define MQTT5_KEEPALIVE_S 10
+// Wait for an acknowledgement or the rest of a packet
+#define MQTT5_TIMEOUT_MS 1000
+#define MQTT5_SESSION_EXPIRY_S 300
+#define MQTT5_RECEIVE_MAXIMUM 4
+// Largest packet sent or received, also announced as Maximum Packet Size
+#define MQTT5_BUFFER_SIZE 1024
+// Outgoing topic aliases, topics past either limit are sent in full
+#define MQTT5_MAX_ALIASES 320
+#define MQTT5_ALIAS_ARENA 8192
+
+namespace remoto
+{
+    class Mqtt5Client : public MqttTransport
+    {
+    private:
+        Client *_net;
+        const char *_host;
+        uint16_t _port;
+        MqttMessageHandler _handler;
+
+        uint8_t _tx[MQTT5_BUFFER_SIZE];
+        uint8_t _rx[MQTT5_BUFFER_SIZE];
+        size_t _rxLength;
+
+        bool _connected;
+        bool _sessionPresent;
+        bool _cleanStart; // only for the first connection after boot
+        uint8_t _reason;  // last CONNACK or DISCONNECT reason code
+        uint16_t _packetId;
+
+        // Limits granted by the broker in CONNACK
+        uint16_t _keepAliveS;
+        uint16_t _receiveMaximum;
+        uint16_t _sendQuota; // QoS 1 publishes that may still be sent
+        uint16_t _aliasMaximum;
+        uint32_t _maxPacketSize;
+        uint8_t _maxQos;
+
+        uint32_t _lastSend;
+        uint32_t _pingSent;
+        bool _pingPending;
+
+        // Topic of each alias, alias n is entry n-1
+        uint32_t _aliasHash[MQTT5_MAX_ALIASES];
+        uint16_t _aliasOffset[MQTT5_MAX_ALIASES];
+        uint16_t _aliasCount;
+        uint16_t _arenaUsed;
+        char _arena[MQTT5_ALIAS_ARENA];
+
+        uint16_t nextPacketId();
+        uint16_t findAlias(const char *topic, size_t length, bool &isNew);
+        void dropNewestAlias();
+        bool send(uint8_t header, size_t bodyLength);
+        int readPacket(uint32_t timeoutMs, uint8_t &header);
+        int handlePacket(uint8_t header);
+        int handlePublish(uint8_t flags);
+        int parseConnack();
+        // Process incoming packets until one of the wanted type arrives
+        int waitFor(uint8_t type, uint16_t packetId);
+        void close();
+
+    public:
+        Mqtt5Client();
+
+        void begin(const char *host, uint16_t port, Client &net) override;
+        bool connect(const char *clientId, const char *user, const char *password) override;
+        void disconnect() override;
+        bool connected() override;
+        bool sessionPresent() const override { return _sessionPresent; }
+        bool publish(const char *topic, const uint8_t *payload, size_t length,
+                     bool retained = false, uint8_t qos = 0) override;
+        bool subscribe(const char *topic, uint8_t qos = 0) override;
+        bool loop() override;
+        void onMessage(MqttMessageHandler handler) override;
+        uint8_t protocolVersion() const override { return MQTT_VERSION_5; }
+
+        using MqttTransport::publish;
+
+        uint8_t getReasonCode() const { return _reason; }
+        uint16_t getAliasCount() const { return _aliasCount; }
+    };
+} // namespace remoto
+
+#endif // MQTT5_H
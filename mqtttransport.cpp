@@ -0,0 +1,75 @@
+/*
+ * Remoto: MQTT transport for Arduino OPTA
+ * -------------------------------------------------------------------
+ * MQTT 3.1.1 adapter over the MQTTClient library. See mqtttransport.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "mqtttransport.h"
+
+namespace remoto
+{
+    // The library callback has no context, there is one transport
+    static Mqtt311Transport *instance = nullptr;
+
+    Mqtt311Transport::Mqtt311Transport()
+        : _client(MQTT311_BUFFER_SIZE), _handler(nullptr), _sessionPresent(false)
+    {
+        instance = this;
+    }
+
+    void Mqtt311Transport::received(MQTTClient *, char topic[], char bytes[], int length)
+    {
+        if (instance != nullptr && instance->_handler != nullptr)
+        {
+            instance->_handler(topic, (const uint8_t *)bytes, length);
+        }
+    }
+
+    void Mqtt311Transport::begin(const char *host, uint16_t port, Client &net)
+    {
+        _client.begin(host, port, net);
+        _client.onMessageAdvanced(received);
+    }
+
+    bool Mqtt311Transport::connect(const char *clientId, const char *user, const char *password)
+    {
+        // Clean sessions, the subscriptions are renewed on every connection
+        bool ok = _client.connect(clientId, user, password);
+        _sessionPresent = false;
+        return ok;
+    }
+
+    void Mqtt311Transport::disconnect()
+    {
+        _client.disconnect();
+    }
+
+    bool Mqtt311Transport::connected()
+    {
+        return _client.connected();
+    }
+
+    bool Mqtt311Transport::publish(const char *topic, const uint8_t *payload, size_t length, bool retained, uint8_t qos)
+    {
+        return _client.publish(topic, (const char *)payload, length, retained, qos);
+    }
+
+    bool Mqtt311Transport::subscribe(const char *topic, uint8_t qos)
+    {
+        return _client.subscribe(topic, qos);
+    }
+
+    bool Mqtt311Transport::loop()
+    {
+        return _client.loop();
+    }
+
+    void Mqtt311Transport::onMessage(MqttMessageHandler handler)
+    {
+        _handler = handler;
+    }
+} // namespace remoto
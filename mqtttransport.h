@@ -0,0 +1,85 @@
+/*
+ * Remoto: MQTT transport for Arduino OPTA
+ * -------------------------------------------------------------------
+ * The firmware talks to the broker through MqttTransport, so the
+ * protocol version is a setting. Version 3.1.1 goes through the
+ * MQTTClient library, version 5 through Mqtt5Client (see mqtt5.h).
+ * Received messages are handed over as bytes, without String copies.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(MQTTTRANSPORT_H)
+#define MQTTTRANSPORT_H
+#include <Arduino.h>
+#include <MQTT.h>
+
+// Protocol levels of the CONNECT packet
+#define MQTT_VERSION_311 4
+#define MQTT_VERSION_5 5
+// Packet buffer of the 3.1.1 client, largest topic plus payload
+#define MQTT311_BUFFER_SIZE 1024
+
+namespace remoto
+{
+    // Topic is null terminated, the payload is not
+    typedef void (*MqttMessageHandler)(const char *topic, const uint8_t *payload, size_t length);
+
+    class MqttTransport
+    {
+    public:
+        virtual ~MqttTransport() = default;
+
+        virtual void begin(const char *host, uint16_t port, Client &net) = 0;
+        virtual bool connect(const char *clientId, const char *user, const char *password) = 0;
+        virtual void disconnect() = 0;
+        virtual bool connected() = 0;
+        // True when the broker kept the subscriptions of the last session
+        virtual bool sessionPresent() const = 0;
+
+        virtual bool publish(const char *topic, const uint8_t *payload, size_t length,
+                             bool retained = false, uint8_t qos = 0) = 0;
+        virtual bool subscribe(const char *topic, uint8_t qos = 0) = 0;
+        // Keepalive and dispatch of the received messages
+        virtual bool loop() = 0;
+        virtual void onMessage(MqttMessageHandler handler) = 0;
+        virtual uint8_t protocolVersion() const = 0;
+
+        bool publish(const char *topic, const char *payload, bool retained = false, uint8_t qos = 0)
+        {
+            return publish(topic, (const uint8_t *)payload, strlen(payload), retained, qos);
+        }
+    };
+
+    // MQTT 3.1.1 through the MQTTClient library
+    class Mqtt311Transport : public MqttTransport
+    {
+    private:
+        MQTTClient _client;
+        MqttMessageHandler _handler;
+        bool _sessionPresent;
+
+        static void received(MQTTClient *client, char topic[], char bytes[], int length);
+
+    public:
+        Mqtt311Transport();
+
+        void begin(const char *host, uint16_t port, Client &net) override;
+        bool connect(const char *clientId, const char *user, const char *password) override;
+        void disconnect() override;
+        bool connected() override;
+        bool sessionPresent() const override { return _sessionPresent; }
+        bool publish(const char *topic, const uint8_t *payload, size_t length,
+                     bool retained = false, uint8_t qos = 0) override;
+        bool subscribe(const char *topic, uint8_t qos = 0) override;
+        bool loop() override;
+        void onMessage(MqttMessageHandler handler) override;
+        uint8_t protocolVersion() const override { return MQTT_VERSION_311; }
+
+        using MqttTransport::publish;
+    };
+} // namespace remoto
+
+#endif // MQTTTRANSPORT_H
@@ -0,0 +1,205 @@
+/*
+ * Remoto: Over-the-air firmware update for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Streaming image writer and bootloader handoff. See ota.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "ota.h"
+#include <Arduino_Portenta_OTA.h>
+#include "logger.h"
+
+namespace remoto
+{
+    // The bootloader looks for the image under this name
+    static const char *const OTA_UPDATE_FILE = "/fs/UPDATE.BIN";
+
+    static Arduino_Portenta_OTA_QSPI ota(QSPI_FLASH_FATFS_MBR, OTA_PARTITION);
+
+    static int parseHex(const char *hex, uint8_t *out, size_t length)
+    {
+        if (strlen(hex) != length * 2)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < length * 2; ++i)
+        {
+            char c = tolower(hex[i]);
+            int nibble;
+            if (c >= '0' && c <= '9')
+            {
+                nibble = c - '0';
+            }
+            else if (c >= 'a' && c <= 'f')
+            {
+                nibble = c - 'a' + 10;
+            }
+            else
+            {
+                return -1;
+            }
+            if (i % 2 == 0)
+            {
+                out[i / 2] = nibble << 4;
+            }
+            else
+            {
+                out[i / 2] |= nibble;
+            }
+        }
+        return 0;
+    }
+
+    FirmwareUpdater::FirmwareUpdater()
+        : _file(nullptr), _size(0), _written(0), _verified(false)
+    {
+        mbedtls_sha256_init(&_sha);
+    }
+
+    FirmwareUpdater::~FirmwareUpdater()
+    {
+        abort();
+        mbedtls_sha256_free(&_sha);
+    }
+
+    int FirmwareUpdater::begin(size_t size, const char *sha256Hex)
+    {
+        abort();
+        if (size == 0 || size > OTA_MAX_IMAGE_SIZE || parseHex(sha256Hex, _expected, SHA256_SIZE) != 0)
+        {
+            return -1;
+        }
+        // Mounts the update partition
+        if (ota.begin() != Arduino_Portenta_OTA::Error::None)
+        {
+            logError("OTA: update partition not available");
+            return -1;
+        }
+        _file = fopen(OTA_UPDATE_FILE, "wb");
+        if (_file == nullptr)
+        {
+            logError("OTA: cannot create update file");
+            return -1;
+        }
+        // Data goes from our chunk buffer straight to the file system
+        setvbuf(_file, nullptr, _IONBF, 0);
+        mbedtls_sha256_starts_ret(&_sha, 0);
+        _size = size;
+        _written = 0;
+        return 0;
+    }
+
+    int FirmwareUpdater::write(const uint8_t *data, size_t length)
+    {
+        if (_file == nullptr || _written + length > _size)
+        {
+            return -1;
+        }
+        if (fwrite(data, 1, length, _file) != length)
+        {
+            return -1;
+        }
+        mbedtls_sha256_update_ret(&_sha, data, length);
+        _written += length;
+        return 0;
+    }
+
+    // Hash what actually landed in flash
+    int FirmwareUpdater::readBackDigest(uint8_t *digest)
+    {
+        static uint8_t chunk[OTA_CHUNK_SIZE];
+        FILE *file = fopen(OTA_UPDATE_FILE, "rb");
+        if (file == nullptr)
+        {
+            return -1;
+        }
+        mbedtls_sha256_context sha;
+        mbedtls_sha256_init(&sha);
+        mbedtls_sha256_starts_ret(&sha, 0);
+        size_t total = 0;
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        {
+            mbedtls_sha256_update_ret(&sha, chunk, n);
+            total += n;
+        }
+        fclose(file);
+        mbedtls_sha256_finish_ret(&sha, digest);
+        mbedtls_sha256_free(&sha);
+        return total == _size ? 0 : -1;
+    }
+
+    int FirmwareUpdater::finish()
+    {
+        if (_file == nullptr || _written != _size)
+        {
+            abort();
+            return -1;
+        }
+        fclose(_file);
+        _file = nullptr;
+
+        uint8_t digest[SHA256_SIZE];
+        mbedtls_sha256_finish_ret(&_sha, digest);
+        if (memcmp(digest, _expected, SHA256_SIZE) != 0)
+        {
+            logError("OTA: received image does not match its digest");
+            abort();
+            return -1;
+        }
+        if (readBackDigest(digest) != 0 || memcmp(digest, _expected, SHA256_SIZE) != 0)
+        {
+            logError("OTA: stored image does not match its digest");
+            abort();
+            return -1;
+        }
+        _verified = true;
+        return 0;
+    }
+
+    void FirmwareUpdater::abort()
+    {
+        if (_file != nullptr)
+        {
+            fclose(_file);
+            _file = nullptr;
+        }
+        if (_size > 0 && !_verified)
+        {
+            // Never leave a partial image where the bootloader looks
+            remove(OTA_UPDATE_FILE);
+        }
+        _size = 0;
+        _written = 0;
+        _verified = false;
+    }
+
+    void FirmwareUpdater::apply()
+    {
+        if (!_verified)
+        {
+            return;
+        }
+        logInfo("OTA: image verified, switching to the new firmware");
+        // Flags the update for the bootloader, which flashes it on reset
+        if (ota.update() != Arduino_Portenta_OTA::Error::None)
+        {
+            logError("OTA: bootloader handoff failed");
+            return;
+        }
+        ota.reset();
+    }
+
+    size_t FirmwareUpdater::getWritten() const
+    {
+        return _written;
+    }
+
+    size_t FirmwareUpdater::getSize() const
+    {
+        return _size;
+    }
+} // namespace remoto
@@ -0,0 +1,64 @@
+/*
+ * Remoto: Over-the-air firmware update for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Streams a firmware image into the update partition of the QSPI flash
+ * in fixed-size chunks while hashing it with SHA-256, so RAM use does
+ * not depend on the image size. Once the image is complete it is read
+ * back and verified against the expected digest, and only then handed
+ * over to the bootloader, which installs it on the next reset.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(OTA_H)
+#define OTA_H
+#include <Arduino.h>
+#include "mbedtls/sha256.h"
+
+// Chunk size of the streaming update, one QSPI erase sector
+#define OTA_CHUNK_SIZE 4096
+// Largest image accepted, the whole M7 flash
+#define OTA_MAX_IMAGE_SIZE (2 * 1024 * 1024UL)
+// QSPI partition holding the update file
+#define OTA_PARTITION 2
+
+namespace remoto
+{
+    constexpr size_t SHA256_SIZE = 32;
+
+    class FirmwareUpdater
+    {
+    private:
+        mbedtls_sha256_context _sha;
+        uint8_t _expected[SHA256_SIZE];
+        FILE *_file;
+        size_t _size;
+        size_t _written;
+        bool _verified;
+
+        int readBackDigest(uint8_t *digest);
+
+    public:
+        FirmwareUpdater();
+        ~FirmwareUpdater();
+
+        // Prepare the update partition for an image of the given size,
+        // expected digest as 64 hex characters
+        int begin(size_t size, const char *sha256Hex);
+        // Append the next chunk of the image
+        int write(const uint8_t *data, size_t length);
+        // Check the received and the stored image against the digest
+        int finish();
+        // Discard a partial image
+        void abort();
+        // Hand the verified image to the bootloader and reset, does not return
+        void apply();
+
+        size_t getWritten() const;
+        size_t getSize() const;
+    };
+} // namespace remoto
+
+#endif // OTA_H
@@ -0,0 +1,380 @@
+/*
+ * Remoto: Timed output programs for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Command parsing and the edge scheduler. See outputtimer.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "outputtimer.h"
+#include "logger.h"
+
+namespace remoto
+{
+    static_assert(MAX_OUTPUTS <= 64, "report flags are 64 bit");
+
+    static const char *const MODE_NAMES[NUM_TIMED_MODES] = {"set", "pulse", "delay", "pwm", "sequence", "cancel"};
+    static const char *const STATUS_NAMES[NUM_TIMED_STATUSES] = {"idle", "running", "done", "cancelled", "failed"};
+
+    static constexpr uint32_t WAKE_FLAG = 1;
+
+    static bool validMs(JsonVariantConst ms)
+    {
+        return ms.is<uint32_t>() && ms.as<uint32_t>() > 0 && ms.as<uint32_t>() <= TIMED_MAX_STEP_MS;
+    }
+
+    static bool validValue(JsonVariantConst value)
+    {
+        return value.is<int>() && (value.as<int>() == 0 || value.as<int>() == 1);
+    }
+
+    int parseTimedCommand(const char *payload, size_t length, TimedCommand &command)
+    {
+        memset((void *)&command, 0, sizeof(command));
+        if (length == 0)
+        {
+            return -1;
+        }
+        // Plain value, as sent by the first releases
+        if (payload[0] != '{')
+        {
+            char value[16];
+            size_t n = length < sizeof(value) - 1 ? length : sizeof(value) - 1;
+            memcpy(value, payload, n);
+            value[n] = '\0';
+            command.mode = TIMED_SET;
+            command.final = atoi(value) != 0;
+            return 0;
+        }
+
+        // On the heap, the callers run on small stacks
+        DynamicJsonDocument doc(JSON_OBJECT_SIZE(8) + JSON_ARRAY_SIZE(TIMED_MAX_STEPS) + TIMED_MAX_STEPS * JSON_ARRAY_SIZE(2) + 64);
+        if (deserializeJson(doc, payload, length))
+        {
+            return -1;
+        }
+        const char *mode = doc["mode"];
+        int m = 0;
+        while (m < NUM_TIMED_MODES && (mode == nullptr || strcmp(mode, MODE_NAMES[m]) != 0))
+        {
+            m++;
+        }
+        command.mode = (TimedMode)m;
+        JsonVariantConst value = doc["value"];
+        switch (command.mode)
+        {
+        case TIMED_SET:
+            if (!validValue(value))
+            {
+                return -1;
+            }
+            command.final = value.as<int>();
+            return 0;
+        case TIMED_PULSE:
+        {
+            // High by default, back to the opposite level afterwards
+            if ((!value.isNull() && !validValue(value)) || !validMs(doc["ms"]))
+            {
+                return -1;
+            }
+            uint8_t level = value.isNull() ? 1 : value.as<int>();
+            command.steps = 1;
+            command.step[0] = {doc["ms"].as<uint32_t>(), level};
+            command.repeat = 1;
+            command.final = !level;
+            return 0;
+        }
+        case TIMED_DELAY:
+            if (!validValue(value) || !validMs(doc["ms"]))
+            {
+                return -1;
+            }
+            command.steps = 1;
+            command.step[0] = {doc["ms"].as<uint32_t>(), 0};
+            command.repeat = 1;
+            command.final = value.as<int>();
+            return 0;
+        case TIMED_PWM:
+        {
+            JsonVariantConst count = doc["count"];
+            if (!validMs(doc["periodMs"]) || !validMs(doc["onMs"]) ||
+                doc["onMs"].as<uint32_t>() >= doc["periodMs"].as<uint32_t>() ||
+                (!count.isNull() && !count.is<uint32_t>()))
+            {
+                return -1;
+            }
+            uint32_t onMs = doc["onMs"].as<uint32_t>();
+            command.steps = 2;
+            command.step[0] = {onMs, 1};
+            command.step[1] = {doc["periodMs"].as<uint32_t>() - onMs, 0};
+            command.repeat = count.as<uint32_t>();
+            command.final = 0;
+            return 0;
+        }
+        case TIMED_SEQUENCE:
+        {
+            // [[value, ms], ...]
+            JsonArrayConst steps = doc["steps"];
+            JsonVariantConst repeat = doc["repeat"];
+            JsonVariantConst final = doc["final"];
+            if (steps.isNull() || steps.size() == 0 || steps.size() > TIMED_MAX_STEPS ||
+                (!repeat.isNull() && !repeat.is<uint32_t>()) || (!final.isNull() && !validValue(final)))
+            {
+                return -1;
+            }
+            for (JsonVariantConst step : steps)
+            {
+                if (step.size() != 2 || !validValue(step[0]) || !validMs(step[1]))
+                {
+                    return -1;
+                }
+                command.step[command.steps++] = {step[1].as<uint32_t>(), (uint8_t)step[0].as<int>()};
+            }
+            command.repeat = repeat.isNull() ? 1 : repeat.as<uint32_t>();
+            command.final = final | 0;
+            return 0;
+        }
+        case TIMED_CANCEL:
+            return 0;
+        default:
+            return -1;
+        }
+    }
+
+    OutputTimer::OutputTimer(Channels &channels)
+        : _channels(channels), _reports{}, _unpublished(0)
+    {
+        for (int i = 0; i < TIMED_SLOTS; ++i)
+        {
+            _slots[i].output = -1;
+        }
+    }
+
+    uint64_t OutputTimer::nowUs()
+    {
+        // 64 bit microseconds of the hardware ticker, never wraps
+        return ticker_read_us(get_us_ticker_data());
+    }
+
+    void OutputTimer::expired()
+    {
+        // Interrupt context, the thread does the work
+        _wake.set(WAKE_FLAG);
+    }
+
+    int OutputTimer::find(int output) const
+    {
+        for (int i = 0; i < TIMED_SLOTS; ++i)
+        {
+            if (_slots[i].output == output)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int OutputTimer::start(int output, const TimedCommand &command)
+    {
+        if (output < 0 || output >= _channels.outputCount() || command.mode >= NUM_TIMED_MODES)
+        {
+            return -1;
+        }
+        int result = 0;
+        _mutex.lock();
+        int running = find(output);
+        if (running >= 0)
+        {
+            finish(_slots[running], TIMED_CANCELLED);
+        }
+        if (command.mode == TIMED_SET)
+        {
+            result = _channels.setOutput(output, command.final);
+        }
+        else if (command.mode != TIMED_CANCEL)
+        {
+            int free = find(-1);
+            if (free < 0)
+            {
+                result = -1;
+            }
+            else
+            {
+                Slot &slot = _slots[free];
+                slot.output = output;
+                slot.command = command;
+                if (command.mode == TIMED_DELAY)
+                {
+                    slot.command.step[0].value = _channels.getOutput(output);
+                }
+                slot.step = 0;
+                slot.cycle = 0;
+                // The first edge is applied by the timer thread like the others
+                slot.dueUs = nowUs();
+                slot.firstDueUs = slot.dueUs;
+                slot.firstUs = 0;
+                _reports[output] = {};
+                _reports[output].mode = command.mode;
+                _reports[output].status = TIMED_RUNNING;
+                _unpublished &= ~(1ULL << output);
+            }
+        }
+        _mutex.unlock();
+        _wake.set(WAKE_FLAG);
+        return result;
+    }
+
+    void OutputTimer::skipMissed(Slot &slot, uint64_t now)
+    {
+        const TimedCommand &command = slot.command;
+        TimedReport &report = _reports[slot.output];
+        // Every step lasts at least a millisecond, the loop ends
+        while (!(command.repeat != 0 && slot.cycle >= command.repeat) &&
+               slot.dueUs + command.step[slot.step].ms * 1000ULL <= now)
+        {
+            slot.dueUs += command.step[slot.step].ms * 1000ULL;
+            if (++slot.step == command.steps)
+            {
+                slot.step = 0;
+                report.cycles = ++slot.cycle;
+            }
+            report.skipped++;
+        }
+    }
+
+    void OutputTimer::edge(Slot &slot, uint64_t now)
+    {
+        const TimedCommand &command = slot.command;
+        bool last = command.repeat != 0 && slot.cycle >= command.repeat;
+        uint8_t value = last ? command.final : command.step[slot.step].value;
+        if (_channels.setOutput(slot.output, value) != 0)
+        {
+            logWarn("Timed output O%d could not be written", slot.output + 1);
+            finish(slot, TIMED_FAILED);
+            return;
+        }
+
+        TimedReport &report = _reports[slot.output];
+        if (report.edges == 0)
+        {
+            slot.firstUs = now;
+        }
+        report.edges++;
+        uint64_t late = now - slot.dueUs;
+        if (late > report.maxLateUs)
+        {
+            report.maxLateUs = late > UINT32_MAX ? UINT32_MAX : (uint32_t)late;
+        }
+        report.requestedUs = slot.dueUs - slot.firstDueUs;
+        report.actualUs = now - slot.firstUs;
+        if (last)
+        {
+            finish(slot, TIMED_DONE);
+            return;
+        }
+
+        // From the schedule, not from now, so lateness does not add up
+        slot.dueUs += command.step[slot.step].ms * 1000ULL;
+        if (++slot.step == command.steps)
+        {
+            slot.step = 0;
+            report.cycles = ++slot.cycle;
+        }
+    }
+
+    void OutputTimer::finish(Slot &slot, TimedStatus status)
+    {
+        _reports[slot.output].status = status;
+        _unpublished |= 1ULL << slot.output;
+        logDebug("Timed output O%d %s %s", slot.output + 1, MODE_NAMES[slot.command.mode], STATUS_NAMES[status]);
+        slot.output = -1;
+    }
+
+    void OutputTimer::run()
+    {
+        _wake.wait_any(WAKE_FLAG);
+        _mutex.lock();
+        uint64_t now = nowUs();
+        uint64_t next = UINT64_MAX;
+        for (int i = 0; i < TIMED_SLOTS; ++i)
+        {
+            Slot &slot = _slots[i];
+            // One write per slot, the edges already overdue are skipped
+            if (slot.output >= 0 && slot.dueUs <= now)
+            {
+                skipMissed(slot, now);
+                edge(slot, now);
+                now = nowUs();
+            }
+            if (slot.output >= 0 && slot.dueUs < next)
+            {
+                next = slot.dueUs;
+            }
+        }
+        _timeout.detach();
+        if (next != UINT64_MAX)
+        {
+            _timeout.attach(mbed::callback(this, &OutputTimer::expired), std::chrono::microseconds(next > now ? next - now : 0));
+        }
+        _mutex.unlock();
+    }
+
+    bool OutputTimer::running(int output) const
+    {
+        _mutex.lock();
+        bool found = output >= 0 && find(output) >= 0;
+        _mutex.unlock();
+        return found;
+    }
+
+    bool OutputTimer::takeReport(int output, TimedReport &report)
+    {
+        if (output < 0 || output >= MAX_OUTPUTS)
+        {
+            return false;
+        }
+        _mutex.lock();
+        bool pending = (_unpublished >> output) & 1;
+        if (pending)
+        {
+            report = _reports[output];
+            _unpublished &= ~(1ULL << output);
+        }
+        _mutex.unlock();
+        return pending;
+    }
+
+    void OutputTimer::reportToJson(const TimedReport &report, JsonObject timer)
+    {
+        timer["mode"] = MODE_NAMES[report.mode];
+        timer["status"] = STATUS_NAMES[report.status];
+        timer["edges"] = report.edges;
+        timer["cycles"] = report.cycles;
+        timer["requestedMs"] = (uint32_t)(report.requestedUs / 1000);
+        timer["actualMs"] = report.actualUs / 1000.0;
+        timer["maxLateUs"] = report.maxLateUs;
+        timer["skipped"] = report.skipped;
+    }
+
+    void OutputTimer::toJson(JsonObject outputs) const
+    {
+        // Copied under the lock, the timer thread is never held up by JSON
+        static TimedReport snapshot[MAX_OUTPUTS];
+        _mutex.lock();
+        memcpy((void *)snapshot, (const void *)_reports, sizeof(snapshot));
+        _mutex.unlock();
+        for (int i = 0; i < _channels.outputCount(); ++i)
+        {
+            char name[8];
+            snprintf(name, sizeof(name), "O%d", i + 1);
+            JsonObject output = outputs.createNestedObject(name);
+            output["state"] = _channels.getOutput(i);
+            if (snapshot[i].status != TIMED_IDLE)
+            {
+                reportToJson(snapshot[i], output.createNestedObject("timer"));
+            }
+        }
+    }
+} // namespace remoto
@@ -0,0 +1,148 @@
+/*
+ * Remoto: Timed output programs for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Pulses, delayed switching, PWM and step sequences run on the device,
+ * so their timing does not depend on the broker or on the network.
+ * Every program is a list of steps, each holding the output at a value
+ * for a number of milliseconds, repeated a number of times and ending
+ * on a final value.
+ *
+ * The next edge of all running programs is armed on a Timeout of the
+ * microsecond hardware ticker. Its interrupt only wakes the timer
+ * thread, which runs above every other thread and writes the output,
+ * since the expansion outputs cannot be written from an interrupt.
+ * Edges are scheduled from the previous scheduled edge, not from the
+ * time it was applied, so a late edge does not shift the ones after
+ * it. Edges whose time had already passed when the thread ran are
+ * skipped and counted, the output goes straight to the step current.
+ *
+ * A finished program leaves a report with the requested and measured
+ * duration and the worst lateness of its edges.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(OUTPUTTIMER_H)
+#define OUTPUTTIMER_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "mbed.h"
+#include "channels.h"
+
+// Programs running at the same time, one per output
+#define TIMED_SLOTS 8
+#define TIMED_MAX_STEPS 16
+// Longest step, one day
+#define TIMED_MAX_STEP_MS 86400000UL
+// Largest command accepted, a full sequence
+#define TIMED_COMMAND_MAX 512
+#define TIMED_STACK_SIZE 4096
+
+namespace remoto
+{
+    enum TimedMode : uint8_t
+    {
+        TIMED_SET = 0, // plain value, stops the program running
+        TIMED_PULSE,
+        TIMED_DELAY,
+        TIMED_PWM,
+        TIMED_SEQUENCE,
+        TIMED_CANCEL, // stops the program, the output keeps its value
+        NUM_TIMED_MODES
+    };
+
+    enum TimedStatus : uint8_t
+    {
+        TIMED_IDLE = 0,
+        TIMED_RUNNING,
+        TIMED_DONE,
+        TIMED_CANCELLED,
+        TIMED_FAILED, // the output could not be written
+        NUM_TIMED_STATUSES
+    };
+
+    struct TimedStep
+    {
+        uint32_t ms;
+        uint8_t value;
+    };
+
+    struct TimedCommand
+    {
+        TimedMode mode;
+        uint8_t steps;
+        TimedStep step[TIMED_MAX_STEPS];
+        uint32_t repeat; // passes through the steps, 0 until cancelled
+        uint8_t final;   // value after the last pass, or of TIMED_SET
+    };
+
+    struct TimedReport
+    {
+        TimedMode mode;
+        TimedStatus status;
+        uint32_t edges;       // output writes, the final one included
+        uint32_t cycles;      // passes completed
+        uint64_t requestedUs; // from the first to the last edge, as scheduled
+        uint64_t actualUs;    // the same, as applied
+        uint32_t maxLateUs;   // worst delay of an edge past its schedule
+        uint32_t skipped;     // edges not written, a later one was due
+    };
+
+    // Read a command, JSON or a plain 0/1 value. Returns -1 if invalid.
+    // The hold value of TIMED_DELAY is the output state when it starts.
+    int parseTimedCommand(const char *payload, size_t length, TimedCommand &command);
+
+    class OutputTimer
+    {
+    private:
+        struct Slot
+        {
+            int output; // -1 when free
+            TimedCommand command;
+            uint8_t step;
+            uint32_t cycle;
+            uint64_t dueUs; // next edge, as scheduled
+            uint64_t firstDueUs;
+            uint64_t firstUs;
+        };
+
+        Channels &_channels;
+        Slot _slots[TIMED_SLOTS];
+        TimedReport _reports[MAX_OUTPUTS];
+        uint64_t _unpublished; // reports of finished programs, bit per output
+        mbed::Timeout _timeout;
+        rtos::EventFlags _wake;
+        mutable rtos::Mutex _mutex;
+
+        static uint64_t nowUs();
+        void expired();
+        // Move the schedule to the step current at now
+        void skipMissed(Slot &slot, uint64_t now);
+        void edge(Slot &slot, uint64_t now);
+        void finish(Slot &slot, TimedStatus status);
+        // Slot running a program on the output, -1 for a free slot
+        int find(int output) const;
+
+    public:
+        explicit OutputTimer(Channels &channels);
+
+        // Run a command on an output, replacing its running program.
+        // Returns -1 for an unknown output or when every slot is busy.
+        int start(int output, const TimedCommand &command);
+
+        // Wait for the next edge and apply it, from the timer thread
+        void run();
+
+        bool running(int output) const;
+        // Report of a program finished since the last call
+        bool takeReport(int output, TimedReport &report);
+
+        static void reportToJson(const TimedReport &report, JsonObject timer);
+        // State of the outputs and their running or last program
+        void toJson(JsonObject outputs) const;
+    };
+} // namespace remoto
+
+#endif // OUTPUTTIMER_H
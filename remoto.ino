@@ -9,15 +9,52 @@
  * - Ethernet-based networking.
  * - WiFi Netowrking
  * - MQTT client for telemetry and control.
- * - JSON-based configuration stored in flash memory.
+ * - Configuration stored in flash memory as a checked binary record.
  * - Web server for monitoring and configuration.
- * - Scheduler for periodic tasks.
+ * - Timer wheel scheduler for periodic tasks.
+ * - Capture of inputs and requests for replay on a PC.
+ * - Retained device shadow, reconciled on every MQTT connection.
+ * - Optional input scan and output writes on the M4 core.
+ *
+ * Built for the M4 core, the sketch only runs the channels for the M7,
+ * see iolink.h.
  *
  * Author: Alberto Perro
  * Date: 27-12-2024
  * License: CERN-OHL-P
  */
 
+#if defined(CORE_CM4)
+#include "channels.h"
+#include "filter.h"
+#include "iolink.h"
+
+using namespace remoto;
+
+// The channels of the panel, scanned and written for the M7
+#if defined(REMOTO_SIM_EXPANSION)
+SimulatedExpansionBus expansionBus;
+#else
+OptaExpansionBus expansionBus;
+#endif
+Channels channels;
+FilterBank filters;
+// Shared with the M7, at an address its MPU region can cover
+alignas(IOLINK_SHARED_SIZE) IoShared shared;
+IoCoreServer ioCore(channels, filters, expansionBus, shared);
+
+void setup()
+{
+  ioCore.boot();
+}
+
+void loop()
+{
+  ioCore.poll();
+  delay(1);
+}
+
+#else
 #include <Scheduler.h>
 // Network
 #include <ArduinoJson.h>
@@ -25,49 +62,140 @@
 #include <Ethernet.h>
 #include <SPI.h>
 #include <MQTT.h>
-// Wifi + NTP
+// Wifi
 #include <WiFi.h>
-#include <NTPClient.h>
-#include <TimeLib.h>
 
 // flash
 #include "KVStore.h"
 #include "kvstore_global_api.h"
 
 #include "config.h"
+#include "channels.h"
+#include "configstore.h"
+#include "timebase.h"
+#include "supervisor.h"
+#include "tasks.h"
+#include "http.h"
+#include "admission.h"
+#include "modbus.h"
+#include "mqtttransport.h"
+#include "mqtt5.h"
+#include "tls.h"
+#include "governor.h"
+#include "logger.h"
+#include "outputtimer.h"
+#include "trace.h"
+#include "shadow.h"
+#include "filter.h"
+#include "iolink.h"
+#include "memprofile.h"
+#include "ota.h"
 #include "webpage.h"
 
 using namespace remoto;
 
 EthernetClient net;
 EthernetServer server(80);
-MQTTClient client;
+EthernetUDP ntpEthUDP;
+// MQTT, the protocol version is a setting
+Mqtt311Transport mqtt311;
+Mqtt5Client mqtt5;
+MqttTransport *mqtt = &mqtt311;
+TlsClient tls;     // wraps net or wnet when mqtt.tls is set
 // Wifi
 WiFiClient wnet;
 WiFiUDP ntpUDP;
 WiFiServer wserver(80);
 // NTP
-NTPClient timeClient(ntpUDP, DEFAULT_TIME_SERVER);
-unsigned long timeString = 0;
+Timebase timebase;
+// Watchdog
+Supervisor supervisor;
+// Web server share of the processor
+HttpAdmission admission;
+// Prints the log records, below every other thread
+rtos::Thread logThread(osPriorityLow, LOG_STACK_SIZE);
+// Firmware update
+FirmwareUpdater updater;
+// Periodic work, MQTT and LEDs on one thread, IO on another
+TaskScheduler commsTasks("comms");
+TaskScheduler ioTasks("io");
+int telemetryTask = -1;
+// Publish budget, telemetry runs slower than configured when it is tight
+PublishGovernor governor;
+uint32_t telemetryPeriodMs = 0;
+
+// Onboard and expansion IO
+#if defined(REMOTO_SIM_EXPANSION)
+SimulatedExpansionBus expansionBus;
+#else
+OptaExpansionBus expansionBus;
+#endif
+Channels channels;
+// Filter chains of the analog inputs, run by the channel scan
+FilterBank filters;
+#if defined(REMOTO_IO_CORE)
+// The M4 core running the channels, when it answers
+IoCoreLink ioLink;
+#endif
+// Pulses and sequences, timed on the device
+OutputTimer timers(channels);
+rtos::Thread timerThread(osPriorityRealtime, TIMED_STACK_SIZE);
+// Inputs, requests and messages for the replay runner, off until started
+TraceRecorder trace;
+// Retained reported and desired state on the broker
+DeviceShadow shadow;
 
 config conf;
+// Modbus TCP, coil writes run as output commands
+int writeCoil(int output, bool value);
+ModbusServer modbus(conf, channels, writeCoil);
+ModbusListener<EthernetServer, EthernetClient> modbusEth;
+ModbusListener<WiFiServer, WiFiClient> modbusWiFi;
+bool useWiFi = false;
 bool mqttConnected = false;
+// Output commands waiting for their state to be published
+bool ackPending[MAX_OUTPUTS];
 long lastPublish = -1;
-bool forceMQTTSend = false;
 // Wifi +  NTP Stuff
 char ssid[] = DEFAULT_SSID;
 char pass[] = DEFAULT_SSID_PASS;
 
 void connectMQTT();
-void loopHeartbeat();
-void loopTele();
-void getStringFromPOST();
-void mqttReceived(String &topic, String &payload);
-IPAddress parseIP(const String &ipaddr);
+void loopComms();
+void loopSupervisor();
+void loopIo();
+void loopLog();
+void loopTimers();
+void publishTelemetry();
+void serviceMQTT();
+void heartbeatOn();
+void heartbeatOff();
+void scanInputs();
+void pollModbus();
+void publishStalls();
+void publishAcks();
+void publishShadow();
+void applyDesired(const uint8_t *payload, size_t length);
+bool publishControl(const char *topic, const char *payload, bool retained = false);
+void adjustTelemetryPeriod(uint32_t messages, uint32_t bytes);
+int telemetryMessage(int n, const char *deviceId, char *topic, size_t topicSize, char *payload, size_t payloadSize);
+void handleFirmwareUpload(Client &client);
+void handleConfigUpload(Client &client);
+bool admitClient(Client &client, IPAddress ip);
+void handleTlsUpload(Client &client, const String &request);
+void handleOutputCommand(Client &client, const String &request);
+void handleClient(Client &client);
+void sendTrace(Client &client);
+void startTrace();
+void mqttReceived(const char *topic, const uint8_t *payload, size_t length);
+String getTls();
+
+int parseIP(const char *ipaddr, IPAddress &address);
 // Network
 int connectWiFi();
 int connectEthernet();
 void setupNTP();
+void resolveTimeServer();
 REDIRECT_STDOUT_TO(Serial);
 
 void setup()
@@ -75,42 +203,71 @@ void setup()
   // Setup user button early
   pinMode(BTN_USER, INPUT);
   Serial.begin(115200);
+  logThread.start(loopLog);
   delay(5000);
-  Serial.println("Arduino OPTA");
-  Serial.println("-----------------------");
+  logInfo("Arduino OPTA");
+  logInfo("-----------------------");
   // read config
-  Serial.println("Try to read config from flash");
-  char readBuffer[1024];
-  kv_get("config", readBuffer, 1024, 0);
-  Serial.println(readBuffer);
+  logInfo("Try to read config from flash");
+  int loaded = loadConfig(conf);
   // init heartbeat led
   pinMode(LED_USER, OUTPUT);
+  // restore the stall history of the previous run
+  supervisor.begin();
 
   // if we have a blank flash or the user button is being held then (re)load the config
-  Serial.println("Hold the user button for a fresh config write.. waiting 5s..");
+  logInfo("Hold the user button for a fresh config write.. waiting 5s..");
   digitalWrite(LED_USER, HIGH);
   delay(5000);
 
-  if (conf.loadFromJson(readBuffer, 1024) != 0 || !digitalRead(BTN_USER))
+  if (loaded < 0 || !digitalRead(BTN_USER))
   {
     kv_reset("/kv/");
-    Serial.println("Warning: config not found, writing defaults");
+    logWarn("Config not found, writing defaults");
     conf.loadDefaults();
-    String def = conf.toJson();
-    Serial.println(def);
-    Serial.println(def.length());
-    kv_set("config", def.c_str(), def.length(), 0);
-    Serial.println("read back:");
-    kv_get("config", readBuffer, 1024, 0);
-    Serial.println(readBuffer);
-    conf.loadFromJson(readBuffer, 1024);
+    saveConfig(conf);
   }
+  setLoggerLevel(conf.getLogLevel());
+  logInfo("Device %s, log level %s", conf.getDeviceId(), logLevelName(getLoggerLevel()));
   // Turn the user LED back off
   digitalWrite(LED_USER, LOW);
 
-  Serial.println("Configure Pins");
-  conf.initializePins();
-  Serial.println("Configure Network");
+  logInfo("Configure Channels");
+#if defined(REMOTO_IO_CORE)
+  if (ioLink.boot() == 0)
+  {
+    logInfo("Channels on the I/O core");
+    channels.begin(ioLink);
+  }
+  else
+  {
+    logWarn("I/O core not answering, scanning here");
+    channels.begin(expansionBus);
+  }
+#else
+  channels.begin(expansionBus);
+#endif
+  for (int i = 0; i < channels.inputCount(); i++)
+  {
+    channels.setInputAnalog(i, conf.getInputType(i) == ANALOG);
+    if (conf.getInputType(i) == ANALOG && conf.getInputFilter(i).stageCount() > 0)
+    {
+      if (filters.setChain(i, conf.getInputFilter(i)) != 0)
+      {
+        logWarn("No filter for I%d, out of chains", i + 1);
+      }
+#if defined(REMOTO_IO_CORE)
+      // Run by the I/O core, which has as many chains
+      ioLink.setChain(i, conf.getInputFilter(i));
+#endif
+    }
+  }
+  channels.setFilter(&filters);
+  channels.configure();
+  channels.scan();
+  timerThread.start(loopTimers);
+  logInfo("%d expansion modules, %d inputs, %d outputs", channels.moduleCount() - 1, channels.inputCount(), channels.outputCount());
+  logInfo("Configure Network");
   // init boot led
   pinMode(LEDR, OUTPUT);
   digitalWrite(LEDR, HIGH);
@@ -120,135 +277,340 @@ void setup()
   int wstatus = WL_IDLE_STATUS;
   if (conf.getWiFiPref())
   {
-    Serial.println("Config set to prefer WiFi");
+    logInfo("Config set to prefer WiFi");
     wstatus = connectWiFi();
     if (wstatus != WL_CONNECTED)
     {
-      Serial.println("WiFi Failed. Trying Ethernet");
+      logWarn("WiFi Failed. Trying Ethernet");
       connectEthernet(); //will get stuck if does not connect
     }
   }
   else
   {
-    Serial.println("Config set to prefer Ethernet");
+    logInfo("Config set to prefer Ethernet");
     if (connectEthernet() == 0)
     {
-      Serial.println("Ethernet Failed. Trying WiFi");
+      logWarn("Ethernet Failed. Trying WiFi");
       wstatus = connectWiFi();
       if(wstatus != WL_CONNECTED){
-        Serial.println("ERROR: Cannot connect to WiFi. Halting.");
+        logError("Cannot connect to WiFi. Halting.");
         while(true);
       }
     }
   }
   delay(1000);
-  Serial.println("Configure MQTT");
-  Serial.println("MQTT Server: " + conf.getMqttServer() + " Port: " + String(conf.getMqttPort()));
+  logInfo("Configure MQTT");
+  if (conf.getMqttVersion() == MQTT_VERSION_5)
+  {
+    mqtt = &mqtt5;
+  }
+  logInfo("MQTT Server: %s Port: %d Version: %d", conf.getMqttServer(), conf.getMqttPort(), conf.getMqttVersion());
+  Client *transport = &net;
   if (wstatus == WL_CONNECTED)
   {
-    Serial.println("Using WiFi");
-    client.begin(conf.getMqttServer().c_str(), conf.getMqttPort(), wnet);
+    logInfo("Using WiFi");
+    transport = &wnet;
   }
   else
   {
-    Serial.println("Using Ethernet");
-    client.begin(conf.getMqttServer().c_str(), conf.getMqttPort(), net);
+    logInfo("Using Ethernet");
   }
+  if (conf.getMqttTls())
+  {
+    // Without credentials every connection fails, never falls back to plain TCP
+    logInfo("Using TLS");
+    tls.begin(*transport);
+    transport = &tls;
+  }
+  // The clients keep a pointer to the host name, stored in conf
+  mqtt->begin(conf.getMqttServer(), conf.getMqttPort(), *transport);
+  mqtt->onMessage(mqttReceived);
+  governor.begin(conf.getPublishBudget());
   connectMQTT();
-  client.onMessage(mqttReceived);
 
   if (wstatus == WL_CONNECTED)
   {
-    Serial.print("Start WebServer on Wifi using ");
-    Serial.println(WiFi.localIP());
+    IPAddress ip = WiFi.localIP();
+    logInfo("Start WebServer on Wifi using %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
     // Start web server on WiFi
     wserver.begin();
+    modbusWiFi.begin();
+    useWiFi = true;
     delay(1000);
   }
   else
   {
     // Start web server on WiFi
-    Serial.print("Start WebServer on Ethernet using ");
+    IPAddress ip = Ethernet.localIP();
+    logInfo("Start WebServer on Ethernet using %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
     server.begin();
+    modbusEth.begin();
   }
+  setupNTP();
+
+  // Periodic tasks, the first telemetry goes out straight away
+  telemetryPeriodMs = conf.getMqttUpdateInterval() > 0 ? conf.getMqttUpdateInterval() * 1000UL : 1000;
+  commsTasks.addPeriodic("mqtt", serviceMQTT, MQTT_SERVICE_MS, 0, COMMS_DEADLINE_MS);
+  telemetryTask = commsTasks.addPeriodic("telemetry", publishTelemetry, telemetryPeriodMs, 1, COMMS_DEADLINE_MS);
+  commsTasks.addPeriodic("heartbeat", heartbeatOn, HEARTBEAT_PERIOD_MS, 2, HEARTBEAT_PERIOD_MS);
+  commsTasks.addPeriodic("ntp", resolveTimeServer, NTP_RETRY_MS, 3, COMMS_DEADLINE_MS);
+#if defined(REMOTO_MEM_PROFILE)
+  commsTasks.addPeriodic("memory", memReport, MEM_REPORT_MS, 3, COMMS_DEADLINE_MS);
+#endif
+  ioTasks.addPeriodic("scan", scanInputs, IO_SCAN_INTERVAL_MS, 0, IO_SCAN_INTERVAL_MS);
+  ioTasks.addPeriodic("modbus", pollModbus, MODBUS_POLL_MS, 1, IO_SCAN_INTERVAL_MS);
 
   // Start Scheduler Loops
-  Scheduler.startLoop(loopTele);
-  Scheduler.startLoop(loopHeartbeat);
-  Serial.println("Startup Completed.");
+  supervisor.registerTask(TASK_LOOP, "loop", LOOP_DEADLINE_MS, LOOP_LIMIT_MS);
+  supervisor.registerTask(TASK_COMMS, "comms", COMMS_DEADLINE_MS, COMMS_LIMIT_MS);
+  supervisor.registerTask(TASK_IO, "io", IO_DEADLINE_MS, IO_LIMIT_MS);
+  supervisor.start();
+  // A handshake needs a deeper stack than plain MQTT
+  Scheduler.startLoop(loopComms, conf.getMqttTls() ? TLS_STACK_SIZE : COMMS_STACK_SIZE);
+  Scheduler.startLoop(loopSupervisor);
+  Scheduler.startLoop(loopIo, 4096);
+  logInfo("Startup Completed.");
 }
 
 void loop()
 {
+  supervisor.checkIn(TASK_LOOP);
+  memWatchStack("loop");
+  // Serve the waiting clients within the HTTP budget of this pass
+  uint32_t httpStart = millis();
   // Check if we are WiFi or ethernet
   if (WiFi.status() == WL_CONNECTED)
   {
-    WiFiClient client = wserver.available();
-    if (client)
+    while (millis() - httpStart < HTTP_LOOP_BUDGET_MS)
     {
-      handleWiFiClient(client); // Handle the client
+      WiFiClient client = wserver.available();
+      if (!client)
+      {
+        break;
+      }
+      if (admitClient(client, client.remoteIP()))
+      {
+        TraceClient traced(client, trace, client.remoteIP());
+        handleClient(traced); // Handle the client
+      }
     }
   }
   else if (Ethernet.linkStatus() == LinkON)
   {
     // Listen for incoming client requests on Ethernet
-    EthernetClient client = server.available();
-    if (client)
+    while (millis() - httpStart < HTTP_LOOP_BUDGET_MS)
     {
-      handleEthClient(client); // Handle the client
+      EthernetClient client = server.available();
+      if (!client)
+      {
+        break;
+      }
+      if (admitClient(client, client.remoteIP()))
+      {
+        TraceClient traced(client, trace, client.remoteIP());
+        handleClient(traced); // Handle the client
+      }
     }
   }
+  admission.addBusy(millis() - httpStart);
   // reconnect to WiFi if connection is lost
   // and it is the preferred network
   if(WiFi.status() != WL_CONNECTED && conf.getWiFiPref()){
-    Serial.println("Trying to reconnect to WiFi");
+    logWarn("Trying to reconnect to WiFi");
     connectWiFi();
   }
-  // NTP
-  timeClient.update();
-  timeString = timeClient.getEpochTime();
+  // NTP, never blocks waiting for the server or its name
+  timebase.update();
   // For the Scheduler
   yield();
 }
 
-// Telemetry Loop
-void loopTele()
+// Print the log records, the only thread waiting on the serial port
+void loopLog()
+{
+  memWatchStack("log");
+  while (true)
+  {
+    drainLogs(Serial);
+    delay(LOG_DRAIN_MS);
+  }
+}
+
+// Apply the edges of the timed outputs, above every other thread
+void loopTimers()
+{
+  memWatchStack("timers");
+  while (true)
+  {
+    timers.run();
+  }
+}
+
+// MQTT, telemetry and heartbeat tasks
+void loopComms()
+{
+  supervisor.checkIn(TASK_COMMS);
+  memWatchStack("comms");
+  commsTasks.run();
+}
+
+// Publish the input snapshot, released every update interval
+void publishTelemetry()
 {
-  if ((millis() / 1000) - lastPublish > conf.getMqttUpdateInterval() || lastPublish == -1 || forceMQTTSend == true)
+  MemScope scope(MEM_MQTT);
+  if (!mqtt->connected())
+  {
+    return;
+  }
+  const char *deviceId = conf.getDeviceId();
+  char topic[CONFIG_DEVICE_ID_LEN + 16];
+  char payload[CONFIG_DEVICE_ID_LEN + 1];
+  // Size the snapshot first, it is sent or deferred as a whole
+  uint32_t messages = 0;
+  uint32_t bytes = 0;
+  int found;
+  for (int n = 0; (found = telemetryMessage(n, deviceId, topic, sizeof(topic), payload, sizeof(payload))) >= 0; n++)
   {
-    // update the client state
-    forceMQTTSend = false;
-    lastPublish = millis() / 1000;
-    String rootTopic = conf.getDeviceId() + "/";
-    // Device Information
-    client.publish(String(rootTopic + "deviceId").c_str(), conf.getDeviceId());
-    Serial.println("SendMQTTDevInfo");
-    // Inputs
-    for (size_t i = 0; i < NUM_INPUTS; i++)
+    if (found > 0)
     {
-      String inTopic = "I" + String(i + 1) + "/";
-      if (conf.getInputType(i) == ANALOG)
-      {
-        float value = analogRead(conf.getInputPin(i)) * (3.249 / ((1 << ADC_BITS) - 1)) / 0.3034;
-        char buffer[10];
-        int ret = snprintf(buffer, sizeof(buffer), "%0.2f", value);
-        client.publish(String(rootTopic + inTopic + "val").c_str(), buffer);
-        client.publish(String(rootTopic + inTopic + "type").c_str(), "0");
-      }
-      else
-      {
-        client.publish(String(rootTopic + inTopic + "val").c_str(), String(digitalRead(conf.getInputPin(i))).c_str());
-        client.publish(String(rootTopic + inTopic + "type").c_str(), "1");
-      }
+      messages++;
+      bytes += PublishGovernor::packetSize(topic, strlen(payload));
+    }
+  }
+  // The reported state goes with the snapshot, with fresh inputs
+  static char report[SHADOW_REPORT_SIZE];
+  char reportTopic[SHADOW_TOPIC_SIZE];
+  snprintf(reportTopic, sizeof(reportTopic), "%s" SHADOW_REPORTED_TOPIC, deviceId);
+  int reportLength = shadow.report(channels, conf, timebase.nowMs(), report, sizeof(report));
+  if (reportLength >= 0)
+  {
+    messages++;
+    bytes += PublishGovernor::packetSize(reportTopic, reportLength);
+  }
+  adjustTelemetryPeriod(messages, bytes);
+  if (!governor.admit(PUBLISH_PERIODIC, messages, bytes))
+  {
+    logWarn("Telemetry deferred, publish budget low");
+    return;
+  }
+  lastPublish = millis() / 1000;
+  for (int n = 0; (found = telemetryMessage(n, deviceId, topic, sizeof(topic), payload, sizeof(payload))) >= 0; n++)
+  {
+    if (found > 0 && mqtt->publish(topic, payload))
+    {
+      trace.published(topic, payload);
+    }
+  }
+  if (reportLength >= 0 && mqtt->publish(reportTopic, report, true))
+  {
+    trace.published(reportTopic, report);
+    shadow.reported();
+  }
+  logDebug("MQTT published successfully. %ld", lastPublish);
+}
+
+// Message n of the telemetry snapshot: device information, then the
+// inputs from the snapshot of the IO loop. Returns 1 with the topic and
+// payload filled, 0 for a slot with nothing to send, -1 past the end.
+int telemetryMessage(int n, const char *deviceId, char *topic, size_t topicSize, char *payload, size_t payloadSize)
+{
+  if (n == 0)
+  {
+    snprintf(topic, topicSize, "%s/deviceId", deviceId);
+    snprintf(payload, payloadSize, "%s", deviceId);
+    return 1;
+  }
+  if (n == 1)
+  {
+    snprintf(topic, topicSize, "%s/time", deviceId);
+    formatTimestamp(payload, payloadSize, timebase.nowMs());
+    return 1;
+  }
+  int i = (n - 2) / 3;
+  if (i >= channels.inputCount())
+  {
+    return -1;
+  }
+  bool analog = conf.getInputType(i) == ANALOG;
+  switch ((n - 2) % 3)
+  {
+  case 0:
+    snprintf(topic, topicSize, "%s/I%d/val", deviceId, i + 1);
+    if (analog)
+    {
+      formatMilli(payload, payloadSize, conf.scaleInput(i, channels.readInput(i)), 2);
     }
-    Serial.println("MQTT published successfully. " + String(lastPublish));
+    else
+    {
+      snprintf(payload, payloadSize, "%u", channels.readInput(i));
+    }
+    return 1;
+  case 1:
+    snprintf(topic, topicSize, "%s/I%d/type", deviceId, i + 1);
+    snprintf(payload, payloadSize, "%s", analog ? "0" : "1");
+    return 1;
+  default:
+    if (!analog)
+    {
+      return 0;
+    }
+    snprintf(topic, topicSize, "%s/I%d/unit", deviceId, i + 1);
+    snprintf(payload, payloadSize, "%s", conf.getInputUnit(i));
+    return 1;
+  }
+}
+
+// Stretch the telemetry period to what the budget sustains, or bring
+// it back to the configured interval
+void adjustTelemetryPeriod(uint32_t messages, uint32_t bytes)
+{
+  uint32_t configuredMs = conf.getMqttUpdateInterval() > 0 ? conf.getMqttUpdateInterval() * 1000UL : 1000;
+  uint32_t sustainableMs = governor.sustainableMs(messages, bytes);
+  uint32_t periodMs = sustainableMs > configuredMs ? sustainableMs : configuredMs;
+  if (periodMs != telemetryPeriodMs)
+  {
+    telemetryPeriodMs = periodMs;
+    commsTasks.setPeriod(telemetryTask, periodMs);
+    logInfo("Telemetry period %lu s to fit the publish budget", (unsigned long)(periodMs / 1000));
+  }
+}
+
+// Control messages, charged to the budget ahead of telemetry
+bool publishControl(const char *topic, const char *payload, bool retained)
+{
+  if (!governor.admit(PUBLISH_CONTROL, 1, PublishGovernor::packetSize(topic, strlen(payload))))
+  {
+    return false;
+  }
+  if (!mqtt->publish(topic, payload, retained))
+  {
+    return false;
+  }
+  trace.published(topic, payload);
+  return true;
+}
+
+// Keep the broker connection alive and dispatch incoming commands
+void serviceMQTT()
+{
+  MemScope scope(MEM_MQTT);
+  // report stalls once we are back online
+  if (mqtt->connected() && supervisor.hasUnpublished())
+  {
+    publishStalls();
   }
 
-  client.loop();
+  mqtt->loop();
+  publishAcks();
+  publishShadow();
 
-  if (!client.connected())
+  if (!mqtt->connected())
   {
     digitalWrite(LEDR, HIGH);
+    if (mqttConnected)
+    {
+      trace.mqttState(false);
+    }
     mqttConnected = false;
     connectMQTT();
   }
@@ -259,56 +621,253 @@ void loopTele()
   }
 }
 
+// Publish the stall history kept by the supervisor
+void publishStalls()
+{
+  StaticJsonDocument<512> doc;
+  doc["watchdogReset"] = supervisor.wasWatchdogReset();
+  doc["count"] = supervisor.getStallCount();
+  supervisor.toJson(doc.createNestedArray("history"));
+  char payload[512];
+  serializeJson(doc, payload, sizeof(payload));
+  char topic[CONFIG_DEVICE_ID_LEN + 16];
+  snprintf(topic, sizeof(topic), "%s/stalls", conf.getDeviceId());
+  if (publishControl(topic, payload))
+  {
+    supervisor.markPublished();
+  }
+}
+
+// Acknowledge output commands with the state now set, <deviceId>/O<n>/state,
+// and report finished timed commands on <deviceId>/O<n>/timer
+void publishAcks()
+{
+  char topic[CONFIG_DEVICE_ID_LEN + 16];
+  for (int i = 0; i < channels.outputCount(); i++)
+  {
+    TimedReport report;
+    if (mqtt->connected() && timers.takeReport(i, report))
+    {
+      StaticJsonDocument<JSON_OBJECT_SIZE(8)> doc;
+      OutputTimer::reportToJson(report, doc.to<JsonObject>());
+      char payload[192];
+      serializeJson(doc, payload, sizeof(payload));
+      snprintf(topic, sizeof(topic), "%s/O%d/timer", conf.getDeviceId(), i + 1);
+      publishControl(topic, payload);
+      ackPending[i] = true;
+    }
+    if (ackPending[i] && mqtt->connected())
+    {
+      ackPending[i] = false;
+      snprintf(topic, sizeof(topic), "%s/O%d/state", conf.getDeviceId(), i + 1);
+      publishControl(topic, channels.getOutput(i) ? "1" : "0");
+    }
+  }
+}
+
+// Report the state on connection and after output changes, retained for
+// the subscribers to come
+void publishShadow()
+{
+  if (!mqtt->connected() || !shadow.due(channels, timers))
+  {
+    return;
+  }
+  static char report[SHADOW_REPORT_SIZE];
+  if (shadow.report(channels, conf, timebase.nowMs(), report, sizeof(report)) < 0)
+  {
+    logError("Shadow report does not fit in %d bytes", SHADOW_REPORT_SIZE);
+    return;
+  }
+  char topic[SHADOW_TOPIC_SIZE];
+  snprintf(topic, sizeof(topic), "%s" SHADOW_REPORTED_TOPIC, conf.getDeviceId());
+  if (publishControl(topic, report, true))
+  {
+    shadow.reported();
+  }
+}
+
 // MQTT Connection Handler
 void connectMQTT()
 {
-  Serial.print("Connecting to MQTT broker...");
-  while (!client.connect(conf.getDeviceId().c_str(), conf.getMqttUser().c_str(), conf.getMqttPassword().c_str()))
+  MemScope scope(MEM_MQTT);
+  logInfo("Connecting to MQTT broker...");
+  int attempts = 0;
+  while (!mqtt->connect(conf.getDeviceId(), conf.getMqttUser(), conf.getMqttPassword()))
   {
-    Serial.print(".");
+    // each attempt is bounded, the mqtt task retries later
+    supervisor.checkIn(TASK_COMMS);
+    if (++attempts >= MQTT_CONNECT_ATTEMPTS)
+    {
+      logWarn("MQTT broker not reachable after %d attempts, retrying later", attempts);
+      return;
+    }
   }
-  Serial.println("\nConnected to MQTT broker!");
+  logInfo("Connected to MQTT broker!");
   mqttConnected = true;
-  for (size_t i = 0; i < NUM_OUTPUTS; i++)
+  trace.mqttState(true);
+  shadow.connected();
+  // Subscribed every time, the broker answers with the retained document
+  char topic[SHADOW_TOPIC_SIZE];
+  snprintf(topic, sizeof(topic), "%s" SHADOW_DESIRED_TOPIC, conf.getDeviceId());
+  mqtt->subscribe(topic, 1);
+  // An MQTT 5 session kept by the broker still has the output subscriptions
+  if (mqtt->sessionPresent())
   {
-    String topic = conf.getDeviceId() + "/O" + String(i + 1);
-    client.subscribe(topic);
-    Serial.println("Subcribed to " + topic);
+    logInfo("MQTT session resumed");
+    return;
+  }
+  for (int i = 0; i < channels.outputCount(); i++)
+  {
+    snprintf(topic, sizeof(topic), "%s/O%d", conf.getDeviceId(), i + 1);
+    mqtt->subscribe(topic, 1);
+    logInfo("Subscribed to %s", topic);
   }
 }
 
 // mqtt subscribe callback
-void mqttReceived(String &topic, String &payload)
+void mqttReceived(const char *topic, const uint8_t *payload, size_t length)
+{
+  logDebug("Received %s: %.*s", topic, (int)length, (const char *)payload);
+  trace.mqttMessage(topic, payload, length);
+  // Output commands arrive on <deviceId>/O<n>
+  const char *deviceId = conf.getDeviceId();
+  size_t idLength = strlen(deviceId);
+  if (strncmp(topic, deviceId, idLength) == 0 && strcmp(topic + idLength, SHADOW_DESIRED_TOPIC) == 0)
+  {
+    applyDesired(payload, length);
+  }
+  else if (strncmp(topic, deviceId, idLength) == 0 && strncmp(topic + idLength, "/O", 2) == 0)
+  {
+    int index = atoi(topic + idLength + 2) - 1;
+    // A plain 0/1, or a timed command in JSON
+    static TimedCommand command;
+    if (parseTimedCommand((const char *)payload, length, command) == 0 && timers.start(index, command) == 0)
+    {
+      logInfo("Output %d command accepted", index + 1);
+      // Published after the loop, not from inside the client callback
+      ackPending[index] = true;
+    }
+    else
+    {
+      logWarn("Output %d command rejected", index + 1);
+    }
+  }
+}
+
+// Bring the outputs to a new desired state of the shadow, running
+// programs on them are replaced as by a plain command
+void applyDesired(const uint8_t *payload, size_t length)
 {
-  Serial.println("Received " + topic + ": " + payload);
-  for (size_t i = 0; i < NUM_OUTPUTS; i++)
+  static ShadowDesired desired;
+  int result = shadow.desired((const char *)payload, length, desired);
+  if (result < 0)
+  {
+    logWarn("Shadow desired state rejected");
+    return;
+  }
+  if (result == 0)
+  {
+    return;
+  }
+  static TimedCommand command;
+  command.mode = TIMED_SET;
+  int applied = 0;
+  for (int i = 0; i < channels.outputCount(); i++)
   {
-    String match = conf.getDeviceId() + "/O" + String(i + 1);
-    if (topic == match)
+    if (desired.outputs[i] < 0)
+    {
+      continue;
+    }
+    command.final = desired.outputs[i];
+    if (timers.start(i, command) == 0)
+    {
+      applied++;
+    }
+    else
     {
-      digitalWrite(conf.getOutputPin(i), payload.toInt());
-      digitalWrite(conf.getOutputLed(i), payload.toInt());
-      Serial.println("Setting output " + String(i + 1));
+      logWarn("Output %d desired state not applied", i + 1);
     }
   }
+  logInfo("Shadow desired version %lu applied to %d outputs", (unsigned long)desired.version, applied);
 }
 // blink to show it is alive
-void loopHeartbeat()
+void heartbeatOn()
 {
   digitalWrite(LED_USER, HIGH);
-  delay(100);
+  commsTasks.addOneShot("blink", heartbeatOff, HEARTBEAT_BLINK_MS, 2, HEARTBEAT_PERIOD_MS);
+}
+
+void heartbeatOff()
+{
   digitalWrite(LED_USER, LOW);
-  // Break up the long delay to yield control  ##Fix for watchdog crash.
-  for (int i = 0; i < 49; i++)
+}
+
+// check task deadlines and feed the watchdog
+void loopSupervisor()
+{
+  memWatchStack("supervisor");
+  supervisor.check();
+  delay(SUPERVISOR_PERIOD_MS);
+}
+
+// IO snapshot and Modbus TCP, independent of the web server
+void loopIo()
+{
+  supervisor.checkIn(TASK_IO);
+  memWatchStack("io");
+  ioTasks.run();
+}
+
+void scanInputs()
+{
+  channels.scan();
+  trace.scan(channels);
+}
+
+void pollModbus()
+{
+  if (useWiFi)
+  {
+    modbusWiFi.poll(modbus);
+  }
+  else
   {
-    delay(100);
-    yield();
+    modbusEth.poll(modbus);
   }
 }
 
-// Handle webserver calls on WiFi
-void handleWiFiClient(WiFiClient client)
+// A coil write replaces the program running on the output, as a plain
+// command over MQTT or HTTP does, and its state is published
+int writeCoil(int output, bool value)
 {
+  static TimedCommand command;
+  command.mode = TIMED_SET;
+  command.final = value;
+  if (timers.start(output, command) != 0)
+  {
+    return -1;
+  }
+  ackPending[output] = true;
+  return 0;
+}
+
+// Turn away a client over its share before its request is read
+bool admitClient(Client &client, IPAddress ip)
+{
+  uint32_t retryAfterS = admission.admit((uint32_t)ip);
+  if (retryAfterS == 0)
+  {
+    return true;
+  }
+  sendRetryLater(client, retryAfterS);
+  return false;
+}
+
+// Handle webserver calls, on WiFi or Ethernet
+void handleClient(Client &client)
+{
+  MemScope scope(MEM_HTTP);
   // Read client request
   String request = client.readStringUntil('\r');
   client.flush();
@@ -325,9 +884,9 @@ void handleWiFiClient(WiFiClient client)
     client.stop();
     return;
   }
-  else if (request.startsWith("GET /config"))
+  else if (request.startsWith("GET /tasks"))
   {
-    String json = conf.toJson();
+    String json = getTasks();
     client.println("HTTP/1.1 200 OK");
     client.println("Content-Type: application/json");
     client.println("Connection: close");
@@ -336,71 +895,31 @@ void handleWiFiClient(WiFiClient client)
     client.stop();
     return;
   }
-  else if (request.startsWith("GET /device"))
-  {
-    client.println("HTTP/1.1 200 OK");
-    client.println("Content-Type: text/html");
-    client.println("Connection: close");
-    client.println();
-
-    // Read the HTML from program memory
-    client.write(configHtml, strlen_P(configHtml));
-    client.stop();
-    return;
-  }
-  else if (request.startsWith("GET /send"))
+  else if (request.startsWith("GET /tls"))
   {
+    String json = getTls();
     client.println("HTTP/1.1 200 OK");
     client.println("Content-Type: application/json");
     client.println("Connection: close");
     client.println();
-    client.println("{\"status\":\"success\",\"message\":\"MQTT forced send received.\"}");
-    forceMQTTSend = true;
+    client.println(json);
     client.stop();
     return;
   }
-  else if (request.startsWith("POST /config"))
+  else if (request.startsWith("GET /logs"))
   {
-    // Retrieve JSON data from the POST request
-    String json = getStringFromWiFiPOST(client);
-    // Respond to the client
+    String json = getLogs();
     client.println("HTTP/1.1 200 OK");
     client.println("Content-Type: application/json");
     client.println("Connection: close");
     client.println();
-    client.println("{\"status\":\"success\",\"message\":\"Configuration updated\"}");
+    client.println(json);
     client.stop();
-    Serial.println("New Config Received: " + json);
-    if (conf.loadFromJson(json.c_str(), json.length()) == 0)
-    {
-      kv_set("config", json.c_str(), json.length(), 0);
-      Serial.println("Valid Configuration, rebooting.");
-      NVIC_SystemReset();
-    }
     return;
   }
-
-  client.println("HTTP/1.1 200 OK");
-  client.println("Content-Type: text/html");
-  client.println("Connection: close");
-  client.println();
-
-  // Read the HTML from program memory
-  client.write(rootHtml, strlen_P(rootHtml));
-  client.stop();
-}
-
-// handle webserver calls on Ethernet
-void handleEthClient(EthernetClient client)
-{
-  // Read client request
-  String request = client.readStringUntil('\r');
-  client.flush();
-
-  // Serve JSON data for dynamic updates
-  if (request.startsWith("GET /data"))
+  else if (request.startsWith("GET /metrics"))
   {
-    String json = getData();
+    String json = getMetrics();
     client.println("HTTP/1.1 200 OK");
     client.println("Content-Type: application/json");
     client.println("Connection: close");
@@ -428,7 +947,7 @@ void handleEthClient(EthernetClient client)
     client.println();
 
     // Read the HTML from program memory
-    client.write(configHtml, strlen_P(configHtml));
+    client.write((const uint8_t *)configHtml, strlen_P(configHtml));
     client.stop();
     return;
   }
@@ -439,28 +958,70 @@ void handleEthClient(EthernetClient client)
     client.println("Connection: close");
     client.println();
     client.println("{\"status\":\"success\",\"message\":\"MQTT forced send received.\"}");
-    forceMQTTSend = true;
+    commsTasks.trigger(telemetryTask);
     client.stop();
     return;
   }
+  else if (request.startsWith("POST /firmware"))
+  {
+    trace.redactHttp();
+    handleFirmwareUpload(client);
+    return;
+  }
   else if (request.startsWith("POST /config"))
   {
-    // Retrieve JSON data from the POST request
-    String json = getStringFromPOST(client);
-    // Respond to the client
+    handleConfigUpload(client);
+    return;
+  }
+  else if (request.startsWith("POST /tls/"))
+  {
+    // Keys stay out of the trace
+    trace.redactHttp();
+    handleTlsUpload(client, request);
+    return;
+  }
+  else if (request.startsWith("GET /outputs"))
+  {
+    String json = getOutputs();
     client.println("HTTP/1.1 200 OK");
     client.println("Content-Type: application/json");
     client.println("Connection: close");
     client.println();
-    client.println("{\"status\":\"success\",\"message\":\"Configuration updated\"}");
+    client.println(json);
     client.stop();
-    Serial.println("New Config Received: " + json);
-    if (conf.loadFromJson(json.c_str(), json.length()) == 0)
-    {
-      kv_set("config", json.c_str(), json.length(), 0);
-      Serial.println("Valid Configuration, rebooting.");
-      NVIC_SystemReset();
-    }
+    return;
+  }
+  else if (request.startsWith("POST /outputs/"))
+  {
+    handleOutputCommand(client, request);
+    return;
+  }
+  else if (request.startsWith("GET /trace/status"))
+  {
+    String json = getTraceStatus();
+    client.println("HTTP/1.1 200 OK");
+    client.println("Content-Type: application/json");
+    client.println("Connection: close");
+    client.println();
+    client.println(json);
+    client.stop();
+    return;
+  }
+  else if (request.startsWith("GET /trace"))
+  {
+    sendTrace(client);
+    return;
+  }
+  else if (request.startsWith("POST /trace/start"))
+  {
+    startTrace();
+    sendHttpResponse(client, 200, "application/json", "{\"status\":\"success\",\"message\":\"Capture started\"}");
+    return;
+  }
+  else if (request.startsWith("POST /trace/stop"))
+  {
+    trace.stop();
+    sendHttpResponse(client, 200, "application/json", "{\"status\":\"success\",\"message\":\"Capture stopped\"}");
     return;
   }
 
@@ -470,19 +1031,220 @@ void handleEthClient(EthernetClient client)
   client.println();
 
   // Read the HTML from program memory
-  client.write(rootHtml, strlen_P(rootHtml));
+  client.write((const uint8_t *)rootHtml, strlen_P(rootHtml));
+  client.stop();
+}
+
+// Receive a new configuration, apply it and reboot
+void handleConfigUpload(Client &client)
+{
+  MemScope scope(MEM_CONFIG);
+  // peak RAM of an upload is this buffer plus the JSON tree
+  static char body[CONFIG_JSON_SIZE];
+  HttpRequestHeaders headers;
+  int length = -400;
+  if (readRequestHeaders(client, headers, HTTP_TIMEOUT_MS) == 0)
+  {
+    length = readRequestBody(client, headers, body, sizeof(body), HTTP_TIMEOUT_MS);
+  }
+  if (length < 0)
+  {
+    sendHttpResponse(client, -length, "application/json", "{\"status\":\"error\",\"message\":\"Incomplete configuration\"}");
+    return;
+  }
+  // The body holds the passwords, only its size is logged
+  logInfo("New Config Received, %d bytes", length);
+  // the body is parsed in place and no longer readable afterwards
+  if (conf.loadFromJsonInPlace(body, length) != 0)
+  {
+    sendHttpResponse(client, 400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid configuration\"}");
+    return;
+  }
+  sendHttpResponse(client, 200, "application/json", "{\"status\":\"success\",\"message\":\"Configuration updated\"}");
+  // store the merged config, so optional sections are not lost
+  saveConfig(conf);
+  logInfo("Valid Configuration, rebooting.");
+  NVIC_SystemReset();
+}
+
+// Store a TLS credential, raw PEM or "identity:hexkey" in the body.
+// An empty body removes it. Applied at the next boot.
+void handleTlsUpload(Client &client, const String &request)
+{
+  // POST /tls/<name> HTTP/1.1
+  int start = strlen("POST /tls/");
+  int end = request.indexOf(' ', start);
+  TlsCredential which = tlsCredentialFromName(request.c_str() + start, (end < 0 ? request.length() : end) - start);
+  if (which == NUM_TLS_CREDENTIALS)
+  {
+    sendHttpResponse(client, 404, "application/json", "{\"status\":\"error\",\"message\":\"Unknown credential\"}");
+    return;
+  }
+  static char body[TLS_CREDENTIAL_MAX + 1];
+  HttpRequestHeaders headers;
+  int length = -400;
+  if (readRequestHeaders(client, headers, HTTP_TIMEOUT_MS) == 0)
+  {
+    length = readRequestBody(client, headers, body, sizeof(body), HTTP_TIMEOUT_MS);
+  }
+  if (length < 0)
+  {
+    sendHttpResponse(client, -length, "application/json", "{\"status\":\"error\",\"message\":\"Incomplete credential\"}");
+    return;
+  }
+  int result = storeTlsCredential(which, body, length);
+  memset(body, 0, sizeof(body));
+  if (result != 0)
+  {
+    sendHttpResponse(client, 400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid credential\"}");
+    return;
+  }
+  logInfo(length > 0 ? "TLS credential stored" : "TLS credential removed");
+  sendHttpResponse(client, 200, "application/json", "{\"status\":\"success\",\"message\":\"Credential stored, applied at the next boot\"}");
+}
+
+// Run an output command, the plain value or JSON accepted over MQTT
+void handleOutputCommand(Client &client, const String &request)
+{
+  // POST /outputs/<n> HTTP/1.1
+  int index = atoi(request.c_str() + strlen("POST /outputs/")) - 1;
+  if (index < 0 || index >= channels.outputCount())
+  {
+    sendHttpResponse(client, 404, "application/json", "{\"status\":\"error\",\"message\":\"Unknown output\"}");
+    return;
+  }
+  static char body[TIMED_COMMAND_MAX];
+  HttpRequestHeaders headers;
+  int length = -400;
+  if (readRequestHeaders(client, headers, HTTP_TIMEOUT_MS) == 0)
+  {
+    length = readRequestBody(client, headers, body, sizeof(body), HTTP_TIMEOUT_MS);
+  }
+  if (length < 0)
+  {
+    sendHttpResponse(client, -length, "application/json", "{\"status\":\"error\",\"message\":\"Incomplete command\"}");
+    return;
+  }
+  static TimedCommand command;
+  if (parseTimedCommand(body, length, command) != 0)
+  {
+    sendHttpResponse(client, 400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid command\"}");
+    return;
+  }
+  // Every timer busy, or an expansion output that did not answer
+  if (timers.start(index, command) != 0)
+  {
+    sendHttpResponse(client, 503, "application/json", "{\"status\":\"error\",\"message\":\"Output unavailable\"}");
+    return;
+  }
+  ackPending[index] = true;
+  sendHttpResponse(client, 200, "application/json", "{\"status\":\"success\",\"message\":\"Command started\"}");
+}
+
+// Stream a firmware image to the update partition, chunk by chunk
+void handleFirmwareUpload(Client &client)
+{
+  static uint8_t chunk[OTA_CHUNK_SIZE];
+  HttpRequestHeaders headers;
+  if (readRequestHeaders(client, headers, HTTP_TIMEOUT_MS) != 0)
+  {
+    sendHttpResponse(client, 400, "application/json", "{\"status\":\"error\",\"message\":\"Malformed request\"}");
+    return;
+  }
+  if (headers.contentLength <= 0)
+  {
+    sendHttpResponse(client, 411, "application/json", "{\"status\":\"error\",\"message\":\"Content-Length required\"}");
+    return;
+  }
+  if (updater.begin(headers.contentLength, headers.sha256) != 0)
+  {
+    sendHttpResponse(client, 400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid size or X-Firmware-SHA256\"}");
+    return;
+  }
+
+  logInfo("Receiving firmware, %d bytes", (int)headers.contentLength);
+  size_t remaining = headers.contentLength;
+  while (remaining > 0)
+  {
+    size_t wanted = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+    size_t got = readExact(client, chunk, wanted, HTTP_TIMEOUT_MS);
+    if (got == 0 || updater.write(chunk, got) != 0)
+    {
+      updater.abort();
+      sendHttpResponse(client, got == 0 ? 408 : 500, "application/json", "{\"status\":\"error\",\"message\":\"Upload interrupted\"}");
+      return;
+    }
+    remaining -= got;
+    // the upload is progress, not a stall
+    supervisor.checkIn(TASK_LOOP);
+  }
+
+  if (updater.finish() != 0)
+  {
+    sendHttpResponse(client, 422, "application/json", "{\"status\":\"error\",\"message\":\"Firmware verification failed\"}");
+    return;
+  }
+  sendHttpResponse(client, 200, "application/json", "{\"status\":\"success\",\"message\":\"Firmware verified, rebooting\"}");
+  delay(100);
+  updater.apply();
+}
+
+// Start a capture from the current inputs, outputs and broker state
+void startTrace()
+{
+  trace.start(channels);
+  trace.mqttState(mqttConnected);
+  logInfo("Trace capture started");
+}
+
+// Download the capture, chunk by chunk from the recorder
+void sendTrace(Client &client)
+{
+  static uint8_t chunk[512];
+  TraceHeader header;
+  size_t length = trace.snapshot(header);
+  client.println("HTTP/1.1 200 OK");
+  client.println("Content-Type: application/octet-stream");
+  client.print("Content-Length: ");
+  client.println((unsigned long)(sizeof(header) + length));
+  client.println("Connection: close");
+  client.println();
+  client.write((const uint8_t *)&header, sizeof(header));
+  for (size_t offset = 0; offset < length;)
+  {
+    size_t n = trace.read(offset, chunk, length - offset < sizeof(chunk) ? length - offset : sizeof(chunk));
+    if (client.write(chunk, n) != n)
+    {
+      break;
+    }
+    offset += n;
+  }
   client.stop();
 }
 
 // Create JSON Data
 String getData()
 {
-  StaticJsonDocument<512> doc;
+  MemScope scope(MEM_JSON);
+  // Sized for the channels present, names are copied into the document
+  size_t capacity = JSON_OBJECT_SIZE(11) + 128 + JSON_OBJECT_SIZE(9) + JSON_OBJECT_SIZE(4) +
+                    JSON_OBJECT_SIZE(channels.inputCount()) + channels.inputCount() * (JSON_OBJECT_SIZE(3) + 8) +
+                    JSON_OBJECT_SIZE(channels.outputCount()) + channels.outputCount() * 8;
+  DynamicJsonDocument doc(capacity);
   doc["deviceId"] = conf.getDeviceId();
   // MQTT Connection Status
   doc["mqttConnected"] = mqttConnected;
-  // NTP Time
-  doc["NTP"] = timeString;
+  // NTP Time, seconds and milliseconds since the Unix epoch
+  doc["NTP"] = timebase.epoch();
+  doc["time"] = timebase.nowMs();
+  // Supervisor
+  doc["stalls"] = supervisor.getStallCount();
+  // Publish budget
+  JsonObject budget = doc.createNestedObject("budget");
+  governor.toJson(budget);
+  budget["telemetryPeriodS"] = telemetryPeriodMs / 1000;
+  // Web server admission
+  admission.toJson(doc.createNestedObject("http"));
   // Last Publish Time
   if (lastPublish > 0)
   {
@@ -495,110 +1257,156 @@ String getData()
 
   // Digital Inputs
   JsonObject inputsObject = doc.createNestedObject("inputs");
-  for (int i = 0; i < NUM_INPUTS; i++)
+  char name[12];
+  for (int i = 0; i < channels.inputCount(); i++)
   {
-    String name = "I" + String(i + 1);
+    snprintf(name, sizeof(name), "I%d", i + 1);
     if (conf.getInputType(i) == DIGITAL)
     {
       JsonObject obj = inputsObject.createNestedObject(name);
-      obj["value"] = digitalRead(conf.getInputPin(i));
+      obj["value"] = channels.readInput(i);
       obj["type"] = true;
     }
     else
     {
       JsonObject obj = inputsObject.createNestedObject(name);
-      obj["value"] = analogRead(conf.getInputPin(i)) * (3.249 / ((1 << ADC_BITS) - 1)) / 0.3034;
+      obj["value"] = conf.scaleInput(i, channels.readInput(i)) / (float)MILLI;
       obj["type"] = false;
+      obj["unit"] = conf.getInputUnit(i);
     }
   }
   JsonObject outputsObj = doc.createNestedObject("outputs");
-  for (int i = 0; i < NUM_OUTPUTS; i++)
+  for (int i = 0; i < channels.outputCount(); i++)
   {
-    String name = "O" + String(i + 1);
-    outputsObj[name] = digitalRead(conf.getOutputPin(i));
+    snprintf(name, sizeof(name), "O%d", i + 1);
+    outputsObj[name] = channels.getOutput(i);
   }
   String jsonString;
   serializeJson(doc, jsonString);
   return jsonString;
 }
 
-String getStringFromPOST(EthernetClient client)
+// Timing statistics of the scheduled tasks
+String getTasks()
 {
-  String json = "";
-  bool headersEnded = false;
-
-  while (client.available())
+  MemScope scope(MEM_JSON);
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(3) + 2 * (JSON_ARRAY_SIZE(SCHED_MAX_TASKS) + SCHED_MAX_TASKS * JSON_OBJECT_SIZE(10)) +
+                          JSON_OBJECT_SIZE(5));
+  commsTasks.toJson(doc.createNestedArray(commsTasks.getName()));
+  ioTasks.toJson(doc.createNestedArray(ioTasks.getName()));
+#if defined(REMOTO_IO_CORE)
+  if (ioLink.attached())
   {
-    String line = client.readStringUntil('\n'); // Read line-by-line
-    // Detect the end of headers (an empty line)
-    if (line == "\r")
-    {
-      headersEnded = true; // Headers end here
-      continue;
-    }
-    // If headers have ended, start collecting the body (JSON)
-    if (headersEnded)
-    {
-      json += line; // Append body content to the json string
-    }
+    ioLink.toJson(doc.createNestedObject("ioCore"));
   }
-  return json; // Return trimmed JSON string
+#endif
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
 }
 
-String getStringFromWiFiPOST(WiFiClient client)
+// TLS credentials present and handshake statistics, never key material
+String getTls()
 {
-  String json = "";
-  bool headersEnded = false;
+  MemScope scope(MEM_JSON);
+  StaticJsonDocument<2 * JSON_OBJECT_SIZE(10)> doc;
+  JsonObject status = doc.to<JsonObject>();
+  status["enabled"] = conf.getMqttTls();
+  tls.toJson(status);
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
+}
 
-  while (client.available())
-  {
-    String line = client.readStringUntil('\n'); // Read line-by-line
-    // Detect the end of headers (an empty line)
-    if (line == "\r")
-    {
-      headersEnded = true; // Headers end here
-      continue;
-    }
-    // If headers have ended, start collecting the body (JSON)
-    if (headersEnded)
-    {
-      json += line; // Append body content to the json string
-    }
-  }
-  return json; // Return trimmed JSON string
+// Output states with their running or last timed command
+String getOutputs()
+{
+  MemScope scope(MEM_JSON);
+  int count = channels.outputCount();
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(count) + count * (JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(8) + 8));
+  timers.toJson(doc.to<JsonObject>());
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
+}
+
+// Capture state and buffer use
+String getTraceStatus()
+{
+  MemScope scope(MEM_JSON);
+  StaticJsonDocument<JSON_OBJECT_SIZE(5)> doc;
+  trace.toJson(doc.to<JsonObject>());
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
+}
+
+// Log records held in RAM, oldest first
+String getLogs()
+{
+  MemScope scope(MEM_JSON);
+  // The messages stay in the logger, only pointers go in the document
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(LOG_RECORDS) + LOG_RECORDS * JSON_OBJECT_SIZE(3));
+  logsToJson(doc.to<JsonObject>());
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
+}
+
+// Heap, subsystems and stacks, see memprofile.h
+String getMetrics()
+{
+  MemScope scope(MEM_JSON);
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(9) + JSON_OBJECT_SIZE(NUM_MEM_TAGS) +
+                          NUM_MEM_TAGS * JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(MEM_MAX_THREADS) +
+                          MEM_MAX_THREADS * JSON_OBJECT_SIZE(2));
+  memToJson(doc.to<JsonObject>());
+  String jsonString;
+  serializeJson(doc, jsonString);
+  return jsonString;
 }
 
-IPAddress parseIP(const String &ipaddr)
+// Dotted quad to address, -1 when the text is not one
+int parseIP(const char *ipaddr, IPAddress &address)
 {
   uint8_t ip[4];
-  sscanf(ipaddr.c_str(), "%u.%u.%u.%u", &ip[0], &ip[1], &ip[2], &ip[3]);
-  IPAddress ret(ip[0], ip[1], ip[2], ip[3]);
-  return ret;
+  if (sscanf(ipaddr, "%hhu.%hhu.%hhu.%hhu", &ip[0], &ip[1], &ip[2], &ip[3]) != 4)
+  {
+    return -1;
+  }
+  address = IPAddress(ip[0], ip[1], ip[2], ip[3]);
+  return 0;
 }
 
 int connectWiFi()
 {
   int ret = WL_IDLE_STATUS;
-  if (conf.getDHCP())
+  IPAddress address;
+  if (!conf.getDHCP() && parseIP(conf.getDeviceIpAddress(), address) == 0)
   {
-    WiFi.begin(ssid, pass);
+    WiFi.config(address);
   }
   else
   {
-    WiFi.config(parseIP(conf.getDeviceIpAddress()));
+    if (!conf.getDHCP())
+    {
+      logError("Invalid device IP address %s, using DHCP", conf.getDeviceIpAddress());
+    }
+    WiFi.begin(ssid, pass);
   }
   // try 10 times to connect to wifi
   for (int i = 0; i < 10; i++)
   {
-    Serial.print("Attempting to connect to SSID: ");
-    Serial.println(ssid);
+    logInfo("Attempting to connect to SSID: %s", ssid);
     // Connect to WPA/WPA2 network. Change this line if using open or WEP network:
     ret = WiFi.begin(ssid, pass);
     // wait 3 seconds for connection:
     delay(3000);
+    // retries are bounded, keep the supervisor informed
+    supervisor.checkIn(TASK_LOOP);
     if (ret == WL_CONNECTED)
     {
-      Serial.println("Connected to wifi");
+      logInfo("Connected to wifi");
       digitalWrite(LEDR, LOW);
       return ret;
     }
@@ -606,27 +1414,62 @@ int connectWiFi()
   return ret;
 }
 
+int lookupWiFi(const char *host, IPAddress &address)
+{
+  return WiFi.hostByName(host, address);
+}
+
+int lookupEthernet(const char *host, IPAddress &address)
+{
+  return Ethernet.hostByName(host, address);
+}
+
+// Start the disciplined clock on whichever network is up
+void setupNTP()
+{
+  logInfo("Time server: %s", conf.getTimeServer());
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    timebase.begin(ntpUDP, conf.getTimeServer(), lookupWiFi);
+  }
+  else
+  {
+    timebase.begin(ntpEthUDP, conf.getTimeServer(), lookupEthernet);
+  }
+}
+
+// Look the time server up, on the comms thread as DNS blocks
+void resolveTimeServer()
+{
+  timebase.resolve();
+}
+
 int connectEthernet()
 {
   int ret = 0;
-  Serial.println("Starting Ethernet");
+  IPAddress address;
+  logInfo("Starting Ethernet");
   // if one is found
-  if (conf.getDHCP())
+  if (!conf.getDHCP() && parseIP(conf.getDeviceIpAddress(), address) == 0)
   {
-    ret = Ethernet.begin();
+    ret = Ethernet.begin(address);
   }
   else
   {
-    ret = Ethernet.begin(parseIP(conf.getDeviceIpAddress()));
+    if (!conf.getDHCP())
+    {
+      logError("Invalid device IP address %s, using DHCP", conf.getDeviceIpAddress());
+    }
+    ret = Ethernet.begin();
   }
 
   if (ret == 0)
   {
-    Serial.println("Ethernet failed to connect.");
+    logWarn("Ethernet failed to connect.");
 
     if (Ethernet.hardwareStatus() == EthernetNoHardware)
     {
-      Serial.println("Ethernet shield not found.");
+      logError("Ethernet shield not found.");
       // if wifi is preferred, this is the last chance to connect
       while (conf.getWiFiPref())
       {
@@ -639,7 +1482,7 @@ int connectEthernet()
 
     if (Ethernet.linkStatus() == LinkOFF)
     {
-      Serial.println("Ethernet cable not connected.");
+      logWarn("Ethernet cable not connected.");
       // if wifi is preferred, this is the last chance to connect
       while (conf.getWiFiPref())
       {
@@ -651,4 +1494,6 @@ int connectEthernet()
     }
   }
   return ret;
-}
\ No newline at end of file
+}
+
+#endif // CORE_CM4
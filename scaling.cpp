@@ -0,0 +1,429 @@
+/*
+ * Remoto: Analog input scaling for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Per-channel calibration of the analog inputs, compiled to fixed point
+ * at config load. See scaling.h for the model.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "scaling.h"
+#include <math.h>
+
+namespace remoto
+{
+    // Largest engineering value representable in milli-units
+    constexpr float SCALING_LIMIT = (float)INT32_MAX / MILLI;
+
+    static int32_t saturate(int64_t value)
+    {
+        if (value > INT32_MAX)
+        {
+            return INT32_MAX;
+        }
+        if (value < INT32_MIN)
+        {
+            return INT32_MIN;
+        }
+        return (int32_t)value;
+    }
+
+    // Convert a float to a rounded int32, -1 if it does not fit
+    static int toFixed(double value, int32_t *out)
+    {
+        if (isnan(value) || value > INT32_MAX || value < INT32_MIN)
+        {
+            return -1;
+        }
+        *out = (int32_t)lround(value);
+        return 0;
+    }
+
+    ChannelScaling::ChannelScaling()
+    {
+        loadDefaults();
+    }
+
+    void ChannelScaling::loadDefaults()
+    {
+        _mode = ScalingMode::POLY;
+        _coeffs[0] = 0.0f;
+        _coeffs[1] = 1.0f;
+        _numCoeffs = 2;
+        _lutPoints = 0;
+        _clamp = false;
+        _min = -SCALING_LIMIT;
+        _max = SCALING_LIMIT;
+        strcpy(_unit, "V");
+        // Factory curve, no need to go through compile()
+        _polyQ[0] = 0;
+        _polyQ[1] = FACTORY_GAIN_Q;
+        _minMilli = INT32_MIN;
+        _maxMilli = INT32_MAX;
+    }
+
+    // Fold the factory curve into the user description and precompute
+    // the fixed point coefficients used by convert()
+    int ChannelScaling::compile()
+    {
+        if (_mode == ScalingMode::POLY)
+        {
+            // volts = raw / 2^ADC_BITS * FACTORY_FULL_SCALE, so the
+            // coefficient of raw^i picks up FACTORY_FULL_SCALE^i
+            double scale = MILLI;
+            for (int i = 0; i < _numCoeffs; ++i)
+            {
+                if (toFixed(_coeffs[i] * scale, &_polyQ[i]) != 0)
+                {
+                    return -1;
+                }
+                scale *= FACTORY_FULL_SCALE;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < _lutPoints; ++i)
+            {
+                double raw = _lutX[i] / FACTORY_FULL_SCALE * (1UL << ADC_BITS);
+                raw = constrain(raw, 0.0, (double)ADC_MAX);
+                _lutRaw[i] = (uint16_t)lround(raw);
+                if (toFixed((double)_lutY[i] * MILLI, &_lutVal[i]) != 0)
+                {
+                    return -1;
+                }
+                if (i > 0)
+                {
+                    // Breakpoints must stay distinct once quantized
+                    if (_lutRaw[i] <= _lutRaw[i - 1])
+                    {
+                        return -1;
+                    }
+                    int64_t rise = (int64_t)_lutVal[i] - _lutVal[i - 1];
+                    int64_t slope = rise * (1L << 16) / (_lutRaw[i] - _lutRaw[i - 1]);
+                    if (slope > INT32_MAX || slope < INT32_MIN)
+                    {
+                        return -1;
+                    }
+                    _lutSlope[i - 1] = (int32_t)slope;
+                }
+            }
+        }
+
+        if (_clamp)
+        {
+            if (toFixed((double)_min * MILLI, &_minMilli) != 0 ||
+                toFixed((double)_max * MILLI, &_maxMilli) != 0 ||
+                _minMilli > _maxMilli)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            _minMilli = INT32_MIN;
+            _maxMilli = INT32_MAX;
+        }
+        return 0;
+    }
+
+    int ChannelScaling::setLinear(float gain, float offset)
+    {
+        float coeffs[2] = {offset, gain};
+        return setPolynomial(coeffs, 2);
+    }
+
+    int ChannelScaling::setPolynomial(const float *coeffs, int count)
+    {
+        if (count < 1 || count > MAX_POLY_COEFFS)
+        {
+            return -1;
+        }
+        ChannelScaling previous = *this;
+        _mode = ScalingMode::POLY;
+        _numCoeffs = count;
+        for (int i = 0; i < count; ++i)
+        {
+            _coeffs[i] = coeffs[i];
+        }
+        if (compile() != 0)
+        {
+            *this = previous;
+            return -1;
+        }
+        return 0;
+    }
+
+    int ChannelScaling::setTable(const float *x, const float *y, int count)
+    {
+        if (count < 2 || count > MAX_LUT_POINTS)
+        {
+            return -1;
+        }
+        ChannelScaling previous = *this;
+        _mode = ScalingMode::LUT;
+        _lutPoints = count;
+        for (int i = 0; i < count; ++i)
+        {
+            _lutX[i] = x[i];
+            _lutY[i] = y[i];
+        }
+        if (compile() != 0)
+        {
+            *this = previous;
+            return -1;
+        }
+        return 0;
+    }
+
+    int ChannelScaling::setClamp(float min, float max)
+    {
+        ChannelScaling previous = *this;
+        _clamp = true;
+        _min = min;
+        _max = max;
+        if (compile() != 0)
+        {
+            *this = previous;
+            return -1;
+        }
+        return 0;
+    }
+
+    void ChannelScaling::clearClamp()
+    {
+        _clamp = false;
+        _min = -SCALING_LIMIT;
+        _max = SCALING_LIMIT;
+        _minMilli = INT32_MIN;
+        _maxMilli = INT32_MAX;
+    }
+
+    int ChannelScaling::setUnit(const char *unit)
+    {
+        if (unit == nullptr || strlen(unit) > MAX_UNIT_LEN)
+        {
+            return -1;
+        }
+        strcpy(_unit, unit);
+        return 0;
+    }
+
+    const char *ChannelScaling::getUnit() const
+    {
+        return _unit;
+    }
+
+    // Hot path: integer only
+    int32_t ChannelScaling::convert(uint16_t raw) const
+    {
+        int64_t value;
+        if (_mode == ScalingMode::POLY)
+        {
+            // Horner on raw counts, each step is one multiply-add
+            value = _polyQ[_numCoeffs - 1];
+            for (int i = _numCoeffs - 2; i >= 0; --i)
+            {
+                value = ((value * raw) >> ADC_BITS) + _polyQ[i];
+            }
+        }
+        else if (raw <= _lutRaw[0])
+        {
+            value = _lutVal[0];
+        }
+        else if (raw >= _lutRaw[_lutPoints - 1])
+        {
+            value = _lutVal[_lutPoints - 1];
+        }
+        else
+        {
+            int i = 0;
+            while (raw >= _lutRaw[i + 1])
+            {
+                ++i;
+            }
+            value = _lutVal[i] + (((int64_t)(raw - _lutRaw[i]) * _lutSlope[i]) >> 16);
+        }
+
+        int32_t result = saturate(value);
+        if (result < _minMilli)
+        {
+            return _minMilli;
+        }
+        if (result > _maxMilli)
+        {
+            return _maxMilli;
+        }
+        return result;
+    }
+
+    int ChannelScaling::fromJson(JsonObjectConst obj)
+    {
+        ChannelScaling next;
+        int ret = 0;
+
+        if (obj.containsKey("poly"))
+        {
+            JsonArrayConst poly = obj["poly"];
+            float coeffs[MAX_POLY_COEFFS];
+            int count = poly.size();
+            if (count > MAX_POLY_COEFFS)
+            {
+                return -1;
+            }
+            for (int i = 0; i < count; ++i)
+            {
+                coeffs[i] = poly[i].as<float>();
+            }
+            ret = next.setPolynomial(coeffs, count);
+        }
+        else if (obj.containsKey("lut"))
+        {
+            JsonArrayConst lut = obj["lut"];
+            float x[MAX_LUT_POINTS];
+            float y[MAX_LUT_POINTS];
+            int count = lut.size();
+            if (count > MAX_LUT_POINTS)
+            {
+                return -1;
+            }
+            for (int i = 0; i < count; ++i)
+            {
+                x[i] = lut[i][0].as<float>();
+                y[i] = lut[i][1].as<float>();
+            }
+            ret = next.setTable(x, y, count);
+        }
+        else
+        {
+            ret = next.setLinear(obj["gain"] | 1.0f, obj["offset"] | 0.0f);
+        }
+        if (ret != 0)
+        {
+            return -1;
+        }
+
+        if (obj.containsKey("min") || obj.containsKey("max"))
+        {
+            if (next.setClamp(obj["min"] | -SCALING_LIMIT, obj["max"] | SCALING_LIMIT) != 0)
+            {
+                return -1;
+            }
+        }
+        if (next.setUnit(obj["unit"] | "V") != 0)
+        {
+            return -1;
+        }
+
+        *this = next;
+        return 0;
+    }
+
+    void ChannelScaling::toJson(JsonObject obj) const
+    {
+        if (_mode == ScalingMode::LUT)
+        {
+            JsonArray lut = obj.createNestedArray("lut");
+            for (int i = 0; i < _lutPoints; ++i)
+            {
+                JsonArray point = lut.createNestedArray();
+                point.add(_lutX[i]);
+                point.add(_lutY[i]);
+            }
+        }
+        else if (_numCoeffs <= 2)
+        {
+            obj["gain"] = _numCoeffs > 1 ? _coeffs[1] : 0.0f;
+            obj["offset"] = _coeffs[0];
+        }
+        else
+        {
+            JsonArray poly = obj.createNestedArray("poly");
+            for (int i = 0; i < _numCoeffs; ++i)
+            {
+                poly.add(_coeffs[i]);
+            }
+        }
+        obj["unit"] = (const char *)_unit;
+        if (_clamp)
+        {
+            obj["min"] = _min;
+            obj["max"] = _max;
+        }
+    }
+
+    int ChannelScaling::fromSettings(const ScalingSettings &settings)
+    {
+        ChannelScaling next;
+        int ret = -1;
+        if (settings.mode == (uint8_t)ScalingMode::POLY)
+        {
+            ret = next.setPolynomial(settings.coeffs, settings.numCoeffs);
+        }
+        else if (settings.mode == (uint8_t)ScalingMode::LUT)
+        {
+            ret = next.setTable(settings.lutX, settings.lutY, settings.lutPoints);
+        }
+        if (ret != 0)
+        {
+            return -1;
+        }
+        if (settings.clamp && next.setClamp(settings.min, settings.max) != 0)
+        {
+            return -1;
+        }
+        // The unit has to end within its field
+        if (memchr(settings.unit, '\0', sizeof(settings.unit)) == nullptr || next.setUnit(settings.unit) != 0)
+        {
+            return -1;
+        }
+        *this = next;
+        return 0;
+    }
+
+    void ChannelScaling::toSettings(ScalingSettings &settings) const
+    {
+        // Entries not in use stay zero, equal descriptions store equal bytes
+        memset((void *)&settings, 0, sizeof(settings));
+        settings.mode = (uint8_t)_mode;
+        if (_mode == ScalingMode::POLY)
+        {
+            settings.numCoeffs = _numCoeffs;
+            memcpy(settings.coeffs, _coeffs, _numCoeffs * sizeof(float));
+        }
+        else
+        {
+            settings.lutPoints = _lutPoints;
+            memcpy(settings.lutX, _lutX, _lutPoints * sizeof(float));
+            memcpy(settings.lutY, _lutY, _lutPoints * sizeof(float));
+        }
+        if (_clamp)
+        {
+            settings.clamp = 1;
+            settings.min = _min;
+            settings.max = _max;
+        }
+        strcpy(settings.unit, _unit);
+    }
+
+    int formatMilli(char *buffer, size_t length, int32_t value, int decimals)
+    {
+        static const int32_t powers[] = {1, 10, 100, 1000};
+        decimals = constrain(decimals, 0, 3);
+        int32_t step = MILLI / powers[decimals];
+
+        // Round half away from zero to the requested precision
+        int64_t magnitude = value < 0 ? -(int64_t)value : value;
+        magnitude = (magnitude + step / 2) / step;
+        const char *sign = (value < 0 && magnitude != 0) ? "-" : "";
+        long whole = (long)(magnitude / powers[decimals]);
+        long frac = (long)(magnitude % powers[decimals]);
+
+        if (decimals == 0)
+        {
+            return snprintf(buffer, length, "%s%ld", sign, whole);
+        }
+        return snprintf(buffer, length, "%s%ld.%0*ld", sign, whole, decimals, frac);
+    }
+} // namespace remoto
@@ -0,0 +1,125 @@
+/*
+ * Remoto: Analog input scaling for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Per-channel calibration of the analog inputs. Each channel describes
+ * its transfer function in engineering terms (linear gain/offset, a
+ * polynomial or a lookup table over the terminal voltage, plus unit and
+ * clamp). At config load the description is folded together with the
+ * factory ADC curve and compiled to fixed point, so that converting a
+ * raw ADC reading is an integer multiply-add and yields milli-units.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SCALING_H)
+#define SCALING_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define ADC_BITS 16
+
+namespace remoto
+{
+    //---------------- FACTORY ADC CURVE ----------------
+    // OPTA analog frontend: 3.249 V ADC reference behind a 0.3034 divider.
+    constexpr double FACTORY_VREF = 3.249;
+    constexpr double FACTORY_DIVIDER = 0.3034;
+    constexpr uint32_t ADC_MAX = (1UL << ADC_BITS) - 1;
+    // Raw counts are treated as a Q16 fraction of full scale, so the
+    // full scale voltage is the one reached at 1 << ADC_BITS counts.
+    constexpr double FACTORY_FULL_SCALE = FACTORY_VREF / FACTORY_DIVIDER * (double)(1UL << ADC_BITS) / ADC_MAX;
+    // Engineering values are carried as integers in thousandths of a unit
+    constexpr int32_t MILLI = 1000;
+    constexpr int32_t FACTORY_GAIN_Q = (int32_t)(FACTORY_FULL_SCALE * MILLI + 0.5);
+
+    constexpr int MAX_POLY_COEFFS = 4; // up to a cubic
+    constexpr int MAX_LUT_POINTS = 8;
+    constexpr int MAX_UNIT_LEN = 8;
+
+    enum class ScalingMode : uint8_t
+    {
+        POLY = 0, // linear is a polynomial with two coefficients
+        LUT = 1
+    };
+
+    // Description of a channel as it is stored in flash. Only the entries
+    // in use are set, the fixed point form is compiled again on load.
+    struct ScalingSettings
+    {
+        uint8_t mode; // ScalingMode
+        uint8_t numCoeffs;
+        uint8_t lutPoints;
+        uint8_t clamp;
+        float coeffs[MAX_POLY_COEFFS];
+        float lutX[MAX_LUT_POINTS];
+        float lutY[MAX_LUT_POINTS];
+        float min;
+        float max;
+        char unit[MAX_UNIT_LEN + 1];
+        uint8_t reserved[3];
+    };
+
+    class ChannelScaling
+    {
+    private:
+        // User description, engineering value as a function of volts
+        ScalingMode _mode;
+        float _coeffs[MAX_POLY_COEFFS]; // c0 + c1*V + c2*V^2 + c3*V^3
+        uint8_t _numCoeffs;
+        float _lutX[MAX_LUT_POINTS]; // volts, strictly increasing
+        float _lutY[MAX_LUT_POINTS]; // engineering units
+        uint8_t _lutPoints;
+        bool _clamp;
+        float _min;
+        float _max;
+        char _unit[MAX_UNIT_LEN + 1];
+
+        // Compiled form, evaluated directly on raw ADC counts
+        int32_t _polyQ[MAX_POLY_COEFFS];
+        uint16_t _lutRaw[MAX_LUT_POINTS];
+        int32_t _lutVal[MAX_LUT_POINTS];
+        int32_t _lutSlope[MAX_LUT_POINTS]; // milli-units per count, Q16
+        int32_t _minMilli;
+        int32_t _maxMilli;
+
+        int compile();
+
+    public:
+        ChannelScaling();
+
+        // Factory curve: volts at the terminal, no clamp
+        void loadDefaults();
+
+        // Engineering value = offset + gain * volts
+        int setLinear(float gain, float offset);
+        // Engineering value = sum(coeffs[i] * volts^i)
+        int setPolynomial(const float *coeffs, int count);
+        // Piecewise-linear table, x in volts (increasing), y in units
+        int setTable(const float *x, const float *y, int count);
+
+        int setClamp(float min, float max);
+        void clearClamp();
+
+        int setUnit(const char *unit);
+        const char *getUnit() const;
+
+        // Convert a raw ADC reading to thousandths of the engineering unit
+        int32_t convert(uint16_t raw) const;
+
+        // JSON round trip for the REST config
+        int fromJson(JsonObjectConst obj);
+        void toJson(JsonObject obj) const;
+
+        // Stored form. fromSettings() checks and compiles the description
+        // as the setters do, -1 leaves the channel unchanged.
+        int fromSettings(const ScalingSettings &settings);
+        void toSettings(ScalingSettings &settings) const;
+    };
+
+    // Format a milli-unit value with the given number of decimals (0-3)
+    int formatMilli(char *buffer, size_t length, int32_t value, int decimals);
+} // namespace remoto
+
+#endif // SCALING_H
@@ -0,0 +1,150 @@
+/*
+ * Remoto: Device shadow for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Desired document parsing and reported document. See shadow.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "shadow.h"
+#include "configstore.h"
+#include "scaling.h"
+#include "timebase.h"
+#include <stdarg.h>
+
+namespace remoto
+{
+    // Append to a document, false once it does not fit
+    static bool append(char *buffer, size_t size, size_t &used, const char *format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buffer + used, size - used, format, args);
+        va_end(args);
+        if (n < 0 || (size_t)n >= size - used)
+        {
+            return false;
+        }
+        used += n;
+        return true;
+    }
+
+    DeviceShadow::DeviceShadow()
+        : _reportNow(true), _reportMs(0), _applied(false), _desiredCrc(0), _desiredVersion(0)
+    {
+        memset(_reported, 0, sizeof(_reported));
+        memset(_pending, 0, sizeof(_pending));
+    }
+
+    void DeviceShadow::connected()
+    {
+        _reportNow = true;
+    }
+
+    int DeviceShadow::desired(const char *payload, size_t length, ShadowDesired &state)
+    {
+        // An empty retained message clears the document on the broker
+        if (length == 0)
+        {
+            return 0;
+        }
+        uint32_t crc = crc32(payload, length);
+        if (_applied && crc == _desiredCrc)
+        {
+            return 0;
+        }
+        // On the heap, the MQTT callback runs on a small stack
+        DynamicJsonDocument doc(JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(MAX_OUTPUTS));
+        if (deserializeJson(doc, payload, length))
+        {
+            return -1;
+        }
+        JsonVariantConst version = doc["version"];
+        JsonArrayConst outputs = doc["outputs"];
+        if ((!version.isNull() && !version.is<uint32_t>()) || outputs.isNull() || outputs.size() > MAX_OUTPUTS)
+        {
+            return -1;
+        }
+        memset(state.outputs, -1, sizeof(state.outputs));
+        int i = 0;
+        for (JsonVariantConst value : outputs)
+        {
+            if (!value.isNull())
+            {
+                if (!value.is<int>() || (value.as<int>() != 0 && value.as<int>() != 1))
+                {
+                    return -1;
+                }
+                state.outputs[i] = value.as<int>();
+            }
+            i++;
+        }
+        state.version = version | 0;
+        _applied = true;
+        _desiredCrc = crc;
+        _desiredVersion = state.version;
+        _reportNow = true;
+        return 1;
+    }
+
+    bool DeviceShadow::due(const Channels &channels, const OutputTimer &timers) const
+    {
+        if (_reportNow)
+        {
+            return true;
+        }
+        if (millis() - _reportMs < SHADOW_MIN_INTERVAL_MS)
+        {
+            return false;
+        }
+        // A running program reports when it ends
+        for (int i = 0; i < channels.outputCount(); ++i)
+        {
+            if (channels.getOutput(i) != _reported[i] && !timers.running(i))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int DeviceShadow::report(const Channels &channels, const config &conf, uint64_t timeMs, char *buffer, size_t size)
+    {
+        char number[24];
+        size_t used = 0;
+        formatTimestamp(number, sizeof(number), timeMs);
+        bool fits = append(buffer, size, used, "{\"time\":%s,\"desiredVersion\":%lu,\"outputs\":[", number,
+                           (unsigned long)_desiredVersion);
+        for (int i = 0; fits && i < channels.outputCount(); ++i)
+        {
+            _pending[i] = channels.getOutput(i);
+            fits = append(buffer, size, used, i > 0 ? ",%u" : "%u", _pending[i]);
+        }
+        fits = fits && append(buffer, size, used, "],\"inputs\":[");
+        // Values as in the telemetry, analog ones in engineering units
+        for (int i = 0; fits && i < channels.inputCount(); ++i)
+        {
+            uint16_t raw = channels.readInput(i);
+            if (conf.getInputType(i) == ANALOG)
+            {
+                formatMilli(number, sizeof(number), conf.scaleInput(i, raw), 2);
+            }
+            else
+            {
+                snprintf(number, sizeof(number), "%u", raw);
+            }
+            fits = append(buffer, size, used, i > 0 ? ",%s" : "%s", number);
+        }
+        fits = fits && append(buffer, size, used, "]}");
+        return fits ? (int)used : -1;
+    }
+
+    void DeviceShadow::reported()
+    {
+        memcpy(_reported, _pending, sizeof(_reported));
+        _reportNow = false;
+        _reportMs = millis();
+    }
+} // namespace remoto
@@ -0,0 +1,85 @@
+/*
+ * Remoto: Device shadow for Arduino OPTA
+ * -------------------------------------------------------------------
+ * The state of the device is kept on the broker in two retained
+ * documents, so that it outlives a reboot of either side:
+ *
+ *   <deviceId>/shadow/reported  outputs, input values and the desired
+ *                               version applied, from the device
+ *   <deviceId>/shadow/desired   output states to apply, from the
+ *                               application
+ *
+ * On every connection the device publishes its reported state and
+ * subscribes to the desired one, which the broker sends back straight
+ * away, so outputs and dashboards converge within one round trip
+ * rather than a telemetry period. A desired document is applied when it
+ * differs from the last one applied, so a reconnection does not undo
+ * the commands sent on <deviceId>/O<n> in the meantime.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SHADOW_H)
+#define SHADOW_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "channels.h"
+#include "config.h"
+#include "outputtimer.h"
+
+#define SHADOW_REPORTED_TOPIC "/shadow/reported"
+#define SHADOW_DESIRED_TOPIC "/shadow/desired"
+#define SHADOW_TOPIC_SIZE (CONFIG_DEVICE_ID_LEN + 20)
+// Reported document, within the MQTT packet buffers
+#define SHADOW_REPORT_SIZE 896
+// Reports on output changes are at least this far apart
+#define SHADOW_MIN_INTERVAL_MS 1000
+
+namespace remoto
+{
+    // Output states of a desired document, -1 where it leaves the
+    // output alone
+    struct ShadowDesired
+    {
+        int8_t outputs[MAX_OUTPUTS];
+        uint32_t version;
+    };
+
+    class DeviceShadow
+    {
+    private:
+        uint8_t _reported[MAX_OUTPUTS]; // outputs in the last report
+        uint8_t _pending[MAX_OUTPUTS];  // outputs in the report being sent
+        bool _reportNow;
+        uint32_t _reportMs;
+        bool _applied; // a desired document was applied since boot
+        uint32_t _desiredCrc;
+        uint32_t _desiredVersion;
+
+    public:
+        DeviceShadow();
+
+        // New broker connection, report at once
+        void connected();
+
+        // Read a desired document: {"version":3,"outputs":[1,null,0]}.
+        // Returns 1 when it is new, 0 when it was applied already or is
+        // empty, -1 when invalid.
+        int desired(const char *payload, size_t length, ShadowDesired &state);
+
+        // Whether a report is due: the first one of a connection, after a
+        // desired document, or when outputs changed outside of a timed
+        // program, at most every SHADOW_MIN_INTERVAL_MS.
+        bool due(const Channels &channels, const OutputTimer &timers) const;
+
+        // Write the reported document, returns its length or -1 if it
+        // does not fit
+        int report(const Channels &channels, const config &conf, uint64_t timeMs, char *buffer, size_t size);
+        // The last report written was published
+        void reported();
+    };
+} // namespace remoto
+
+#endif // SHADOW_H
@@ -0,0 +1,244 @@
+/*
+ * Remoto: Task supervisor and hardware watchdog for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Deadline tracking of the scheduler tasks and stall history. See
+ * supervisor.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "supervisor.h"
+#include "logger.h"
+#include "mbed.h"
+#include "kvstore_global_api.h"
+
+namespace remoto
+{
+    constexpr uint32_t STALL_MAGIC = 0x5354414C; // "STAL"
+
+    // Layout of the history kept in flash across resets
+    struct PersistedHistory
+    {
+        uint32_t magic;
+        uint32_t stallCount;
+        uint8_t length;
+        uint8_t head;
+        uint16_t reserved;
+        StallRecord records[STALL_HISTORY_LEN];
+    };
+
+    Supervisor::Supervisor()
+        : _historyLen(0), _historyHead(0), _stallCount(0), _unpublished(false),
+          _watchdogReset(false), _started(false)
+    {
+        for (int i = 0; i < NUM_SUPERVISED_TASKS; ++i)
+        {
+            _tasks[i].name = "";
+            _tasks[i].deadlineMs = 0;
+            _tasks[i].limitMs = 0;
+            _tasks[i].lastCheckIn = 0;
+            _tasks[i].overrunMs = 0;
+            _tasks[i].active = false;
+            _tasks[i].stalled = false;
+            _tasks[i].worstMs = 0;
+        }
+    }
+
+    void Supervisor::begin()
+    {
+        _watchdogReset = mbed::ResetReason::get() == RESET_REASON_WATCHDOG;
+
+        PersistedHistory stored;
+        size_t actual = 0;
+        if (kv_get("stalls", &stored, sizeof(stored), &actual) == MBED_SUCCESS &&
+            actual == sizeof(stored) && stored.magic == STALL_MAGIC &&
+            stored.length <= STALL_HISTORY_LEN && stored.head < STALL_HISTORY_LEN)
+        {
+            memcpy(_history, stored.records, sizeof(_history));
+            _historyLen = stored.length;
+            _historyHead = stored.head;
+            _stallCount = stored.stallCount;
+            _unpublished = _historyLen > 0;
+        }
+        if (_watchdogReset)
+        {
+            logWarn("Supervisor: recovered from a watchdog reset");
+        }
+    }
+
+    void Supervisor::start()
+    {
+        // Tasks registered before the start get a fresh deadline
+        uint32_t now = millis();
+        for (int i = 0; i < NUM_SUPERVISED_TASKS; ++i)
+        {
+            _tasks[i].lastCheckIn = now;
+        }
+        mbed::Watchdog::get_instance().start(WATCHDOG_TIMEOUT_MS);
+        _started = true;
+    }
+
+    void Supervisor::registerTask(SupervisedTask task, const char *name, uint32_t deadlineMs, uint32_t limitMs)
+    {
+        if (task >= NUM_SUPERVISED_TASKS)
+        {
+            return;
+        }
+        _tasks[task].name = name;
+        _tasks[task].deadlineMs = deadlineMs;
+        _tasks[task].limitMs = limitMs > deadlineMs ? limitMs : deadlineMs;
+        _tasks[task].lastCheckIn = millis();
+        _tasks[task].active = true;
+    }
+
+    void Supervisor::checkIn(SupervisedTask task)
+    {
+        if (task >= NUM_SUPERVISED_TASKS)
+        {
+            return;
+        }
+        TaskState &state = _tasks[task];
+        uint32_t now = millis();
+        uint32_t elapsed = now - state.lastCheckIn;
+        if (state.active && elapsed > state.deadlineMs)
+        {
+            // Reported by check(), which owns the history
+            state.overrunMs = elapsed - state.deadlineMs;
+        }
+        state.lastCheckIn = now;
+    }
+
+    void Supervisor::check()
+    {
+        uint32_t now = millis();
+        bool hung = false;
+
+        for (int i = 0; i < NUM_SUPERVISED_TASKS; ++i)
+        {
+            TaskState &state = _tasks[i];
+            if (!state.active)
+            {
+                continue;
+            }
+            if (state.overrunMs != 0)
+            {
+                // The task came back after missing its deadline
+                record(i, state.overrunMs, false);
+                state.overrunMs = 0;
+                state.stalled = false;
+            }
+
+            uint32_t elapsed = now - state.lastCheckIn;
+            if (elapsed > state.deadlineMs && !state.stalled)
+            {
+                state.stalled = true;
+                logWarn("Supervisor: task %s missed its %lu ms deadline", state.name, (unsigned long)state.deadlineMs);
+            }
+            if (elapsed > state.limitMs)
+            {
+                if (!hung && _started)
+                {
+                    record(i, elapsed - state.deadlineMs, true);
+                }
+                hung = true;
+            }
+        }
+
+        if (!_started)
+        {
+            return;
+        }
+        if (hung)
+        {
+            // Stop feeding, the watchdog resets the device
+            // The record may not reach Serial, the stall history keeps it
+            _started = false;
+            logError("Supervisor: task hung, waiting for watchdog reset");
+            return;
+        }
+        mbed::Watchdog::get_instance().kick();
+    }
+
+    void Supervisor::record(uint8_t task, uint32_t overrunMs, bool reset)
+    {
+        StallRecord &rec = _history[_historyHead];
+        rec.task = task;
+        rec.reset = reset ? 1 : 0;
+        rec.reserved = 0;
+        rec.overrunMs = overrunMs;
+        rec.uptimeS = millis() / 1000;
+        _historyHead = (_historyHead + 1) % STALL_HISTORY_LEN;
+        if (_historyLen < STALL_HISTORY_LEN)
+        {
+            _historyLen++;
+        }
+        _stallCount++;
+        _unpublished = true;
+        if (overrunMs > _tasks[task].worstMs)
+        {
+            _tasks[task].worstMs = overrunMs;
+        }
+        logWarn("Supervisor: task %s overran its deadline by %lu ms", _tasks[task].name, (unsigned long)overrunMs);
+        persist();
+    }
+
+    void Supervisor::persist()
+    {
+        PersistedHistory stored;
+        stored.magic = STALL_MAGIC;
+        stored.stallCount = _stallCount;
+        stored.length = _historyLen;
+        stored.head = _historyHead;
+        stored.reserved = 0;
+        memcpy(stored.records, _history, sizeof(_history));
+        kv_set("stalls", &stored, sizeof(stored), 0);
+    }
+
+    bool Supervisor::wasWatchdogReset() const
+    {
+        return _watchdogReset;
+    }
+
+    uint32_t Supervisor::getStallCount() const
+    {
+        return _stallCount;
+    }
+
+    uint32_t Supervisor::getWorstOverrun(SupervisedTask task) const
+    {
+        if (task >= NUM_SUPERVISED_TASKS)
+        {
+            return 0;
+        }
+        return _tasks[task].worstMs;
+    }
+
+    bool Supervisor::hasUnpublished() const
+    {
+        return _unpublished;
+    }
+
+    void Supervisor::markPublished()
+    {
+        // Once reported the history no longer needs to survive a reset
+        _unpublished = false;
+        kv_remove("stalls");
+    }
+
+    // Oldest first
+    void Supervisor::toJson(JsonArray history) const
+    {
+        int first = (_historyHead + STALL_HISTORY_LEN - _historyLen) % STALL_HISTORY_LEN;
+        for (int n = 0; n < _historyLen; ++n)
+        {
+            const StallRecord &rec = _history[(first + n) % STALL_HISTORY_LEN];
+            JsonObject obj = history.createNestedObject();
+            obj["task"] = rec.task < NUM_SUPERVISED_TASKS ? _tasks[rec.task].name : "unknown";
+            obj["overrunMs"] = rec.overrunMs;
+            obj["uptime"] = rec.uptimeS;
+            obj["reset"] = rec.reset != 0;
+        }
+    }
+} // namespace remoto
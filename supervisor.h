@@ -0,0 +1,110 @@
+/*
+ * Remoto: Task supervisor and hardware watchdog for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Every scheduler thread checks in once per iteration. The supervisor
+ * runs in its own loop, compares the time since each check-in with the
+ * task deadline and only feeds the hardware watchdog while every task
+ * stays within its hard limit. Overruns are logged with the task name
+ * and the time lost, kept in a small history that survives a watchdog
+ * reset, and published once the device is back online.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(SUPERVISOR_H)
+#define SUPERVISOR_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Hardware watchdog, backstop for the supervisor loop itself
+#define WATCHDOG_TIMEOUT_MS 8000
+#define SUPERVISOR_PERIOD_MS 100
+
+// Task deadlines and hang limits
+#define LOOP_DEADLINE_MS 15000
+#define LOOP_LIMIT_MS 60000
+#define COMMS_DEADLINE_MS 15000
+#define COMMS_LIMIT_MS 60000
+#define IO_DEADLINE_MS 2000
+#define IO_LIMIT_MS 30000
+
+namespace remoto
+{
+    enum SupervisedTask : uint8_t
+    {
+        TASK_LOOP = 0,
+        TASK_COMMS,
+        TASK_IO,
+        NUM_SUPERVISED_TASKS
+    };
+
+    constexpr int STALL_HISTORY_LEN = 8;
+
+    struct StallRecord
+    {
+        uint8_t task;
+        uint8_t reset;      // 1 if the watchdog had to reset the device
+        uint16_t reserved;
+        uint32_t overrunMs; // time past the deadline
+        uint32_t uptimeS;   // uptime when the stall ended
+    };
+
+    class Supervisor
+    {
+    private:
+        struct TaskState
+        {
+            const char *name;
+            uint32_t deadlineMs;
+            uint32_t limitMs;
+            volatile uint32_t lastCheckIn;
+            volatile uint32_t overrunMs; // set by checkIn, consumed by check
+            volatile bool active;
+            bool stalled;
+            uint32_t worstMs;
+        };
+
+        TaskState _tasks[NUM_SUPERVISED_TASKS];
+        StallRecord _history[STALL_HISTORY_LEN];
+        uint8_t _historyLen;
+        uint8_t _historyHead;
+        uint32_t _stallCount;
+        bool _unpublished;
+        bool _watchdogReset;
+        bool _started;
+
+        void record(uint8_t task, uint32_t overrunMs, bool reset);
+        void persist();
+
+    public:
+        Supervisor();
+
+        // Restore the history kept across the last reset
+        void begin();
+        // Start the hardware watchdog, from here on it must be fed
+        void start();
+
+        // Deadline is the expected worst iteration time, past the limit
+        // the task is considered hung and the device is reset
+        void registerTask(SupervisedTask task, const char *name, uint32_t deadlineMs, uint32_t limitMs);
+
+        // Called by the tasks, once per iteration and inside long retries
+        void checkIn(SupervisedTask task);
+
+        // Called from the supervisor loop, feeds the watchdog
+        void check();
+
+        bool wasWatchdogReset() const;
+        uint32_t getStallCount() const;
+        uint32_t getWorstOverrun(SupervisedTask task) const;
+
+        // Stall history not yet reported over MQTT
+        bool hasUnpublished() const;
+        void markPublished();
+        void toJson(JsonArray history) const;
+    };
+} // namespace remoto
+
+#endif // SUPERVISOR_H
@@ -0,0 +1,392 @@
+/*
+ * Remoto: Timer wheel task scheduler for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Wheel bookkeeping, dispatch and statistics. See tasks.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "tasks.h"
+#include "logger.h"
+
+namespace remoto
+{
+    constexpr uint64_t TICK_US = SCHED_TICK_MS * 1000ULL;
+
+    TaskScheduler::TaskScheduler(const char *name)
+        : _name(name), _tick(0), _nowUs(0), _lastMicros(0)
+    {
+        for (Task &task : _tasks)
+        {
+            task.used = false;
+            task.triggered = false;
+            task.next = -1;
+        }
+        for (int8_t &slot : _slots)
+        {
+            slot = -1;
+        }
+    }
+
+    uint64_t TaskScheduler::now()
+    {
+        _mutex.lock();
+        uint32_t micro = micros();
+        _nowUs += (uint32_t)(micro - _lastMicros);
+        _lastMicros = micro;
+        uint64_t result = _nowUs;
+        _mutex.unlock();
+        return result;
+    }
+
+    // Slot of the first tick at or after the release. A release that is
+    // already due goes to the next tick to be visited.
+    void TaskScheduler::link(int id)
+    {
+        uint64_t tick = (_tasks[id].dueUs + TICK_US - 1) / TICK_US;
+        if (tick <= _tick)
+        {
+            tick = _tick + 1;
+        }
+        int slot = tick % SCHED_WHEEL_SLOTS;
+        _tasks[id].next = _slots[slot];
+        _slots[slot] = id;
+    }
+
+    void TaskScheduler::unlink(int id)
+    {
+        for (int8_t &head : _slots)
+        {
+            for (int8_t *link = &head; *link >= 0; link = &_tasks[*link].next)
+            {
+                if (*link == id)
+                {
+                    *link = _tasks[id].next;
+                    _tasks[id].next = -1;
+                    return;
+                }
+            }
+        }
+    }
+
+    int TaskScheduler::add(const char *name, TaskFunction function, uint32_t delayMs, uint32_t periodMs,
+                           uint8_t priority, uint32_t deadlineMs)
+    {
+        if (function == nullptr)
+        {
+            return -1;
+        }
+        _mutex.lock();
+        int id = -1;
+        for (int i = 0; i < SCHED_MAX_TASKS; ++i)
+        {
+            if (!_tasks[i].used)
+            {
+                id = i;
+                break;
+            }
+        }
+        if (id >= 0)
+        {
+            Task &task = _tasks[id];
+            task.name = name;
+            task.function = function;
+            task.dueUs = now() + delayMs * 1000ULL;
+            task.periodMs = periodMs;
+            task.deadlineMs = deadlineMs;
+            task.priority = priority;
+            task.triggered = false;
+            memset(&task.stats, 0, sizeof(task.stats));
+            task.used = true;
+            link(id);
+        }
+        _mutex.unlock();
+        if (id < 0)
+        {
+            logError("Scheduler %s full, task %s dropped", _name, name);
+        }
+        return id;
+    }
+
+    int TaskScheduler::addPeriodic(const char *name, TaskFunction function, uint32_t periodMs, uint8_t priority,
+                                   uint32_t deadlineMs, uint32_t phaseMs)
+    {
+        if (periodMs == 0)
+        {
+            return -1;
+        }
+        return add(name, function, phaseMs, periodMs, priority, deadlineMs);
+    }
+
+    int TaskScheduler::addOneShot(const char *name, TaskFunction function, uint32_t delayMs, uint8_t priority,
+                                  uint32_t deadlineMs)
+    {
+        return add(name, function, delayMs, 0, priority, deadlineMs);
+    }
+
+    int TaskScheduler::setPeriod(int id, uint32_t periodMs)
+    {
+        if (id < 0 || id >= SCHED_MAX_TASKS || periodMs == 0)
+        {
+            return -1;
+        }
+        _mutex.lock();
+        int result = -1;
+        if (_tasks[id].used && _tasks[id].periodMs != 0)
+        {
+            _tasks[id].periodMs = periodMs;
+            result = 0;
+        }
+        _mutex.unlock();
+        return result;
+    }
+
+    int TaskScheduler::cancel(int id)
+    {
+        if (id < 0 || id >= SCHED_MAX_TASKS)
+        {
+            return -1;
+        }
+        _mutex.lock();
+        int result = -1;
+        if (_tasks[id].used)
+        {
+            unlink(id);
+            _tasks[id].used = false;
+            _tasks[id].triggered = false;
+            result = 0;
+        }
+        _mutex.unlock();
+        return result;
+    }
+
+    int TaskScheduler::trigger(int id)
+    {
+        if (id < 0 || id >= SCHED_MAX_TASKS || !_tasks[id].used)
+        {
+            return -1;
+        }
+        // A flag only, picked up by the next pass
+        _tasks[id].triggered = true;
+        return 0;
+    }
+
+    void TaskScheduler::execute(int id, bool triggered)
+    {
+        Task &task = _tasks[id];
+        uint64_t start = now();
+        task.function();
+        uint64_t end = now();
+
+        _mutex.lock();
+        TaskStats &stats = task.stats;
+        uint32_t exec = end - start;
+        stats.runs++;
+        stats.lastExecUs = exec;
+        stats.totalExecUs += exec;
+        if (exec > stats.maxExecUs)
+        {
+            stats.maxExecUs = exec;
+        }
+        if (triggered)
+        {
+            // Out of band, the releases of the task are left as they are
+            stats.triggered++;
+            if (task.used && task.periodMs == 0)
+            {
+                unlink(id);
+                task.used = false;
+            }
+            _mutex.unlock();
+            return;
+        }
+
+        uint32_t jitter = start - task.dueUs;
+        stats.totalJitterUs += jitter;
+        if (jitter > stats.maxJitterUs)
+        {
+            stats.maxJitterUs = jitter;
+        }
+        if (end - task.dueUs > task.deadlineMs * 1000ULL)
+        {
+            stats.misses++;
+        }
+        // Cancelled while running
+        if (!task.used)
+        {
+            _mutex.unlock();
+            return;
+        }
+        if (task.periodMs == 0)
+        {
+            task.used = false;
+            _mutex.unlock();
+            return;
+        }
+        uint64_t period = task.periodMs * 1000ULL;
+        task.dueUs += period;
+        if (task.dueUs <= end)
+        {
+            uint64_t lost = (end - task.dueUs) / period + 1;
+            stats.skipped += lost;
+            task.dueUs += lost * period;
+        }
+        link(id);
+        _mutex.unlock();
+    }
+
+    uint32_t TaskScheduler::runPending()
+    {
+        int8_t ready[SCHED_MAX_TASKS];
+        bool out[SCHED_MAX_TASKS];
+        int count = 0;
+
+        _mutex.lock();
+        uint64_t current = now();
+        uint64_t tick = current / TICK_US;
+        // After a long pause one turn of the wheel visits every slot
+        uint64_t first = _tick + 1;
+        if (tick >= SCHED_WHEEL_SLOTS && first < tick - SCHED_WHEEL_SLOTS + 1)
+        {
+            first = tick - SCHED_WHEEL_SLOTS + 1;
+        }
+        for (uint64_t t = first; t <= tick; ++t)
+        {
+            int8_t *link = &_slots[t % SCHED_WHEEL_SLOTS];
+            while (*link >= 0)
+            {
+                int id = *link;
+                // Tasks of a later turn stay where they are
+                if (_tasks[id].dueUs <= current)
+                {
+                    *link = _tasks[id].next;
+                    _tasks[id].next = -1;
+                    _tasks[id].triggered = false;
+                    out[count] = false;
+                    ready[count++] = id;
+                }
+                else
+                {
+                    link = &_tasks[id].next;
+                }
+            }
+        }
+        if (tick > _tick)
+        {
+            _tick = tick;
+        }
+        for (int id = 0; id < SCHED_MAX_TASKS; ++id)
+        {
+            if (_tasks[id].used && _tasks[id].triggered)
+            {
+                _tasks[id].triggered = false;
+                out[count] = true;
+                ready[count++] = id;
+            }
+        }
+        _mutex.unlock();
+
+        // By priority, then by release time
+        for (int i = 1; i < count; ++i)
+        {
+            int8_t id = ready[i];
+            bool flag = out[i];
+            int j = i - 1;
+            while (j >= 0 && (_tasks[ready[j]].priority > _tasks[id].priority ||
+                              (_tasks[ready[j]].priority == _tasks[id].priority &&
+                               _tasks[ready[j]].dueUs > _tasks[id].dueUs)))
+            {
+                ready[j + 1] = ready[j];
+                out[j + 1] = out[j];
+                j--;
+            }
+            ready[j + 1] = id;
+            out[j + 1] = flag;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            execute(ready[i], out[i]);
+        }
+
+        // Time to the next release
+        _mutex.lock();
+        current = now();
+        uint64_t wait = SCHED_MAX_SLEEP_MS * 1000ULL;
+        for (const Task &task : _tasks)
+        {
+            if (!task.used)
+            {
+                continue;
+            }
+            if (task.triggered || task.dueUs <= current)
+            {
+                wait = 0;
+                break;
+            }
+            if (task.dueUs - current < wait)
+            {
+                wait = task.dueUs - current;
+            }
+        }
+        _mutex.unlock();
+        return (wait + 999) / 1000;
+    }
+
+    void TaskScheduler::run()
+    {
+        uint32_t wait = runPending();
+        if (wait > 0)
+        {
+            delay(wait);
+        }
+        else
+        {
+            yield();
+        }
+    }
+
+    int TaskScheduler::getStats(int id, TaskStats &stats) const
+    {
+        if (id < 0 || id >= SCHED_MAX_TASKS)
+        {
+            return -1;
+        }
+        _mutex.lock();
+        int result = -1;
+        if (_tasks[id].used)
+        {
+            stats = _tasks[id].stats;
+            result = 0;
+        }
+        _mutex.unlock();
+        return result;
+    }
+
+    void TaskScheduler::toJson(JsonArray tasks) const
+    {
+        _mutex.lock();
+        for (const Task &task : _tasks)
+        {
+            if (!task.used)
+            {
+                continue;
+            }
+            const TaskStats &stats = task.stats;
+            uint32_t released = stats.runs - stats.triggered;
+            JsonObject obj = tasks.createNestedObject();
+            obj["name"] = task.name;
+            obj["periodMs"] = task.periodMs;
+            obj["priority"] = task.priority;
+            obj["runs"] = stats.runs;
+            obj["misses"] = stats.misses;
+            obj["skipped"] = stats.skipped;
+            obj["execAvgUs"] = stats.runs > 0 ? (uint32_t)(stats.totalExecUs / stats.runs) : 0;
+            obj["execMaxUs"] = stats.maxExecUs;
+            obj["jitterAvgUs"] = released > 0 ? (uint32_t)(stats.totalJitterUs / released) : 0;
+            obj["jitterMaxUs"] = stats.maxJitterUs;
+        }
+        _mutex.unlock();
+    }
+} // namespace remoto
@@ -0,0 +1,111 @@
+/*
+ * Remoto: Timer wheel task scheduler for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Periodic and one-shot tasks sharing one thread. Tasks wait in a
+ * hashed timer wheel with a 1 ms tick, so finding the due ones costs
+ * the same whatever their number and period. Due tasks run to
+ * completion by priority, 0 first. The next release of a periodic task
+ * is computed from its previous release and not from the time it
+ * finished, so periods do not drift; releases missed by an overrun are
+ * skipped and counted instead of being run back to back.
+ *
+ * Every task keeps its execution time, release jitter and deadline
+ * misses, reported by toJson().
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(TASKS_H)
+#define TASKS_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "mbed.h"
+
+// Tasks of one scheduler, one-shots included
+#define SCHED_MAX_TASKS 8
+#define SCHED_TICK_MS 1
+#define SCHED_WHEEL_SLOTS 64
+// Longest sleep between passes, bounds the latency of trigger()
+#define SCHED_MAX_SLEEP_MS 10
+
+namespace remoto
+{
+    typedef void (*TaskFunction)();
+
+    struct TaskStats
+    {
+        uint32_t runs;
+        uint32_t triggered; // runs requested through trigger()
+        uint32_t misses;    // released runs that ended past the deadline
+        uint32_t skipped;   // releases lost to overruns
+        uint32_t lastExecUs;
+        uint32_t maxExecUs;
+        uint64_t totalExecUs;
+        uint32_t maxJitterUs; // start delay after the release time
+        uint64_t totalJitterUs;
+    };
+
+    class TaskScheduler
+    {
+    private:
+        struct Task
+        {
+            const char *name;
+            TaskFunction function;
+            uint64_t dueUs;
+            uint32_t periodMs; // 0 for one-shot
+            uint32_t deadlineMs;
+            uint8_t priority;
+            bool used;
+            volatile bool triggered;
+            int8_t next; // in the wheel slot list
+            TaskStats stats;
+        };
+
+        const char *_name;
+        Task _tasks[SCHED_MAX_TASKS];
+        int8_t _slots[SCHED_WHEEL_SLOTS];
+        uint64_t _tick; // last tick whose slot was visited
+        // 64 bit extension of micros()
+        uint64_t _nowUs;
+        uint32_t _lastMicros;
+        mutable rtos::Mutex _mutex;
+
+        uint64_t now();
+        void link(int id);
+        void unlink(int id);
+        int add(const char *name, TaskFunction function, uint32_t delayMs, uint32_t periodMs,
+                uint8_t priority, uint32_t deadlineMs);
+        void execute(int id, bool triggered);
+
+    public:
+        explicit TaskScheduler(const char *name);
+
+        // First release after phaseMs, then every periodMs. Returns the
+        // task id or -1 when the scheduler is full.
+        int addPeriodic(const char *name, TaskFunction function, uint32_t periodMs, uint8_t priority,
+                        uint32_t deadlineMs, uint32_t phaseMs = 0);
+        // Single release after delayMs, the slot is freed once it ran
+        int addOneShot(const char *name, TaskFunction function, uint32_t delayMs, uint8_t priority,
+                       uint32_t deadlineMs);
+        // Takes effect from the next release
+        int setPeriod(int id, uint32_t periodMs);
+        int cancel(int id);
+        // Run a task on the next pass without moving its releases. Safe
+        // to call from other threads.
+        int trigger(int id);
+
+        // Run the due tasks, returns the milliseconds to the next release
+        uint32_t runPending();
+        // One pass and the sleep until the next release, for startLoop
+        void run();
+
+        const char *getName() const { return _name; }
+        int getStats(int id, TaskStats &stats) const;
+        void toJson(JsonArray tasks) const;
+    };
+} // namespace remoto
+
+#endif // TASKS_H
@@ -0,0 +1,309 @@
+/*
+ * Remoto: Disciplined timebase for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Non-blocking SNTP client and slewed UTC clock. See timebase.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "timebase.h"
+
+namespace remoto
+{
+    // Seconds between the NTP era (1900) and the Unix epoch (1970)
+    constexpr uint32_t NTP_UNIX_OFFSET = 2208988800UL;
+    // Move the clock reference forward at least this often
+    constexpr uint64_t TIME_REBASE_US = 3600 * 1000000ULL;
+
+    static uint32_t read32(const uint8_t *p)
+    {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+
+    static void write32(uint8_t *p, uint32_t v)
+    {
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+    }
+
+    // NTP timestamp (32.32 fixed point since 1900) to Unix microseconds
+    static int64_t ntpToUnixUs(const uint8_t *p)
+    {
+        uint32_t seconds = read32(p) - NTP_UNIX_OFFSET;
+        uint32_t fraction = read32(p + 4);
+        return (int64_t)seconds * 1000000LL + (((uint64_t)fraction * 1000000ULL) >> 32);
+    }
+
+    Timebase::Timebase()
+        : _udp(nullptr), _lookup(nullptr), _resolved(false), _state(State::IDLE), _misses(0),
+          _monoBase(0), _monoLast(micros()),
+          _synced(false), _refMono(0), _refUtc(0), _freqPpb(0), _slewUs(0),
+          _lastSyncMono(0), _requestMono(0), _nextPollMono(0), _pollMs(NTP_MIN_POLL_MS),
+          _syncCount(0), _lastOffsetUs(0), _lastRttUs(0)
+    {
+        _server[0] = '\0';
+    }
+
+    void Timebase::begin(UDP &udp, const char *server, HostLookup lookup)
+    {
+        _udp = &udp;
+        _lookup = lookup;
+        _udp->begin(NTP_PORT);
+        setServer(server);
+    }
+
+    void Timebase::setServer(const char *server)
+    {
+        strncpy(_server, server, MAX_TIME_SERVER_LEN);
+        _server[MAX_TIME_SERVER_LEN] = '\0';
+        _resolved.store(false, std::memory_order_release);
+        _state = State::IDLE;
+        _mutex.lock();
+        _nextPollMono = monotonicUs();
+        _mutex.unlock();
+    }
+
+    void Timebase::resolve()
+    {
+        if (_lookup == nullptr || _server[0] == '\0' || _resolved.load(std::memory_order_acquire))
+        {
+            return;
+        }
+        // update() does not touch the address until _resolved is set
+        IPAddress address;
+        if (_lookup(_server, address) == 1)
+        {
+            _serverIp = address;
+            _resolved.store(true, std::memory_order_release);
+        }
+    }
+
+    // micros() wraps every ~71 minutes, update() folds it into 64 bits.
+    // Called with the mutex held, like utcAt().
+    uint64_t Timebase::monotonicUs() const
+    {
+        return _monoBase + (uint32_t)(micros() - _monoLast);
+    }
+
+    // Portion of the pending correction slewed in over dt microseconds
+    static int64_t slewApplied(int64_t pending, int64_t dt)
+    {
+        int64_t slew = dt * TIME_MAX_SLEW_PPM / 1000000LL;
+        if (pending >= 0)
+        {
+            return slew < pending ? slew : pending;
+        }
+        return slew < -pending ? -slew : pending;
+    }
+
+    int64_t Timebase::utcAt(uint64_t mono) const
+    {
+        int64_t dt = (int64_t)(mono - _refMono);
+        return _refUtc + dt + dt * _freqPpb / 1000000000LL + slewApplied(_slewUs, dt);
+    }
+
+    void Timebase::update()
+    {
+        _mutex.lock();
+        uint32_t now32 = micros();
+        _monoBase += (uint32_t)(now32 - _monoLast);
+        _monoLast = now32;
+        uint64_t now = _monoBase;
+
+        // Keep dt small so the fixed point corrections cannot overflow
+        if (_synced && now - _refMono > TIME_REBASE_US)
+        {
+            int64_t utc = utcAt(now);
+            _slewUs -= slewApplied(_slewUs, (int64_t)(now - _refMono));
+            _refUtc = utc;
+            _refMono = now;
+        }
+        _mutex.unlock();
+
+        if (_udp == nullptr || _server[0] == '\0')
+        {
+            return;
+        }
+
+        if (_state == State::WAITING)
+        {
+            // Only look at what already arrived, never wait for it
+            if (_udp->parsePacket() >= (int)NTP_PACKET_SIZE)
+            {
+                uint8_t packet[NTP_PACKET_SIZE];
+                _udp->read(packet, NTP_PACKET_SIZE);
+                processReply(packet, now);
+            }
+            else if (now - _requestMono > NTP_REPLY_TIMEOUT_MS * 1000ULL)
+            {
+                _state = State::IDLE;
+                _nextPollMono = now + NTP_RETRY_MS * 1000ULL;
+                if (++_misses >= NTP_MAX_MISSES)
+                {
+                    // The server may have moved, resolve() looks it up again
+                    _resolved.store(false, std::memory_order_release);
+                    _misses = 0;
+                }
+            }
+        }
+        else if (now >= _nextPollMono && _resolved.load(std::memory_order_acquire))
+        {
+            sendRequest(now);
+        }
+    }
+
+    void Timebase::sendRequest(uint64_t now)
+    {
+        uint8_t packet[NTP_PACKET_SIZE] = {0};
+        packet[0] = 0x23; // LI 0, version 4, mode 3 (client)
+        // Our send time goes in the transmit timestamp, the server echoes
+        // it back as originate so stale replies can be told apart
+        write32(&packet[40], (uint32_t)(now >> 32));
+        write32(&packet[44], (uint32_t)now);
+
+        // Drop whatever is left from a previous exchange
+        while (_udp->parsePacket() > 0)
+        {
+        }
+
+        // Always by address, a name would be looked up here and block
+        int ret = _udp->beginPacket(_serverIp, NTP_PORT);
+        if (ret == 1)
+        {
+            _udp->write(packet, NTP_PACKET_SIZE);
+            ret = _udp->endPacket();
+        }
+        _requestMono = now;
+        if (ret == 1)
+        {
+            _state = State::WAITING;
+        }
+        else
+        {
+            _nextPollMono = now + NTP_RETRY_MS * 1000ULL;
+        }
+    }
+
+    void Timebase::processReply(const uint8_t *packet, uint64_t now)
+    {
+        uint8_t leap = packet[0] >> 6;
+        uint8_t mode = packet[0] & 0x07;
+        uint8_t stratum = packet[1];
+        uint64_t cookie = ((uint64_t)read32(&packet[24]) << 32) | read32(&packet[28]);
+        if (cookie != _requestMono)
+        {
+            return; // not the answer to our request, keep waiting
+        }
+        _state = State::IDLE;
+        if (leap == 3 || mode != 4 || stratum == 0 || stratum > 15)
+        {
+            // Unsynchronized server or kiss-o'-death
+            _nextPollMono = now + NTP_RETRY_MS * 1000ULL;
+            return;
+        }
+        _misses = 0;
+
+        int64_t received = ntpToUnixUs(&packet[32]);
+        int64_t transmitted = ntpToUnixUs(&packet[40]);
+        int64_t rtt = (int64_t)(now - _requestMono) - (transmitted - received);
+        if (rtt < 0)
+        {
+            rtt = 0;
+        }
+        int64_t measured = transmitted + rtt / 2;
+        _lastRttUs = (uint32_t)rtt;
+
+        _mutex.lock();
+        int64_t current = utcAt(now);
+        _lastOffsetUs = _synced ? measured - current : 0;
+
+        if (!_synced || _lastOffsetUs > TIME_STEP_THRESHOLD_US || _lastOffsetUs < -TIME_STEP_THRESHOLD_US)
+        {
+            // First sync or a large error: step and restart frequency tracking
+            _refUtc = measured;
+            _slewUs = 0;
+            _freqPpb = 0;
+            _pollMs = NTP_MIN_POLL_MS;
+            _synced = true;
+        }
+        else
+        {
+            // Whatever the previous slew did not get to is not drift
+            int64_t pending = _slewUs - slewApplied(_slewUs, (int64_t)(now - _refMono));
+            int64_t drift = _lastOffsetUs - pending;
+            int64_t elapsed = (int64_t)(now - _lastSyncMono);
+            if (elapsed > 0)
+            {
+                // Frequency locked loop with a 1/4 gain
+                int64_t freq = _freqPpb + drift * 1000000000LL / elapsed / 4;
+                freq = constrain(freq, -TIME_MAX_FREQ_PPM * 1000LL, TIME_MAX_FREQ_PPM * 1000LL);
+                _freqPpb = (int32_t)freq;
+            }
+            _refUtc = current;
+            _slewUs = _lastOffsetUs;
+            _pollMs = _pollMs * 2 > NTP_MAX_POLL_MS ? NTP_MAX_POLL_MS : _pollMs * 2;
+        }
+        _refMono = now;
+        _mutex.unlock();
+        _lastSyncMono = now;
+        _syncCount++;
+        _nextPollMono = now + _pollMs * 1000ULL;
+    }
+
+    bool Timebase::isSynced() const
+    {
+        return _synced;
+    }
+
+    uint64_t Timebase::nowMs() const
+    {
+        _mutex.lock();
+        uint64_t ms = _synced ? (uint64_t)utcAt(monotonicUs()) / 1000ULL : 0;
+        _mutex.unlock();
+        return ms;
+    }
+
+    uint32_t Timebase::epoch() const
+    {
+        return (uint32_t)(nowMs() / 1000ULL);
+    }
+
+    float Timebase::getDriftPpm() const
+    {
+        return _freqPpb / 1000.0f;
+    }
+
+    int32_t Timebase::getLastOffsetMs() const
+    {
+        _mutex.lock();
+        int64_t offset = _lastOffsetUs;
+        _mutex.unlock();
+        return (int32_t)(offset / 1000);
+    }
+
+    uint32_t Timebase::getLastRttMs() const
+    {
+        return _lastRttUs / 1000;
+    }
+
+    uint32_t Timebase::getSyncCount() const
+    {
+        return _syncCount;
+    }
+
+    int formatTimestamp(char *buffer, size_t length, uint64_t ms)
+    {
+        // Split so that no 64 bit printf support is needed
+        unsigned long seconds = (unsigned long)(ms / 1000ULL);
+        unsigned int fraction = (unsigned int)(ms % 1000ULL);
+        if (seconds == 0)
+        {
+            return snprintf(buffer, length, "%u", fraction);
+        }
+        return snprintf(buffer, length, "%lu%03u", seconds, fraction);
+    }
+} // namespace remoto
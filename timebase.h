@@ -0,0 +1,122 @@
+/*
+ * Remoto: Disciplined timebase for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Millisecond UTC clock built on micros(). The NTP exchange is driven
+ * from update() without ever waiting for the reply, and corrections are
+ * applied by slewing the clock rather than stepping it, so timestamps
+ * stay monotonic. The oscillator frequency error is estimated across
+ * successive syncs and compensated between them. The server name is
+ * looked up apart, by resolve(), as a DNS query blocks. The clock
+ * reference is kept under a mutex, so nowMs() can be called from any
+ * thread while update() moves it.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(TIMEBASE_H)
+#define TIMEBASE_H
+#include <Arduino.h>
+#include <atomic>
+#include "mbed.h"
+
+namespace remoto
+{
+    constexpr uint16_t NTP_PORT = 123;
+    constexpr size_t NTP_PACKET_SIZE = 48;
+    constexpr size_t MAX_TIME_SERVER_LEN = 63;
+
+    constexpr uint32_t NTP_REPLY_TIMEOUT_MS = 2000;
+    constexpr uint32_t NTP_RETRY_MS = 15 * 1000UL;
+    constexpr uint32_t NTP_MIN_POLL_MS = 64 * 1000UL;
+    constexpr uint32_t NTP_MAX_POLL_MS = 1024 * 1000UL;
+    // Forget the resolved address after this many missed replies
+    constexpr uint8_t NTP_MAX_MISSES = 4;
+
+    // Offsets above this are stepped, below are slewed
+    constexpr int64_t TIME_STEP_THRESHOLD_US = 1000 * 1000LL;
+    // Slew rate and frequency correction limits, parts per million
+    constexpr int32_t TIME_MAX_SLEW_PPM = 500;
+    constexpr int32_t TIME_MAX_FREQ_PPM = 500;
+
+    // Look a host name up, 1 on success as hostByName() of the network
+    typedef int (*HostLookup)(const char *host, IPAddress &address);
+
+    class Timebase
+    {
+    private:
+        enum class State : uint8_t
+        {
+            IDLE,
+            WAITING
+        };
+
+        UDP *_udp;
+        HostLookup _lookup;
+        char _server[MAX_TIME_SERVER_LEN + 1];
+        IPAddress _serverIp;
+        // _serverIp is valid, set by resolve() and cleared by update()
+        std::atomic<bool> _resolved;
+        State _state;
+        uint8_t _misses;
+
+        // 64 bit extension of micros()
+        uint64_t _monoBase;
+        uint32_t _monoLast;
+
+        // UTC = _refUtc + dt + dt * _freqPpb / 1e9 + slew, dt = mono - _refMono
+        bool _synced;
+        uint64_t _refMono;
+        int64_t _refUtc;
+        int32_t _freqPpb;
+        int64_t _slewUs; // correction still to be slewed at _refMono
+
+        uint64_t _lastSyncMono;
+        uint64_t _requestMono;
+        uint64_t _nextPollMono;
+        uint32_t _pollMs;
+        uint32_t _syncCount;
+        int64_t _lastOffsetUs;
+        uint32_t _lastRttUs;
+        // Guards the 64 bit extension and the clock reference
+        mutable rtos::Mutex _mutex;
+
+        uint64_t monotonicUs() const;
+        int64_t utcAt(uint64_t mono) const;
+        void sendRequest(uint64_t now);
+        void processReply(const uint8_t *packet, uint64_t now);
+
+    public:
+        Timebase();
+
+        // Start syncing against the given server over an open UDP socket,
+        // its name is looked up through lookup
+        void begin(UDP &udp, const char *server, HostLookup lookup);
+        void setServer(const char *server);
+
+        // Look the server name up when its address is not known. DNS can
+        // take seconds, so this runs on a thread that may wait, not the
+        // one calling update()
+        void resolve();
+        // Drive the NTP exchange, never waits on the network
+        void update();
+
+        bool isSynced() const;
+        // UTC milliseconds since the Unix epoch, 0 until the first sync
+        uint64_t nowMs() const;
+        // UTC seconds since the Unix epoch, 0 until the first sync
+        uint32_t epoch() const;
+
+        // Diagnostics
+        float getDriftPpm() const;
+        int32_t getLastOffsetMs() const;
+        uint32_t getLastRttMs() const;
+        uint32_t getSyncCount() const;
+    };
+
+    // Format a millisecond timestamp as a decimal string
+    int formatTimestamp(char *buffer, size_t length, uint64_t ms);
+} // namespace remoto
+
+#endif // TIMEBASE_H
@@ -0,0 +1,568 @@
+/*
+ * Remoto: TLS client for Arduino OPTA
+ * -------------------------------------------------------------------
+ * mbedTLS over an Arduino Client and credential storage. See tls.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "tls.h"
+#include "logger.h"
+#include "mbed.h"
+#include "kvstore_global_api.h"
+#include "mbedtls/platform_util.h"
+
+namespace remoto
+{
+    static const char *const CREDENTIAL_NAMES[NUM_TLS_CREDENTIALS] = {"ca", "cert", "key", "psk"};
+    static const char *const CREDENTIAL_KEYS[NUM_TLS_CREDENTIALS] = {"tls_ca", "tls_cert", "tls_key", "tls_psk"};
+
+    // Shared by storage and loading, both run before or instead of a
+    // connection. Wiped after use, it holds key material.
+    static char credential[TLS_CREDENTIAL_MAX + 1];
+
+    TlsCredential tlsCredentialFromName(const char *name, size_t length)
+    {
+        for (int i = 0; i < NUM_TLS_CREDENTIALS; ++i)
+        {
+            if (strlen(CREDENTIAL_NAMES[i]) == length && strncmp(CREDENTIAL_NAMES[i], name, length) == 0)
+            {
+                return (TlsCredential)i;
+            }
+        }
+        return NUM_TLS_CREDENTIALS;
+    }
+
+    bool hasTlsCredential(TlsCredential which)
+    {
+        kv_info_t info;
+        return which < NUM_TLS_CREDENTIALS && kv_get_info(CREDENTIAL_KEYS[which], &info) == MBED_SUCCESS && info.size > 0;
+    }
+
+    // Read a credential into the shared buffer, null terminated
+    static int readCredential(TlsCredential which, size_t &length)
+    {
+        kv_info_t info;
+        if (kv_get_info(CREDENTIAL_KEYS[which], &info) != MBED_SUCCESS || info.size == 0 || info.size > TLS_CREDENTIAL_MAX)
+        {
+            return -1;
+        }
+        if (kv_get(CREDENTIAL_KEYS[which], credential, info.size, &length) != MBED_SUCCESS)
+        {
+            return -1;
+        }
+        credential[length] = '\0';
+        return 0;
+    }
+
+    static int hexDigit(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F')
+        {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    // "identity:hexkey", returns the key length or -1
+    static int parsePsk(const char *text, size_t length, const char *&identity, size_t &identityLength, uint8_t *key)
+    {
+        const char *colon = (const char *)memchr(text, ':', length);
+        if (colon == nullptr)
+        {
+            return -1;
+        }
+        identity = text;
+        identityLength = colon - text;
+        const char *hex = colon + 1;
+        size_t hexLength = length - identityLength - 1;
+        // Trailing newline of a file upload
+        while (hexLength > 0 && (hex[hexLength - 1] == '\n' || hex[hexLength - 1] == '\r'))
+        {
+            hexLength--;
+        }
+        if (identityLength == 0 || identityLength > TLS_PSK_IDENTITY_MAX ||
+            hexLength == 0 || hexLength % 2 != 0 || hexLength > 2 * TLS_PSK_MAX)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < hexLength / 2; ++i)
+        {
+            int high = hexDigit(hex[2 * i]);
+            int low = hexDigit(hex[2 * i + 1]);
+            if (high < 0 || low < 0)
+            {
+                return -1;
+            }
+            key[i] = (high << 4) | low;
+        }
+        return hexLength / 2;
+    }
+
+    int storeTlsCredential(TlsCredential which, const char *data, size_t length)
+    {
+        if (which >= NUM_TLS_CREDENTIALS || length > TLS_CREDENTIAL_MAX)
+        {
+            return -1;
+        }
+        if (length == 0)
+        {
+            kv_remove(CREDENTIAL_KEYS[which]);
+            return 0;
+        }
+        // PEM parsing wants the terminator counted in the length
+        memcpy(credential, data, length);
+        credential[length] = '\0';
+        int result = 0;
+        switch (which)
+        {
+        case TLS_CA:
+        case TLS_CERT:
+        {
+            mbedtls_x509_crt crt;
+            mbedtls_x509_crt_init(&crt);
+            result = mbedtls_x509_crt_parse(&crt, (const unsigned char *)credential, length + 1);
+            mbedtls_x509_crt_free(&crt);
+            break;
+        }
+        case TLS_KEY:
+        {
+            mbedtls_pk_context pk;
+            mbedtls_pk_init(&pk);
+            result = mbedtls_pk_parse_key(&pk, (const unsigned char *)credential, length + 1, nullptr, 0);
+            mbedtls_pk_free(&pk);
+            break;
+        }
+        case TLS_PSK:
+        {
+            const char *identity;
+            size_t identityLength;
+            uint8_t key[TLS_PSK_MAX];
+            result = parsePsk(credential, length, identity, identityLength, key) > 0 ? 0 : -1;
+            mbedtls_platform_zeroize(key, sizeof(key));
+            break;
+        }
+        default:
+            break;
+        }
+        if (result == 0 && kv_set(CREDENTIAL_KEYS[which], credential, length, 0) != MBED_SUCCESS)
+        {
+            result = -1;
+        }
+        mbedtls_platform_zeroize(credential, sizeof(credential));
+        return result == 0 ? 0 : -1;
+    }
+
+    TlsClient::TlsClient()
+        : _transport(nullptr), _haveSession(false), _ready(false), _open(false), _peeked(-1),
+          _full(0), _resumed(0), _failures(0), _lastMs(0), _lastResumed(false), _fullTotalMs(0),
+          _fullMaxMs(0), _resumedTotalMs(0), _resumedMaxMs(0), _lastError(0)
+    {
+        mbedtls_entropy_init(&_entropy);
+        mbedtls_ctr_drbg_init(&_drbg);
+        mbedtls_ssl_config_init(&_conf);
+        mbedtls_ssl_init(&_ssl);
+        mbedtls_x509_crt_init(&_ca);
+        mbedtls_x509_crt_init(&_cert);
+        mbedtls_pk_init(&_key);
+        mbedtls_ssl_session_init(&_session);
+    }
+
+    TlsClient::~TlsClient()
+    {
+        mbedtls_ssl_session_free(&_session);
+        mbedtls_ssl_free(&_ssl);
+        mbedtls_ssl_config_free(&_conf);
+        mbedtls_pk_free(&_key);
+        mbedtls_x509_crt_free(&_cert);
+        mbedtls_x509_crt_free(&_ca);
+        mbedtls_ctr_drbg_free(&_drbg);
+        mbedtls_entropy_free(&_entropy);
+    }
+
+    int TlsClient::sendCallback(void *context, const unsigned char *buffer, size_t length)
+    {
+        Client *transport = ((TlsClient *)context)->_transport;
+        size_t written = transport->write(buffer, length);
+        if (written > 0)
+        {
+            return written;
+        }
+        return transport->connected() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+
+    int TlsClient::recvCallback(void *context, unsigned char *buffer, size_t length)
+    {
+        Client *transport = ((TlsClient *)context)->_transport;
+        int available = transport->available();
+        if (available <= 0)
+        {
+            // 0 tells mbedTLS the connection is gone
+            return transport->connected() ? MBEDTLS_ERR_SSL_WANT_READ : 0;
+        }
+        int n = transport->read(buffer, (size_t)available < length ? available : length);
+        return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    int TlsClient::loadCredentials()
+    {
+        size_t length;
+        bool ca = false;
+        bool psk = false;
+        int result = 0;
+        if (readCredential(TLS_CA, length) == 0)
+        {
+            result = mbedtls_x509_crt_parse(&_ca, (const unsigned char *)credential, length + 1);
+            mbedtls_ssl_conf_ca_chain(&_conf, &_ca, nullptr);
+            ca = true;
+        }
+        if (result == 0 && readCredential(TLS_CERT, length) == 0)
+        {
+            result = mbedtls_x509_crt_parse(&_cert, (const unsigned char *)credential, length + 1);
+            if (result == 0 && readCredential(TLS_KEY, length) == 0)
+            {
+                result = mbedtls_pk_parse_key(&_key, (const unsigned char *)credential, length + 1, nullptr, 0);
+                if (result == 0)
+                {
+                    result = mbedtls_ssl_conf_own_cert(&_conf, &_cert, &_key);
+                }
+            }
+        }
+        if (result == 0 && readCredential(TLS_PSK, length) == 0)
+        {
+#if defined(MBEDTLS_KEY_EXCHANGE_SOME_PSK_ENABLED)
+            const char *identity;
+            size_t identityLength;
+            uint8_t key[TLS_PSK_MAX];
+            int keyLength = parsePsk(credential, length, identity, identityLength, key);
+            result = keyLength > 0 ? mbedtls_ssl_conf_psk(&_conf, key, keyLength, (const unsigned char *)identity, identityLength) : -1;
+            mbedtls_platform_zeroize(key, sizeof(key));
+            psk = result == 0;
+#else
+            logError("TLS: PSK key exchange not available in this mbedTLS build");
+#endif
+        }
+        mbedtls_platform_zeroize(credential, sizeof(credential));
+        if (result != 0)
+        {
+            logError("TLS: invalid stored credential");
+            return -1;
+        }
+        if (!ca && !psk)
+        {
+            logError("TLS: no CA certificate or PSK stored, the broker cannot be authenticated");
+            return -1;
+        }
+        // With a PSK alone the key itself authenticates the broker
+        mbedtls_ssl_conf_authmode(&_conf, ca ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
+        return 0;
+    }
+
+    int TlsClient::begin(Client &transport)
+    {
+        _transport = &transport;
+        if (_ready)
+        {
+            return 0;
+        }
+        const char *personal = "remoto";
+        if (mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, (const unsigned char *)personal, strlen(personal)) != 0 ||
+            mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+        {
+            logError("TLS: setup failed");
+            return -1;
+        }
+        mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+        if (loadCredentials() != 0 || mbedtls_ssl_setup(&_ssl, &_conf) != 0)
+        {
+            return -1;
+        }
+        mbedtls_ssl_set_bio(&_ssl, this, sendCallback, recvCallback, nullptr);
+        _ready = true;
+        return 0;
+    }
+
+    int TlsClient::handshake(const char *host)
+    {
+        mbedtls_ssl_session_reset(&_ssl);
+        // Also the name checked against the broker certificate
+        if (host != nullptr && mbedtls_ssl_set_hostname(&_ssl, host) != 0)
+        {
+            return -1;
+        }
+        bool offered = _haveSession && mbedtls_ssl_set_session(&_ssl, &_session) == 0;
+
+        uint32_t start = millis();
+        int result;
+        while ((result = mbedtls_ssl_handshake(&_ssl)) != 0)
+        {
+            if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                break;
+            }
+            if (millis() - start > TLS_HANDSHAKE_TIMEOUT_MS)
+            {
+                result = MBEDTLS_ERR_SSL_TIMEOUT;
+                break;
+            }
+            yield();
+        }
+        uint32_t elapsed = millis() - start;
+        if (result != 0)
+        {
+            _failures++;
+            _lastError = result;
+            // A stale session must not fail the next attempt too
+            mbedtls_ssl_session_free(&_session);
+            _haveSession = false;
+            logWarn("TLS handshake failed, error -0x%04X", (unsigned)-result);
+            return -1;
+        }
+
+        // A resumed session keeps the master secret of the one offered
+        mbedtls_ssl_session session;
+        mbedtls_ssl_session_init(&session);
+        bool resumed = false;
+        if (mbedtls_ssl_get_session(&_ssl, &session) == 0)
+        {
+            resumed = offered && memcmp(session.master, _session.master, sizeof(session.master)) == 0;
+            mbedtls_ssl_session_free(&_session);
+            // The copy takes over the ticket and certificate it points to
+            _session = session;
+            _haveSession = true;
+        }
+        else
+        {
+            mbedtls_ssl_session_free(&session);
+        }
+
+        _lastMs = elapsed;
+        _lastResumed = resumed;
+        if (resumed)
+        {
+            _resumed++;
+            _resumedTotalMs += elapsed;
+            _resumedMaxMs = elapsed > _resumedMaxMs ? elapsed : _resumedMaxMs;
+        }
+        else
+        {
+            _full++;
+            _fullTotalMs += elapsed;
+            _fullMaxMs = elapsed > _fullMaxMs ? elapsed : _fullMaxMs;
+        }
+        logInfo("TLS handshake %lu ms, %s, %s", (unsigned long)elapsed, resumed ? "resumed" : "full",
+                mbedtls_ssl_get_ciphersuite(&_ssl));
+        return 0;
+    }
+
+    int TlsClient::connect(IPAddress ip, uint16_t port)
+    {
+        if (!_ready || !_transport->connect(ip, port))
+        {
+            return 0;
+        }
+        if (handshake(nullptr) != 0)
+        {
+            _transport->stop();
+            return 0;
+        }
+        _open = true;
+        _peeked = -1;
+        return 1;
+    }
+
+    int TlsClient::connect(const char *host, uint16_t port)
+    {
+        if (!_ready || !_transport->connect(host, port))
+        {
+            return 0;
+        }
+        if (handshake(host) != 0)
+        {
+            _transport->stop();
+            return 0;
+        }
+        _open = true;
+        _peeked = -1;
+        return 1;
+    }
+
+    size_t TlsClient::write(uint8_t b)
+    {
+        return write(&b, 1);
+    }
+
+    size_t TlsClient::write(const uint8_t *buffer, size_t size)
+    {
+        if (!_open)
+        {
+            return 0;
+        }
+        size_t written = 0;
+        uint32_t start = millis();
+        while (written < size)
+        {
+            int result = mbedtls_ssl_write(&_ssl, buffer + written, size - written);
+            if (result > 0)
+            {
+                written += result;
+                continue;
+            }
+            if ((result == MBEDTLS_ERR_SSL_WANT_WRITE || result == MBEDTLS_ERR_SSL_WANT_READ) &&
+                millis() - start < TLS_WRITE_TIMEOUT_MS)
+            {
+                yield();
+                continue;
+            }
+            _lastError = result;
+            _open = false;
+            break;
+        }
+        return written;
+    }
+
+    int TlsClient::available()
+    {
+        if (!_open)
+        {
+            return 0;
+        }
+        size_t pending = mbedtls_ssl_get_bytes_avail(&_ssl) + (_peeked >= 0 ? 1 : 0);
+        if (pending == 0 && _transport->available() > 0)
+        {
+            // Decrypt the next record, keeping its first byte aside
+            uint8_t b;
+            int result = mbedtls_ssl_read(&_ssl, &b, 1);
+            if (result == 1)
+            {
+                _peeked = b;
+            }
+            else if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                _open = false;
+                return 0;
+            }
+            pending = mbedtls_ssl_get_bytes_avail(&_ssl) + (_peeked >= 0 ? 1 : 0);
+        }
+        return pending;
+    }
+
+    int TlsClient::read()
+    {
+        uint8_t b;
+        return read(&b, 1) == 1 ? b : -1;
+    }
+
+    int TlsClient::read(uint8_t *buffer, size_t size)
+    {
+        if (size == 0)
+        {
+            return 0;
+        }
+        size_t used = 0;
+        if (_peeked >= 0)
+        {
+            buffer[used++] = _peeked;
+            _peeked = -1;
+        }
+        if (_open && used < size && (mbedtls_ssl_get_bytes_avail(&_ssl) > 0 || _transport->available() > 0))
+        {
+            int result = mbedtls_ssl_read(&_ssl, buffer + used, size - used);
+            if (result > 0)
+            {
+                used += result;
+            }
+            else if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                // Close notify or a fatal alert
+                _open = false;
+            }
+        }
+        return used > 0 ? (int)used : -1;
+    }
+
+    int TlsClient::peek()
+    {
+        // available() may already have set a byte aside
+        if (available() > 0 && _peeked < 0)
+        {
+            uint8_t b;
+            if (mbedtls_ssl_read(&_ssl, &b, 1) == 1)
+            {
+                _peeked = b;
+            }
+        }
+        return _peeked;
+    }
+
+    void TlsClient::flush()
+    {
+        _transport->flush();
+    }
+
+    void TlsClient::stop()
+    {
+        if (_open)
+        {
+            mbedtls_ssl_close_notify(&_ssl);
+        }
+        _open = false;
+        _peeked = -1;
+        if (_transport != nullptr)
+        {
+            _transport->stop();
+        }
+    }
+
+    uint8_t TlsClient::connected()
+    {
+        if (!_open)
+        {
+            return 0;
+        }
+        return _transport->connected() || available() > 0;
+    }
+
+    TlsClient::operator bool()
+    {
+        return _open;
+    }
+
+    void TlsClient::toJson(JsonObject status) const
+    {
+        for (int i = 0; i < NUM_TLS_CREDENTIALS; ++i)
+        {
+            status[CREDENTIAL_NAMES[i]] = hasTlsCredential((TlsCredential)i);
+        }
+        status["ready"] = _ready;
+        status["connected"] = _open;
+        if (_open)
+        {
+            status["cipher"] = mbedtls_ssl_get_ciphersuite(&_ssl);
+        }
+        JsonObject handshakes = status.createNestedObject("handshakes");
+        handshakes["full"] = _full;
+        handshakes["resumed"] = _resumed;
+        handshakes["failed"] = _failures;
+        handshakes["lastMs"] = _lastMs;
+        handshakes["lastResumed"] = _lastResumed;
+        handshakes["fullAvgMs"] = _full > 0 ? _fullTotalMs / _full : 0;
+        handshakes["fullMaxMs"] = _fullMaxMs;
+        handshakes["resumedAvgMs"] = _resumed > 0 ? _resumedTotalMs / _resumed : 0;
+        handshakes["resumedMaxMs"] = _resumedMaxMs;
+        handshakes["lastError"] = _lastError;
+    }
+} // namespace remoto
@@ -0,0 +1,121 @@
+/*
+ * Remoto: TLS client for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Wraps the plain Ethernet or WiFi client in a TLS 1.2 session with
+ * mbedTLS, so MQTT credentials and traffic never travel in clear. The
+ * broker is authenticated with a CA certificate or a pre-shared key,
+ * and a client certificate can be presented to brokers that ask for
+ * one. The credentials are kept in the KVStore, one key each, and
+ * uploaded with POST /tls/<name>.
+ *
+ * The session of the last connection is kept, so a reconnection
+ * resumes it with a session ticket or session ID and skips the key
+ * exchange and certificate checks. Handshake times are measured
+ * separately for full and resumed handshakes.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(TLS_H)
+#define TLS_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+// Longest wait for the link to take more data
+#define TLS_WRITE_TIMEOUT_MS 5000
+// Largest PEM accepted for a credential
+#define TLS_CREDENTIAL_MAX 4096
+// PSK as "identity:hexkey", the key at most 32 bytes
+#define TLS_PSK_IDENTITY_MAX 64
+#define TLS_PSK_MAX 32
+// Stack of the thread running handshakes, the key exchange is deep
+#define TLS_STACK_SIZE 8192
+
+namespace remoto
+{
+    enum TlsCredential : uint8_t
+    {
+        TLS_CA = 0,
+        TLS_CERT,
+        TLS_KEY,
+        TLS_PSK,
+        NUM_TLS_CREDENTIALS
+    };
+
+    // Credential named in the URL, NUM_TLS_CREDENTIALS if unknown
+    TlsCredential tlsCredentialFromName(const char *name, size_t length);
+    // Validate and store a credential, an empty one removes it.
+    // Takes effect at the next boot.
+    int storeTlsCredential(TlsCredential which, const char *data, size_t length);
+    bool hasTlsCredential(TlsCredential which);
+
+    class TlsClient : public Client
+    {
+    private:
+        Client *_transport;
+        mbedtls_entropy_context _entropy;
+        mbedtls_ctr_drbg_context _drbg;
+        mbedtls_ssl_config _conf;
+        mbedtls_ssl_context _ssl;
+        mbedtls_x509_crt _ca;
+        mbedtls_x509_crt _cert;
+        mbedtls_pk_context _key;
+        mbedtls_ssl_session _session; // of the last connection
+        bool _haveSession;
+        bool _ready;
+        bool _open;
+        int _peeked;
+
+        // Handshake statistics
+        uint32_t _full;
+        uint32_t _resumed;
+        uint32_t _failures;
+        uint32_t _lastMs;
+        bool _lastResumed;
+        uint32_t _fullTotalMs;
+        uint32_t _fullMaxMs;
+        uint32_t _resumedTotalMs;
+        uint32_t _resumedMaxMs;
+        int _lastError;
+
+        static int sendCallback(void *context, const unsigned char *buffer, size_t length);
+        static int recvCallback(void *context, unsigned char *buffer, size_t length);
+        int loadCredentials();
+        int handshake(const char *host);
+
+    public:
+        TlsClient();
+        ~TlsClient();
+
+        // Load the stored credentials and run TLS over the transport
+        int begin(Client &transport);
+
+        int connect(IPAddress ip, uint16_t port) override;
+        int connect(const char *host, uint16_t port) override;
+        size_t write(uint8_t b) override;
+        size_t write(const uint8_t *buffer, size_t size) override;
+        int available() override;
+        int read() override;
+        int read(uint8_t *buffer, size_t size) override;
+        int peek() override;
+        void flush() override;
+        void stop() override;
+        uint8_t connected() override;
+        operator bool() override;
+        using Print::write;
+
+        bool lastResumed() const { return _lastResumed; }
+        uint32_t lastHandshakeMs() const { return _lastMs; }
+        void toJson(JsonObject status) const;
+    };
+} // namespace remoto
+
+#endif // TLS_H
@@ -0,0 +1,412 @@
+/*
+ * Remoto: Input and request capture for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Record buffer and client wrapper. See trace.h.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#include "trace.h"
+#include "configstore.h"
+
+namespace remoto
+{
+    static_assert(MAX_INPUTS <= 256 && MAX_OUTPUTS <= 256, "channel indexes are one byte");
+    static_assert(sizeof(TraceHeader) == 16, "trace header layout");
+
+    TraceRecorder::TraceRecorder()
+        : _used(0), _capturing(false), _full(false), _startMs(0), _stopMs(0),
+          _inputs{}, _outputs{}, _chunkUsed(0), _chunkMs(0), _httpOpen(false), _redacted(false),
+          _responseBytes(0), _responseCrc(0), _openUs(0)
+    {
+    }
+
+    uint8_t *TraceRecorder::reserve(TraceKind kind, uint32_t timeMs, size_t length)
+    {
+        if (!_capturing)
+        {
+            return nullptr;
+        }
+        if (length > UINT16_MAX || _used + TRACE_RECORD_HEADER + length > sizeof(_buffer))
+        {
+            // Keep the start of the session, not its end
+            _capturing = false;
+            _full = true;
+            _stopMs = millis();
+            return nullptr;
+        }
+        uint8_t *record = _buffer + _used;
+        uint16_t size = length;
+        memcpy(record, &timeMs, 4);
+        record[4] = kind;
+        memcpy(record + 5, &size, 2);
+        _used += TRACE_RECORD_HEADER + length;
+        return record + TRACE_RECORD_HEADER;
+    }
+
+    void TraceRecorder::flushChunk()
+    {
+        if (_chunkUsed == 0)
+        {
+            return;
+        }
+        // Stamped with the first byte, the replay has it ready by then
+        uint8_t *data = reserve(TRACE_HTTP_DATA, _chunkMs, _chunkUsed);
+        if (data != nullptr)
+        {
+            memcpy(data, _chunk, _chunkUsed);
+        }
+        _chunkUsed = 0;
+    }
+
+    void TraceRecorder::start(const Channels &channels)
+    {
+        _mutex.lock();
+        _used = 0;
+        _full = false;
+        _startMs = millis();
+        _stopMs = _startMs;
+        _chunkUsed = 0;
+        _httpOpen = false;
+        _capturing = true;
+
+        uint8_t *data = reserve(TRACE_LAYOUT, 0, channels.moduleCount() * 5);
+        for (int m = 0, first = 0; data != nullptr && m < channels.moduleCount(); ++m)
+        {
+            const ModuleInfo &info = channels.getModule(m);
+            uint32_t analogMask = 0;
+            for (int i = 0; i < info.inputs; ++i)
+            {
+                analogMask |= (uint32_t)channels.isInputAnalog(first + i) << i;
+            }
+            first += info.inputs;
+            data[m * 5] = info.kind;
+            memcpy(data + m * 5 + 1, &analogMask, 4);
+        }
+
+        // The whole state, the changes that follow apply to it
+        data = reserve(TRACE_INPUTS, 0, channels.inputCount() * 3);
+        for (int i = 0; data != nullptr && i < channels.inputCount(); ++i)
+        {
+            _inputs[i] = channels.readRawInput(i);
+            data[i * 3] = i;
+            memcpy(data + i * 3 + 1, &_inputs[i], 2);
+        }
+        data = reserve(TRACE_OUTPUTS, 0, channels.outputCount() * 2);
+        for (int i = 0; data != nullptr && i < channels.outputCount(); ++i)
+        {
+            _outputs[i] = channels.getOutput(i);
+            data[i * 2] = i;
+            data[i * 2 + 1] = _outputs[i];
+        }
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::stop()
+    {
+        _mutex.lock();
+        if (_capturing)
+        {
+            _capturing = false;
+            _stopMs = millis();
+        }
+        _httpOpen = false;
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::scan(const Channels &channels)
+    {
+        if (!_capturing)
+        {
+            return;
+        }
+        uint8_t changes[MAX_INPUTS * 3];
+        _mutex.lock();
+        uint32_t timeMs = millis() - _startMs;
+        size_t count = 0;
+        for (int i = 0; i < channels.inputCount(); ++i)
+        {
+            uint16_t value = channels.readRawInput(i);
+            int32_t delta = (int32_t)value - _inputs[i];
+            bool changed = channels.isInputAnalog(i) ? (delta >= TRACE_ANALOG_DEADBAND || delta <= -TRACE_ANALOG_DEADBAND)
+                                                     : delta != 0;
+            if (changed)
+            {
+                _inputs[i] = value;
+                changes[count * 3] = i;
+                memcpy(changes + count * 3 + 1, &value, 2);
+                count++;
+            }
+        }
+        uint8_t *data = count > 0 ? reserve(TRACE_INPUTS, timeMs, count * 3) : nullptr;
+        if (data != nullptr)
+        {
+            memcpy(data, changes, count * 3);
+        }
+
+        count = 0;
+        for (int i = 0; i < channels.outputCount(); ++i)
+        {
+            uint8_t value = channels.getOutput(i);
+            if (value != _outputs[i])
+            {
+                _outputs[i] = value;
+                changes[count * 2] = i;
+                changes[count * 2 + 1] = value;
+                count++;
+            }
+        }
+        data = count > 0 ? reserve(TRACE_OUTPUTS, timeMs, count * 2) : nullptr;
+        if (data != nullptr)
+        {
+            memcpy(data, changes, count * 2);
+        }
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::httpOpen(uint32_t address)
+    {
+        if (!_capturing)
+        {
+            return;
+        }
+        _mutex.lock();
+        _httpOpen = true;
+        _redacted = false;
+        _chunkUsed = 0;
+        _responseBytes = 0;
+        _responseCrc = 0;
+        _openUs = micros();
+        uint8_t *data = reserve(TRACE_HTTP_OPEN, millis() - _startMs, 4);
+        if (data != nullptr)
+        {
+            memcpy(data, &address, 4);
+        }
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::httpRead(const uint8_t *data, size_t length)
+    {
+        if (!_httpOpen || _redacted)
+        {
+            return;
+        }
+        _mutex.lock();
+        while (length > 0 && _httpOpen)
+        {
+            if (_chunkUsed == 0)
+            {
+                _chunkMs = millis() - _startMs;
+            }
+            size_t n = sizeof(_chunk) - _chunkUsed;
+            n = n < length ? n : length;
+            memcpy(_chunk + _chunkUsed, data, n);
+            _chunkUsed += n;
+            data += n;
+            length -= n;
+            if (_chunkUsed == sizeof(_chunk))
+            {
+                flushChunk();
+            }
+        }
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::httpWrite(const uint8_t *data, size_t length)
+    {
+        if (!_httpOpen)
+        {
+            return;
+        }
+        _mutex.lock();
+        flushChunk();
+        _responseBytes += length;
+        _responseCrc = crc32(data, length, _responseCrc);
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::httpClose(bool peerClosed)
+    {
+        if (!_httpOpen)
+        {
+            return;
+        }
+        _mutex.lock();
+        flushChunk();
+        uint32_t handlingUs = micros() - _openUs;
+        uint8_t *data = reserve(TRACE_HTTP_CLOSE, millis() - _startMs, 13);
+        if (data != nullptr)
+        {
+            memcpy(data, &_responseBytes, 4);
+            memcpy(data + 4, &_responseCrc, 4);
+            memcpy(data + 8, &handlingUs, 4);
+            data[12] = (peerClosed ? TRACE_PEER_CLOSED : 0) | (_redacted ? TRACE_REDACTED : 0);
+        }
+        _httpOpen = false;
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::redactHttp()
+    {
+        if (!_httpOpen)
+        {
+            return;
+        }
+        _mutex.lock();
+        flushChunk();
+        _redacted = true;
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::mqttState(bool connected)
+    {
+        if (!_capturing)
+        {
+            return;
+        }
+        _mutex.lock();
+        uint8_t *data = reserve(TRACE_MQTT_STATE, millis() - _startMs, 1);
+        if (data != nullptr)
+        {
+            data[0] = connected;
+        }
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::mqttMessage(const char *topic, const uint8_t *payload, size_t length)
+    {
+        if (!_capturing)
+        {
+            return;
+        }
+        size_t topicLength = strlen(topic);
+        topicLength = topicLength < UINT8_MAX ? topicLength : UINT8_MAX;
+        _mutex.lock();
+        uint8_t *data = reserve(TRACE_MQTT_MESSAGE, millis() - _startMs, 1 + topicLength + length);
+        if (data != nullptr)
+        {
+            data[0] = topicLength;
+            memcpy(data + 1, topic, topicLength);
+            memcpy(data + 1 + topicLength, payload, length);
+        }
+        _mutex.unlock();
+    }
+
+    void TraceRecorder::published(const char *topic, const char *payload)
+    {
+        if (!_capturing)
+        {
+            return;
+        }
+        size_t topicLength = strlen(topic);
+        uint16_t length = strlen(payload);
+        uint32_t crc = crc32(payload, length);
+        _mutex.lock();
+        uint8_t *data = reserve(TRACE_PUBLISH, millis() - _startMs, 6 + topicLength);
+        if (data != nullptr)
+        {
+            memcpy(data, &length, 2);
+            memcpy(data + 2, &crc, 4);
+            memcpy(data + 6, topic, topicLength);
+        }
+        _mutex.unlock();
+    }
+
+    size_t TraceRecorder::snapshot(TraceHeader &header) const
+    {
+        _mutex.lock();
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.full = _full;
+        header.reserved = 0;
+        header.startMs = _startMs;
+        header.durationMs = (_capturing ? millis() : _stopMs) - _startMs;
+        size_t length = _used;
+        _mutex.unlock();
+        return length;
+    }
+
+    size_t TraceRecorder::read(size_t offset, uint8_t *data, size_t length) const
+    {
+        _mutex.lock();
+        size_t n = offset < _used ? _used - offset : 0;
+        n = n < length ? n : length;
+        memcpy(data, _buffer + offset, n);
+        _mutex.unlock();
+        return n;
+    }
+
+    void TraceRecorder::toJson(JsonObject status) const
+    {
+        TraceHeader header;
+        size_t length = snapshot(header);
+        status["capturing"] = _capturing;
+        status["full"] = _full;
+        status["bytes"] = sizeof(header) + length;
+        status["capacity"] = sizeof(header) + sizeof(_buffer);
+        status["durationMs"] = header.durationMs;
+    }
+
+    TraceClient::TraceClient(Client &client, TraceRecorder &trace, uint32_t address)
+        : _client(client), _trace(trace), _open(true)
+    {
+        trace.httpOpen(address);
+    }
+
+    TraceClient::~TraceClient()
+    {
+        close();
+    }
+
+    void TraceClient::close()
+    {
+        if (_open)
+        {
+            _open = false;
+            _trace.httpClose(!_client.connected());
+        }
+    }
+
+    size_t TraceClient::write(uint8_t b)
+    {
+        size_t n = _client.write(b);
+        _trace.httpWrite(&b, n);
+        return n;
+    }
+
+    size_t TraceClient::write(const uint8_t *buffer, size_t size)
+    {
+        size_t n = _client.write(buffer, size);
+        _trace.httpWrite(buffer, n);
+        return n;
+    }
+
+    int TraceClient::read()
+    {
+        int c = _client.read();
+        if (c >= 0)
+        {
+            uint8_t b = c;
+            _trace.httpRead(&b, 1);
+        }
+        return c;
+    }
+
+    int TraceClient::read(uint8_t *buffer, size_t size)
+    {
+        int n = _client.read(buffer, size);
+        if (n > 0)
+        {
+            _trace.httpRead(buffer, n);
+        }
+        return n;
+    }
+
+    void TraceClient::stop()
+    {
+        close();
+        _client.stop();
+    }
+} // namespace remoto
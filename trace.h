@@ -0,0 +1,162 @@
+/*
+ * Remoto: Input and request capture for Arduino OPTA
+ * -------------------------------------------------------------------
+ * Records what drives the firmware, so that a session from the field
+ * can be replayed on a PC (see api_tests/replay): the input changes of
+ * every scan, the HTTP requests as the handlers read them, the MQTT
+ * messages received and the broker connection state. Output changes,
+ * the size and CRC-32 of every HTTP response and the CRC-32 of every
+ * publish are recorded too, for the replay to compare against.
+ *
+ * Records go to a RAM buffer and capture stops when it is full, so a
+ * trace always holds the start of the session with the state it began
+ * from. Capture is off at boot and costs one flag test per hook.
+ *
+ * A trace is a TraceHeader followed by the records, each a 7 byte
+ * header (milliseconds since the start, kind and payload length) and
+ * its payload, all little endian and unaligned.
+ *
+ * Author: Alberto Perro
+ * Date: 27-12-2024
+ * License: CERN-OHL-P
+ */
+
+#if !defined(TRACE_H)
+#define TRACE_H
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "mbed.h"
+#include "channels.h"
+
+// Capture buffer, the replay build raises it
+#if !defined(TRACE_BUFFER_SIZE)
+#define TRACE_BUFFER_SIZE 16384
+#endif
+#define TRACE_MAGIC "RMTR"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_HEADER 7
+// Request bytes gathered into one record
+#define TRACE_HTTP_CHUNK 128
+// Analog changes smaller than this, in ADC counts, are not recorded
+#define TRACE_ANALOG_DEADBAND 64
+
+namespace remoto
+{
+    enum TraceKind : uint8_t
+    {
+        TRACE_LAYOUT = 0,   // per module: kind, analog input mask (uint32)
+        TRACE_INPUTS,       // per changed input: index, value (uint16)
+        TRACE_OUTPUTS,      // per changed output: index, value
+        TRACE_HTTP_OPEN,    // client address (uint32)
+        TRACE_HTTP_DATA,    // request bytes, in the order they were read
+        TRACE_HTTP_CLOSE,   // response bytes, CRC-32, handling time in us (uint32), flags (uint8)
+        TRACE_MQTT_STATE,   // 1 connected, 0 connection lost
+        TRACE_MQTT_MESSAGE, // topic length, topic, payload
+        TRACE_PUBLISH,      // payload bytes (uint16), CRC-32, topic
+        NUM_TRACE_KINDS
+    };
+
+    // Flags of TRACE_HTTP_CLOSE
+    constexpr uint8_t TRACE_PEER_CLOSED = 0x01; // the client had hung up
+    constexpr uint8_t TRACE_REDACTED = 0x02;    // body not recorded
+
+    struct TraceHeader
+    {
+        char magic[4];
+        uint8_t version;
+        uint8_t full; // capture stopped on a full buffer
+        uint16_t reserved;
+        uint32_t startMs;    // uptime at the start
+        uint32_t durationMs; // to the stop, or to the download
+    };
+
+    class TraceRecorder
+    {
+    private:
+        uint8_t _buffer[TRACE_BUFFER_SIZE];
+        size_t _used;
+        volatile bool _capturing;
+        bool _full;
+        uint32_t _startMs;
+        uint32_t _stopMs;
+        // Last recorded state, changes are recorded against it
+        uint16_t _inputs[MAX_INPUTS];
+        uint8_t _outputs[MAX_OUTPUTS];
+        // The connection being served, one at a time from the main loop
+        uint8_t _chunk[TRACE_HTTP_CHUNK];
+        size_t _chunkUsed;
+        uint32_t _chunkMs;
+        bool _httpOpen;
+        bool _redacted;
+        uint32_t _responseBytes;
+        uint32_t _responseCrc;
+        uint32_t _openUs;
+        mutable rtos::Mutex _mutex;
+
+        // Room for a record with its header written, under the lock.
+        // nullptr, and the capture stopped, when it does not fit.
+        uint8_t *reserve(TraceKind kind, uint32_t timeMs, size_t length);
+        void flushChunk();
+
+    public:
+        TraceRecorder();
+
+        // Clear the buffer and record the layout and the current state
+        void start(const Channels &channels);
+        void stop();
+        bool capturing() const { return _capturing; }
+
+        // After each scan, the inputs (as read, before their filters) and
+        // the outputs that changed
+        void scan(const Channels &channels);
+
+        void httpOpen(uint32_t address);
+        void httpRead(const uint8_t *data, size_t length);
+        void httpWrite(const uint8_t *data, size_t length);
+        void httpClose(bool peerClosed);
+        // Leave out the rest of the request, for secrets and firmware
+        void redactHttp();
+
+        void mqttState(bool connected);
+        void mqttMessage(const char *topic, const uint8_t *payload, size_t length);
+        void published(const char *topic, const char *payload);
+
+        // Header and record bytes for a download. The bytes below the
+        // returned length do not change until the next start().
+        size_t snapshot(TraceHeader &header) const;
+        size_t read(size_t offset, uint8_t *data, size_t length) const;
+
+        void toJson(JsonObject status) const;
+    };
+
+    // Client wrapper that hands what the handler reads and writes to the
+    // recorder, from the request line to stop()
+    class TraceClient : public Client
+    {
+    private:
+        Client &_client;
+        TraceRecorder &_trace;
+        bool _open;
+
+        void close();
+
+    public:
+        TraceClient(Client &client, TraceRecorder &trace, uint32_t address);
+        ~TraceClient();
+
+        int connect(IPAddress ip, uint16_t port) override { return _client.connect(ip, port); }
+        int connect(const char *host, uint16_t port) override { return _client.connect(host, port); }
+        size_t write(uint8_t b) override;
+        size_t write(const uint8_t *buffer, size_t size) override;
+        int available() override { return _client.available(); }
+        int read() override;
+        int read(uint8_t *buffer, size_t size) override;
+        int peek() override { return _client.peek(); }
+        void flush() override { _client.flush(); }
+        void stop() override;
+        uint8_t connected() override { return _client.connected(); }
+        operator bool() override { return (bool)_client; }
+    };
+} // namespace remoto
+
+#endif // TRACE_H
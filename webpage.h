@@ -209,7 +209,7 @@ const char rootHtml[] PROGMEM = R"rawliteral(
             digitalList.appendChild(li);
           } else {
             const li = document.createElement('li');
-            li.innerText = `${pin}: ${data.inputs[pin].value.toFixed(2)} V`;
+            li.innerText = `${pin}: ${data.inputs[pin].value.toFixed(2)} ${data.inputs[pin].unit || "V"}`;
             analogList.appendChild(li);
           }
         });